@@ -0,0 +1,707 @@
+#include "audit.h"
+
+#include "clock.h"
+#include "log.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define AUDIT_SEGMENT_MAGIC 0x4C413350 // "P3AL"
+#define AUDIT_INDEX_MAGIC   0x49413350 // "P3AI"
+#define AUDIT_VERSION       1
+
+// "YYYY-MM.log"
+#define AUDIT_SEGMENT_NAME_LEN 11
+
+struct AuditSegmentHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size; // sizeof(struct AuditRecord)
+  uint32_t reserved;
+};
+
+struct AuditIndexHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_count; // number of records in the segment when the index was written
+  uint32_t reserved;
+};
+
+struct AuditIndexEntry
+{
+  int32_t  member_id;
+  uint32_t record; // position of the record in the segment
+};
+
+//! A segment or index file mapped read-only.
+struct AuditMapping
+{
+  void const * data;
+  size_t       size;
+};
+
+enum QueryStep
+{
+  QUERY_CONTINUE,
+  QUERY_STOP,
+};
+
+struct QueryState
+{
+  struct AuditQuery const * query;
+  AuditQueryCallback        callback;
+  void *                    user_data;
+  size_t                    matches;
+};
+
+static bool           make_directory(char const * directory);
+static int            get_month(uint64_t timestamp);
+static bool           open_segment(int month);
+static bool           write_missing_indices(void);
+static bool           write_index(char const * directory, int month);
+static bool           map_file(char const * path, struct AuditMapping * mapping);
+static void           unmap_file(struct AuditMapping * mapping);
+static size_t         get_record_count(struct AuditMapping const * segment);
+static enum QueryStep query_segment(char const * directory, char const * name, struct QueryState * state);
+
+static struct
+{
+  char directory[PATH_MAX];
+  int  fd;
+  int      month;          // the month of the open segment, see get_month()
+  uint64_t last_timestamp; // timestamp of the last record of the open segment, 0 if it has none
+} audit_writer = {
+    .fd             = -1,
+    .month          = -1,
+    .last_timestamp = 0,
+};
+
+bool audit_open(char const * directory)
+{
+  assert(directory != NULL);
+  assert(audit_writer.fd == -1);
+
+  if (strlen(directory) + 1 + AUDIT_SEGMENT_NAME_LEN + 8 >= sizeof audit_writer.directory) {
+    log_print(LSS_SYSTEM, LL_ERROR, "audit log path is too long: %s", directory);
+    return false;
+  }
+  strcpy(audit_writer.directory, directory);
+
+  if (!make_directory(directory)) {
+    return false;
+  }
+
+  if (!open_segment(get_month(clock_get_ms(CLOCK_REALTIME)))) {
+    return false;
+  }
+
+  // an index that is missing is only a performance problem, queries fall back to scanning.
+  (void)write_missing_indices();
+
+  return true;
+}
+
+void audit_close(void)
+{
+  if (audit_writer.fd == -1)
+    return;
+
+  if (close(audit_writer.fd) == -1) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to close audit log");
+  }
+  audit_writer.fd             = -1;
+  audit_writer.month          = -1;
+  audit_writer.last_timestamp = 0;
+}
+
+uint64_t audit_request_time(struct AuditRecord const * record)
+{
+  assert(record != NULL);
+  return (record->timestamp > record->latency_ms) ? (record->timestamp - record->latency_ms) : 0;
+}
+
+bool audit_append(struct AuditRecord const * stamped)
+{
+  assert(stamped != NULL);
+  if (audit_writer.fd == -1)
+    return false;
+
+  // queries rely on the order, so the records never go back in time
+  struct AuditRecord record = *stamped;
+  if (record.timestamp < audit_writer.last_timestamp) {
+    record.timestamp = audit_writer.last_timestamp;
+  }
+
+  int const month = get_month(record.timestamp);
+  if (month > audit_writer.month) {
+    int const previous_month = audit_writer.month;
+    if (close(audit_writer.fd) == -1) {
+      log_perror(LSS_SYSTEM, LL_WARNING, "failed to close audit log");
+    }
+    audit_writer.fd = -1;
+
+    if (!open_segment(month)) {
+      return false;
+    }
+    (void)write_index(audit_writer.directory, previous_month);
+  }
+
+  // the segment is opened with O_APPEND, so a single write never interleaves with a
+  // partial record. A torn record at the end is cut off by open_segment().
+  ssize_t const written = write(audit_writer.fd, &record, sizeof record);
+  if (written != (ssize_t)sizeof record) {
+    if (written == -1) {
+      log_perror(LSS_SYSTEM, LL_ERROR, "failed to append to audit log");
+    }
+    else {
+      log_print(LSS_SYSTEM, LL_ERROR, "failed to append to audit log: short write");
+    }
+    return false;
+  }
+  audit_writer.last_timestamp = record.timestamp;
+
+  // door transactions are rare, but each one must survive a power cut.
+  if (fdatasync(audit_writer.fd) == -1) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to sync audit log");
+  }
+
+  return true;
+}
+
+//! Creates `directory` and all of its parents.
+static bool make_directory(char const * directory)
+{
+  char path[PATH_MAX];
+  strncpy(path, directory, sizeof path - 1);
+  path[sizeof path - 1] = 0;
+
+  for (char * it = path + 1; *it != 0; it++) {
+    if (*it != '/')
+      continue;
+    *it = 0;
+    if ((mkdir(path, 0755) == -1) && (errno != EEXIST)) {
+      log_perror(LSS_SYSTEM, LL_ERROR, "failed to create audit log directory");
+      return false;
+    }
+    *it = '/';
+  }
+
+  // the log tells who entered when, so only the daemon's group may read it.
+  // A directory of an older daemon is closed as well.
+  if ((mkdir(path, 0750) == -1) && (errno != EEXIST)) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to create audit log directory");
+    return false;
+  }
+  if (chmod(path, 0750) == -1) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to restrict access to the audit log directory");
+  }
+  return true;
+}
+
+//! Returns the number of months since year 0 for a timestamp in milliseconds.
+static int get_month(uint64_t timestamp)
+{
+  time_t const seconds = (time_t)(timestamp / 1000u);
+  struct tm    utc;
+  gmtime_r(&seconds, &utc);
+  return 12 * (utc.tm_year + 1900) + utc.tm_mon;
+}
+
+static void get_segment_path(char * path, size_t path_size, char const * directory, int month, char const * extension)
+{
+  snprintf(path, path_size, "%s/%04d-%02d.%s", directory, month / 12, (month % 12) + 1, extension);
+}
+
+static bool open_segment(int month)
+{
+  assert(audit_writer.fd == -1);
+
+  char path[PATH_MAX];
+  get_segment_path(path, sizeof path, audit_writer.directory, month, "log");
+
+  int const fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+  if (fd == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to open audit log");
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to query audit log size");
+    close(fd);
+    return false;
+  }
+
+  uint64_t     last_timestamp = 0;
+  size_t const size           = (size_t)info.st_size;
+  if (size < sizeof(struct AuditSegmentHeader)) {
+    struct AuditSegmentHeader const header = {
+        .magic       = AUDIT_SEGMENT_MAGIC,
+        .version     = AUDIT_VERSION,
+        .record_size = sizeof(struct AuditRecord),
+        .reserved    = 0,
+    };
+    if ((ftruncate(fd, 0) == -1) || (write(fd, &header, sizeof header) != (ssize_t)sizeof header) || (fsync(fd) == -1)) {
+      log_perror(LSS_SYSTEM, LL_ERROR, "failed to initialize audit log");
+      close(fd);
+      return false;
+    }
+
+    // make the new file itself durable, not only its contents.
+    int const dir_fd = open(audit_writer.directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1) {
+      (void)fsync(dir_fd);
+      close(dir_fd);
+    }
+  }
+  else {
+    struct AuditSegmentHeader header;
+    if (pread(fd, &header, sizeof header, 0) != (ssize_t)sizeof header) {
+      log_perror(LSS_SYSTEM, LL_ERROR, "failed to read audit log header");
+      close(fd);
+      return false;
+    }
+    if ((header.magic != AUDIT_SEGMENT_MAGIC) || (header.version != AUDIT_VERSION) || (header.record_size != sizeof(struct AuditRecord))) {
+      log_print(LSS_SYSTEM, LL_ERROR, "%s is not an audit log of this version, refusing to append to it.", path);
+      close(fd);
+      return false;
+    }
+
+    // cut off a record that was torn by a crash, so all following records stay aligned.
+    size_t const records = (size - sizeof header) / sizeof(struct AuditRecord);
+    size_t const used    = sizeof header + records * sizeof(struct AuditRecord);
+    if (used != size) {
+      log_print(LSS_SYSTEM, LL_WARNING, "removing %zu bytes of a torn record from %s", size - used, path);
+      if (ftruncate(fd, (off_t)used) == -1) {
+        log_perror(LSS_SYSTEM, LL_ERROR, "failed to repair audit log");
+        close(fd);
+        return false;
+      }
+    }
+
+    struct AuditRecord last;
+    if ((records > 0) && (pread(fd, &last, sizeof last, (off_t)(used - sizeof last)) == (ssize_t)sizeof last)) {
+      last_timestamp = last.timestamp;
+    }
+  }
+
+  audit_writer.fd             = fd;
+  audit_writer.month          = month;
+  audit_writer.last_timestamp = last_timestamp;
+  return true;
+}
+
+static bool parse_segment_name(char const * name, int * month)
+{
+  int year, month_of_year;
+  int length = 0;
+  if (sscanf(name, "%4d-%2d.log%n", &year, &month_of_year, &length) != 2)
+    return false;
+  if ((length != AUDIT_SEGMENT_NAME_LEN) || (name[length] != 0))
+    return false;
+  if ((month_of_year < 1) || (month_of_year > 12))
+    return false;
+  *month = 12 * year + (month_of_year - 1);
+  return true;
+}
+
+//! Writes the index of every finished segment that has none or an outdated one.
+static bool write_missing_indices(void)
+{
+  DIR * const dir = opendir(audit_writer.directory);
+  if (dir == NULL) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to list audit log directory");
+    return false;
+  }
+
+  bool            ok = true;
+  struct dirent * entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int month;
+    if (!parse_segment_name(entry->d_name, &month) || (month >= audit_writer.month))
+      continue;
+
+    char segment_path[PATH_MAX], index_path[PATH_MAX];
+    get_segment_path(segment_path, sizeof segment_path, audit_writer.directory, month, "log");
+    get_segment_path(index_path, sizeof index_path, audit_writer.directory, month, "idx");
+
+    struct AuditMapping segment, index;
+    if (!map_file(segment_path, &segment))
+      continue;
+    size_t const record_count = get_record_count(&segment);
+    unmap_file(&segment);
+
+    bool up_to_date = false;
+    if (map_file(index_path, &index)) {
+      struct AuditIndexHeader const * const header = index.data;
+      up_to_date                                   = (index.size >= sizeof *header) && (header->magic == AUDIT_INDEX_MAGIC) && (header->version == AUDIT_VERSION) && (header->record_count == record_count);
+      unmap_file(&index);
+    }
+
+    if (!up_to_date) {
+      ok &= write_index(audit_writer.directory, month);
+    }
+  }
+
+  closedir(dir);
+  return ok;
+}
+
+static int compare_index_entries(void const * lhs, void const * rhs)
+{
+  struct AuditIndexEntry const * const a = lhs;
+  struct AuditIndexEntry const * const b = rhs;
+  if (a->member_id != b->member_id)
+    return (a->member_id < b->member_id) ? -1 : 1;
+  if (a->record != b->record)
+    return (a->record < b->record) ? -1 : 1;
+  return 0;
+}
+
+//! Writes `<month>.idx` for the segment of `month`. The index is only valid for
+//! the record count it was written for, so only finished segments get one.
+static bool write_index(char const * directory, int month)
+{
+  char segment_path[PATH_MAX], index_path[PATH_MAX], temp_path[PATH_MAX];
+  get_segment_path(segment_path, sizeof segment_path, directory, month, "log");
+  get_segment_path(index_path, sizeof index_path, directory, month, "idx");
+  get_segment_path(temp_path, sizeof temp_path, directory, month, "idx.tmp");
+
+  struct AuditMapping segment;
+  if (!map_file(segment_path, &segment)) {
+    return false;
+  }
+
+  size_t const                     record_count = get_record_count(&segment);
+  struct AuditRecord const * const records      = (struct AuditRecord const *)((uint8_t const *)segment.data + sizeof(struct AuditSegmentHeader));
+
+  struct AuditIndexEntry * const entries = malloc(sizeof(struct AuditIndexEntry) * (record_count + 1));
+  if (entries == NULL) {
+    log_print(LSS_SYSTEM, LL_ERROR, "out of memory while indexing %s", segment_path);
+    unmap_file(&segment);
+    return false;
+  }
+  for (size_t i = 0; i < record_count; i++) {
+    entries[i] = (struct AuditIndexEntry){
+        .member_id = records[i].member_id,
+        .record    = (uint32_t)i,
+    };
+  }
+  unmap_file(&segment);
+
+  qsort(entries, record_count, sizeof entries[0], compare_index_entries);
+
+  struct AuditIndexHeader const header = {
+      .magic        = AUDIT_INDEX_MAGIC,
+      .version      = AUDIT_VERSION,
+      .record_count = (uint32_t)record_count,
+      .reserved     = 0,
+  };
+
+  bool      ok = false;
+  int const fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+  if (fd == -1) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to create audit index");
+  }
+  else {
+    size_t const entries_size = sizeof(struct AuditIndexEntry) * record_count;
+    if ((write(fd, &header, sizeof header) != (ssize_t)sizeof header) || (write(fd, entries, entries_size) != (ssize_t)entries_size) || (fsync(fd) == -1)) {
+      log_perror(LSS_SYSTEM, LL_WARNING, "failed to write audit index");
+    }
+    else {
+      ok = true;
+    }
+    close(fd);
+
+    // readers only ever see a complete index
+    if (ok && (rename(temp_path, index_path) == -1)) {
+      log_perror(LSS_SYSTEM, LL_WARNING, "failed to move audit index into place");
+      ok = false;
+    }
+    if (!ok) {
+      unlink(temp_path);
+    }
+  }
+
+  free(entries);
+
+  if (ok) {
+    log_print(LSS_SYSTEM, LL_VERBOSE, "indexed %zu records of %s", record_count, segment_path);
+  }
+  return ok;
+}
+
+static bool map_file(char const * path, struct AuditMapping * mapping)
+{
+  *mapping = (struct AuditMapping){
+      .data = NULL,
+      .size = 0,
+  };
+
+  int const fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+
+  struct stat info;
+  if ((fstat(fd, &info) == -1) || (info.st_size == 0)) {
+    close(fd);
+    return false;
+  }
+
+  void * const data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps the file alive
+  if (data == MAP_FAILED) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to map audit log");
+    return false;
+  }
+
+  mapping->data = data;
+  mapping->size = (size_t)info.st_size;
+  return true;
+}
+
+static void unmap_file(struct AuditMapping * mapping)
+{
+  if (mapping->data != NULL) {
+    munmap((void *)mapping->data, mapping->size);
+  }
+  mapping->data = NULL;
+  mapping->size = 0;
+}
+
+//! Returns the number of complete records in a mapped segment, 0 if it is not a valid segment.
+static size_t get_record_count(struct AuditMapping const * segment)
+{
+  struct AuditSegmentHeader const * const header = segment->data;
+  if (segment->size < sizeof *header)
+    return 0;
+  if ((header->magic != AUDIT_SEGMENT_MAGIC) || (header->version != AUDIT_VERSION) || (header->record_size != sizeof(struct AuditRecord)))
+    return 0;
+  return (segment->size - sizeof *header) / sizeof(struct AuditRecord);
+}
+
+static int compare_segment_names(void const * lhs, void const * rhs)
+{
+  // newest first
+  return -strcmp(*(char * const *)lhs, *(char * const *)rhs);
+}
+
+bool audit_query(char const * directory, struct AuditQuery const * query, AuditQueryCallback callback, void * user_data)
+{
+  assert(directory != NULL);
+  assert(query != NULL);
+  assert(callback != NULL);
+
+  DIR * const dir = opendir(directory);
+  if (dir == NULL) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to open audit log directory");
+    return false;
+  }
+
+  char ** names      = NULL;
+  size_t  name_count = 0;
+
+  bool            ok = true;
+  struct dirent * entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int month;
+    if (!parse_segment_name(entry->d_name, &month))
+      continue;
+
+    char ** const new_names = realloc(names, sizeof(char *) * (name_count + 1));
+    char * const  name      = strdup(entry->d_name);
+    if ((new_names == NULL) || (name == NULL)) {
+      log_print(LSS_SYSTEM, LL_ERROR, "out of memory while listing the audit log");
+      free(name);
+      if (new_names != NULL) {
+        names = new_names;
+      }
+      ok = false;
+      break;
+    }
+    names             = new_names;
+    names[name_count] = name;
+    name_count += 1;
+  }
+  closedir(dir);
+
+  if (ok) {
+    qsort(names, name_count, sizeof names[0], compare_segment_names);
+
+    struct QueryState state = {
+        .query     = query,
+        .callback  = callback,
+        .user_data = user_data,
+        .matches   = 0,
+    };
+    for (size_t i = 0; i < name_count; i++) {
+      if (query_segment(directory, names[i], &state) == QUERY_STOP)
+        break;
+    }
+  }
+
+  for (size_t i = 0; i < name_count; i++) {
+    free(names[i]);
+  }
+  free(names);
+
+  return ok;
+}
+
+//! Passes `record` to the callback if it matches the query.
+static enum QueryStep report_record(struct QueryState * state, struct AuditRecord const * record)
+{
+  struct AuditQuery const * const query = state->query;
+
+  if ((query->member_id >= 0) && (record->member_id != query->member_id))
+    return QUERY_CONTINUE;
+  if ((query->actions != 0) && ((record->action >= 32) || !(query->actions & (1U << record->action))))
+    return QUERY_CONTINUE;
+
+  if (!state->callback(state->user_data, record))
+    return QUERY_STOP;
+
+  state->matches += 1;
+  if ((query->limit != 0) && (state->matches >= query->limit))
+    return QUERY_STOP;
+
+  return QUERY_CONTINUE;
+}
+
+static enum QueryStep query_segment(char const * directory, char const * name, struct QueryState * state)
+{
+  struct AuditQuery const * const query = state->query;
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof path, "%s/%s", directory, name);
+
+  struct AuditMapping segment;
+  if (!map_file(path, &segment)) {
+    return QUERY_CONTINUE;
+  }
+
+  size_t const                     record_count = get_record_count(&segment);
+  struct AuditRecord const * const records      = (struct AuditRecord const *)((uint8_t const *)segment.data + sizeof(struct AuditSegmentHeader));
+
+  // records are ordered by time, so everything at or after `before` is cut off by binary search.
+  size_t end = record_count;
+  if (query->before != 0) {
+    size_t low = 0;
+    while (low < end) {
+      size_t const mid = low + (end - low) / 2;
+      if (records[mid].timestamp < query->before) {
+        low = mid + 1;
+      }
+      else {
+        end = mid;
+      }
+    }
+  }
+
+  enum QueryStep step = QUERY_CONTINUE;
+
+  struct AuditMapping index = {
+      .data = NULL,
+      .size = 0,
+  };
+  bool use_index = false;
+  if (query->member_id >= 0) {
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof index_path, "%s/%.*s.idx", directory, AUDIT_SEGMENT_NAME_LEN - 4, name);
+    if (map_file(index_path, &index)) {
+      struct AuditIndexHeader const * const header = index.data;
+
+      use_index = (index.size >= sizeof *header) && (header->magic == AUDIT_INDEX_MAGIC) && (header->version == AUDIT_VERSION) && (header->record_count == record_count) && (index.size >= sizeof *header + sizeof(struct AuditIndexEntry) * record_count);
+    }
+  }
+
+  if (use_index) {
+    struct AuditIndexEntry const * const entries = (struct AuditIndexEntry const *)((uint8_t const *)index.data + sizeof(struct AuditIndexHeader));
+
+    // find the entry after the last one of the member, then walk back to get the newest records first
+    size_t low = 0, high = record_count;
+    while (low < high) {
+      size_t const mid = low + (high - low) / 2;
+      if (entries[mid].member_id <= query->member_id) {
+        low = mid + 1;
+      }
+      else {
+        high = mid;
+      }
+    }
+
+    for (size_t i = low; (i > 0) && (entries[i - 1].member_id == query->member_id); i--) {
+      uint32_t const record = entries[i - 1].record;
+      if (record >= end)
+        continue;
+      step = report_record(state, &records[record]);
+      if (step == QUERY_STOP)
+        break;
+    }
+  }
+  else {
+    for (size_t i = end; i > 0; i--) {
+      step = report_record(state, &records[i - 1]);
+      if (step == QUERY_STOP)
+        break;
+    }
+  }
+
+  unmap_file(&index);
+  unmap_file(&segment);
+  return step;
+}
+
+char const * audit_action_name(enum AuditAction action)
+{
+  switch (action) {
+  case AUDIT_OPEN_FRONT: return "open-front";
+  case AUDIT_OPEN_BACK: return "open-back";
+  case AUDIT_CLOSE: return "close";
+  case AUDIT_FORCE_OPEN: return "force-open";
+  case AUDIT_SYSTEM_RESET: return "system-reset";
+  }
+  return "<<INVALID>>";
+}
+
+char const * audit_outcome_name(enum AuditOutcome outcome)
+{
+  switch (outcome) {
+  case AUDIT_SUCCESS: return "success";
+  case AUDIT_NO_CHANGE: return "no change";
+  case AUDIT_REJECTED: return "rejected";
+  case AUDIT_TIMEOUT: return "timeout";
+  case AUDIT_NOT_ENTERED: return "not entered";
+  case AUDIT_ATTACHED: return "attached";
+  }
+  return "<<INVALID>>";
+}
+
+bool audit_parse_action(char const * name, enum AuditAction * action)
+{
+  assert(name != NULL);
+  assert(action != NULL);
+
+  for (enum AuditAction it = AUDIT_OPEN_FRONT; it <= AUDIT_SYSTEM_RESET; it++) {
+    if (strcmp(name, audit_action_name(it)) == 0) {
+      *action = it;
+      return true;
+    }
+  }
+  return false;
+}
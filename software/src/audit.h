@@ -0,0 +1,90 @@
+#ifndef PORTAL300_AUDIT_H
+#define PORTAL300_AUDIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Persistent audit log of door transactions. The daemon appends one fixed
+// size record per finished transaction to a segment file per month
+// (`<dir>/2024-05.log`, UTC). Records are stamped with the time of their
+// outcome, which is when they are appended, so the records of a segment are
+// ordered by time and time ranges are found by binary search.
+//
+// When a month is over, the daemon writes a sidecar index (`<dir>/2024-05.idx`)
+// of (member_id, record) pairs sorted by member, so finding the transactions of
+// a member doesn't need to scan years of records. Only the current segment is
+// scanned linearly.
+//
+// Segments are only ever appended to and can be mapped read-only by any
+// number of readers while the daemon writes.
+
+#define AUDIT_DEFAULT_PATH "/var/lib/portal300/audit"
+
+enum AuditAction
+{
+  AUDIT_OPEN_FRONT   = 1,
+  AUDIT_OPEN_BACK    = 2,
+  AUDIT_CLOSE        = 3,
+  AUDIT_FORCE_OPEN   = 4,
+  AUDIT_SYSTEM_RESET = 5,
+};
+
+enum AuditOutcome
+{
+  AUDIT_SUCCESS     = 1, // the shack reached the requested state, or the keyholder changed
+  AUDIT_NO_CHANGE   = 2, // the shack already was in the requested state
+  AUDIT_REJECTED    = 3, // another transaction was in progress
+  AUDIT_TIMEOUT     = 4, // the doors didn't reach the requested state in time
+  AUDIT_NOT_ENTERED = 5, // the doors were unlocked, but nobody came in
+  AUDIT_ATTACHED    = 6, // joined the transaction of another request, which has its own record
+};
+
+//! A single transaction as stored on disk. Little endian, never change the layout.
+struct AuditRecord
+{
+  uint64_t timestamp;      // CLOCK_REALTIME of the outcome in milliseconds, see audit_request_time()
+  int32_t  member_id;      // -1 if the transaction was not started by a member (e.g. a button)
+  uint32_t latency_ms;     // time from the request to the outcome
+  uint32_t transaction_id; // the ipc client id, matches TRANSACTION_ID in the journal
+  uint8_t  action;         // enum AuditAction
+  uint8_t  outcome;        // enum AuditOutcome
+  uint8_t  reserved[2];
+};
+
+_Static_assert(sizeof(struct AuditRecord) == 24, "audit records must keep their on-disk size");
+
+//! Opens the current segment in `directory` for appending and writes missing
+//! indices of previous segments. The directory is created if necessary.
+bool audit_open(char const * directory);
+void audit_close(void);
+
+//! Appends `record` and syncs it to disk. Starts a new segment when the month
+//! changed. A timestamp older than the last record, after the clock was set
+//! back, is raised to the one of the last record to keep the segment ordered.
+bool audit_append(struct AuditRecord const * record);
+
+//! Returns CLOCK_REALTIME of the request of `record` in milliseconds.
+uint64_t audit_request_time(struct AuditRecord const * record);
+
+struct AuditQuery
+{
+  int32_t  member_id; // only return records of this member, -1 for all members
+  uint32_t actions;   // bit mask of (1 << enum AuditAction), 0 for all actions
+  uint64_t before;    // only return records older than this timestamp, 0 for all
+  size_t   limit;     // maximum number of records, 0 for no limit
+};
+
+//! Called for each match, newest first. Return false to stop the query.
+typedef bool (*AuditQueryCallback)(void * user_data, struct AuditRecord const * record);
+
+//! Runs `query` against the audit log in `directory`. Doesn't need the daemon.
+bool audit_query(char const * directory, struct AuditQuery const * query, AuditQueryCallback callback, void * user_data);
+
+char const * audit_action_name(enum AuditAction action);
+char const * audit_outcome_name(enum AuditOutcome outcome);
+
+//! Parses a name as returned by `audit_action_name`.
+bool audit_parse_action(char const * name, enum AuditAction * action);
+
+#endif // PORTAL300_AUDIT_H
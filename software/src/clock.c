@@ -0,0 +1,15 @@
+#include "clock.h"
+
+uint64_t clock_get_ms(clockid_t clock)
+{
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return 1000u * (uint64_t)now.tv_sec + (uint64_t)now.tv_nsec / 1000000u;
+}
+
+uint64_t clock_get_ns(clockid_t clock)
+{
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return 1000000000u * (uint64_t)now.tv_sec + (uint64_t)now.tv_nsec;
+}
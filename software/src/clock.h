@@ -0,0 +1,17 @@
+#ifndef PORTAL300_CLOCK_H
+#define PORTAL300_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+// The daemon keeps its times as plain integers: CLOCK_MONOTONIC for
+// deadlines and durations, CLOCK_REALTIME for everything that is stored or
+// shown to people.
+
+//! Returns the time of `clock` in milliseconds.
+uint64_t clock_get_ms(clockid_t clock);
+
+//! Returns the time of `clock` in nanoseconds.
+uint64_t clock_get_ns(clockid_t clock);
+
+#endif // PORTAL300_CLOCK_H
@@ -0,0 +1,238 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "controller.h"
+#include "log.h"
+#include "portal-router.h"
+#include "state-machine.h"
+
+#include <portal300.h>
+
+// Runs request sequences through the controller that sm-explore can't cover,
+// as the request queue lives outside of the state machine. The daemon handles
+// the outcome of a transaction portal-wide, like disconnecting all waiting
+// clients, so a queued request must not start before every signal of the
+// transaction ahead of it was popped. Each scenario checks that, and the
+// signals the queued clients get in the end.
+
+#define CHECK_MAX_STEPS   16
+#define CHECK_MAX_CLIENTS 8
+
+enum StepKind
+{
+  STEP_END = 0,
+  STEP_DOOR,    // applies `state` of `door`
+  STEP_REQUEST, // `client` requests `event`
+  STEP_TIMEOUT, // the timer expires
+  STEP_MQTT,    // a doorbell or button message with `topic` and `data`
+  STEP_EXPECT,  // `client` got `signal` so far
+};
+
+struct Step
+{
+  enum StepKind  kind;
+  bool           no_pop; // don't pop the signals after this step, like an event in the same iteration of the main loop
+  int            door;
+  enum DoorState state;
+  enum SM_Event  event;
+  uint32_t       client;
+  enum SM_Signal signal;
+  char const *   topic;
+  char const *   data;
+};
+
+struct Scenario
+{
+  char const * name;
+  struct Step  steps[CHECK_MAX_STEPS];
+};
+
+#define DOOR(d, s)        {.kind = STEP_DOOR, .door = (d), .state = (s)}
+#define DOOR_NO_POP(d, s) {.kind = STEP_DOOR, .no_pop = true, .door = (d), .state = (s)}
+#define REQUEST(c, e)     {.kind = STEP_REQUEST, .client = (c), .event = (e)}
+#define TIMEOUT()         {.kind = STEP_TIMEOUT}
+#define TIMEOUT_NO_POP()  {.kind = STEP_TIMEOUT, .no_pop = true}
+#define MQTT(t, d)        {.kind = STEP_MQTT, .topic = PORTAL_TOPIC(t), .data = (d)}
+#define EXPECT(c, s)      {.kind = STEP_EXPECT, .client = (c), .signal = (s)}
+
+static struct Scenario const scenarios[] = {
+    {
+        .name  = "open queued behind a close that times out",
+        .steps = {
+            DOOR(SM_DOOR_B2, DOOR_LOCKED),
+            DOOR(SM_DOOR_C2, DOOR_CLOSED),
+            REQUEST(1, EVENT_SSH_CLOSE_REQUEST),
+            REQUEST(2, EVENT_SSH_OPEN_FRONT_REQUEST),
+            EXPECT(2, SIGNAL_REQUEST_QUEUED),
+            TIMEOUT(),
+            EXPECT(2, SIGNAL_OPEN_DOOR_B2_SAFE),
+        },
+    },
+    {
+        .name  = "open back queued behind an open front",
+        .steps = {
+            DOOR(SM_DOOR_B2, DOOR_LOCKED),
+            DOOR(SM_DOOR_C2, DOOR_LOCKED),
+            REQUEST(1, EVENT_SSH_OPEN_FRONT_REQUEST),
+            REQUEST(2, EVENT_SSH_OPEN_BACK_REQUEST),
+            EXPECT(2, SIGNAL_REQUEST_QUEUED),
+            DOOR(SM_DOOR_B2, DOOR_CLOSED),
+            DOOR(SM_DOOR_B2, DOOR_OPEN),
+            DOOR(SM_DOOR_C2, DOOR_CLOSED),
+            EXPECT(1, SIGNAL_OPEN_DOOR_B2_SAFE),
+            EXPECT(2, SIGNAL_CHANGE_KEYHOLDER),
+        },
+    },
+    {
+        .name  = "request after a timeout that was not popped yet",
+        .steps = {
+            DOOR(SM_DOOR_B2, DOOR_LOCKED),
+            DOOR(SM_DOOR_C2, DOOR_CLOSED),
+            REQUEST(1, EVENT_SSH_CLOSE_REQUEST),
+            REQUEST(2, EVENT_SSH_OPEN_FRONT_REQUEST),
+            TIMEOUT_NO_POP(),
+            REQUEST(3, EVENT_SSH_OPEN_BACK_REQUEST),
+            EXPECT(3, SIGNAL_REQUEST_QUEUED),
+            EXPECT(2, SIGNAL_OPEN_DOOR_B2_SAFE),
+        },
+    },
+    {
+        .name  = "doorbell in the same iteration as the end of an open",
+        .steps = {
+            DOOR(SM_DOOR_B2, DOOR_LOCKED),
+            DOOR(SM_DOOR_C2, DOOR_LOCKED),
+            REQUEST(1, EVENT_SSH_OPEN_FRONT_REQUEST),
+            REQUEST(2, EVENT_SSH_OPEN_BACK_REQUEST),
+            EXPECT(2, SIGNAL_REQUEST_QUEUED),
+            DOOR(SM_DOOR_B2, DOOR_CLOSED),
+            DOOR(SM_DOOR_B2, DOOR_OPEN),
+            DOOR_NO_POP(SM_DOOR_C2, DOOR_CLOSED),
+            MQTT(PORTAL300_TOPIC_EVENT_DOORBELL, ""),
+            EXPECT(1, SIGNAL_OPEN_DOOR_B2_SAFE),
+            EXPECT(2, SIGNAL_CHANGE_KEYHOLDER),
+        },
+    },
+};
+
+//! Signals each client got so far, as bit mask of (1 << enum SM_Signal).
+static uint32_t received[CHECK_MAX_CLIENTS];
+
+//! Clients whose request was queued and didn't start yet.
+static bool waiting[CHECK_MAX_CLIENTS];
+
+static bool check_send_mqtt(void * user_data, char const * topic, char const * data)
+{
+  (void)user_data;
+  (void)topic;
+  (void)data;
+  return true;
+}
+
+static void check_start_timer(void * user_data, uint32_t ms)
+{
+  (void)user_data;
+  (void)ms;
+}
+
+static void check_cancel_timer(void * user_data)
+{
+  (void)user_data;
+}
+
+static uint64_t check_get_time_ms(void * user_data)
+{
+  (void)user_data;
+  return 0;
+}
+
+//! Pops all signals like the main loop of the daemon. Returns NULL if the
+//! queued requests waited for them, otherwise a description of the violation.
+static char const * pop_signals(struct Controller * controller)
+{
+  enum SM_Signal signal;
+  uint32_t       client_id;
+  while (controller_pop_signal(controller, &signal, &client_id)) {
+    if (client_id < CHECK_MAX_CLIENTS) {
+      received[client_id] |= (1U << signal);
+      waiting[client_id] = (signal == SIGNAL_REQUEST_QUEUED);
+    }
+
+    for (uint32_t client = 0; client < CHECK_MAX_CLIENTS; client++) {
+      if (waiting[client] && !controller_has_request(controller, client))
+        return "a queued request started before the signals ahead of it were handled";
+    }
+
+    controller_execute_signal(controller, signal);
+  }
+  return NULL;
+}
+
+static bool run_scenario(struct Scenario const * scenario)
+{
+  static struct ControllerEnvironment const env = {
+      .user_data    = NULL,
+      .send_mqtt    = check_send_mqtt,
+      .start_timer  = check_start_timer,
+      .cancel_timer = check_cancel_timer,
+      .get_time_ms  = check_get_time_ms,
+  };
+
+  struct Controller controller;
+  controller_init(&controller, &env);
+  for (uint32_t client = 0; client < CHECK_MAX_CLIENTS; client++) {
+    received[client] = 0;
+    waiting[client]  = false;
+  }
+
+  for (size_t i = 0; (i < CHECK_MAX_STEPS) && (scenario->steps[i].kind != STEP_END); i++) {
+    struct Step const * const step = &scenario->steps[i];
+
+    switch (step->kind) {
+    case STEP_DOOR: controller_handle_door_status(&controller, step->door, step->state); break;
+    case STEP_REQUEST: controller_handle_request(&controller, step->event, step->client); break;
+    case STEP_TIMEOUT: controller_handle_timeout(&controller); break;
+    case STEP_MQTT: (void)controller_handle_mqtt(&controller, step->topic, step->data); break;
+
+    case STEP_EXPECT:
+      if ((received[step->client] & (1U << step->signal)) == 0) {
+        fprintf(stderr, "%s: step %zu: client %u didn't get %s\n", scenario->name, i + 1, (unsigned int)step->client, sm_signal_name(step->signal));
+        return false;
+      }
+      continue;
+
+    default: continue;
+    }
+
+    if (step->no_pop)
+      continue;
+
+    char const * const violation = pop_signals(&controller);
+    if (violation != NULL) {
+      fprintf(stderr, "%s: step %zu: %s\n", scenario->name, i + 1, violation);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(void)
+{
+  if (!log_init()) {
+    fprintf(stderr, "failed to initialize logging.\n");
+    return EXIT_FAILURE;
+  }
+  log_set_stderr_level(LL_ERROR);
+
+  size_t const count  = sizeof scenarios / sizeof scenarios[0];
+  size_t       failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!run_scenario(&scenarios[i])) {
+      failed += 1;
+    }
+  }
+
+  fprintf(stdout, "ran %zu controller scenarios, %zu failed\n", count, failed);
+  return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
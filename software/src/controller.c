@@ -0,0 +1,454 @@
+#include "controller.h"
+
+#include "log.h"
+#include "portal-router.h"
+
+#include <portal300.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+static void state_machine_signal_handler(void * user_data, void * context, enum SM_Signal signal);
+static void apply_event(struct Controller * controller, enum SM_Event event, int door, void * context);
+static void push_signal(struct Controller * controller, enum SM_Signal signal, uint32_t client_id);
+static void time_phase(struct Controller * controller, enum SM_Signal signal);
+static void finish_phase(struct Controller * controller, enum SM_Phase phase);
+static void run_queued_requests(struct Controller * controller);
+
+static bool send_mqtt_msg(struct Controller * controller, char const * topic, char const * data);
+
+static bool streq(char const * a, char const * b)
+{
+  return (strcmp(a, b) == 0);
+}
+
+void controller_init(struct Controller * controller, struct ControllerEnvironment const * env)
+{
+  assert(controller != NULL);
+  assert(env != NULL);
+  assert(env->send_mqtt != NULL);
+  assert(env->start_timer != NULL);
+  assert(env->cancel_timer != NULL);
+  assert(env->get_time_ms != NULL);
+
+  controller->env           = *env;
+  controller->read_offset   = 0;
+  controller->size          = 0;
+  controller->request_count = 0;
+  controller->timer_phase   = SM_NO_PHASE;
+  controller->timer_started = 0;
+  controller->timer_ms      = CONTROLLER_ENTRY_TIMEOUT_MS;
+
+  memset(controller->events, 0, sizeof controller->events);
+  memset(controller->transitions, 0, sizeof controller->transitions);
+
+  timeout_budget_init(&controller->timeouts[SM_PHASE_UNLOCK], CONTROLLER_UNLOCK_TIMEOUT_MS, true);
+  timeout_budget_init(&controller->timeouts[SM_PHASE_ENTRY], CONTROLLER_ENTRY_TIMEOUT_MS, false);
+  timeout_budget_init(&controller->timeouts[SM_PHASE_LOCK], CONTROLLER_LOCK_TIMEOUT_MS, true);
+
+  sm_init(&controller->state_machine, state_machine_signal_handler, controller);
+}
+
+void controller_set_timeout(struct Controller * controller, enum SM_Phase phase, uint32_t limit_ms)
+{
+  assert(controller != NULL);
+  assert(phase < SM_PHASE_COUNT);
+
+  struct TimeoutBudget * const budget = &controller->timeouts[phase];
+  timeout_budget_init(budget, limit_ms, budget->adaptive);
+}
+
+uint32_t controller_get_timeout(struct Controller const * controller, enum SM_Phase phase)
+{
+  assert(controller != NULL);
+  assert(phase < SM_PHASE_COUNT);
+  return timeout_budget_get(&controller->timeouts[phase]);
+}
+
+bool controller_handle_mqtt(struct Controller * controller, char const * topic, char const * data)
+{
+  assert(controller != NULL);
+  assert(topic != NULL);
+  assert(data != NULL);
+
+  if (streq(topic, PORTAL_TOPIC(PORTAL300_TOPIC_EVENT_DOORBELL))) {
+    apply_event(controller, EVENT_DOORBELL_FRONT, SM_NO_DOOR, NULL);
+  }
+  else if (streq(topic, PORTAL_TOPIC(PORTAL300_TOPIC_EVENT_BUTTON))) {
+    int const door = sm_find_door_id(data);
+    if (door >= 0)
+      apply_event(controller, EVENT_BUTTON, door, NULL);
+    else
+      log_print_ratelimited(LSS_SYSTEM, LL_WARNING, "Received button event for unhandled door %s", data);
+  }
+  else {
+    int            door;
+    enum DoorState state;
+    if (!controller_parse_door_status(topic, data, &door, &state))
+      return false;
+    if (state != DOOR_UNOBSERVED)
+      controller_handle_door_status(controller, door, state);
+    return true;
+  }
+
+  // queued requests start from controller_pop_signal(), once the signals of
+  // the transaction ahead of them were handled
+  return true;
+}
+
+bool controller_parse_door_status(char const * topic, char const * data, int * door, enum DoorState * state)
+{
+  assert(topic != NULL);
+  assert(data != NULL);
+  assert(door != NULL);
+  assert(state != NULL);
+
+  char const * const prefix        = PORTAL_TOPIC(PORTAL300_TOPIC_STATUS_DOOR(""));
+  size_t const       prefix_length = sizeof(PORTAL300_TOPIC_STATUS_DOOR("")) - sizeof(PORTAL300_TOPIC_PREFIX);
+  if (strncmp(topic, prefix, prefix_length) != 0)
+    return false;
+  *door = sm_find_door(topic + prefix_length);
+  if (*door < 0)
+    return false;
+
+  if (streq(data, PORTAL300_STATUS_DOOR_LOCKED)) {
+    *state = DOOR_LOCKED;
+  }
+  else if (streq(data, PORTAL300_STATUS_DOOR_CLOSED)) {
+    *state = DOOR_CLOSED;
+  }
+  else if (streq(data, PORTAL300_STATUS_DOOR_OPENED)) {
+    *state = DOOR_OPEN;
+  }
+  else {
+    log_print_ratelimited(LSS_SYSTEM, LL_WARNING, "door %s status update sent invalid status: %s", sm_doors[*door].name, data);
+    *state = DOOR_UNOBSERVED;
+  }
+  return true;
+}
+
+void controller_handle_door_status(struct Controller * controller, int door, enum DoorState state)
+{
+  assert(controller != NULL);
+  assert((door >= 0) && (door < SM_DOOR_COUNT));
+  assert((state == DOOR_OPEN) || (state == DOOR_CLOSED) || (state == DOOR_LOCKED));
+
+  static enum SM_Event const events[] = {
+      [DOOR_OPEN]   = EVENT_DOOR_OPENED,
+      [DOOR_CLOSED] = EVENT_DOOR_CLOSED,
+      [DOOR_LOCKED] = EVENT_DOOR_LOCKED,
+  };
+
+  log_set_context(&(struct LogContext){
+      .member_id      = -1,
+      .door           = sm_doors[door].name,
+      .transaction_id = 0,
+  });
+  apply_event(controller, events[state], door, NULL);
+  log_set_context(NULL);
+}
+
+void controller_handle_request(struct Controller * controller, enum SM_Event event, uint32_t client_id)
+{
+  assert(controller != NULL);
+
+  struct StateMachine * const sm   = &controller->state_machine;
+  bool const                  busy = sm_is_busy(sm);
+
+  // queued requests go first, even when the transaction before them just
+  // finished and they didn't start yet
+  if (busy || (controller->request_count > 0)) {
+    // two members arriving together shouldn't get an error, so the request
+    // either shares the result of the running transaction or waits for it.
+    if (busy && sm_serves_request(sm, event)) {
+      push_signal(controller, SIGNAL_REQUEST_ATTACHED, client_id);
+      return;
+    }
+    if (controller->request_count < CONTROLLER_REQUEST_QUEUE_LEN) {
+      controller->requests[controller->request_count] = (struct ControllerRequest){
+          .event     = event,
+          .client_id = client_id,
+      };
+      controller->request_count += 1;
+      push_signal(controller, SIGNAL_REQUEST_QUEUED, client_id);
+      return;
+    }
+    if (!busy) {
+      push_signal(controller, SIGNAL_CANNOT_HANDLE_REQUEST, client_id);
+      return;
+    }
+    // the queue is full, let the state machine reject the request
+  }
+
+  apply_event(controller, event, SM_NO_DOOR, &client_id);
+}
+
+void controller_cancel_requests(struct Controller * controller, uint32_t client_id)
+{
+  assert(controller != NULL);
+
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < controller->request_count; i++) {
+    if (controller->requests[i].client_id != client_id) {
+      controller->requests[kept] = controller->requests[i];
+      kept += 1;
+    }
+  }
+  controller->request_count = kept;
+}
+
+bool controller_has_request(struct Controller const * controller, uint32_t client_id)
+{
+  assert(controller != NULL);
+
+  for (uint32_t i = 0; i < controller->request_count; i++) {
+    if (controller->requests[i].client_id == client_id)
+      return true;
+  }
+  return false;
+}
+
+bool controller_expire_timer(struct Controller * controller)
+{
+  assert(controller != NULL);
+
+  if (!sm_is_busy(&controller->state_machine))
+    return false;
+
+  // the phase didn't take too long, so its timeout must not learn from it
+  controller->timer_phase = SM_NO_PHASE;
+  controller->timer_ms    = 0;
+  controller->env.start_timer(controller->env.user_data, 0);
+  return true;
+}
+
+void controller_handle_timeout(struct Controller * controller)
+{
+  assert(controller != NULL);
+  apply_event(controller, EVENT_TIMEOUT, SM_NO_DOOR, NULL);
+}
+
+//! Applies `event` to the state machine and counts it.
+static void apply_event(struct Controller * controller, enum SM_Event event, int door, void * context)
+{
+  struct StateMachine * const sm     = &controller->state_machine;
+  struct StateMachine const   before = *sm;
+
+  sm_apply_event(sm, event, door, context);
+
+  controller->events[event] += 1;
+  if ((sm->state != before.state) || (sm->doors_observed != before.doors_observed) || (sm->doors_open != before.doors_open) || (sm->doors_locked != before.doors_locked)) {
+    controller->transitions[event] += 1;
+  }
+}
+
+//! Applies the queued requests in order until one starts a transaction. The
+//! requests behind it that ask for its result attach to it right away.
+static void run_queued_requests(struct Controller * controller)
+{
+  struct StateMachine * const sm = &controller->state_machine;
+
+  while (controller->request_count > 0) {
+    struct ControllerRequest request = controller->requests[0];
+
+    bool const attach = sm_serves_request(sm, request.event);
+    if (!attach && sm_is_busy(sm))
+      break;
+
+    controller->request_count -= 1;
+    memmove(&controller->requests[0], &controller->requests[1], controller->request_count * sizeof controller->requests[0]);
+
+    if (attach)
+      push_signal(controller, SIGNAL_REQUEST_ATTACHED, request.client_id);
+    else
+      apply_event(controller, request.event, SM_NO_DOOR, &request.client_id);
+  }
+}
+
+bool controller_pop_signal(struct Controller * controller, enum SM_Signal * signal, uint32_t * client_id)
+{
+  assert(controller != NULL);
+  assert(signal != NULL);
+  assert(client_id != NULL);
+
+  // the caller handled every signal of the previous transaction, so its
+  // outcome can't affect the clients of the next one anymore
+  if (controller->size == 0) {
+    run_queued_requests(controller);
+  }
+  if (controller->size == 0)
+    return false;
+
+  *signal    = controller->signals[controller->read_offset];
+  *client_id = controller->client_ids[controller->read_offset];
+
+  controller->size -= 1;
+  controller->read_offset += 1;
+  controller->read_offset %= CONTROLLER_SIGNAL_QUEUE_LEN;
+
+  return true;
+}
+
+void controller_execute_signal(struct Controller * controller, enum SM_Signal signal)
+{
+  assert(controller != NULL);
+
+  switch (signal) {
+  case SIGNAL_OPEN_DOOR_B:
+    log_print(LSS_SYSTEM, LL_MESSAGE, "Unlocking building front door.");
+
+    // Wenn der shack aktuell sicher "offen" ist, senden wir eine Nachricht an die Fronttüre:
+    if (!send_mqtt_msg(controller, PORTAL_TOPIC(PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE), DOOR_NAME(DOOR_B))) {
+      log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to open B.");
+    }
+    break;
+
+  case SIGNAL_OPEN_DOOR_C:
+    log_print(LSS_SYSTEM, LL_MESSAGE, "Unlocking building back door.");
+    if (!send_mqtt_msg(controller, PORTAL_TOPIC(PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE), DOOR_NAME(DOOR_C))) {
+      log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to open C.");
+    }
+    break;
+
+  case SIGNAL_OPEN_DOOR_B2_SAFE:
+    log_print(LSS_SYSTEM, LL_MESSAGE, "Safely opening inner front door.");
+    if (!send_mqtt_msg(controller, PORTAL_TOPIC(PORTAL300_TOPIC_ACTION_OPEN_DOOR_SAFE), DOOR_NAME(DOOR_B2))) {
+      log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to safely open B2");
+    }
+    break;
+
+  case SIGNAL_OPEN_DOOR_C2_SAFE:
+    log_print(LSS_SYSTEM, LL_MESSAGE, "Safely opening inner back door.");
+    if (!send_mqtt_msg(controller, PORTAL_TOPIC(PORTAL300_TOPIC_ACTION_OPEN_DOOR_SAFE), DOOR_NAME(DOOR_C2))) {
+      log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to safely open C2");
+    }
+    break;
+
+  case SIGNAL_OPEN_DOOR_B2_UNSAFE:
+    log_print(LSS_SYSTEM, LL_MESSAGE, "Opening inner front door.");
+    if (!send_mqtt_msg(controller, PORTAL_TOPIC(PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE), DOOR_NAME(DOOR_B2))) {
+      log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to open B2");
+    }
+    break;
+
+  case SIGNAL_OPEN_DOOR_C2_UNSAFE:
+    log_print(LSS_SYSTEM, LL_MESSAGE, "Opening inner back door.");
+    if (!send_mqtt_msg(controller, PORTAL_TOPIC(PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE), DOOR_NAME(DOOR_C2))) {
+      log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to open C2");
+    }
+    break;
+
+  case SIGNAL_LOCK_ALL:
+    log_print(LSS_SYSTEM, LL_MESSAGE, "Sending request to lock all doors...");
+
+    for (int door = 0; door < SM_DOOR_COUNT; door++) {
+      if (!send_mqtt_msg(controller, PORTAL_TOPIC(PORTAL300_TOPIC_ACTION_LOCK_DOOR), sm_doors[door].id)) {
+        log_print(LSS_SYSTEM, LL_ERROR, "Could not send message to close door %s", sm_doors[door].name);
+        break;
+      }
+    }
+    break;
+
+  case SIGNAL_START_TIMEOUT:
+    log_print(LSS_SYSTEM, LL_VERBOSE, "handling timeout request. timeout is in %u ms.", controller->timer_ms);
+    controller->env.start_timer(controller->env.user_data, controller->timer_ms);
+    break;
+
+  case SIGNAL_CANCEL_TIMEOUT:
+    log_print(LSS_SYSTEM, LL_VERBOSE, "cancelling timeout request.");
+    controller->env.cancel_timer(controller->env.user_data);
+    break;
+
+  default:
+    // the daemon handles the bookkeeping of the other signals
+    break;
+  }
+}
+
+static bool send_mqtt_msg(struct Controller * controller, char const * topic, char const * data)
+{
+  return controller->env.send_mqtt(controller->env.user_data, topic, data);
+}
+
+static void state_machine_signal_handler(void * user_data, void * context, enum SM_Signal signal)
+{
+  struct Controller * const controller = user_data;
+
+  uint32_t const client_id = (context != NULL) ? *(uint32_t const *)context : CONTROLLER_NO_CLIENT;
+
+  time_phase(controller, signal);
+  push_signal(controller, signal, client_id);
+}
+
+//! Times the phases of a transaction while the state machine sends its
+//! signals, as only then the phase of each signal is known.
+static void time_phase(struct Controller * controller, enum SM_Signal signal)
+{
+  switch (signal) {
+  case SIGNAL_START_TIMEOUT:
+  {
+    enum SM_Phase const phase = sm_get_phase(&controller->state_machine);
+
+    controller->timer_phase   = phase;
+    controller->timer_started = controller->env.get_time_ms(controller->env.user_data);
+    controller->timer_ms      = (phase != SM_NO_PHASE) ? timeout_budget_get(&controller->timeouts[phase]) : CONTROLLER_ENTRY_TIMEOUT_MS;
+    break;
+  }
+
+  case SIGNAL_UNLOCK_SUCCESSFUL:
+    finish_phase(controller, SM_PHASE_UNLOCK);
+    break;
+
+  case SIGNAL_LOCK_SUCCESSFUL:
+    finish_phase(controller, SM_PHASE_LOCK);
+    break;
+
+  case SIGNAL_OPEN_SUCCESSFUL:
+    controller->timer_phase = SM_NO_PHASE;
+    break;
+
+  case SIGNAL_USER_REQUESTED_TIMED_OUT:
+    if (controller->timer_phase != SM_NO_PHASE) {
+      struct TimeoutBudget * const budget = &controller->timeouts[controller->timer_phase];
+      timeout_budget_expired(budget);
+      log_print(LSS_SYSTEM, LL_VERBOSE, "%s phase timed out after %u ms, its timeout is now %u ms.", sm_phase_name(controller->timer_phase), controller->timer_ms, timeout_budget_get(budget));
+    }
+    controller->timer_phase = SM_NO_PHASE;
+    break;
+
+  default:
+    break;
+  }
+}
+
+//! Learns the duration of `phase` if the timer ran for it.
+static void finish_phase(struct Controller * controller, enum SM_Phase phase)
+{
+  if (controller->timer_phase != phase)
+    return;
+  controller->timer_phase = SM_NO_PHASE;
+
+  uint64_t const now      = controller->env.get_time_ms(controller->env.user_data);
+  uint64_t const duration = (now > controller->timer_started) ? (now - controller->timer_started) : 0;
+
+  struct TimeoutBudget * const budget = &controller->timeouts[phase];
+  if (!budget->adaptive)
+    return;
+
+  timeout_budget_sample(budget, (duration < UINT32_MAX) ? (uint32_t)duration : UINT32_MAX);
+  log_print(LSS_SYSTEM, LL_VERBOSE, "%s phase took %u ms, its timeout is now %u ms.", sm_phase_name(phase), (unsigned int)duration, timeout_budget_get(budget));
+}
+
+static void push_signal(struct Controller * controller, enum SM_Signal signal, uint32_t client_id)
+{
+  if (controller->size >= CONTROLLER_SIGNAL_QUEUE_LEN) {
+    log_print(LSS_SYSTEM, LL_ERROR, "Could not handle signal from state machine: ring buffer full!");
+    return;
+  }
+
+  size_t const write_index            = (controller->read_offset + controller->size) % CONTROLLER_SIGNAL_QUEUE_LEN;
+  controller->signals[write_index]    = signal;
+  controller->client_ids[write_index] = client_id;
+  controller->size += 1;
+}
@@ -0,0 +1,139 @@
+#ifndef PORTAL300_CONTROLLER_H
+#define PORTAL300_CONTROLLER_H
+
+#include "state-machine.h"
+#include "timeout-budget.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The door logic of the daemon: Turns MQTT messages and requests into state
+// machine events and executes the door actions of the resulting signals. It
+// doesn't touch sockets or clocks itself, everything goes through a
+// `struct ControllerEnvironment`. The daemon passes the real MQTT client and
+// timerfd, `portal-replay` passes a recording and a virtual clock.
+//
+// Topics are relative to the prefix of the portal the controller belongs to,
+// see PORTAL_TOPIC() in portal-router.h.
+
+//! Client id of signals that were not caused by a request.
+#define CONTROLLER_NO_CLIENT (~0U)
+
+#define CONTROLLER_SIGNAL_QUEUE_LEN 64
+
+//! Default worst case timeouts of the phases, see controller_set_timeout().
+//! The door firmware needs up to 20 s to move a bolt, waits 60 s for
+//! somebody to open an unlocked door and 30 s for a door to be closed before
+//! it locks it.
+#define CONTROLLER_UNLOCK_TIMEOUT_MS 40000
+#define CONTROLLER_ENTRY_TIMEOUT_MS  120000
+#define CONTROLLER_LOCK_TIMEOUT_MS   60000
+
+//! Requests that can wait for a busy state machine, more are rejected.
+#define CONTROLLER_REQUEST_QUEUE_LEN 8
+
+//! A request that waits until the state machine is idle again.
+struct ControllerRequest
+{
+  enum SM_Event event;
+  uint32_t      client_id;
+};
+
+struct ControllerEnvironment
+{
+  void * user_data;
+
+  //! Publishes `data` on `topic`, relative to the portal's prefix.
+  bool (*send_mqtt)(void * user_data, char const * topic, char const * data);
+
+  //! Calls controller_handle_timeout() after `ms` milliseconds, replacing a running timer.
+  void (*start_timer)(void * user_data, uint32_t ms);
+  void (*cancel_timer)(void * user_data);
+
+  //! Returns a monotonic time in milliseconds, the phases are timed with it.
+  uint64_t (*get_time_ms)(void * user_data);
+};
+
+struct Controller
+{
+  struct StateMachine          state_machine;
+  struct ControllerEnvironment env;
+
+  // signals of the state machine that were not popped yet
+  uint32_t       read_offset, size;
+  enum SM_Signal signals[CONTROLLER_SIGNAL_QUEUE_LEN];
+  uint32_t       client_ids[CONTROLLER_SIGNAL_QUEUE_LEN];
+
+  // requests that arrived while the state machine was busy, oldest first
+  uint32_t                 request_count;
+  struct ControllerRequest requests[CONTROLLER_REQUEST_QUEUE_LEN];
+
+  // timeouts of the phases and the phase the timer runs for
+  struct TimeoutBudget timeouts[SM_PHASE_COUNT];
+  enum SM_Phase        timer_phase;   // SM_NO_PHASE when no timer runs, or after a restart
+  uint64_t             timer_started; // get_time_ms() when the timer was started
+  uint32_t             timer_ms;      // timeout of the last SIGNAL_START_TIMEOUT
+
+  // how often each event was applied, and how often it changed the state or the doors
+  uint64_t events[SM_EVENT_COUNT];
+  uint64_t transitions[SM_EVENT_COUNT];
+};
+
+void controller_init(struct Controller * controller, struct ControllerEnvironment const * env);
+
+//! Sets the worst case timeout of `phase`. The timeouts of the unlock and the
+//! lock phase adapt to how long the doors take, but never exceed it. The
+//! entry phase depends on people, so it always gets the full timeout.
+void controller_set_timeout(struct Controller * controller, enum SM_Phase phase, uint32_t limit_ms);
+
+//! Returns the timeout the next run of `phase` gets.
+uint32_t controller_get_timeout(struct Controller const * controller, enum SM_Phase phase);
+
+//! Applies door status, button and door bell messages to the state machine.
+//! `topic` is relative to the portal's prefix. Returns false if `topic` is not
+//! one of those.
+bool controller_handle_mqtt(struct Controller * controller, char const * topic, char const * data);
+
+//! Parses a door status message. Returns false if `topic` is not the status
+//! topic of a door in `sm_doors`. Otherwise `door` is its index and `state`
+//! the status, or DOOR_UNOBSERVED if `data` is not a valid status.
+bool controller_parse_door_status(char const * topic, char const * data, int * door, enum DoorState * state);
+
+//! Applies the status `state` of `door` to the state machine.
+void controller_handle_door_status(struct Controller * controller, int door, enum DoorState state);
+
+//! Applies an open or close request of the ipc client `client_id`. While the
+//! state machine is busy, a request that asks for the result of the running
+//! transaction attaches to it (SIGNAL_REQUEST_ATTACHED), every other request
+//! is queued (SIGNAL_REQUEST_QUEUED) and applied once the transaction is
+//! finished and its signals are popped, see controller_pop_signal(). Only
+//! when the queue is full, the request is rejected.
+void controller_handle_request(struct Controller * controller, enum SM_Event event, uint32_t client_id);
+
+//! Drops the queued requests of `client_id`, for clients that disconnected.
+void controller_cancel_requests(struct Controller * controller, uint32_t client_id);
+
+//! Returns true if a request of `client_id` waits in the queue.
+bool controller_has_request(struct Controller const * controller, uint32_t client_id);
+
+//! Gives up on the running transaction, e.g. because a door it waits for
+//! can't report anymore. The timer is restarted to expire right away, so the
+//! transaction fails like a timeout, but without widening the timeout of the
+//! phase. Returns false if no transaction is running.
+bool controller_expire_timer(struct Controller * controller);
+
+//! Applies the expiration of the timer started with `start_timer`.
+void controller_handle_timeout(struct Controller * controller);
+
+//! Takes the oldest signal of the state machine. `client_id` is the client
+//! whose request caused the signal or CONTROLLER_NO_CLIENT. The caller must
+//! handle a signal before taking the next: when none is left, the queued
+//! requests start, so the outcome of a transaction is handled before the
+//! next transaction starts.
+bool controller_pop_signal(struct Controller * controller, enum SM_Signal * signal, uint32_t * client_id);
+
+//! Performs the door actions of `signal`, like sending lock commands or
+//! starting the timer. Signals without door actions are ignored.
+void controller_execute_signal(struct Controller * controller, enum SM_Signal signal);
+
+#endif // PORTAL300_CONTROLLER_H
@@ -0,0 +1,205 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "door-filter.h"
+#include "state-machine.h"
+
+// Feeds status sequences of bouncing and repeating door controllers into the
+// door filter and checks what reaches the state machine, and when. The state
+// machine itself is not involved, `pass_repeat` stands in for
+// sm_waits_for_door().
+
+#define CHECK_MAX_STEPS 12
+
+enum StepKind
+{
+  STEP_END = 0,
+  STEP_INPUT,      // `state` of `door` arrives at `at`, passes right away if `passes`
+  STEP_DUE,        // at `at`, `state` of `door` is due, or nothing if `door` is -1
+  STEP_TIMEOUT,    // at `at`, door_filter_timeout() returns `timeout`
+  STEP_DUPLICATES, // `door` counted `count` duplicates so far
+};
+
+struct Step
+{
+  enum StepKind  kind;
+  int            door;
+  enum DoorState state;
+  bool           pass_repeat;
+  uint64_t       at;
+  bool           passes;
+  int            timeout;
+  uint32_t       count;
+};
+
+struct Scenario
+{
+  char const * name;
+  uint32_t     hold_ms;
+  struct Step  steps[CHECK_MAX_STEPS];
+};
+
+#define INPUT(d, s, t, p)        {.kind = STEP_INPUT, .door = (d), .state = (s), .at = (t), .passes = (p)}
+#define INPUT_WAITED(d, s, t, p) {.kind = STEP_INPUT, .door = (d), .state = (s), .pass_repeat = true, .at = (t), .passes = (p)}
+#define DUE(t, d, s)             {.kind = STEP_DUE, .at = (t), .door = (d), .state = (s)}
+#define NOTHING_DUE(t)           {.kind = STEP_DUE, .at = (t), .door = -1}
+#define TIMEOUT(t, ms)           {.kind = STEP_TIMEOUT, .at = (t), .timeout = (ms)}
+#define DUPLICATES(d, n)         {.kind = STEP_DUPLICATES, .door = (d), .count = (n)}
+
+static struct Scenario const scenarios[] = {
+    {
+        .name    = "repeats are dropped unless the state machine waits for the door",
+        .hold_ms = 500,
+        .steps   = {
+            INPUT(SM_DOOR_B2, DOOR_LOCKED, 0, true),
+            INPUT(SM_DOOR_B2, DOOR_LOCKED, 1000, false),
+            INPUT_WAITED(SM_DOOR_B2, DOOR_LOCKED, 2000, true),
+            INPUT(SM_DOOR_C2, DOOR_LOCKED, 2000, true),
+            DUPLICATES(SM_DOOR_B2, 1),
+            DUPLICATES(SM_DOOR_C2, 0),
+        },
+    },
+    {
+        .name    = "a change of a quiet door passes right away",
+        .hold_ms = 500,
+        .steps   = {
+            INPUT(SM_DOOR_B2, DOOR_LOCKED, 0, true),
+            INPUT(SM_DOOR_B2, DOOR_CLOSED, 500, true),
+            TIMEOUT(500, -1),
+        },
+    },
+    {
+        .name    = "a quick change is held for the hold time",
+        .hold_ms = 500,
+        .steps   = {
+            INPUT(SM_DOOR_B2, DOOR_LOCKED, 0, true),
+            INPUT(SM_DOOR_B2, DOOR_CLOSED, 100, false),
+            TIMEOUT(100, 500),
+            NOTHING_DUE(599),
+            DUE(600, SM_DOOR_B2, DOOR_CLOSED),
+            NOTHING_DUE(600),
+            TIMEOUT(600, -1),
+        },
+    },
+    {
+        .name    = "every held change restarts the hold time",
+        .hold_ms = 500,
+        .steps   = {
+            INPUT(SM_DOOR_B2, DOOR_LOCKED, 0, true),
+            INPUT(SM_DOOR_B2, DOOR_CLOSED, 100, false),
+            INPUT(SM_DOOR_B2, DOOR_OPEN, 400, false),
+            NOTHING_DUE(600),
+            TIMEOUT(600, 300),
+            DUE(900, SM_DOOR_B2, DOOR_OPEN),
+        },
+    },
+    {
+        .name    = "a repeat of the held status doesn't restart the hold time",
+        .hold_ms = 500,
+        .steps   = {
+            INPUT(SM_DOOR_B2, DOOR_LOCKED, 0, true),
+            INPUT(SM_DOOR_B2, DOOR_CLOSED, 100, false),
+            INPUT_WAITED(SM_DOOR_B2, DOOR_CLOSED, 400, false),
+            DUE(600, SM_DOOR_B2, DOOR_CLOSED),
+            DUPLICATES(SM_DOOR_B2, 1),
+        },
+    },
+    {
+        .name    = "a door that bounces back passes nothing",
+        .hold_ms = 500,
+        .steps   = {
+            INPUT(SM_DOOR_C2, DOOR_LOCKED, 0, true),
+            INPUT(SM_DOOR_C2, DOOR_CLOSED, 100, false),
+            INPUT_WAITED(SM_DOOR_C2, DOOR_LOCKED, 200, false),
+            TIMEOUT(200, -1),
+            NOTHING_DUE(400),
+            INPUT(SM_DOOR_C2, DOOR_CLOSED, 500, false),
+            DUE(1000, SM_DOOR_C2, DOOR_CLOSED),
+        },
+    },
+    {
+        .name    = "without hold time only repeats are dropped",
+        .hold_ms = 0,
+        .steps   = {
+            INPUT(SM_DOOR_B2, DOOR_LOCKED, 0, true),
+            INPUT(SM_DOOR_B2, DOOR_CLOSED, 0, true),
+            INPUT(SM_DOOR_B2, DOOR_OPEN, 0, true),
+            INPUT(SM_DOOR_B2, DOOR_OPEN, 0, false),
+            TIMEOUT(0, -1),
+        },
+    },
+};
+
+static bool run_scenario(struct Scenario const * scenario)
+{
+  struct DoorFilter filter;
+  door_filter_init(&filter, scenario->hold_ms);
+
+  for (size_t i = 0; (i < CHECK_MAX_STEPS) && (scenario->steps[i].kind != STEP_END); i++) {
+    struct Step const * const step = &scenario->steps[i];
+
+    switch (step->kind) {
+    case STEP_INPUT:
+    {
+      bool const passes = door_filter_input(&filter, step->door, step->state, step->pass_repeat, step->at);
+      if (passes != step->passes) {
+        fprintf(stderr, "%s: step %zu: door %s %s %s\n", scenario->name, i + 1, sm_doors[step->door].name, sm_door_state_name(step->state), passes ? "passed" : "didn't pass");
+        return false;
+      }
+      break;
+    }
+
+    case STEP_DUE:
+    {
+      int            door;
+      enum DoorState state;
+      bool const     due = door_filter_take_due(&filter, step->at, &door, &state);
+      if (due != (step->door >= 0)) {
+        fprintf(stderr, "%s: step %zu: %s due at %llu ms\n", scenario->name, i + 1, due ? "a status was" : "nothing was", (unsigned long long)step->at);
+        return false;
+      }
+      if (due && ((door != step->door) || (state != step->state))) {
+        fprintf(stderr, "%s: step %zu: door %s %s was due\n", scenario->name, i + 1, sm_doors[door].name, sm_door_state_name(state));
+        return false;
+      }
+      break;
+    }
+
+    case STEP_TIMEOUT:
+    {
+      int const timeout = door_filter_timeout(&filter, step->at);
+      if (timeout != step->timeout) {
+        fprintf(stderr, "%s: step %zu: timeout is %d ms, expected %d ms\n", scenario->name, i + 1, timeout, step->timeout);
+        return false;
+      }
+      break;
+    }
+
+    case STEP_DUPLICATES:
+      if (filter.doors[step->door].duplicates != step->count) {
+        fprintf(stderr, "%s: step %zu: door %s counted %u duplicates\n", scenario->name, i + 1, sm_doors[step->door].name, (unsigned int)filter.doors[step->door].duplicates);
+        return false;
+      }
+      break;
+
+    default: break;
+    }
+  }
+  return true;
+}
+
+int main(void)
+{
+  size_t const count  = sizeof scenarios / sizeof scenarios[0];
+  size_t       failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!run_scenario(&scenarios[i])) {
+      failed += 1;
+    }
+  }
+
+  fprintf(stdout, "ran %zu door filter scenarios, %zu failed\n", count, failed);
+  return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
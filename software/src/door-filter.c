@@ -0,0 +1,103 @@
+#include "door-filter.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+void door_filter_init(struct DoorFilter * filter, uint32_t hold_ms)
+{
+  assert(filter != NULL);
+
+  filter->hold_ms = hold_ms;
+  for (int door = 0; door < SM_DOOR_COUNT; door++) {
+    filter->doors[door] = (struct DoorFilterDoor){
+        .passed     = DOOR_UNOBSERVED,
+        .held       = DOOR_UNOBSERVED,
+        .changed_at = 0,
+        .duplicates = 0,
+        .flaps      = 0,
+    };
+  }
+}
+
+bool door_filter_input(struct DoorFilter * filter, int door, enum DoorState state, bool pass_repeat, uint64_t now)
+{
+  assert(filter != NULL);
+  assert((door >= 0) && (door < SM_DOOR_COUNT));
+  assert(state != DOOR_UNOBSERVED);
+
+  struct DoorFilterDoor * const filtered = &filter->doors[door];
+
+  if (state == filtered->passed) {
+    if (filtered->held != DOOR_UNOBSERVED) {
+      // bounced back before the hold time was over, the door isn't quiet yet
+      filtered->held       = DOOR_UNOBSERVED;
+      filtered->changed_at = now;
+      filtered->flaps += 1;
+      return false;
+    }
+    if (pass_repeat)
+      return true;
+
+    filtered->duplicates += 1;
+    return false;
+  }
+
+  if (state == filtered->held) {
+    // a repetition doesn't restart the hold time
+    filtered->duplicates += 1;
+    return false;
+  }
+
+  if ((filtered->passed == DOOR_UNOBSERVED) || (now - filtered->changed_at >= filter->hold_ms)) {
+    filtered->passed     = state;
+    filtered->held       = DOOR_UNOBSERVED;
+    filtered->changed_at = now;
+    return true;
+  }
+
+  // held until the door was quiet for the hold time
+  filtered->held       = state;
+  filtered->changed_at = now;
+  filtered->flaps += 1;
+  return false;
+}
+
+bool door_filter_take_due(struct DoorFilter * filter, uint64_t now, int * door, enum DoorState * state)
+{
+  assert(filter != NULL);
+  assert(door != NULL);
+  assert(state != NULL);
+
+  for (int i = 0; i < SM_DOOR_COUNT; i++) {
+    struct DoorFilterDoor * const filtered = &filter->doors[i];
+    if ((filtered->held == DOOR_UNOBSERVED) || (now - filtered->changed_at < filter->hold_ms))
+      continue;
+
+    filtered->passed = filtered->held;
+    filtered->held   = DOOR_UNOBSERVED;
+
+    *door  = i;
+    *state = filtered->passed;
+    return true;
+  }
+  return false;
+}
+
+int door_filter_timeout(struct DoorFilter const * filter, uint64_t now)
+{
+  assert(filter != NULL);
+
+  int timeout = -1;
+  for (int i = 0; i < SM_DOOR_COUNT; i++) {
+    struct DoorFilterDoor const * const filtered = &filter->doors[i];
+    if (filtered->held == DOOR_UNOBSERVED)
+      continue;
+
+    uint64_t const due  = filtered->changed_at + filter->hold_ms;
+    int const      left = (due > now) ? (int)(due - now) : 0;
+    if ((timeout < 0) || (left < timeout)) {
+      timeout = left;
+    }
+  }
+  return timeout;
+}
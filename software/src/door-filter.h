@@ -0,0 +1,59 @@
+#ifndef PORTAL300_DOOR_FILTER_H
+#define PORTAL300_DOOR_FILTER_H
+
+#include "state-machine.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Input filter for the status messages of the doors of a portal. The door
+// controllers republish their status periodically and a bouncing sensor
+// sends opened/closed/opened within milliseconds, but the state machine
+// should only see real changes:
+//
+// - A status that repeats the last passed one is dropped, unless the state
+//   machine waits for the door. Some transitions only react to an event of a
+//   door that is in the expected state already, like "locking completed" when
+//   the last door locked before the machine waited for the shack to lock, so
+//   they depend on the periodic status of the controllers.
+// - A change passes right away if the door was quiet for the hold time.
+// - A change that follows within the hold time is held, and every further
+//   change restarts the hold time. Only the status the door settled on passes
+//   once the door was quiet for the hold time, a door that bounced back to the
+//   passed status passes nothing.
+//
+// Times are milliseconds of any monotonic clock.
+
+#define DOOR_FILTER_DEFAULT_HOLD_MS 500
+
+struct DoorFilterDoor
+{
+  enum DoorState passed;     // last status passed to the state machine, DOOR_UNOBSERVED before the first
+  enum DoorState held;       // status that waits for the hold time, DOOR_UNOBSERVED if none
+  uint64_t       changed_at; // when the status last changed, passed or held
+  uint32_t       duplicates; // dropped repetitions of the passed or held status
+  uint32_t       flaps;      // changes that came within the hold time
+};
+
+struct DoorFilter
+{
+  uint32_t              hold_ms; // 0 only drops duplicates
+  struct DoorFilterDoor doors[SM_DOOR_COUNT];
+};
+
+void door_filter_init(struct DoorFilter * filter, uint32_t hold_ms);
+
+//! Filters the status `state` of `door` that was received at `now`. A repeated
+//! status passes if `pass_repeat` is set, see sm_waits_for_door(). Returns
+//! true if it passes to the state machine right away.
+bool door_filter_input(struct DoorFilter * filter, int door, enum DoorState state, bool pass_repeat, uint64_t now);
+
+//! Takes a held status of a door that was quiet for the hold time at `now`.
+//! Returns false if none is due.
+bool door_filter_take_due(struct DoorFilter * filter, uint64_t now, int * door, enum DoorState * state);
+
+//! Returns the time in ms until the next held status is due, or -1 if none is
+//! held. Suitable as poll() timeout.
+int door_filter_timeout(struct DoorFilter const * filter, uint64_t now);
+
+#endif // PORTAL300_DOOR_FILTER_H
@@ -0,0 +1,129 @@
+#include "flight-recorder.h"
+
+#include "clock.h"
+#include "log.h"
+
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+_Static_assert((FLIGHT_RECORDER_LEN & (FLIGHT_RECORDER_LEN - 1)) == 0, "FLIGHT_RECORDER_LEN must be a power of two");
+
+static struct
+{
+  struct FlightRecord ring[FLIGHT_RECORDER_LEN];
+  uint64_t            total; // number of records ever added, the next one goes to `total % FLIGHT_RECORDER_LEN`
+
+  // all paths are prepared in advance, the crash handler can't format strings
+  char path[PATH_MAX];
+  char temp_path[PATH_MAX];
+  char crash_path[PATH_MAX];
+} flight_recorder = {
+    .total      = 0,
+    .path       = FLIGHT_RECORDER_DEFAULT_PATH,
+    .temp_path  = FLIGHT_RECORDER_DEFAULT_PATH ".tmp",
+    .crash_path = FLIGHT_RECORDER_DEFAULT_PATH ".crash",
+};
+
+static bool write_dump(char const * path, char const * temp_path);
+
+void flight_recorder_add(struct FlightRecord record)
+{
+  record.timestamp = clock_get_ns(CLOCK_MONOTONIC);
+
+  flight_recorder.ring[flight_recorder.total & (FLIGHT_RECORDER_LEN - 1)] = record;
+  flight_recorder.total += 1;
+}
+
+bool flight_recorder_set_path(char const * path)
+{
+  assert(path != NULL);
+
+  if (strlen(path) + sizeof ".crash" > sizeof flight_recorder.path) {
+    log_print(LSS_SYSTEM, LL_ERROR, "flight recorder path is too long: %s", path);
+    return false;
+  }
+
+  strcpy(flight_recorder.path, path);
+  snprintf(flight_recorder.temp_path, sizeof flight_recorder.temp_path, "%s.tmp", path);
+  snprintf(flight_recorder.crash_path, sizeof flight_recorder.crash_path, "%s.crash", path);
+  return true;
+}
+
+char const * flight_recorder_get_path(void)
+{
+  return flight_recorder.path;
+}
+
+bool flight_recorder_dump(void)
+{
+  if (!write_dump(flight_recorder.path, flight_recorder.temp_path)) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to write flight recorder");
+    return false;
+  }
+  log_print(LSS_SYSTEM, LL_MESSAGE, "wrote flight recorder with %llu records to %s", (unsigned long long)flight_recorder.total, flight_recorder.path);
+  return true;
+}
+
+void flight_recorder_dump_crash(void)
+{
+  // nothing we could do about an error here
+  (void)write_dump(flight_recorder.crash_path, NULL);
+}
+
+//! Writes the ring oldest record first. With `temp_path`, the dump is written
+//! there and renamed, so readers never see a partial file.
+//! Only uses async-signal-safe functions.
+static bool write_dump(char const * path, char const * temp_path)
+{
+  struct timespec monotonic, real;
+  clock_gettime(CLOCK_MONOTONIC, &monotonic);
+  clock_gettime(CLOCK_REALTIME, &real);
+
+  uint64_t const total = flight_recorder.total;
+  uint32_t const count = (total < FLIGHT_RECORDER_LEN) ? (uint32_t)total : FLIGHT_RECORDER_LEN;
+  uint32_t const start = (uint32_t)((total - count) & (FLIGHT_RECORDER_LEN - 1));
+
+  struct FlightRecorderDump const header = {
+      .magic          = FLIGHT_RECORDER_MAGIC,
+      .version        = FLIGHT_RECORDER_VERSION,
+      .record_size    = sizeof(struct FlightRecord),
+      .count          = count,
+      .total          = total,
+      .monotonic_time = 1000000000u * (uint64_t)monotonic.tv_sec + (uint64_t)monotonic.tv_nsec,
+      .real_time      = 1000000000u * (uint64_t)real.tv_sec + (uint64_t)real.tv_nsec,
+  };
+
+  // the ring wraps at most once, so the records are two slices of it
+  uint32_t const first_len = (start + count <= FLIGHT_RECORDER_LEN) ? count : FLIGHT_RECORDER_LEN - start;
+
+  struct iovec const parts[] = {
+      {.iov_base = (void *)&header, .iov_len = sizeof header},
+      {.iov_base = &flight_recorder.ring[start], .iov_len = sizeof(struct FlightRecord) * first_len},
+      {.iov_base = &flight_recorder.ring[0], .iov_len = sizeof(struct FlightRecord) * (count - first_len)},
+  };
+  size_t const size = parts[0].iov_len + parts[1].iov_len + parts[2].iov_len;
+
+  int const fd = open((temp_path != NULL) ? temp_path : path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+
+  bool const ok = (writev(fd, parts, sizeof parts / sizeof parts[0]) == (ssize_t)size) && (fsync(fd) == 0);
+  close(fd);
+
+  if (temp_path == NULL) {
+    return ok;
+  }
+  if (!ok || (rename(temp_path, path) == -1)) {
+    unlink(temp_path);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,67 @@
+#ifndef PORTAL300_FLIGHT_RECORDER_H
+#define PORTAL300_FLIGHT_RECORDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Flight recorder of the state machine. Every event, signal and transition of
+// the state machine is stored into a fixed size ring in memory, which costs a
+// clock read and a few stores, so it is always on. The ring is only written
+// to disk when somebody asks for it (SIGUSR1, portal-trigger flight-recorder)
+// or when the daemon crashes. `portal-trace -r <file>` prints a dump.
+
+#define FLIGHT_RECORDER_LEN          1024 // must be a power of two
+#define FLIGHT_RECORDER_DEFAULT_PATH "/var/lib/portal300/flight-recorder"
+
+enum FlightRecordKind
+{
+  FLIGHT_EVENT      = 1, // `code` and `door` are the enum SM_Event and door passed to sm_apply_event()
+  FLIGHT_SIGNAL     = 2, // `code` is the enum SM_Signal sent by the state machine
+  FLIGHT_TRANSITION = 3, // the state or a door changed while handling the last event
+};
+
+//! A single entry of the ring. Door states are packed as two bits per door
+//! of `sm_doors`, the first door in the lowest bits.
+struct FlightRecord
+{
+  uint64_t timestamp; // CLOCK_MONOTONIC in nanoseconds
+  uint8_t  kind;      // enum FlightRecordKind
+  uint8_t  code;
+  uint8_t  door;
+  uint8_t  state_before;
+  uint8_t  state_after;
+  uint8_t  reserved;
+  uint16_t doors_before;
+  uint16_t doors_after;
+};
+
+//! Layout of a dump file: the header followed by `count` records, oldest first.
+struct FlightRecorderDump
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t count;
+  uint64_t total;          // records written since the daemon started, older ones were overwritten
+  uint64_t monotonic_time; // CLOCK_MONOTONIC when the dump was written, in nanoseconds
+  uint64_t real_time;      // CLOCK_REALTIME when the dump was written, in nanoseconds
+};
+
+#define FLIGHT_RECORDER_MAGIC   0x52463350 // "P3FR"
+#define FLIGHT_RECORDER_VERSION 2
+
+//! Appends `record` to the ring and sets its timestamp.
+void flight_recorder_add(struct FlightRecord record);
+
+//! Sets the file written by flight_recorder_dump(). Crash dumps go to `<path>.crash`.
+bool flight_recorder_set_path(char const * path);
+char const * flight_recorder_get_path(void);
+
+//! Writes the ring to the dump file.
+bool flight_recorder_dump(void);
+
+//! Writes the ring to the crash dump file. Only uses async-signal-safe
+//! functions and doesn't log, so it can be called from a fatal signal handler.
+void flight_recorder_dump_crash(void);
+
+#endif // PORTAL300_FLIGHT_RECORDER_H
@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ipc.h"
+#include "log.h"
+
+// Compares the throughput of the legacy struct wire format with the TLV
+// format for the messages the daemon exchanges most: open requests from
+// portal-trigger and info lines back to it. Measures encoding and decoding
+// alone, then a full round over a SOCK_SEQPACKET socket pair like the real
+// ipc socket, where the size of a message matters:
+//   bin/ipc-bench [-n <messages>]
+
+struct BenchMessage
+{
+  char const *      name;
+  struct IpcMessage msg;
+};
+
+static struct BenchMessage messages[] = {
+    {
+        .name = "open request",
+        .msg  = {
+            .type      = IPC_MSG_OPEN_FRONT,
+            .data.open = {
+                .member_id   = 42,
+                .member_nick = "xq",
+                .member_name = "Max Mustermann",
+            },
+        },
+    },
+    {
+        .name = "info line",
+        .msg  = {
+            .type      = IPC_MSG_INFO,
+            .data.info = "shackspace is now unlocked via b2",
+        },
+    },
+};
+
+static char const * const format_names[] = {
+    [IPC_WIRE_LEGACY] = "legacy",
+    [IPC_WIRE_V1]     = "tlv",
+};
+
+//! Keeps the compiler from dropping the measured work.
+static volatile size_t sink;
+
+static bool parse_count(char const * text, unsigned long * value)
+{
+  errno      = 0;
+  char * end = NULL;
+  *value     = strtoul(text, &end, 10);
+  return (errno == 0) && (end != text) && (*end == 0) && (*value > 0);
+}
+
+static double get_seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static void report(char const * name, char const * format, char const * stage, unsigned long count, double seconds)
+{
+  fprintf(stdout, "%-13s %-7s %-7s %10.0f msgs/s  %8.1f ns/msg\n", name, format, stage, (double)count / seconds, 1e9 * seconds / (double)count);
+}
+
+static bool bench_codec(struct BenchMessage const * bench, enum IpcWireFormat format, unsigned long count)
+{
+  uint8_t      buffer[IPC_MAX_WIRE_LEN];
+  size_t const length = ipc_encode_msg(format, &bench->msg, buffer, sizeof buffer);
+  if (length == 0) {
+    fprintf(stderr, "failed to encode %s as %s\n", bench->name, format_names[format]);
+    return false;
+  }
+  fprintf(stdout, "%-13s %-7s %zu bytes\n", bench->name, format_names[format], length);
+
+  double start = get_seconds();
+  for (unsigned long i = 0; i < count; i++) {
+    sink = ipc_encode_msg(format, &bench->msg, buffer, sizeof buffer);
+  }
+  report(bench->name, format_names[format], "encode", count, get_seconds() - start);
+
+  struct IpcMessage  decoded;
+  enum IpcWireFormat detected;
+  start = get_seconds();
+  for (unsigned long i = 0; i < count; i++) {
+    if (!ipc_decode_msg(buffer, length, &decoded, &detected)) {
+      fprintf(stderr, "failed to decode %s as %s\n", bench->name, format_names[format]);
+      return false;
+    }
+    sink = (size_t)decoded.type;
+  }
+  report(bench->name, format_names[format], "decode", count, get_seconds() - start);
+  return true;
+}
+
+static bool bench_socket(struct BenchMessage const * bench, enum IpcWireFormat format, unsigned long count)
+{
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1) {
+    fprintf(stderr, "failed to create socket pair: %s\n", strerror(errno));
+    return false;
+  }
+
+  bool              ok = true;
+  struct IpcMessage received;
+  double const      start = get_seconds();
+  for (unsigned long i = 0; ok && (i < count); i++) {
+    ok = ipc_send_msg_with_format(sockets[0], format, &bench->msg) && (ipc_receive_msg(sockets[1], &received) == IPC_SUCCESS);
+  }
+  double const seconds = get_seconds() - start;
+
+  close(sockets[0]);
+  close(sockets[1]);
+
+  if (!ok) {
+    fprintf(stderr, "failed to pass %s as %s over the socket\n", bench->name, format_names[format]);
+    return false;
+  }
+  report(bench->name, format_names[format], "socket", count, seconds);
+  return true;
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned long count = 1000000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "hn:")) != -1) {
+    switch (opt) {
+    case 'n':
+      if (!parse_count(optarg, &count)) {
+        fprintf(stderr, "invalid message count: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'h':
+      fprintf(stdout, "ipc-bench [-n <messages>]\n");
+      return EXIT_SUCCESS;
+
+    default:
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!log_init()) {
+    fprintf(stderr, "failed to initialize logging.\n");
+    return EXIT_FAILURE;
+  }
+  log_set_stderr_level(LL_ERROR);
+
+  for (size_t i = 0; i < sizeof messages / sizeof messages[0]; i++) {
+    for (int format = IPC_WIRE_LEGACY; format <= IPC_WIRE_V1; format++) {
+      if (!bench_codec(&messages[i], (enum IpcWireFormat)format, count) || !bench_socket(&messages[i], (enum IpcWireFormat)format, count)) {
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,222 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ipc.h"
+#include "log.h"
+
+// Checks the ipc codec with the messages that reach the daemon from any local
+// user: both wire formats and their detection, and malformed TLV messages
+// that must be rejected or clipped instead of overrunning a field.
+
+// layout of the V1 wire format, which is fixed for all peers, see ipc.c
+#define WIRE_HEADER_LEN      8
+#define WIRE_TYPE_OFFSET     4
+#define WIRE_LENGTH_OFFSET   6
+#define WIRE_TAG_MEMBER_ID   1
+#define WIRE_TAG_MEMBER_NICK 2
+#define WIRE_TAG_INFO        4
+
+struct Check
+{
+  char const * name;
+  bool (*run)(void);
+};
+
+static struct IpcMessage const open_request = {
+    .type      = IPC_MSG_OPEN_FRONT,
+    .portal    = 0,
+    .data.open = {
+        .member_id   = 42,
+        .member_nick = "xq",
+        .member_name = "Max Mustermann",
+    },
+};
+
+static void set_u16(uint8_t * buffer, size_t offset, uint16_t value)
+{
+  memcpy(buffer + offset, &value, sizeof value);
+}
+
+//! Appends a raw TLV field to an encoded V1 message and fixes its header.
+static size_t append_field(uint8_t * buffer, size_t length, uint8_t tag, void const * value, uint16_t value_len)
+{
+  buffer[length] = tag;
+  memcpy(buffer + length + 1, &value_len, sizeof value_len);
+  memcpy(buffer + length + 3, value, value_len);
+  length += 3 + value_len;
+  set_u16(buffer, WIRE_LENGTH_OFFSET, (uint16_t)(length - WIRE_HEADER_LEN));
+  return length;
+}
+
+static bool decodes(uint8_t const * buffer, size_t length, struct IpcMessage * msg, enum IpcWireFormat expected)
+{
+  enum IpcWireFormat format;
+  return ipc_decode_msg(buffer, length, msg, &format) && (format == expected);
+}
+
+static bool same_open_data(struct IpcMessage const * a, struct IpcMessage const * b)
+{
+  return (a->type == b->type) && (a->data.open.member_id == b->data.open.member_id) && (memcmp(a->data.open.member_nick, b->data.open.member_nick, IPC_MAX_NICK_LEN) == 0) && (memcmp(a->data.open.member_name, b->data.open.member_name, IPC_MAX_NAME_LEN) == 0);
+}
+
+static bool check_round_trip(void)
+{
+  uint8_t           buffer[IPC_MAX_WIRE_LEN];
+  struct IpcMessage decoded;
+
+  struct IpcMessage request = open_request;
+  request.portal            = 3;
+
+  size_t length = ipc_encode_msg(IPC_WIRE_V1, &request, buffer, sizeof buffer);
+  if ((length == 0) || !decodes(buffer, length, &decoded, IPC_WIRE_V1) || !same_open_data(&decoded, &request) || (decoded.portal != 3))
+    return false;
+
+  // the legacy format has no portal
+  length = ipc_encode_msg(IPC_WIRE_LEGACY, &request, buffer, sizeof buffer);
+  return (length != 0) && decodes(buffer, length, &decoded, IPC_WIRE_LEGACY) && same_open_data(&decoded, &request) && (decoded.portal == 0);
+}
+
+static bool check_status_update(void)
+{
+  struct IpcMessage update = {
+      .type        = IPC_MSG_STATUS_UPDATE,
+      .data.update = {
+          .fields = STATUS_FIELD_DOOR_C2 | STATUS_FIELD_KEYHOLDER,
+          .status = {
+              .door_b2        = 2,
+              .door_c2        = 3,
+              .keyholder_id   = 42,
+              .keyholder_nick = "xq",
+          },
+      },
+  };
+
+  uint8_t           buffer[IPC_MAX_WIRE_LEN];
+  struct IpcMessage decoded;
+  size_t const      length = ipc_encode_msg(IPC_WIRE_V1, &update, buffer, sizeof buffer);
+  if ((length == 0) || !decodes(buffer, length, &decoded, IPC_WIRE_V1))
+    return false;
+
+  // fields that didn't change are not sent at all
+  struct PortalStatus const * const status = &decoded.data.update.status;
+  return (decoded.data.update.fields == update.data.update.fields) && (status->door_b2 == 0) && (status->door_c2 == 3) && (status->keyholder_id == 42) && (strcmp(status->keyholder_nick, "xq") == 0);
+}
+
+static bool check_truncated(void)
+{
+  uint8_t           buffer[IPC_MAX_WIRE_LEN];
+  struct IpcMessage decoded;
+  size_t const      length = ipc_encode_msg(IPC_WIRE_V1, &open_request, buffer, sizeof buffer);
+
+  // shorter than the header says
+  for (size_t cut = 1; cut < length; cut++) {
+    if (decodes(buffer, cut, &decoded, IPC_WIRE_V1))
+      return false;
+  }
+
+  // the header agrees, but the last field runs past the end
+  set_u16(buffer, WIRE_LENGTH_OFFSET, (uint16_t)(length - 1 - WIRE_HEADER_LEN));
+  if (decodes(buffer, length - 1, &decoded, IPC_WIRE_V1))
+    return false;
+
+  // not even a complete field header
+  uint8_t const partial[] = {'P', '3', 1, 0, IPC_MSG_CLOSE, 0, 2, 0, WIRE_TAG_INFO, 5};
+  return !decodes(partial, sizeof partial, &decoded, IPC_WIRE_V1);
+}
+
+static bool check_oversized_string(void)
+{
+  struct IpcMessage long_info = {
+      .type = IPC_MSG_INFO,
+  };
+  memset(long_info.data.info, 'n', 300);
+
+  uint8_t      buffer[IPC_MAX_WIRE_LEN];
+  size_t const length = ipc_encode_msg(IPC_WIRE_V1, &long_info, buffer, sizeof buffer);
+  if (length == 0)
+    return false;
+
+  // turn it into an open request with a 300 byte nick
+  set_u16(buffer, WIRE_TYPE_OFFSET, IPC_MSG_OPEN_FRONT);
+  buffer[WIRE_HEADER_LEN] = WIRE_TAG_MEMBER_NICK;
+
+  struct IpcMessage decoded;
+  if (!decodes(buffer, length, &decoded, IPC_WIRE_V1))
+    return false;
+
+  for (size_t i = 0; i < IPC_MAX_NICK_LEN; i++) {
+    if (decoded.data.open.member_nick[i] != 'n')
+      return false;
+  }
+  return decoded.data.open.member_name[0] == 0;
+}
+
+static bool check_invalid_fields(void)
+{
+  uint8_t           buffer[IPC_MAX_WIRE_LEN];
+  struct IpcMessage decoded;
+  size_t            length = ipc_encode_msg(IPC_WIRE_V1, &open_request, buffer, sizeof buffer);
+
+  // fields of newer peers are skipped
+  uint16_t const future = 0xBEEF;
+  length                = append_field(buffer, length, 200, &future, sizeof future);
+  if (!decodes(buffer, length, &decoded, IPC_WIRE_V1) || !same_open_data(&decoded, &open_request))
+    return false;
+
+  // a member id of the wrong size is an error, not a guess
+  uint16_t const short_id = 42;
+  length                  = append_field(buffer, length, WIRE_TAG_MEMBER_ID, &short_id, sizeof short_id);
+  return !decodes(buffer, length, &decoded, IPC_WIRE_V1);
+}
+
+static bool check_format_detection(void)
+{
+  uint8_t           buffer[IPC_MAX_WIRE_LEN];
+  struct IpcMessage decoded;
+  size_t const      length = ipc_encode_msg(IPC_WIRE_LEGACY, &open_request, buffer, sizeof buffer);
+  if ((length == 0) || !decodes(buffer, length, &decoded, IPC_WIRE_LEGACY))
+    return false;
+
+  // legacy messages only come in one size
+  if (decodes(buffer, length - 1, &decoded, IPC_WIRE_LEGACY) || decodes(buffer, length + 1, &decoded, IPC_WIRE_LEGACY))
+    return false;
+
+  // the magic alone doesn't make a V1 message
+  uint8_t const magic[] = {'P', '3', 1, 0};
+  enum IpcWireFormat format;
+  return !ipc_decode_msg(magic, sizeof magic, &decoded, &format);
+}
+
+static struct Check const checks[] = {
+    {"open requests survive both wire formats", check_round_trip},
+    {"status updates only carry the changed fields", check_status_update},
+    {"truncated messages are rejected", check_truncated},
+    {"oversized strings are clipped to their field", check_oversized_string},
+    {"unknown fields are skipped, malformed ones rejected", check_invalid_fields},
+    {"the wire format is detected from the message", check_format_detection},
+};
+
+int main(void)
+{
+  if (!log_init()) {
+    fprintf(stderr, "failed to initialize logging.\n");
+    return EXIT_FAILURE;
+  }
+  // the malformed messages are logged as errors
+  log_disable_stderr();
+
+  size_t const count  = sizeof checks / sizeof checks[0];
+  size_t       failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!checks[i].run()) {
+      fprintf(stderr, "failed: %s\n", checks[i].name);
+      failed += 1;
+    }
+  }
+
+  fprintf(stdout, "ran %zu ipc codec checks, %zu failed\n", count, failed);
+  return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
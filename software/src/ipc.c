@@ -6,8 +6,11 @@
 #include <sys/types.h>
 #include <grp.h>
 
+#include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "log.h"
@@ -17,6 +20,20 @@ const struct sockaddr_un ipc_socket_address = {
     .sun_path   = "/tmp/portal300-ipc.socket",
 };
 
+static struct IpcTraffic traffic;
+
+static void count_sent(size_t length)
+{
+  traffic.messages_sent += 1;
+  traffic.bytes_sent += length;
+}
+
+void ipc_get_traffic(struct IpcTraffic * result)
+{
+  assert(result != NULL);
+  *result = traffic;
+}
+
 int ipc_create_socket()
 {
   int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
@@ -43,40 +60,579 @@ bool ipc_set_flags(int sock)
   return true;
 }
 
+// Wire format V1:
+// Every message starts with a `struct IpcWireHeader`, followed by `length` bytes
+// of TLV fields. Each field is a 1 byte tag, a 2 byte length and the value.
+// Unknown tags are skipped, so new fields can be added without breaking old peers.
+//
+// Legacy messages are always exactly `sizeof(struct IpcLegacyMessage)` bytes long
+// and start with the message type as a 4 byte integer. The first byte of a legacy
+// message is thus always in the range 101..201 and can never be the magic 'P'.
+
+#define IPC_WIRE_MAGIC_0 'P'
+#define IPC_WIRE_MAGIC_1 '3'
+#define IPC_WIRE_VERSION 1
+
+struct IpcWireHeader
+{
+  uint8_t  magic[2];
+  uint8_t  version;
+  uint8_t  reserved;
+  uint16_t type;
+  uint16_t length; // length of the TLV payload after the header
+};
+
+enum IpcWireTag
+{
+  IPC_TAG_MEMBER_ID   = 1, // int32_t
+  IPC_TAG_MEMBER_NICK = 2, // string, not 0 terminated
+  IPC_TAG_MEMBER_NAME = 3, // string, not 0 terminated
+  IPC_TAG_INFO        = 4, // string, not 0 terminated
+  IPC_TAG_STATUS      = 5, // struct PortalStatus, newer revisions may append fields
+
+  // single fields of a status update:
+  IPC_TAG_SHACK_STATE    = 6,  // uint8_t
+  IPC_TAG_ACTIVITY       = 7,  // uint8_t
+  IPC_TAG_DOOR_B2        = 8,  // uint8_t
+  IPC_TAG_DOOR_C2        = 9,  // uint8_t
+  IPC_TAG_MQTT_CONNECTED = 10, // uint8_t
+  IPC_TAG_DEVICES_ONLINE = 11, // uint8_t
+  IPC_TAG_IPC_CLIENTS    = 12, // uint16_t
+  IPC_TAG_KEYHOLDER_ID   = 13, // int32_t
+  IPC_TAG_KEYHOLDER_NICK = 14, // string, not 0 terminated
+
+  // subscription options:
+  IPC_TAG_LOG_SUBSYSTEMS = 15, // uint32_t
+  IPC_TAG_LOG_LEVEL      = 16, // uint8_t
+
+  IPC_TAG_PORTAL = 17, // uint8_t, only sent if not 0
+};
+
+#define IPC_TLV_HEADER_LEN 3
+
+//! The message layout used by portal-trigger before the TLV protocol.
+//! Must never change, as it's what old binaries put on the wire.
+struct IpcLegacyMessage
+{
+  int type;
+  union
+  {
+    struct
+    {
+      int  member_id;
+      char member_nick[256];
+      char member_name[256];
+    } open;
+    char info[1024];
+  } data;
+};
+
+#define IPC_LEGACY_MSG_LEN sizeof(struct IpcLegacyMessage)
+
+_Static_assert(IPC_LEGACY_MSG_LEN <= IPC_MAX_WIRE_LEN, "legacy messages must fit into a wire buffer");
+
+struct WireWriter
+{
+  uint8_t * buffer;
+  size_t    size;
+  size_t    offset;
+  bool      overflow;
+};
+
+static void wire_put_field(struct WireWriter * writer, enum IpcWireTag tag, void const * data, size_t length)
+{
+  if (writer->overflow || length > UINT16_MAX || (writer->offset + IPC_TLV_HEADER_LEN + length) > writer->size) {
+    writer->overflow = true;
+    return;
+  }
+
+  uint16_t const len16 = length;
+
+  uint8_t * const ptr = writer->buffer + writer->offset;
+  ptr[0]              = tag;
+  memcpy(ptr + 1, &len16, sizeof len16);
+  memcpy(ptr + IPC_TLV_HEADER_LEN, data, length);
+
+  writer->offset += IPC_TLV_HEADER_LEN + length;
+}
+
+static size_t encode_legacy(struct IpcMessage const * msg, uint8_t * buffer, size_t buffer_size)
+{
+  if (buffer_size < IPC_LEGACY_MSG_LEN)
+    return 0;
+
+  struct IpcLegacyMessage legacy;
+  memset(&legacy, 0, sizeof legacy);
+
+  legacy.type = msg->type;
+  switch (msg->type) {
+  case IPC_MSG_OPEN_FRONT:
+  case IPC_MSG_OPEN_BACK:
+    legacy.data.open.member_id = msg->data.open.member_id;
+    memcpy(legacy.data.open.member_nick, msg->data.open.member_nick, sizeof legacy.data.open.member_nick);
+    memcpy(legacy.data.open.member_name, msg->data.open.member_name, sizeof legacy.data.open.member_name);
+    break;
+
+  case IPC_MSG_INFO:
+    memcpy(legacy.data.info, msg->data.info, sizeof legacy.data.info);
+    break;
+
+  default:
+    break;
+  }
+
+  memcpy(buffer, &legacy, sizeof legacy);
+  return sizeof legacy;
+}
+
+static size_t encode_v1(struct IpcMessage const * msg, uint8_t * buffer, size_t buffer_size)
+{
+  if (buffer_size < sizeof(struct IpcWireHeader))
+    return 0;
+
+  struct WireWriter writer = {
+      .buffer   = buffer,
+      .size     = buffer_size,
+      .offset   = sizeof(struct IpcWireHeader),
+      .overflow = false,
+  };
+
+  switch (msg->type) {
+  case IPC_MSG_OPEN_FRONT:
+  case IPC_MSG_OPEN_BACK:
+  {
+    int32_t const member_id = msg->data.open.member_id;
+    wire_put_field(&writer, IPC_TAG_MEMBER_ID, &member_id, sizeof member_id);
+    wire_put_field(&writer, IPC_TAG_MEMBER_NICK, msg->data.open.member_nick, strnlen(msg->data.open.member_nick, IPC_MAX_NICK_LEN));
+    wire_put_field(&writer, IPC_TAG_MEMBER_NAME, msg->data.open.member_name, strnlen(msg->data.open.member_name, IPC_MAX_NAME_LEN));
+    break;
+  }
+
+  case IPC_MSG_INFO:
+    wire_put_field(&writer, IPC_TAG_INFO, msg->data.info, strnlen(msg->data.info, IPC_MAX_INFOSTR_LEN));
+    break;
+
+  case IPC_MSG_STATUS:
+    wire_put_field(&writer, IPC_TAG_STATUS, &msg->data.status, sizeof msg->data.status);
+    break;
+
+  case IPC_MSG_SUBSCRIBE:
+    wire_put_field(&writer, IPC_TAG_LOG_SUBSYSTEMS, &msg->data.subscribe.log_subsystems, sizeof msg->data.subscribe.log_subsystems);
+    wire_put_field(&writer, IPC_TAG_LOG_LEVEL, &msg->data.subscribe.log_level, sizeof msg->data.subscribe.log_level);
+    break;
+
+  case IPC_MSG_STATUS_UPDATE:
+  {
+    uint32_t const                    fields = msg->data.update.fields;
+    struct PortalStatus const * const status = &msg->data.update.status;
+    if (fields & STATUS_FIELD_SHACK_STATE)
+      wire_put_field(&writer, IPC_TAG_SHACK_STATE, &status->shack_state, sizeof status->shack_state);
+    if (fields & STATUS_FIELD_ACTIVITY)
+      wire_put_field(&writer, IPC_TAG_ACTIVITY, &status->activity, sizeof status->activity);
+    if (fields & STATUS_FIELD_DOOR_B2)
+      wire_put_field(&writer, IPC_TAG_DOOR_B2, &status->door_b2, sizeof status->door_b2);
+    if (fields & STATUS_FIELD_DOOR_C2)
+      wire_put_field(&writer, IPC_TAG_DOOR_C2, &status->door_c2, sizeof status->door_c2);
+    if (fields & STATUS_FIELD_MQTT_CONNECTED)
+      wire_put_field(&writer, IPC_TAG_MQTT_CONNECTED, &status->mqtt_connected, sizeof status->mqtt_connected);
+    if (fields & STATUS_FIELD_DEVICES_ONLINE)
+      wire_put_field(&writer, IPC_TAG_DEVICES_ONLINE, &status->devices_online, sizeof status->devices_online);
+    if (fields & STATUS_FIELD_IPC_CLIENTS)
+      wire_put_field(&writer, IPC_TAG_IPC_CLIENTS, &status->ipc_clients, sizeof status->ipc_clients);
+    if (fields & STATUS_FIELD_KEYHOLDER) {
+      wire_put_field(&writer, IPC_TAG_KEYHOLDER_ID, &status->keyholder_id, sizeof status->keyholder_id);
+      wire_put_field(&writer, IPC_TAG_KEYHOLDER_NICK, status->keyholder_nick, strnlen(status->keyholder_nick, sizeof status->keyholder_nick));
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+
+  if (msg->portal != 0) {
+    wire_put_field(&writer, IPC_TAG_PORTAL, &msg->portal, sizeof msg->portal);
+  }
+
+  if (writer.overflow)
+    return 0;
+
+  struct IpcWireHeader const header = {
+      .magic    = {IPC_WIRE_MAGIC_0, IPC_WIRE_MAGIC_1},
+      .version  = IPC_WIRE_VERSION,
+      .reserved = 0,
+      .type     = msg->type,
+      .length   = writer.offset - sizeof(struct IpcWireHeader),
+  };
+  memcpy(buffer, &header, sizeof header);
+
+  return writer.offset;
+}
+
+size_t ipc_encode_msg(enum IpcWireFormat format, struct IpcMessage const * msg, uint8_t * buffer, size_t buffer_size)
+{
+  assert(msg != NULL);
+  assert(buffer != NULL);
+
+  switch (format) {
+  case IPC_WIRE_LEGACY: return encode_legacy(msg, buffer, buffer_size);
+  case IPC_WIRE_V1: return encode_v1(msg, buffer, buffer_size);
+  }
+  return 0;
+}
+
+static bool decode_legacy(uint8_t const * buffer, struct IpcMessage * msg)
+{
+  struct IpcLegacyMessage legacy;
+  memcpy(&legacy, buffer, sizeof legacy);
+
+  msg->type = legacy.type;
+  switch (msg->type) {
+  case IPC_MSG_OPEN_FRONT:
+  case IPC_MSG_OPEN_BACK:
+    msg->data.open.member_id = legacy.data.open.member_id;
+    memcpy(msg->data.open.member_nick, legacy.data.open.member_nick, sizeof legacy.data.open.member_nick);
+    memcpy(msg->data.open.member_name, legacy.data.open.member_name, sizeof legacy.data.open.member_name);
+    break;
+
+  case IPC_MSG_INFO:
+    memcpy(msg->data.info, legacy.data.info, sizeof legacy.data.info);
+    break;
+
+  default:
+    break;
+  }
+  return true;
+}
+
+//! Copies a string field into a fixed-size buffer. The buffer is
+//! 0-padded if the field is shorter.
+static void copy_string_field(char * dst, size_t dst_size, uint8_t const * value, size_t length)
+{
+  size_t const copy_len = (length < dst_size) ? length : dst_size;
+  memcpy(dst, value, copy_len);
+  memset(dst + copy_len, 0, dst_size - copy_len);
+}
+
+//! Decodes a fixed-size field of a status update and marks it as present.
+//! Fields with an unexpected size are ignored.
+static void decode_status_field(struct IpcMessage * msg, enum PortalStatusField field, void * dst, size_t dst_size, uint8_t const * value, size_t length)
+{
+  if (length != dst_size) {
+    log_print(LSS_IPC, LL_WARNING, "ignoring status field %u with invalid size %zu", field, length);
+    return;
+  }
+  memcpy(dst, value, length);
+  msg->data.update.fields |= field;
+}
+
+static bool decode_v1(uint8_t const * buffer, size_t length, struct IpcMessage * msg)
+{
+  struct IpcWireHeader header;
+  memcpy(&header, buffer, sizeof header);
+
+  if (header.version < IPC_WIRE_VERSION) {
+    log_print(LSS_IPC, LL_ERROR, "received ipc message with unsupported wire version %u", header.version);
+    return false;
+  }
+  if (sizeof header + header.length != length) {
+    log_print(LSS_IPC, LL_ERROR, "received ipc message with invalid length. header says %zu bytes, but got %zu", sizeof header + header.length, length);
+    return false;
+  }
+
+  msg->type = header.type;
+
+  struct PortalStatus * const update = &msg->data.update.status;
+
+  size_t offset = sizeof header;
+  while (offset < length) {
+    if (offset + IPC_TLV_HEADER_LEN > length) {
+      log_print(LSS_IPC, LL_ERROR, "received truncated ipc field at offset %zu", offset);
+      return false;
+    }
+
+    uint8_t const tag = buffer[offset];
+    uint16_t      field_len;
+    memcpy(&field_len, buffer + offset + 1, sizeof field_len);
+
+    uint8_t const * const value = buffer + offset + IPC_TLV_HEADER_LEN;
+    offset += IPC_TLV_HEADER_LEN + field_len;
+    if (offset > length) {
+      log_print(LSS_IPC, LL_ERROR, "received truncated ipc field with tag %u", tag);
+      return false;
+    }
+
+    switch (tag) {
+    case IPC_TAG_MEMBER_ID:
+    {
+      int32_t member_id;
+      if (field_len != sizeof member_id) {
+        log_print(LSS_IPC, LL_ERROR, "received member id field with invalid size %u", field_len);
+        return false;
+      }
+      memcpy(&member_id, value, sizeof member_id);
+      msg->data.open.member_id = member_id;
+      break;
+    }
+    case IPC_TAG_MEMBER_NICK: copy_string_field(msg->data.open.member_nick, sizeof msg->data.open.member_nick, value, field_len); break;
+    case IPC_TAG_MEMBER_NAME: copy_string_field(msg->data.open.member_name, sizeof msg->data.open.member_name, value, field_len); break;
+    case IPC_TAG_INFO: copy_string_field(msg->data.info, sizeof msg->data.info, value, field_len); break;
+    case IPC_TAG_STATUS:
+    {
+      // older daemons might send a shorter struct, newer ones a longer one.
+      size_t const copy_len = (field_len < sizeof msg->data.status) ? field_len : sizeof msg->data.status;
+      memcpy(&msg->data.status, value, copy_len);
+      break;
+    }
+
+    case IPC_TAG_SHACK_STATE: decode_status_field(msg, STATUS_FIELD_SHACK_STATE, &update->shack_state, sizeof update->shack_state, value, field_len); break;
+    case IPC_TAG_ACTIVITY: decode_status_field(msg, STATUS_FIELD_ACTIVITY, &update->activity, sizeof update->activity, value, field_len); break;
+    case IPC_TAG_DOOR_B2: decode_status_field(msg, STATUS_FIELD_DOOR_B2, &update->door_b2, sizeof update->door_b2, value, field_len); break;
+    case IPC_TAG_DOOR_C2: decode_status_field(msg, STATUS_FIELD_DOOR_C2, &update->door_c2, sizeof update->door_c2, value, field_len); break;
+    case IPC_TAG_MQTT_CONNECTED: decode_status_field(msg, STATUS_FIELD_MQTT_CONNECTED, &update->mqtt_connected, sizeof update->mqtt_connected, value, field_len); break;
+    case IPC_TAG_DEVICES_ONLINE: decode_status_field(msg, STATUS_FIELD_DEVICES_ONLINE, &update->devices_online, sizeof update->devices_online, value, field_len); break;
+    case IPC_TAG_IPC_CLIENTS: decode_status_field(msg, STATUS_FIELD_IPC_CLIENTS, &update->ipc_clients, sizeof update->ipc_clients, value, field_len); break;
+    case IPC_TAG_KEYHOLDER_ID: decode_status_field(msg, STATUS_FIELD_KEYHOLDER, &update->keyholder_id, sizeof update->keyholder_id, value, field_len); break;
+    case IPC_TAG_KEYHOLDER_NICK:
+      copy_string_field(update->keyholder_nick, sizeof update->keyholder_nick, value, field_len);
+      msg->data.update.fields |= STATUS_FIELD_KEYHOLDER;
+      break;
+
+    case IPC_TAG_LOG_SUBSYSTEMS:
+      if (field_len == sizeof msg->data.subscribe.log_subsystems) {
+        memcpy(&msg->data.subscribe.log_subsystems, value, field_len);
+      }
+      break;
+    case IPC_TAG_LOG_LEVEL:
+      if (field_len == sizeof msg->data.subscribe.log_level) {
+        memcpy(&msg->data.subscribe.log_level, value, field_len);
+      }
+      break;
+
+    case IPC_TAG_PORTAL:
+      if (field_len == sizeof msg->portal) {
+        memcpy(&msg->portal, value, field_len);
+      }
+      break;
+
+    default:
+      // fields from newer protocol revisions are ignored
+      break;
+    }
+  }
+
+  return true;
+}
+
+bool ipc_decode_msg(uint8_t const * buffer, size_t length, struct IpcMessage * msg, enum IpcWireFormat * format)
+{
+  assert(buffer != NULL);
+  assert(msg != NULL);
+  assert(format != NULL);
+
+  memset(msg, 0, sizeof *msg);
+
+  if (length >= sizeof(struct IpcWireHeader) && buffer[0] == IPC_WIRE_MAGIC_0 && buffer[1] == IPC_WIRE_MAGIC_1) {
+    *format = IPC_WIRE_V1;
+    return decode_v1(buffer, length, msg);
+  }
+  if (length == IPC_LEGACY_MSG_LEN) {
+    *format = IPC_WIRE_LEGACY;
+    return decode_legacy(buffer, msg);
+  }
+
+  log_print(LSS_IPC, LL_ERROR, "received ipc message of unknown format with %zu bytes", length);
+  return false;
+}
+
 bool ipc_send_msg(int sock, struct IpcMessage msg)
 {
-  // we can safely send/receive the message as it is in-memory as we
-  // are always on the same machine with unix sockets.
-  // WARNING: This assumption requires to have IpcMessage not contain any pointers.
-  ssize_t const len = write(sock, &msg, sizeof msg);
+  return ipc_send_msg_with_format(sock, IPC_WIRE_V1, &msg);
+}
+
+bool ipc_send_msg_with_format(int sock, enum IpcWireFormat format, struct IpcMessage const * msg)
+{
+  uint8_t buffer[IPC_MAX_WIRE_LEN];
+
+  size_t const msg_len = ipc_encode_msg(format, msg, buffer, sizeof buffer);
+  if (msg_len == 0) {
+    log_print(LSS_IPC, LL_ERROR, "failed to encode ipc message of type %u", msg->type);
+    return false;
+  }
+
+  return ipc_send_encoded(sock, buffer, msg_len);
+}
+
+bool ipc_try_send_encoded(int sock, uint8_t const * buffer, size_t length, bool * would_block)
+{
+  assert(buffer != NULL);
+  assert(would_block != NULL);
+
+  *would_block = false;
+
+  ssize_t const len = send(sock, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (len < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      *would_block = true;
+    }
+    else {
+      log_perror(LSS_IPC, LL_ERROR, "failed to send ipc message");
+    }
+    return false;
+  }
+  if ((size_t)len != length) {
+    log_print(LSS_IPC, LL_ERROR, "sent partial ipc message. only transferred %zu of %zu bytes", (size_t)len, length);
+    return false;
+  }
+  count_sent(length);
+  return true;
+}
+
+bool ipc_send_encoded(int sock, uint8_t const * buffer, size_t length)
+{
+  assert(buffer != NULL);
+
+  ssize_t const len = write(sock, buffer, length);
   if (len < 0) {
     log_perror(LSS_IPC, LL_ERROR, "failed to send ipc message");
     return false;
   }
-  if (len != sizeof msg) {
-    log_print(LSS_IPC, LL_ERROR, "sent partial ipc message. only transferred %zu of %zu bytes", (size_t)len, sizeof msg);
+  if ((size_t)len != length) {
+    log_print(LSS_IPC, LL_ERROR, "sent partial ipc message. only transferred %zu of %zu bytes", (size_t)len, length);
     return false;
   }
+  count_sent(length);
   return true;
 }
 
-// TODO: Handle EOF and error differently!
 enum IpcRcvResult ipc_receive_msg(int sock, struct IpcMessage * msg)
 {
-  // we can safely send/receive the message as it is in-memory as we
-  // are always on the same machine with unix sockets.
-  // WARNING: This assumption requires to have IpcMessage not contain any pointers.
-  ssize_t const len = read(sock, msg, sizeof *msg);
+  enum IpcWireFormat format;
+  return ipc_receive_msg_with_format(sock, msg, &format);
+}
+
+// TODO: Handle EOF and error differently!
+enum IpcRcvResult ipc_receive_msg_with_format(int sock, struct IpcMessage * msg, enum IpcWireFormat * format)
+{
+  uint8_t buffer[IPC_MAX_WIRE_LEN];
+
+  // SOCK_SEQPACKET preserves message boundaries, so a single read always
+  // yields exactly one message. MSG_TRUNC reports the real size of oversized messages.
+  ssize_t const len = recv(sock, buffer, sizeof buffer, MSG_TRUNC);
   if (len < 0) {
-    perror("failed to send ipc message");
+    log_perror(LSS_IPC, LL_ERROR, "failed to receive ipc message");
     return IPC_ERROR;
   }
   else if (len == 0) {
     return IPC_EOF;
   }
-  else if (len != sizeof *msg) {
-    log_print(LSS_IPC, LL_ERROR, "received partial ipc message. only transferred %zu of %zu bytes", (size_t)len, sizeof *msg);
+  else if ((size_t)len > sizeof buffer) {
+    log_print(LSS_IPC, LL_ERROR, "received oversized ipc message with %zu bytes", (size_t)len);
+    return IPC_ERROR;
+  }
+
+  traffic.messages_received += 1;
+  traffic.bytes_received += (size_t)len;
+
+  if (!ipc_decode_msg(buffer, len, msg, format)) {
     return IPC_ERROR;
   }
   return IPC_SUCCESS;
-}
\ No newline at end of file
+}
+
+struct IpcBuffer * ipc_buffer_create(enum IpcWireFormat format, struct IpcMessage const * msg)
+{
+  assert(msg != NULL);
+
+  uint8_t      encoded[IPC_MAX_WIRE_LEN];
+  size_t const length = ipc_encode_msg(format, msg, encoded, sizeof encoded);
+  if (length == 0) {
+    log_print(LSS_IPC, LL_ERROR, "failed to encode ipc message of type %u", msg->type);
+    return NULL;
+  }
+
+  struct IpcBuffer * const buffer = malloc(sizeof(struct IpcBuffer) + length);
+  if (buffer == NULL) {
+    return NULL;
+  }
+
+  buffer->refcount = 1;
+  buffer->length   = length;
+  memcpy(buffer->data, encoded, length);
+
+  return buffer;
+}
+
+struct IpcBuffer * ipc_buffer_ref(struct IpcBuffer * buffer)
+{
+  assert(buffer != NULL);
+  assert(buffer->refcount > 0);
+  buffer->refcount += 1;
+  return buffer;
+}
+
+void ipc_buffer_unref(struct IpcBuffer * buffer)
+{
+  if (buffer == NULL)
+    return;
+  assert(buffer->refcount > 0);
+  buffer->refcount -= 1;
+  if (buffer->refcount == 0) {
+    free(buffer);
+  }
+}
+
+void ipc_queue_init(struct IpcSendQueue * queue)
+{
+  assert(queue != NULL);
+  *queue = (struct IpcSendQueue){
+      .read_offset = 0,
+      .size        = 0,
+      .dropped     = 0,
+  };
+}
+
+void ipc_queue_clear(struct IpcSendQueue * queue)
+{
+  assert(queue != NULL);
+  while (queue->size > 0) {
+    ipc_buffer_unref(queue->items[queue->read_offset]);
+    queue->read_offset = (queue->read_offset + 1) % IPC_SEND_QUEUE_LEN;
+    queue->size -= 1;
+  }
+}
+
+bool ipc_queue_push(struct IpcSendQueue * queue, struct IpcBuffer * buffer)
+{
+  assert(queue != NULL);
+  assert(buffer != NULL);
+
+  if (queue->size >= IPC_SEND_QUEUE_LEN) {
+    queue->dropped += 1;
+    return false;
+  }
+
+  size_t const write_index  = (queue->read_offset + queue->size) % IPC_SEND_QUEUE_LEN;
+  queue->items[write_index] = ipc_buffer_ref(buffer);
+  queue->size += 1;
+  return true;
+}
+
+bool ipc_queue_flush(struct IpcSendQueue * queue, int sock)
+{
+  assert(queue != NULL);
+
+  while (queue->size > 0) {
+    struct IpcBuffer * const buffer = queue->items[queue->read_offset];
+
+    bool would_block;
+    if (!ipc_try_send_encoded(sock, buffer->data, buffer->length, &would_block)) {
+      return would_block;
+    }
+
+    ipc_buffer_unref(buffer);
+    queue->read_offset = (queue->read_offset + 1) % IPC_SEND_QUEUE_LEN;
+    queue->size -= 1;
+  }
+  return true;
+}
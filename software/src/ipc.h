@@ -2,9 +2,12 @@
 #define PORTAL300_IPC_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include "status.h"
+
 #define IPC_MAX_INFOSTR_LEN 1024
 #define IPC_MAX_NICK_LEN    256
 #define IPC_MAX_NAME_LEN    256
@@ -12,17 +15,21 @@
 enum IcpMessageType
 {
   // client to daemon
-  IPC_MSG_OPEN_FRONT    = 101,
-  IPC_MSG_OPEN_BACK     = 102,
-  IPC_MSG_CLOSE         = 103,
-  IPC_MSG_SHUTDOWN      = 104,
-  IPC_MSG_QUERY_STATUS  = 105,
-  IPC_MSG_SIMPLE_STATUS = 106,
-  IPC_MSG_SYSTEM_RESET  = 107,
-  IPC_MSG_FORCE_OPEN    = 108,
+  IPC_MSG_OPEN_FRONT           = 101,
+  IPC_MSG_OPEN_BACK            = 102,
+  IPC_MSG_CLOSE                = 103,
+  IPC_MSG_SHUTDOWN             = 104,
+  IPC_MSG_QUERY_STATUS         = 105,
+  IPC_MSG_SIMPLE_STATUS        = 106,
+  IPC_MSG_SYSTEM_RESET         = 107,
+  IPC_MSG_FORCE_OPEN           = 108,
+  IPC_MSG_SUBSCRIBE            = 109, // keep the connection open and receive status updates
+  IPC_MSG_DUMP_FLIGHT_RECORDER = 110, // write the state machine flight recorder to disk, answered with the path
 
   // daemon to client
-  IPC_MSG_INFO = 201,
+  IPC_MSG_INFO          = 201,
+  IPC_MSG_STATUS        = 202, // structured status snapshot, only sent to clients using IPC_WIRE_V1
+  IPC_MSG_STATUS_UPDATE = 203, // changed fields of the status snapshot, only sent to subscribers
 };
 
 enum IpcRcvResult
@@ -32,6 +39,15 @@ enum IpcRcvResult
   IPC_ERROR   = 2,
 };
 
+//! The encoding of a message on the socket.
+//! The daemon answers each client in the format the client used to talk to it,
+//! so binaries from before the TLV protocol keep working.
+enum IpcWireFormat
+{
+  IPC_WIRE_LEGACY = 0, // fixed-size in-memory struct, ~1 KiB per message
+  IPC_WIRE_V1     = 1, // length-prefixed header followed by TLV fields
+};
+
 struct IpcMessageOpenData
 {
   int  member_id;
@@ -39,20 +55,39 @@ struct IpcMessageOpenData
   char member_name[IPC_MAX_NAME_LEN]; // not necessarily 0 terminated!
 };
 
+struct IpcMessageSubscribeData
+{
+  uint32_t log_subsystems; // bit mask of (1 << enum LogSubSystem) to receive log messages for, 0 for no logs
+  uint8_t  log_level;      // enum LogLevel, maximum level of received log messages
+};
+
+struct IpcMessageStatusUpdate
+{
+  uint32_t            fields; // enum PortalStatusField, only these fields of `status` are valid
+  struct PortalStatus status;
+};
+
 struct IpcMessage
 {
   // THIS STRUCT MUST NOT CONTAIN ANY POINTERS!
   enum IcpMessageType type;
+  uint8_t             portal; // portal a request is meant for, see `portal-daemon -x`. legacy clients always use 0
   union
   {
-    struct IpcMessageOpenData open;
-    char                      info[IPC_MAX_INFOSTR_LEN]; // not necessarily 0 terminated!
+    struct IpcMessageOpenData      open;
+    char                           info[IPC_MAX_INFOSTR_LEN]; // not necessarily 0 terminated!
+    struct PortalStatus            status;
+    struct IpcMessageStatusUpdate  update;
+    struct IpcMessageSubscribeData subscribe;
   } data;
 };
 
 // Maximum message length for IPC
 #define IPC_MAX_MSG_LEN sizeof(struct IpcMessage)
 
+// Maximum length of a single encoded message on the socket, in any wire format.
+#define IPC_MAX_WIRE_LEN 2048
+
 extern const struct sockaddr_un ipc_socket_address;
 
 //! Creates a new IPC socket that has the right configuration for IPC.
@@ -63,12 +98,89 @@ int ipc_create_socket(void);
 //! the permissions of the socket are correct.
 bool ipc_set_flags(int fd);
 
-//! Sends an ipc message via the given socket
+//! Encodes `msg` into `buffer` with the given wire format.
+//! Returns the number of bytes used or 0 if the buffer is too small.
+size_t ipc_encode_msg(enum IpcWireFormat format, struct IpcMessage const * msg, uint8_t * buffer, size_t buffer_size);
+
+//! Decodes a message from `buffer` and stores the detected wire format in `format`.
+//! returns true on success.
+bool ipc_decode_msg(uint8_t const * buffer, size_t length, struct IpcMessage * msg, enum IpcWireFormat * format);
+
+//! Messages and bytes this process sent and received over ipc sockets.
+struct IpcTraffic
+{
+  uint64_t messages_sent;
+  uint64_t bytes_sent;
+  uint64_t messages_received;
+  uint64_t bytes_received;
+};
+
+void ipc_get_traffic(struct IpcTraffic * traffic);
+
+//! Sends a message previously encoded with `ipc_encode_msg`.
+//! returns true on success.
+bool ipc_send_encoded(int sock, uint8_t const * buffer, size_t length);
+
+//! Tries to send a message previously encoded with `ipc_encode_msg` without blocking.
+//! Sets `would_block` when the peer can't take the message right now.
+//! returns true on success.
+bool ipc_try_send_encoded(int sock, uint8_t const * buffer, size_t length, bool * would_block);
+
+//! A reference counted, encoded message. Used to send the same message to
+//! many clients while encoding it only once.
+struct IpcBuffer
+{
+  uint32_t refcount;
+  size_t   length;
+  uint8_t  data[];
+};
+
+//! Encodes `msg` into a new buffer with a reference count of 1.
+//! Returns NULL on error.
+struct IpcBuffer * ipc_buffer_create(enum IpcWireFormat format, struct IpcMessage const * msg);
+
+struct IpcBuffer * ipc_buffer_ref(struct IpcBuffer * buffer);
+void               ipc_buffer_unref(struct IpcBuffer * buffer);
+
+#define IPC_SEND_QUEUE_LEN 32
+
+//! Queue of outgoing messages for a single connection. The queue holds a
+//! reference to each buffer until it was written to the socket.
+struct IpcSendQueue
+{
+  uint32_t           read_offset;
+  uint32_t           size;
+  uint32_t           dropped; // number of messages dropped because the queue was full
+  struct IpcBuffer * items[IPC_SEND_QUEUE_LEN];
+};
+
+void ipc_queue_init(struct IpcSendQueue * queue);
+
+//! Drops all pending messages.
+void ipc_queue_clear(struct IpcSendQueue * queue);
+
+//! Appends a reference to `buffer` to the queue.
+//! Returns false when the queue is full and the message was dropped.
+bool ipc_queue_push(struct IpcSendQueue * queue, struct IpcBuffer * buffer);
+
+//! Writes as many queued messages as the socket takes without blocking.
+//! Returns false if the socket failed.
+bool ipc_queue_flush(struct IpcSendQueue * queue, int sock);
+
+//! Sends an ipc message via the given socket with the current wire format.
 //! returns true on success.
 bool ipc_send_msg(int sock, struct IpcMessage msg);
 
+//! Sends an ipc message via the given socket with the given wire format.
+//! returns true on success.
+bool ipc_send_msg_with_format(int sock, enum IpcWireFormat format, struct IpcMessage const * msg);
+
 //! Receives an ipc message via the given socket.
 //! returns true on success.
 enum IpcRcvResult ipc_receive_msg(int sock, struct IpcMessage * msg);
 
-#endif // PORTAL300_IPC_H
\ No newline at end of file
+//! Receives an ipc message via the given socket and stores the wire format
+//! the peer used in `format`.
+enum IpcRcvResult ipc_receive_msg_with_format(int sock, struct IpcMessage * msg, enum IpcWireFormat * format);
+
+#endif // PORTAL300_IPC_H
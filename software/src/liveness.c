@@ -0,0 +1,104 @@
+#include "liveness.h"
+#include "state-machine.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+static bool is_watched(struct LivenessDevice const * device)
+{
+  return device->alive && !device->stale && (device->deadline_ms != 0);
+}
+
+void liveness_init(struct Liveness * liveness)
+{
+  assert(liveness != NULL);
+
+  for (int device = 0; device < DEVICE_COUNT; device++) {
+    liveness->devices[device] = (struct LivenessDevice){
+        .deadline_ms = 0,
+        .alive       = false,
+        .stale       = false,
+        .last_seen   = 0,
+    };
+  }
+  for (int door = 0; door < SM_DOOR_COUNT; door++) {
+    liveness->devices[sm_doors[door].device].deadline_ms = LIVENESS_DOOR_CONTROL_DEADLINE_MS;
+  }
+}
+
+void liveness_set_deadline(struct Liveness * liveness, enum PortalDevice device, uint32_t deadline_ms)
+{
+  assert(liveness != NULL);
+  assert(device < DEVICE_COUNT);
+
+  liveness->devices[device].deadline_ms = deadline_ms;
+  if (deadline_ms == 0) {
+    liveness->devices[device].stale = false;
+  }
+}
+
+bool liveness_seen(struct Liveness * liveness, enum PortalDevice device, uint64_t now)
+{
+  assert(liveness != NULL);
+  assert(device < DEVICE_COUNT);
+
+  struct LivenessDevice * const watched = &liveness->devices[device];
+  bool const                    stale   = watched->stale;
+
+  watched->alive     = true;
+  watched->stale     = false;
+  watched->last_seen = now;
+  return stale;
+}
+
+void liveness_offline(struct Liveness * liveness, enum PortalDevice device)
+{
+  assert(liveness != NULL);
+  assert(device < DEVICE_COUNT);
+
+  liveness->devices[device].alive = false;
+  liveness->devices[device].stale = false;
+}
+
+bool liveness_take_stale(struct Liveness * liveness, uint64_t now, enum PortalDevice * device)
+{
+  assert(liveness != NULL);
+  assert(device != NULL);
+
+  for (int i = 0; i < DEVICE_COUNT; i++) {
+    struct LivenessDevice * const watched = &liveness->devices[i];
+    if (!is_watched(watched) || (now - watched->last_seen < watched->deadline_ms))
+      continue;
+
+    watched->stale = true;
+    *device        = (enum PortalDevice)i;
+    return true;
+  }
+  return false;
+}
+
+bool liveness_is_stale(struct Liveness const * liveness, enum PortalDevice device)
+{
+  assert(liveness != NULL);
+  assert(device < DEVICE_COUNT);
+  return liveness->devices[device].stale;
+}
+
+int liveness_timeout(struct Liveness const * liveness, uint64_t now)
+{
+  assert(liveness != NULL);
+
+  int timeout = -1;
+  for (int i = 0; i < DEVICE_COUNT; i++) {
+    struct LivenessDevice const * const watched = &liveness->devices[i];
+    if (!is_watched(watched))
+      continue;
+
+    uint64_t const due  = watched->last_seen + watched->deadline_ms;
+    int const      left = (due > now) ? (int)(due - now) : 0;
+    if ((timeout < 0) || (left < timeout)) {
+      timeout = left;
+    }
+  }
+  return timeout;
+}
@@ -0,0 +1,56 @@
+#ifndef PORTAL300_LIVENESS_H
+#define PORTAL300_LIVENESS_H
+
+#include "status.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Heartbeat deadlines of the devices of a portal. A device that hangs without
+// dropping its TCP connection never triggers its MQTT last will, so its
+// "online" status alone can't be trusted. Every message of a device counts as
+// sign of life, e.g. the forced door status updates the door controls send
+// about every ten seconds. A device that said nothing for its deadline is
+// stale until it speaks again.
+//
+// Times are milliseconds of any monotonic clock.
+
+//! The door controls force a status update about every ten seconds.
+#define LIVENESS_DOOR_CONTROL_DEADLINE_MS 30000
+
+struct LivenessDevice
+{
+  uint32_t deadline_ms; // 0 for devices without heartbeat
+  bool     alive;       // the device was seen and didn't go offline since
+  bool     stale;       // alive, but silent for longer than the deadline
+  uint64_t last_seen;
+};
+
+struct Liveness
+{
+  struct LivenessDevice devices[DEVICE_COUNT];
+};
+
+//! Initializes the default deadlines, only the door controls have a heartbeat.
+void liveness_init(struct Liveness * liveness);
+
+//! Sets the deadline of `device`, 0 disables it.
+void liveness_set_deadline(struct Liveness * liveness, enum PortalDevice device, uint32_t deadline_ms);
+
+//! Records a message of `device` at `now`. Returns true if it was stale.
+bool liveness_seen(struct Liveness * liveness, enum PortalDevice device, uint64_t now);
+
+//! Records that `device` went offline, an offline device can't be stale.
+void liveness_offline(struct Liveness * liveness, enum PortalDevice device);
+
+//! Marks the next device whose deadline is over at `now` as stale. Returns
+//! false if there is none.
+bool liveness_take_stale(struct Liveness * liveness, uint64_t now, enum PortalDevice * device);
+
+bool liveness_is_stale(struct Liveness const * liveness, enum PortalDevice device);
+
+//! Returns the time in ms until the next deadline is over, or -1 if no device
+//! has to be watched. Suitable as poll() timeout.
+int liveness_timeout(struct Liveness const * liveness, uint64_t now);
+
+#endif // PORTAL300_LIVENESS_H
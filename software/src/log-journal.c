@@ -0,0 +1,202 @@
+#include "log-journal.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOURNAL_MAX_FIELDS 10
+
+//! A journal entry under construction. Every field needs up to four iovecs
+//! (name, length, value, newline), small values are rendered into `scratch`.
+struct JournalEntry
+{
+  struct iovec iov[4 * JOURNAL_MAX_FIELDS];
+  size_t       iov_count;
+  char         scratch[256];
+  size_t       scratch_used;
+};
+
+static void journal_log(void * user_data, struct LogRecord const * record);
+
+static int          journal_fd         = -1;
+static char const * journal_identifier = NULL;
+
+static struct LogConsumer journal_consumer = {
+    .log       = journal_log,
+    .user_data = NULL,
+    .max_level = LL_MESSAGE,
+    .async     = true,
+};
+
+bool log_journal_stderr_is_journal(void)
+{
+  char const * const stream = getenv("JOURNAL_STREAM");
+  if (stream == NULL) {
+    return false;
+  }
+
+  unsigned long long device, inode;
+  if (sscanf(stream, "%llu:%llu", &device, &inode) != 2) {
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(STDERR_FILENO, &info) == -1) {
+    return false;
+  }
+
+  return (info.st_dev == device) && (info.st_ino == inode);
+}
+
+bool log_journal_open(char const * identifier, enum LogLevel level)
+{
+  assert(identifier != NULL);
+  assert(journal_fd == -1);
+
+  int const fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to create journal socket");
+    return false;
+  }
+
+  struct sockaddr_un const address = {
+      .sun_family = AF_UNIX,
+      .sun_path   = LOG_JOURNAL_SOCKET_PATH,
+  };
+  if (connect(fd, (struct sockaddr const *)&address, sizeof address) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to connect to journald");
+    close(fd);
+    return false;
+  }
+
+  journal_fd         = fd;
+  journal_identifier = identifier;
+
+  journal_consumer.max_level = level;
+  log_register_consumer(&journal_consumer);
+
+  return true;
+}
+
+void log_journal_close(void)
+{
+  if (journal_fd == -1)
+    return;
+  if (close(journal_fd) == -1) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to close journal socket");
+  }
+  journal_fd = -1;
+}
+
+static void add_iov(struct JournalEntry * entry, void const * data, size_t length)
+{
+  assert(entry->iov_count < sizeof entry->iov / sizeof entry->iov[0]);
+  entry->iov[entry->iov_count] = (struct iovec){
+      .iov_base = (void *)data,
+      .iov_len  = length,
+  };
+  entry->iov_count += 1;
+}
+
+//! Adds `name=value`. Values containing a newline use the binary field
+//! format, which is `name`, newline, 64 bit little endian length and the value.
+static void add_field(struct JournalEntry * entry, char const * name, char const * value)
+{
+  size_t const length = strlen(value);
+
+  add_iov(entry, name, strlen(name));
+  if (memchr(value, '\n', length) == NULL) {
+    add_iov(entry, "=", 1);
+  }
+  else {
+    assert(entry->scratch_used + 9 <= sizeof entry->scratch);
+    uint8_t * const header = (uint8_t *)&entry->scratch[entry->scratch_used];
+    header[0]              = '\n';
+    for (size_t i = 0; i < 8; i++) {
+      header[1 + i] = (uint8_t)((uint64_t)length >> (8 * i));
+    }
+    entry->scratch_used += 9;
+    add_iov(entry, header, 9);
+  }
+  add_iov(entry, value, length);
+  add_iov(entry, "\n", 1);
+}
+
+static void add_fieldf(struct JournalEntry * entry, char const * name, char const * fmt, ...) __attribute__((format(printf, 3, 4)));
+
+static void add_fieldf(struct JournalEntry * entry, char const * name, char const * fmt, ...)
+{
+  char * const value     = &entry->scratch[entry->scratch_used];
+  size_t const available = sizeof entry->scratch - entry->scratch_used;
+
+  va_list list;
+  va_start(list, fmt);
+  int const length = vsnprintf(value, available, fmt, list);
+  va_end(list);
+
+  assert(length >= 0 && (size_t)length < available);
+  entry->scratch_used += (size_t)length + 1;
+
+  add_field(entry, name, value);
+}
+
+static int syslog_priority(enum LogLevel level)
+{
+  switch (level) {
+  case LL_ERROR: return 3;   // LOG_ERR
+  case LL_WARNING: return 4; // LOG_WARNING
+  case LL_MESSAGE: return 6; // LOG_INFO
+  case LL_VERBOSE: return 7; // LOG_DEBUG
+  }
+  return 6;
+}
+
+static void journal_log(void * user_data, struct LogRecord const * record)
+{
+  (void)user_data;
+  assert(record != NULL);
+
+  if (journal_fd != -1) {
+    struct JournalEntry entry = {
+        .iov_count    = 0,
+        .scratch_used = 0,
+    };
+
+    add_field(&entry, "MESSAGE", record->msg);
+    add_fieldf(&entry, "PRIORITY", "%d", syslog_priority(record->level));
+    add_field(&entry, "SYSLOG_IDENTIFIER", journal_identifier);
+    add_field(&entry, "SUBSYSTEM", log_get_subsystem_name(record->subsystem));
+    add_field(&entry, "LEVEL", log_get_level_name(record->level));
+    if (record->context.member_id >= 0) {
+      add_fieldf(&entry, "MEMBER_ID", "%d", record->context.member_id);
+    }
+    if (record->context.door != NULL) {
+      add_field(&entry, "DOOR", record->context.door);
+    }
+    if (record->context.transaction_id != 0) {
+      add_fieldf(&entry, "TRANSACTION_ID", "%u", record->context.transaction_id);
+    }
+
+    struct msghdr const msg = {
+        .msg_iov    = entry.iov,
+        .msg_iovlen = entry.iov_count,
+    };
+    if (sendmsg(journal_fd, &msg, MSG_NOSIGNAL) != -1) {
+      return;
+    }
+  }
+
+  // journald is not reachable (for example while it restarts), don't lose the message.
+  // can't use the log functions here, we are a log consumer ourselves.
+  fprintf(stderr, "[%s] [%s] %s\n", log_get_level_name(record->level), log_get_subsystem_name(record->subsystem), record->msg);
+}
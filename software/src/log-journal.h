@@ -0,0 +1,28 @@
+#ifndef PORTAL300_LOG_JOURNAL_H
+#define PORTAL300_LOG_JOURNAL_H
+
+#include "log.h"
+
+#include <stdbool.h>
+
+// Log consumer that talks the native journald protocol. Each message is sent
+// as a single datagram with structured fields, so the journal can be queried
+// with `journalctl SUBSYSTEM=mqtt` or `journalctl MEMBER_ID=42` instead of
+// grepping the text:
+//
+//   MESSAGE, PRIORITY, SYSLOG_IDENTIFIER, SUBSYSTEM, LEVEL
+//   MEMBER_ID, DOOR, TRANSACTION_ID (only if set in the log context)
+
+#define LOG_JOURNAL_SOCKET_PATH "/run/systemd/journal/socket"
+
+//! Returns true if stderr is connected to the journal, as announced by
+//! systemd in the JOURNAL_STREAM environment variable.
+bool log_journal_stderr_is_journal(void);
+
+//! Connects to journald and registers the journal consumer with `level` as
+//! its maximum level. `identifier` must stay valid until log_journal_close().
+bool log_journal_open(char const * identifier, enum LogLevel level);
+
+void log_journal_close(void);
+
+#endif // PORTAL300_LOG_JOURNAL_H
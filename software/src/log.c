@@ -1,9 +1,16 @@
 #include "log.h"
+#include "clock.h"
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 #define ANSI_COLOR_RED    "\x1B[0;31m"
 #define ANSI_COLOR_YELLOW "\x1B[0;33m"
@@ -20,28 +27,85 @@ static enum LogLevel subsystem_max_level[] = {
     [LSS_API]     = LL_VERBOSE,
 };
 
-static void log_write_stderr(void * user_data, enum LogSubSystem subsystem, enum LogLevel level, char const * msg);
+static void log_write_stderr(void * user_data, struct LogRecord const * record);
+static void update_enabled_levels(void);
+static void push_async_record(struct LogRecord const * record, uint32_t consumers);
+static void * log_writer_thread(void * arg);
+static void write_rate_limit_summary(struct LogRateLimit * limit);
 
-enum LogLevel log_level = LL_MESSAGE;
-
-static enum LogLevel effective_log_level(enum LogSubSystem subsystem)
-{
-  enum LogLevel ll = subsystem_max_level[subsystem];
-  if (ll > log_level) {
-    return log_level;
-  }
-  else {
-    return ll;
-  }
-}
+//! Cached result of update_enabled_levels(). A message is only formatted
+//! when its level is at most the value of its subsystem.
+//! Starts at -1 so nothing is logged before the first consumer is registered.
+static int enabled_level[LSS_COUNT] = {
+    [LSS_GENERIC] = -1,
+    [LSS_MQTT]    = -1,
+    [LSS_LOGIC]   = -1,
+    [LSS_GPIO]    = -1,
+    [LSS_SYSTEM]  = -1,
+    [LSS_IPC]     = -1,
+    [LSS_API]     = -1,
+};
 
 static struct LogConsumer * log_consumers = NULL;
 
+//! All call sites of log_print_ratelimited() that were hit at least once.
+static struct LogRateLimit * rate_limits = NULL;
+
+static struct LogContext const empty_context = {
+    .member_id      = -1,
+    .door           = NULL,
+    .transaction_id = 0,
+};
+
+static struct LogContext current_context = {
+    .member_id      = -1,
+    .door           = NULL,
+    .transaction_id = 0,
+};
+
 static struct LogConsumer stderr_consumer = {
     .log       = log_write_stderr,
     .user_data = NULL,
+    .max_level = LL_MESSAGE,
+    .async     = true,
+};
+
+#define LOG_RING_LEN            256 // must be a power of two
+#define LOG_RECORD_MSG_LEN      1024
+#define LOG_MAX_ASYNC_CONSUMERS 8
+
+//! A queued message. `sequence` implements the bounded MPSC queue from Dmitry
+//! Vyukov: a slot is free for position `pos` when `sequence == pos` and
+//! readable when `sequence == pos + 1`.
+struct LogSlot
+{
+  _Atomic size_t    sequence;
+  uint32_t          consumers; // bit mask of indices into async_log.consumers
+  struct timespec   timestamp;
+  enum LogSubSystem subsystem;
+  enum LogLevel     level;
+  struct LogContext context;
+  char              msg[LOG_RECORD_MSG_LEN];
 };
 
+static struct
+{
+  atomic_bool running;
+  atomic_bool stop;
+  pthread_t   thread;
+  sem_t       wakeup;
+
+  // snapshot of the async consumers taken in log_start_async(), so the writer
+  // thread never has to walk the consumer list
+  struct LogConsumer * consumers[LOG_MAX_ASYNC_CONSUMERS];
+  size_t               consumer_count;
+
+  struct LogSlot ring[LOG_RING_LEN];
+  _Atomic size_t enqueue_pos;
+  size_t         dequeue_pos; // only used by the writer thread
+  atomic_ulong   dropped;
+} async_log;
+
 bool log_init(void)
 {
   log_register_consumer(&stderr_consumer);
@@ -50,12 +114,40 @@ bool log_init(void)
 
 void log_deinit(void)
 {
-  // nothing to do here yet
+  log_stop_async();
 }
 
 void log_set_level(enum LogSubSystem subsystem, enum LogLevel level)
 {
+  assert(subsystem < LSS_COUNT);
   subsystem_max_level[subsystem] = level;
+  update_enabled_levels();
+}
+
+void log_set_stderr_level(enum LogLevel level)
+{
+  log_set_consumer_level(&stderr_consumer, level);
+}
+
+void log_disable_stderr(void)
+{
+  assert(!atomic_load(&async_log.running));
+
+  struct LogConsumer ** it = &log_consumers;
+  while (*it != NULL) {
+    if (*it == &stderr_consumer) {
+      *it                  = stderr_consumer.next;
+      stderr_consumer.next = NULL;
+      break;
+    }
+    it = &(*it)->next;
+  }
+  update_enabled_levels();
+}
+
+void log_set_context(struct LogContext const * context)
+{
+  current_context = (context != NULL) ? *context : empty_context;
 }
 
 void log_register_consumer(struct LogConsumer * consumer)
@@ -66,6 +158,107 @@ void log_register_consumer(struct LogConsumer * consumer)
 
   consumer->next = log_consumers;
   log_consumers  = consumer;
+
+  update_enabled_levels();
+}
+
+void log_set_consumer_level(struct LogConsumer * consumer, enum LogLevel level)
+{
+  assert(consumer != NULL);
+  if (consumer->max_level == level)
+    return;
+  consumer->max_level = level;
+  update_enabled_levels();
+}
+
+//! Recomputes `enabled_level`: the level of a subsystem is the smaller one of
+//! the subsystem limit and the most verbose consumer.
+static void update_enabled_levels(void)
+{
+  int consumer_level = -1;
+  for (struct LogConsumer const * it = log_consumers; it != NULL; it = it->next) {
+    if ((int)it->max_level > consumer_level) {
+      consumer_level = it->max_level;
+    }
+  }
+
+  for (size_t i = 0; i < LSS_COUNT; i++) {
+    int const ll = subsystem_max_level[i];
+    if (ll > consumer_level) {
+      enabled_level[i] = consumer_level;
+    }
+    else {
+      enabled_level[i] = ll;
+    }
+  }
+}
+
+bool log_start_async(void)
+{
+  if (atomic_load(&async_log.running))
+    return true;
+
+  async_log.consumer_count = 0;
+  for (struct LogConsumer * it = log_consumers; it != NULL; it = it->next) {
+    if (it->async && (async_log.consumer_count < LOG_MAX_ASYNC_CONSUMERS)) {
+      async_log.consumers[async_log.consumer_count] = it;
+      async_log.consumer_count += 1;
+    }
+  }
+
+  for (size_t i = 0; i < LOG_RING_LEN; i++) {
+    atomic_init(&async_log.ring[i].sequence, i);
+  }
+  atomic_init(&async_log.enqueue_pos, 0);
+  async_log.dequeue_pos = 0;
+  atomic_init(&async_log.dropped, 0);
+  atomic_init(&async_log.stop, false);
+
+  if (sem_init(&async_log.wakeup, 0, 0) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to create log writer semaphore");
+    return false;
+  }
+
+  // signals must be handled by the main loop, so the writer blocks all of them
+  sigset_t all_signals, old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+  int const err = pthread_create(&async_log.thread, NULL, log_writer_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+  if (err != 0) {
+    sem_destroy(&async_log.wakeup);
+    errno = err;
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to start log writer thread");
+    return false;
+  }
+
+  atomic_store(&async_log.running, true);
+  return true;
+}
+
+void log_stop_async(void)
+{
+  if (!atomic_load(&async_log.running))
+    return;
+
+  // everything logged from now on is written synchronously again
+  atomic_store(&async_log.running, false);
+
+  atomic_store(&async_log.stop, true);
+  sem_post(&async_log.wakeup);
+
+  int const err = pthread_join(async_log.thread, NULL);
+  if (err != 0) {
+    errno = err;
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to join log writer thread");
+  }
+  sem_destroy(&async_log.wakeup);
+}
+
+bool log_is_enabled(enum LogSubSystem subsystem, enum LogLevel level)
+{
+  return (int)level <= enabled_level[subsystem];
 }
 
 void log_write(enum LogSubSystem subsystem, enum LogLevel level, char const * msg)
@@ -73,17 +266,149 @@ void log_write(enum LogSubSystem subsystem, enum LogLevel level, char const * ms
   assert(msg != NULL);
 
   // filter messages by log level. subsystems can have filtered levels
-  if (level > effective_log_level(subsystem))
+  if (!log_is_enabled(subsystem, level))
     return;
 
+  struct LogRecord record = {
+      .subsystem = subsystem,
+      .level     = level,
+      .msg       = msg,
+      .context   = current_context,
+  };
+  clock_gettime(CLOCK_REALTIME, &record.timestamp);
+
+  bool const async = atomic_load_explicit(&async_log.running, memory_order_acquire);
+
   struct LogConsumer * it = log_consumers;
   while (it != NULL) {
-    it->log(it->user_data, subsystem, level, msg);
+    if ((level <= it->max_level) && !(async && it->async)) {
+      it->log(it->user_data, &record);
+    }
     it = it->next;
   }
+
+  if (async) {
+    uint32_t consumers = 0;
+    for (size_t i = 0; i < async_log.consumer_count; i++) {
+      if (level <= async_log.consumers[i]->max_level) {
+        consumers |= (1U << i);
+      }
+    }
+    if (consumers != 0) {
+      push_async_record(&record, consumers);
+    }
+  }
 }
 
-void log_print(enum LogSubSystem subsystem, enum LogLevel level, char const * fmt, ...)
+//! Copies `record` into the ring. Never blocks, if the ring is full the message
+//! is dropped and counted instead.
+static void push_async_record(struct LogRecord const * record, uint32_t consumers)
+{
+  struct LogSlot * slot;
+
+  size_t pos = atomic_load_explicit(&async_log.enqueue_pos, memory_order_relaxed);
+  while (true) {
+    slot = &async_log.ring[pos & (LOG_RING_LEN - 1)];
+
+    size_t const   seq  = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    intptr_t const diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&async_log.enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0) {
+      // the writer didn't free this slot yet, the ring is full
+      atomic_fetch_add_explicit(&async_log.dropped, 1, memory_order_relaxed);
+      return;
+    }
+    else {
+      pos = atomic_load_explicit(&async_log.enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  slot->consumers = consumers;
+  slot->timestamp = record->timestamp;
+  slot->subsystem = record->subsystem;
+  slot->level     = record->level;
+  slot->context   = record->context;
+  strncpy(slot->msg, record->msg, sizeof slot->msg - 1);
+  slot->msg[sizeof slot->msg - 1] = 0;
+
+  atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+  sem_post(&async_log.wakeup);
+}
+
+//! Passes all queued messages to the async consumers.
+static void drain_async_records(void)
+{
+  while (true) {
+    struct LogSlot * const slot = &async_log.ring[async_log.dequeue_pos & (LOG_RING_LEN - 1)];
+
+    size_t const seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (seq != async_log.dequeue_pos + 1)
+      break;
+
+    struct LogRecord const record = {
+        .timestamp = slot->timestamp,
+        .subsystem = slot->subsystem,
+        .level     = slot->level,
+        .msg       = slot->msg,
+        .context   = slot->context,
+    };
+    for (size_t i = 0; i < async_log.consumer_count; i++) {
+      if (slot->consumers & (1U << i)) {
+        async_log.consumers[i]->log(async_log.consumers[i]->user_data, &record);
+      }
+    }
+
+    atomic_store_explicit(&slot->sequence, async_log.dequeue_pos + LOG_RING_LEN, memory_order_release);
+    async_log.dequeue_pos += 1;
+  }
+
+  unsigned long const dropped = atomic_exchange_explicit(&async_log.dropped, 0, memory_order_relaxed);
+  if (dropped > 0) {
+    char msg[128];
+    snprintf(msg, sizeof msg, "log writer could not keep up, dropped %lu messages.", dropped);
+
+    struct LogRecord record = {
+        .subsystem = LSS_GENERIC,
+        .level     = LL_WARNING,
+        .msg       = msg,
+        .context   = empty_context,
+    };
+    clock_gettime(CLOCK_REALTIME, &record.timestamp);
+
+    for (size_t i = 0; i < async_log.consumer_count; i++) {
+      async_log.consumers[i]->log(async_log.consumers[i]->user_data, &record);
+    }
+  }
+}
+
+static void * log_writer_thread(void * arg)
+{
+  (void)arg;
+
+  while (true) {
+    if (sem_wait(&async_log.wakeup) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    drain_async_records();
+
+    if (atomic_load(&async_log.stop)) {
+      // pick up everything that was queued before the stop request
+      drain_async_records();
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+void log_print_unchecked(enum LogSubSystem subsystem, enum LogLevel level, char const * fmt, ...)
 {
   assert(fmt != NULL);
 
@@ -97,7 +422,125 @@ void log_print(enum LogSubSystem subsystem, enum LogLevel level, char const * fm
   log_write(subsystem, level, log_buffer);
 }
 
-void log_perror(enum LogSubSystem subsystem, enum LogLevel level, char const * msg)
+//! FNV-1a, never returns 0 so 0 can mean "no message".
+static uint64_t hash_message(char const * msg)
+{
+  uint64_t hash = 0xcbf29ce484222325u;
+  for (char const * it = msg; *it != 0; it++) {
+    hash ^= (uint8_t)*it;
+    hash *= 0x100000001b3u;
+  }
+  return (hash != 0) ? hash : 1;
+}
+
+void log_print_limited(struct LogRateLimit * limit, enum LogSubSystem subsystem, enum LogLevel level, char const * fmt, ...)
+{
+  assert(limit != NULL);
+  assert(fmt != NULL);
+
+  uint64_t const now = clock_get_ms(CLOCK_MONOTONIC);
+
+  if (!limit->registered) {
+    limit->registered    = true;
+    limit->tokens        = limit->burst;
+    limit->refill_time   = now;
+    limit->last_hash     = 0;
+    limit->repeated      = 0;
+    limit->suppressed    = 0;
+    limit->pending_since = 0;
+    limit->next          = rate_limits;
+    rate_limits          = limit;
+  }
+  limit->subsystem = subsystem;
+  limit->level     = level;
+
+  bool const has_pending = (limit->repeated > 0) || (limit->suppressed > 0);
+
+  if (limit->interval_ms > 0) {
+    uint64_t const refills = (now - limit->refill_time) / limit->interval_ms;
+    if (refills >= limit->burst - limit->tokens) {
+      limit->tokens      = limit->burst;
+      limit->refill_time = now;
+    }
+    else if (refills > 0) {
+      limit->tokens += (unsigned int)refills;
+      limit->refill_time += refills * limit->interval_ms;
+    }
+  }
+
+  if (limit->tokens == 0) {
+    if (!has_pending) {
+      limit->pending_since = now;
+    }
+    limit->suppressed += 1;
+    return;
+  }
+  limit->tokens -= 1;
+
+  // repetitions take a token as well, so a flood of them is dropped before
+  // formatting too
+  char log_buffer[8192];
+
+  va_list list;
+  va_start(list, fmt);
+  vsnprintf(log_buffer, sizeof log_buffer, fmt, list);
+  va_end(list);
+
+  uint64_t const hash = hash_message(log_buffer);
+  if (hash == limit->last_hash) {
+    if (!has_pending) {
+      limit->pending_since = now;
+    }
+    limit->repeated += 1;
+    if (now - limit->pending_since >= LOG_RATE_LIMIT_REPORT_MS) {
+      write_rate_limit_summary(limit);
+    }
+    return;
+  }
+
+  write_rate_limit_summary(limit);
+
+  limit->last_hash = hash;
+  log_write(subsystem, level, log_buffer);
+}
+
+//! Reports and resets the repetitions and suppressed messages of `limit`.
+static void write_rate_limit_summary(struct LogRateLimit * limit)
+{
+  if (limit->repeated > 0) {
+    log_print(limit->subsystem, limit->level, "last message repeated %lu times", limit->repeated);
+  }
+  if (limit->suppressed > 0) {
+    log_print(limit->subsystem, limit->level, "%lu similar messages were suppressed", limit->suppressed);
+    // the next message must be written even if it equals the last one, or
+    // the summary would look like it belongs to the wrong message.
+    limit->last_hash = 0;
+  }
+  limit->repeated   = 0;
+  limit->suppressed = 0;
+}
+
+int log_flush_ratelimited(void)
+{
+  uint64_t const now = clock_get_ms(CLOCK_MONOTONIC);
+
+  int timeout = -1;
+  for (struct LogRateLimit * it = rate_limits; it != NULL; it = it->next) {
+    if ((it->repeated == 0) && (it->suppressed == 0))
+      continue;
+
+    uint64_t const age = now - it->pending_since;
+    if (age >= LOG_RATE_LIMIT_REPORT_MS) {
+      write_rate_limit_summary(it);
+    }
+    else if ((timeout == -1) || (LOG_RATE_LIMIT_REPORT_MS - age < (uint64_t)timeout)) {
+      timeout = (int)(LOG_RATE_LIMIT_REPORT_MS - age);
+    }
+  }
+  return timeout;
+}
+
+void log_perror_unchecked(enum LogSubSystem subsystem, enum LogLevel level, char const * msg)
 {
   assert(msg != NULL);
 
@@ -115,20 +558,21 @@ void log_perror(enum LogSubSystem subsystem, enum LogLevel level, char const * m
   log_write(subsystem, level, log_buffer);
 }
 
-static void log_write_stderr(void * user_data, enum LogSubSystem subsystem, enum LogLevel level, char const * msg)
+static void log_write_stderr(void * user_data, struct LogRecord const * record)
 {
   (void)user_data;
-  assert(msg != NULL);
+  assert(record != NULL);
+  assert(record->msg != NULL);
 
   char const * color = "";
-  switch (level) {
+  switch (record->level) {
   case LL_ERROR: color = ANSI_COLOR_RED; break;
   case LL_WARNING: color = ANSI_COLOR_YELLOW; break;
   case LL_MESSAGE: color = ""; break;
   case LL_VERBOSE: color = ANSI_COLOR_GRAY; break;
   }
 
-  fprintf(stderr, "[%s%s%s] [%s] %s\n", color, log_get_level_name(level), ANSI_COLOR_RESET, log_get_subsystem_name(subsystem), msg);
+  fprintf(stderr, "[%s%s%s] [%s] %s\n", color, log_get_level_name(record->level), ANSI_COLOR_RESET, log_get_subsystem_name(record->subsystem), record->msg);
 }
 
 char const * log_get_subsystem_name(enum LogSubSystem subsystem)
@@ -161,4 +605,31 @@ char const * log_get_level_name(enum LogLevel level)
   if (level == LL_VERBOSE)
     return "VERBOSE";
   return "<<INVALID>>";
-}
\ No newline at end of file
+}
+bool log_parse_level(char const * name, enum LogLevel * level)
+{
+  assert(name != NULL);
+  assert(level != NULL);
+
+  for (enum LogLevel ll = LL_ERROR; ll <= LL_VERBOSE; ll++) {
+    if (strcasecmp(name, log_get_level_name(ll)) == 0) {
+      *level = ll;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool log_parse_subsystem(char const * name, enum LogSubSystem * subsystem)
+{
+  assert(name != NULL);
+  assert(subsystem != NULL);
+
+  for (enum LogSubSystem ss = LSS_GENERIC; ss < LSS_COUNT; ss++) {
+    if (strcasecmp(name, log_get_subsystem_name(ss)) == 0) {
+      *subsystem = ss;
+      return true;
+    }
+  }
+  return false;
+}
@@ -2,6 +2,15 @@
 #define PORTAL300_LOG_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+//! Messages above this level are removed at compile time and never reach the
+//! logging backend. Release builds can pass -DLOG_COMPILE_LEVEL=2 to drop all
+//! verbose messages including the evaluation of their arguments.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 3 // LL_VERBOSE
+#endif
 
 enum LogLevel
 {
@@ -20,33 +29,146 @@ enum LogSubSystem
   LSS_SYSTEM,
   LSS_IPC,
   LSS_API,
+
+  LSS_COUNT,
+};
+
+//! Describes what the daemon is working on while a message is written.
+//! Structured sinks attach this to each message.
+struct LogContext
+{
+  int          member_id;      // member the message is about, -1 if none
+  char const * door;           // door the message is about, static string or NULL
+  uint32_t     transaction_id; // user request the message belongs to, 0 if none
+};
+
+struct LogRecord
+{
+  struct timespec   timestamp; // CLOCK_REALTIME when the message was written
+  enum LogSubSystem subsystem;
+  enum LogLevel     level;
+  char const *      msg;
+  struct LogContext context;
 };
 
 struct LogConsumer
 {
   // configure:
   void * user_data;
-  void (*log)(void * user_data, enum LogSubSystem subsystem, enum LogLevel level, char const * msg);
+  void (*log)(void * user_data, struct LogRecord const * record);
+  enum LogLevel max_level; // maximum level passed to `log`, change with log_set_consumer_level()
+  bool          async;     // `log` may be called from the log writer thread, see log_start_async()
 
   // internal:
   struct LogConsumer * next;
 };
 
-extern enum LogLevel log_level;
-
 bool log_init(void);
 void log_deinit(void);
 
+//! Limits the messages of `subsystem` to `level` for all consumers.
 void log_set_level(enum LogSubSystem subsystem, enum LogLevel level);
 
+//! Sets the maximum level printed to stderr. Defaults to LL_MESSAGE.
+void log_set_stderr_level(enum LogLevel level);
+//! Stops printing to stderr, for when another consumer already writes to the same place.
+void log_disable_stderr(void);
+
+//! Attaches `context` to all following messages. NULL resets to an empty context.
+void log_set_context(struct LogContext const * context);
+
+//! Starts a background thread that feeds all `async` consumers, so a slow sink
+//! like stderr can't block the caller of log_write(). Messages are queued in a
+//! fixed size ring and dropped (and counted) when the ring is full.
+bool log_start_async(void);
+
+//! Writes all queued messages and stops the background thread. Afterwards
+//! `async` consumers are called synchronously again.
+void log_stop_async(void);
+
 void log_register_consumer(struct LogConsumer * consumer);
+void log_set_consumer_level(struct LogConsumer * consumer, enum LogLevel level);
+
+//! Returns true if a message with `level` in `subsystem` would reach at least one consumer.
+bool log_is_enabled(enum LogSubSystem subsystem, enum LogLevel level);
 
 void log_write(enum LogSubSystem subsystem, enum LogLevel level, char const * msg);
-void log_print(enum LogSubSystem subsystem, enum LogLevel level, char const * fmt, ...) __attribute__((format(printf, 3, 4)));
 
-void log_perror(enum LogSubSystem subsystem, enum LogLevel level, char const * msg);
+// log_print() and log_perror() check the level before anything is formatted,
+// so the arguments of disabled messages are not evaluated at all.
+#define log_print(_Subsystem, _Level, ...)                                     \
+  do {                                                                         \
+    if (((_Level) <= LOG_COMPILE_LEVEL) && log_is_enabled(_Subsystem, _Level)) \
+      log_print_unchecked(_Subsystem, _Level, __VA_ARGS__);                    \
+  } while (0)
+
+#define log_perror(_Subsystem, _Level, _Msg)                                   \
+  do {                                                                         \
+    if (((_Level) <= LOG_COMPILE_LEVEL) && log_is_enabled(_Subsystem, _Level)) \
+      log_perror_unchecked(_Subsystem, _Level, _Msg);                          \
+  } while (0)
+
+void log_print_unchecked(enum LogSubSystem subsystem, enum LogLevel level, char const * fmt, ...) __attribute__((format(printf, 3, 4)));
+void log_perror_unchecked(enum LogSubSystem subsystem, enum LogLevel level, char const * msg);
+
+//! Pending summaries of a rate limited call site are written after this time.
+#define LOG_RATE_LIMIT_REPORT_MS 10000
+
+//! State of a single call site of log_print_ratelimited(). Each call site gets
+//! a token bucket of `burst` messages that refills by one message every
+//! `interval_ms`. Every message takes a token, and without tokens left a
+//! message is dropped before it is formatted. Messages identical to the
+//! previous one of the call site are only counted and reported as
+//! "last message repeated N times".
+struct LogRateLimit
+{
+  // configure:
+  unsigned int burst;
+  unsigned int interval_ms;
+
+  // internal:
+  bool                  registered;
+  unsigned int          tokens;
+  uint64_t              refill_time;   // CLOCK_MONOTONIC in ms
+  uint64_t              last_hash;     // hash of the last written message, 0 if none
+  unsigned long         repeated;      // messages identical to the last written one
+  unsigned long         suppressed;    // messages dropped for lack of tokens
+  uint64_t              pending_since; // time of the first unreported repetition or suppression
+  enum LogSubSystem     subsystem;
+  enum LogLevel         level;
+  struct LogRateLimit * next;
+};
+
+#define LOG_RATE_LIMIT_INIT(_Burst, _IntervalMs) \
+  {                                              \
+    .burst       = (_Burst),                     \
+    .interval_ms = (_IntervalMs),                \
+    .registered  = false,                        \
+    .next        = NULL,                         \
+  }
+
+//! Like log_print(), but limited to 10 messages in a row and one per second
+//! afterwards. Use this for messages a peer can trigger at will.
+#define log_print_ratelimited(_Subsystem, _Level, ...)                         \
+  do {                                                                         \
+    static struct LogRateLimit log_rate_limit = LOG_RATE_LIMIT_INIT(10, 1000); \
+    if (((_Level) <= LOG_COMPILE_LEVEL) && log_is_enabled(_Subsystem, _Level)) \
+      log_print_limited(&log_rate_limit, _Subsystem, _Level, __VA_ARGS__);     \
+  } while (0)
+
+void log_print_limited(struct LogRateLimit * limit, enum LogSubSystem subsystem, enum LogLevel level, char const * fmt, ...) __attribute__((format(printf, 4, 5)));
+
+//! Writes the summaries of rate limited call sites that are pending for at
+//! least LOG_RATE_LIMIT_REPORT_MS. Returns the time in ms until the next
+//! summary is due, or -1 if nothing is pending. Suitable as poll() timeout.
+int log_flush_ratelimited(void);
 
 char const * log_get_subsystem_name(enum LogSubSystem subsystem);
 char const * log_get_level_name(enum LogLevel level);
 
+//! Parses a level name as returned by `log_get_level_name`, case insensitive.
+bool log_parse_level(char const * name, enum LogLevel * level);
+//! Parses a subsystem name as returned by `log_get_subsystem_name`, case insensitive.
+bool log_parse_subsystem(char const * name, enum LogSubSystem * subsystem);
+
 #endif
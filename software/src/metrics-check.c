@@ -0,0 +1,50 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+// Checks the escaping of label values, which come from the command line and
+// end up between the quotes of the Prometheus text format.
+
+struct EscapeCase
+{
+  char const * value;
+  size_t       buffer_size;
+  bool         fits;
+  char const * escaped; // expected result if it fits
+};
+
+static struct EscapeCase const cases[] = {
+    {"shackspace/portal/", 64, true, "shackspace/portal/"},
+    {"", 1, true, ""},
+    {"we\"ird", 64, true, "we\\\"ird"},
+    {"back\\slash", 64, true, "back\\\\slash"},
+    {"two\nlines", 64, true, "two\\nlines"},
+    {"\"\\\n", 7, true, "\\\"\\\\\\n"},
+    {"\"\\\n", 6, false, ""},
+    {"abc", 4, true, "abc"},
+    {"abc", 3, false, ""},
+};
+
+int main(void)
+{
+  size_t const count  = sizeof cases / sizeof cases[0];
+  size_t       failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    struct EscapeCase const * const test = &cases[i];
+
+    char buffer[64];
+    memset(buffer, 'x', sizeof buffer);
+
+    bool const fits = metrics_escape_label_value(buffer, test->buffer_size, test->value);
+    if ((fits != test->fits) || (strcmp(buffer, test->escaped) != 0)) {
+      fprintf(stderr, "case %zu: escaped to \"%s\" (%s), expected \"%s\" (%s)\n", i + 1, buffer, fits ? "fits" : "too long", test->escaped, test->fits ? "fits" : "too long");
+      failed += 1;
+    }
+  }
+
+  fprintf(stdout, "ran %zu label escape cases, %zu failed\n", count, failed);
+  return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,280 @@
+#include "metrics-http.h"
+
+#include "log.h"
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REQUEST_SIZE 1024
+
+static int  listen_fd = -1;
+static char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+//! The pending scrape. A response is being sent while `response_length` is not 0.
+static int    client_fd = -1;
+static char   request[REQUEST_SIZE];
+static size_t request_length  = 0;
+static char   response[METRICS_HTTP_HEADER_SIZE + METRICS_HTTP_RESPONSE_SIZE];
+static char * response_start  = NULL;
+static size_t response_length = 0;
+
+static int  listen_unix(char const * path);
+static int  listen_tcp(char const * address);
+static bool set_nonblocking(int fd);
+static void drop_client(void);
+static void send_response(void);
+
+bool metrics_http_listen(char const * address)
+{
+  assert(address != NULL);
+  assert(listen_fd == -1);
+
+  listen_fd = (address[0] == '/') ? listen_unix(address) : listen_tcp(address);
+  if (listen_fd == -1)
+    return false;
+
+  if (!set_nonblocking(listen_fd) || (listen(listen_fd, 4) == -1)) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to listen for metrics scrapes");
+    metrics_http_close();
+    return false;
+  }
+
+  log_print(LSS_SYSTEM, LL_MESSAGE, "serving metrics on %s", address);
+  return true;
+}
+
+void metrics_http_close(void)
+{
+  drop_client();
+
+  if (listen_fd != -1) {
+    close(listen_fd);
+    listen_fd = -1;
+  }
+  if (unix_path[0] != 0) {
+    unlink(unix_path);
+    unix_path[0] = 0;
+  }
+}
+
+int metrics_http_get_listen_fd(void)
+{
+  return listen_fd;
+}
+
+int metrics_http_get_client_fd(short * events)
+{
+  assert(events != NULL);
+  *events = (response_length > 0) ? POLLOUT : POLLIN;
+  return client_fd;
+}
+
+void metrics_http_accept(void)
+{
+  int const fd = accept(listen_fd, NULL, NULL);
+  if (fd == -1) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      log_perror(LSS_SYSTEM, LL_WARNING, "failed to accept metrics scrape");
+    }
+    return;
+  }
+  (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (!set_nonblocking(fd)) {
+    close(fd);
+    return;
+  }
+
+  // a scraper that didn't finish its request in time has given up anyways
+  drop_client();
+  client_fd = fd;
+}
+
+bool metrics_http_handle(void)
+{
+  if (client_fd == -1)
+    return false;
+
+  if (response_length > 0) {
+    send_response();
+    return false;
+  }
+
+  ssize_t const len = recv(client_fd, request + request_length, sizeof request - request_length - 1, 0);
+  if (len < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      drop_client();
+    }
+    return false;
+  }
+  if (len == 0) {
+    drop_client();
+    return false;
+  }
+  request_length += (size_t)len;
+  request[request_length] = 0;
+
+  // the request is complete with its empty line, its body doesn't matter
+  return (strstr(request, "\r\n\r\n") != NULL) || (strstr(request, "\n\n") != NULL) || (request_length >= sizeof request - 1);
+}
+
+static int listen_unix(char const * path)
+{
+  struct sockaddr_un address = {
+      .sun_family = AF_UNIX,
+  };
+  if (strlen(path) >= sizeof address.sun_path) {
+    log_print(LSS_SYSTEM, LL_ERROR, "metrics socket path is too long: %s", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  int const fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to create metrics socket");
+    return -1;
+  }
+
+  // a socket file left behind by a crash or by the daemon before a hot upgrade
+  (void)unlink(path);
+  if (bind(fd, (struct sockaddr const *)&address, sizeof address) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to bind metrics socket");
+    close(fd);
+    return -1;
+  }
+  strcpy(unix_path, path);
+  return fd;
+}
+
+static int listen_tcp(char const * address)
+{
+  char         host[256] = "127.0.0.1";
+  char const * port      = address;
+
+  char const * const separator = strrchr(address, ':');
+  if (separator != NULL) {
+    size_t const host_length = (size_t)(separator - address);
+    if (host_length >= sizeof host) {
+      log_print(LSS_SYSTEM, LL_ERROR, "invalid metrics address: %s", address);
+      return -1;
+    }
+    memcpy(host, address, host_length);
+    host[host_length] = 0;
+    port              = separator + 1;
+  }
+
+  struct addrinfo const hints = {
+      .ai_family   = AF_UNSPEC,
+      .ai_socktype = SOCK_STREAM,
+      .ai_flags    = AI_PASSIVE | AI_NUMERICSERV,
+  };
+  struct addrinfo * results = NULL;
+  int const         err     = getaddrinfo(host, port, &hints, &results);
+  if (err != 0) {
+    log_print(LSS_SYSTEM, LL_ERROR, "invalid metrics address %s: %s", address, gai_strerror(err));
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo const * iter = results; (iter != NULL) && (fd == -1); iter = iter->ai_next) {
+    fd = socket(iter->ai_family, iter->ai_socktype | SOCK_CLOEXEC, iter->ai_protocol);
+    if (fd == -1)
+      continue;
+
+    // a new daemon binds while the old one still listens during a hot upgrade
+    int const enable = 1;
+    (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable);
+    (void)setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof enable);
+
+    if (bind(fd, iter->ai_addr, iter->ai_addrlen) == -1) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(results);
+
+  if (fd == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to bind metrics socket");
+  }
+  return fd;
+}
+
+static bool set_nonblocking(int fd)
+{
+  int const flags = fcntl(fd, F_GETFL);
+  return (flags != -1) && (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1);
+}
+
+static void drop_client(void)
+{
+  if (client_fd != -1) {
+    close(client_fd);
+    client_fd = -1;
+  }
+  request_length  = 0;
+  response_length = 0;
+}
+
+//! Renders the response behind the space for the header and puts the header
+//! right in front of it.
+void metrics_http_respond(struct Metrics const * metrics)
+{
+  assert(metrics != NULL);
+  assert((client_fd != -1) && (response_length == 0));
+
+  char * const body        = response + METRICS_HTTP_HEADER_SIZE;
+  size_t       body_length = 0;
+  char const * status      = "404 Not Found";
+
+  if ((strncmp(request, "GET /metrics ", 13) == 0) || (strncmp(request, "GET /metrics?", 13) == 0)) {
+    body_length = metrics_render(metrics, body, METRICS_HTTP_RESPONSE_SIZE);
+    status      = (body_length > 0) ? "200 OK" : "500 Internal Server Error";
+    if (body_length == 0) {
+      log_print_ratelimited(LSS_SYSTEM, LL_ERROR, "metrics don't fit into %u bytes", (unsigned int)METRICS_HTTP_RESPONSE_SIZE);
+    }
+  }
+
+  char      header[METRICS_HTTP_HEADER_SIZE];
+  int const header_length = snprintf(header,
+                                     sizeof header,
+                                     "HTTP/1.1 %s\r\n"
+                                     "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                     "Content-Length: %zu\r\n"
+                                     "Connection: close\r\n"
+                                     "\r\n",
+                                     status,
+                                     body_length);
+  assert((header_length > 0) && (header_length < (int)sizeof header));
+
+  response_start  = body - header_length;
+  response_length = (size_t)header_length + body_length;
+  memcpy(response_start, header, (size_t)header_length);
+
+  send_response();
+}
+
+static void send_response(void)
+{
+  ssize_t const len = send(client_fd, response_start, response_length, MSG_NOSIGNAL);
+  if (len < 0) {
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      drop_client();
+    }
+    return;
+  }
+
+  response_start += len;
+  response_length -= (size_t)len;
+  if (response_length == 0) {
+    drop_client();
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef PORTAL300_METRICS_HTTP_H
+#define PORTAL300_METRICS_HTTP_H
+
+#include "metrics.h"
+
+#include <stdbool.h>
+
+// Minimal HTTP endpoint for Prometheus, served from the event loop of the
+// daemon. It answers `GET /metrics` and nothing else, one scrape at a time:
+// a new connection replaces one that is still pending, so a stuck scraper
+// can't block the next one. The HTTP header and the rendered metrics share
+// one buffer, so a scrape usually costs a single write.
+
+//! Space for the header in front of the rendered metrics.
+#define METRICS_HTTP_HEADER_SIZE 256
+
+#define METRICS_HTTP_RESPONSE_SIZE (128 * 1024)
+
+//! Starts listening on `address`, which is either the path of a Unix socket
+//! (starting with '/') or `[host:]port` with host defaulting to 127.0.0.1.
+bool metrics_http_listen(char const * address);
+
+//! Closes the listener and the pending scrape, and removes the Unix socket.
+void metrics_http_close(void);
+
+//! Returns the listening socket, which becomes readable when a scraper
+//! connects, or -1 if the endpoint is disabled.
+int metrics_http_get_listen_fd(void);
+
+//! Returns the socket of the pending scrape and the poll() `events` it waits
+//! for, or -1 if there is none.
+int metrics_http_get_client_fd(short * events);
+
+//! Accepts a new scrape, once the listening socket became readable.
+void metrics_http_accept(void);
+
+//! Reads the request of the pending scrape or writes the rest of its response,
+//! once its socket became ready. Returns true when the request is complete,
+//! then the caller answers it with metrics_http_respond().
+bool metrics_http_handle(void);
+
+//! Renders `metrics` once into the response of the pending scrape and starts
+//! to send it.
+void metrics_http_respond(struct Metrics const * metrics);
+
+#endif // PORTAL300_METRICS_HTTP_H
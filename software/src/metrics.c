@@ -0,0 +1,234 @@
+#include "metrics.h"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+struct TextWriter
+{
+  char * buffer;
+  size_t size;
+  size_t offset;
+  bool   overflow;
+};
+
+static void text_printf(struct TextWriter * writer, char const * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void text_printf(struct TextWriter * writer, char const * fmt, ...)
+{
+  if (writer->overflow)
+    return;
+
+  va_list list;
+  va_start(list, fmt);
+  int const len = vsnprintf(writer->buffer + writer->offset, writer->size - writer->offset, fmt, list);
+  va_end(list);
+
+  if ((len < 0) || ((size_t)len >= writer->size - writer->offset)) {
+    writer->overflow = true;
+    return;
+  }
+  writer->offset += (size_t)len;
+}
+
+void metrics_init(struct Metrics * metrics)
+{
+  assert(metrics != NULL);
+  metrics->family_count = 0;
+  metrics->series_count = 0;
+}
+
+int metrics_add_family(struct Metrics * metrics, char const * name, char const * help, enum MetricType type, double const * bounds, size_t bound_count)
+{
+  assert(metrics != NULL);
+  assert(name != NULL);
+  assert(help != NULL);
+  assert((type != METRIC_HISTOGRAM) || ((bounds != NULL) && (bound_count <= METRICS_MAX_BUCKETS)));
+
+  if (metrics->family_count >= METRICS_MAX_FAMILIES)
+    return -1;
+
+  struct MetricFamily * const family = &metrics->families[metrics->family_count];
+  *family                            = (struct MetricFamily){
+      .name         = name,
+      .help         = help,
+      .type         = type,
+      .bucket_count = (type == METRIC_HISTOGRAM) ? bound_count : 0,
+  };
+  if (family->bucket_count > 0) {
+    memcpy(family->bounds, bounds, bound_count * sizeof bounds[0]);
+  }
+
+  metrics->family_count += 1;
+  return (int)(metrics->family_count - 1);
+}
+
+bool metrics_escape_label_value(char * buffer, size_t buffer_size, char const * value)
+{
+  assert(buffer != NULL);
+  assert(buffer_size > 0);
+  assert(value != NULL);
+
+  size_t length = 0;
+  for (char const * it = value; *it != 0; it++) {
+    char escaped = 0;
+    switch (*it) {
+    case '\\': escaped = '\\'; break;
+    case '"': escaped = '"'; break;
+    case '\n': escaped = 'n'; break;
+    default: break;
+    }
+
+    if (length + ((escaped != 0) ? 2 : 1) >= buffer_size) {
+      buffer[0] = 0;
+      return false;
+    }
+    if (escaped != 0) {
+      buffer[length++] = '\\';
+      buffer[length++] = escaped;
+    }
+    else {
+      buffer[length++] = *it;
+    }
+  }
+  buffer[length] = 0;
+  return true;
+}
+
+struct MetricSeries * metrics_series(struct Metrics * metrics, int family, char const * labels)
+{
+  assert(metrics != NULL);
+  assert(labels != NULL);
+
+  if ((family < 0) || ((size_t)family >= metrics->family_count))
+    return NULL;
+
+  struct MetricFamily const * const owner = &metrics->families[family];
+  for (size_t i = 0; i < metrics->series_count; i++) {
+    struct MetricSeries * const series = &metrics->series[i];
+    if ((series->family == owner) && (strcmp(series->labels, labels) == 0))
+      return series;
+  }
+
+  if ((metrics->series_count >= METRICS_MAX_SERIES) || (strlen(labels) >= METRICS_MAX_LABELS_LEN))
+    return NULL;
+
+  struct MetricSeries * const series = &metrics->series[metrics->series_count];
+  memset(series, 0, sizeof *series);
+  series->family = owner;
+  strcpy(series->labels, labels);
+
+  metrics->series_count += 1;
+  return series;
+}
+
+void metrics_add(struct MetricSeries * series, double delta)
+{
+  if (series != NULL) {
+    series->value += delta;
+  }
+}
+
+void metrics_set(struct MetricSeries * series, double value)
+{
+  if (series != NULL) {
+    series->value = value;
+  }
+}
+
+void metrics_observe(struct MetricSeries * series, double value)
+{
+  if (series == NULL)
+    return;
+
+  series->count += 1;
+  series->sum += value;
+
+  // values above the last bound are only in `count`, the +Inf bucket
+  for (size_t i = 0; i < series->family->bucket_count; i++) {
+    if (value <= series->family->bounds[i]) {
+      series->buckets[i] += 1;
+      break;
+    }
+  }
+}
+
+//! Renders the `{...}` of a sample, `extra` is a label that only this sample has.
+static void render_labels(struct TextWriter * writer, char const * labels, char const * extra)
+{
+  bool const has_labels = (labels[0] != 0);
+  bool const has_extra  = (extra != NULL);
+  if (!has_labels && !has_extra)
+    return;
+  text_printf(writer, "{%s%s%s}", labels, (has_labels && has_extra) ? "," : "", has_extra ? extra : "");
+}
+
+static void render_series(struct TextWriter * writer, struct MetricSeries const * series)
+{
+  struct MetricFamily const * const family = series->family;
+
+  if (family->type != METRIC_HISTOGRAM) {
+    text_printf(writer, "%s", family->name);
+    render_labels(writer, series->labels, NULL);
+    text_printf(writer, " %.15g\n", series->value);
+    return;
+  }
+
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < family->bucket_count; i++) {
+    char bound[48];
+    snprintf(bound, sizeof bound, "le=\"%g\"", family->bounds[i]);
+
+    cumulative += series->buckets[i];
+    text_printf(writer, "%s_bucket", family->name);
+    render_labels(writer, series->labels, bound);
+    text_printf(writer, " %llu\n", (unsigned long long)cumulative);
+  }
+  text_printf(writer, "%s_bucket", family->name);
+  render_labels(writer, series->labels, "le=\"+Inf\"");
+  text_printf(writer, " %llu\n", (unsigned long long)series->count);
+
+  text_printf(writer, "%s_sum", family->name);
+  render_labels(writer, series->labels, NULL);
+  text_printf(writer, " %.15g\n", series->sum);
+
+  text_printf(writer, "%s_count", family->name);
+  render_labels(writer, series->labels, NULL);
+  text_printf(writer, " %llu\n", (unsigned long long)series->count);
+}
+
+size_t metrics_render(struct Metrics const * metrics, char * buffer, size_t buffer_size)
+{
+  assert(metrics != NULL);
+  assert(buffer != NULL);
+  assert(buffer_size > 0);
+
+  static char const * const type_names[] = {
+      [METRIC_COUNTER]   = "counter",
+      [METRIC_GAUGE]     = "gauge",
+      [METRIC_HISTOGRAM] = "histogram",
+  };
+
+  struct TextWriter writer = {
+      .buffer   = buffer,
+      .size     = buffer_size,
+      .offset   = 0,
+      .overflow = false,
+  };
+
+  // the samples of a family have to follow its header
+  for (size_t i = 0; i < metrics->family_count; i++) {
+    struct MetricFamily const * const family = &metrics->families[i];
+
+    text_printf(&writer, "# HELP %s %s\n", family->name, family->help);
+    text_printf(&writer, "# TYPE %s %s\n", family->name, type_names[family->type]);
+    for (size_t j = 0; j < metrics->series_count; j++) {
+      if (metrics->series[j].family == family) {
+        render_series(&writer, &metrics->series[j]);
+      }
+    }
+  }
+
+  return writer.overflow ? 0 : writer.offset;
+}
@@ -0,0 +1,89 @@
+#ifndef PORTAL300_METRICS_H
+#define PORTAL300_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Registry of counters, gauges and histograms, rendered in the text format of
+// Prometheus. A family is a metric name with its help text and type, each of
+// its series has a fixed set of labels. Everything lives in fixed arrays, so
+// updating a series on the hot path is a single addition.
+//
+// Usage:
+//   int const family = metrics_add_family(&metrics, "portal300_x_total", "Things.", METRIC_COUNTER, NULL, 0);
+//   struct MetricSeries * const x = metrics_series(&metrics, family, "portal=\"0\"");
+//   metrics_add(x, 1);
+
+#define METRICS_MAX_FAMILIES   32
+#define METRICS_MAX_SERIES     640
+#define METRICS_MAX_BUCKETS    12
+#define METRICS_MAX_LABELS_LEN 160
+
+enum MetricType
+{
+  METRIC_COUNTER   = 0,
+  METRIC_GAUGE     = 1,
+  METRIC_HISTOGRAM = 2,
+};
+
+struct MetricFamily
+{
+  char const *    name;
+  char const *    help;
+  enum MetricType type;
+  size_t          bucket_count;
+  double          bounds[METRICS_MAX_BUCKETS]; // upper bounds of the histogram buckets, ascending, +Inf is implied
+};
+
+struct MetricSeries
+{
+  struct MetricFamily const * family;
+  char                        labels[METRICS_MAX_LABELS_LEN]; // `name="value"` pairs separated by commas, or empty
+
+  double value; // counters and gauges
+
+  // histograms, the buckets are not cumulative
+  uint64_t count;
+  double   sum;
+  uint64_t buckets[METRICS_MAX_BUCKETS];
+};
+
+struct Metrics
+{
+  size_t              family_count;
+  struct MetricFamily families[METRICS_MAX_FAMILIES];
+  size_t              series_count;
+  struct MetricSeries series[METRICS_MAX_SERIES];
+};
+
+void metrics_init(struct Metrics * metrics);
+
+//! Adds a metric family. `bounds` are the bucket bounds of a histogram and
+//! ignored for other types. Returns the family or -1 if the registry is full.
+int metrics_add_family(struct Metrics * metrics, char const * name, char const * help, enum MetricType type, double const * bounds, size_t bound_count);
+
+//! Escapes `value` for the quotes of a label value: backslash, double quote
+//! and newline. Returns false if it doesn't fit into `buffer`.
+bool metrics_escape_label_value(char * buffer, size_t buffer_size, char const * value);
+
+//! Returns the series of `family` with `labels`, which is added if it doesn't
+//! exist yet. Label values must be escaped, see metrics_escape_label_value().
+//! Returns NULL if the registry is full or `labels` is too long, all updates
+//! accept NULL.
+struct MetricSeries * metrics_series(struct Metrics * metrics, int family, char const * labels);
+
+//! Increments a counter or changes a gauge by `delta`.
+void metrics_add(struct MetricSeries * series, double delta);
+
+//! Sets a gauge, or a counter that is counted elsewhere.
+void metrics_set(struct MetricSeries * series, double value);
+
+//! Adds `value` to a histogram.
+void metrics_observe(struct MetricSeries * series, double value);
+
+//! Renders all metrics into `buffer`. Returns the length of the text, or 0 if
+//! it doesn't fit.
+size_t metrics_render(struct Metrics const * metrics, char * buffer, size_t buffer_size);
+
+#endif // PORTAL300_METRICS_H
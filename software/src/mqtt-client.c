@@ -49,6 +49,28 @@ int mqtt_client_get_socket_fd(struct MqttClient * client)
   return client->socket;
 }
 
+double mqtt_client_get_response_time(struct MqttClient * client)
+{
+  assert(client != NULL);
+  return client->client.typical_response_time;
+}
+
+size_t mqtt_client_get_queued_publishes(struct MqttClient * client)
+{
+  assert(client != NULL);
+
+  struct mqtt_message_queue * const queue = &client->client.mq;
+
+  size_t count = 0;
+  for (ssize_t i = 0; i < mqtt_mq_length(queue); i++) {
+    struct mqtt_queued_message const * const msg = mqtt_mq_get(queue, i);
+    if ((msg->control_type == MQTT_CONTROL_PUBLISH) && (msg->state != MQTT_QUEUED_COMPLETE)) {
+      count += 1;
+    }
+  }
+  return count;
+}
+
 struct MqttClient * mqtt_client_create(
     char const *        host_name,
     int                 port,
@@ -85,6 +107,9 @@ struct MqttClient * mqtt_client_create(
       .connected = false,
       .socket    = -1,
       .ssl       = NULL,
+
+      .connects    = 0,
+      .disconnects = 0,
   };
 
   if (client->cfg_host_name == NULL) {
@@ -320,6 +345,7 @@ bool mqtt_client_connect(struct MqttClient * client)
   client->socket                                 = sockfd;
   client->client.publish_response_callback_state = client;
   client->connected                              = true;
+  client->connects += 1;
 
   return true;
 
@@ -354,6 +380,20 @@ void mqtt_client_disconnect(struct MqttClient * client)
   client->ssl       = NULL;
   client->socket    = -1;
   client->connected = false;
+  client->disconnects += 1;
+}
+
+void mqtt_client_close(struct MqttClient * client)
+{
+  assert(client != NULL);
+  if (!client->connected) {
+    return;
+  }
+
+  if (mqtt_disconnect(&client->client) == MQTT_OK) {
+    (void)mqtt_sync(&client->client);
+  }
+  mqtt_client_disconnect(client);
 }
 
 bool mqtt_client_is_connected(struct MqttClient * client)
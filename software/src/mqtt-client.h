@@ -28,6 +28,10 @@ struct MqttClient
   struct mqtt_client client;
   uint8_t            sendbuf[2048];
   uint8_t            recvbuf[1024];
+
+  // statistics
+  uint32_t connects;
+  uint32_t disconnects;
 };
 
 //! Initializes the MQTT library
@@ -58,6 +62,10 @@ void mqtt_client_destroy(struct MqttClient * client);
 bool mqtt_client_connect(struct MqttClient * client);
 void mqtt_client_disconnect(struct MqttClient * client);
 
+//! Sends DISCONNECT before closing the connection, so the broker drops the
+//! session without publishing the last will.
+void mqtt_client_close(struct MqttClient * client);
+
 bool mqtt_client_is_connected(struct MqttClient * client);
 
 bool mqtt_client_sync(struct MqttClient * client);
@@ -72,4 +80,12 @@ bool mqtt_client_publish(
 
 int mqtt_client_get_socket_fd(struct MqttClient * client);
 
+//! Returns the smoothed time the broker takes to acknowledge, in seconds.
+//! MQTT-C samples it in whole seconds, it is negative before the first
+//! acknowledgement.
+double mqtt_client_get_response_time(struct MqttClient * client);
+
+//! Returns the number of publishes that were not sent or acknowledged yet.
+size_t mqtt_client_get_queued_publishes(struct MqttClient * client);
+
 #endif // PORTAL300_MQTT_CLIENT_H
@@ -1,7 +1,23 @@
+#include "audit.h"
+#include "clock.h"
+#include "controller.h"
+#include "door-filter.h"
+#include "flight-recorder.h"
 #include "ipc.h"
+#include "liveness.h"
 #include "log.h"
+#include "log-journal.h"
+#include "metrics.h"
+#include "metrics-http.h"
 #include "mqtt-client.h"
+#include "portal-router.h"
+#include "service-notify.h"
+#include "snapshot.h"
 #include "state-machine.h"
+#include "status.h"
+#include "status-page.h"
+#include "trace.h"
+#include "upgrade.h"
 
 #include <portal300.h>
 
@@ -44,6 +60,20 @@ struct CliOptions
   char const * client_key_file;
   char const * client_crt_file;
   char const * serial_device_name;
+  char const * status_page_path;
+  char const * trace_path;
+  char const * audit_path;
+  char const * flight_recorder_path;
+  char const * snapshot_path;
+  bool         async_log;
+  bool         verbose;
+  char const * portal_prefixes[PORTAL_ROUTER_MAX];
+  size_t       portal_count;
+  uint32_t     timeouts_ms[SM_PHASE_COUNT]; // 0 keeps the default of the phase
+  uint32_t     door_hold_ms;
+  uint32_t     deadlines_ms[DEVICE_COUNT];
+  uint32_t     deadlines_set; // bit mask of (1 << enum PortalDevice), the others keep their default
+  char const * metrics_address; // NULL disables the metrics endpoint
 };
 
 struct DeviceStatus
@@ -54,13 +84,6 @@ struct DeviceStatus
   bool busch_interface;
 };
 
-static struct DeviceStatus device_status = {
-    .ssh_interface   = true, // we're always online
-    .door_control_b2 = false,
-    .door_control_c2 = false,
-    .busch_interface = false,
-};
-
 enum IpcDisconnectFlag
 {
   IPC_DISCONNECT_ON_LOCKED    = (1 << 0),
@@ -71,27 +94,125 @@ enum IpcDisconnectFlag
 
 struct IpcClientInfo
 {
-  uint32_t client_id;
-  uint32_t disconnect_flags;
-  bool     forward_logs;
+  uint32_t           client_id;
+  uint32_t           disconnect_flags;
+  bool               forward_logs;
+  uint32_t           log_subsystems; // bit mask of (1 << enum LogSubSystem) forwarded to the client
+  enum LogLevel      log_level;      // maximum level forwarded to the client
+  enum IpcWireFormat wire_format;    // the format the client talks, so we can answer old clients
+
+  struct IpcSendQueue send_queue; // messages waiting for the client to accept them
+
+  bool                subscribed;        // client receives IPC_MSG_STATUS_UPDATE on changes
+  struct PortalStatus subscriber_status; // the status the subscriber has received so far
 
   char * nick_name;
   char * full_name;
   int    member_id;
+
+  enum AuditAction requested_action; // the open or close request of the client, 0 if none
+  uint64_t         request_time;     // CLOCK_REALTIME of the request in milliseconds
+  uint8_t          portal;           // the portal the request of the client went to
+};
+
+struct Keyholder
+{
+  int  member_id; // 0 if nobody holds the key
+  char nick_name[STATUS_MAX_KEYHOLDER_NICK_LEN];
+};
+
+//! A set of doors and devices below its own topic prefix, driven by its own
+//! state machine. The index of a portal is the one of its prefix in `portal_router`.
+struct Portal
+{
+  struct Controller   controller;
+  struct DeviceStatus device_status;
+
+  //! Drops repeated door status messages and damps flapping doors before the state machine sees them.
+  struct DoorFilter door_filter;
+
+  //! When the devices were heard of last. A stale device counts as offline.
+  struct Liveness liveness;
+
+  //! The member who holds the key for the currently open shack.
+  struct Keyholder current_keyholder;
+
+  //! The member who started the opening process that is currently in progress.
+  struct Keyholder pending_keyholder;
+
+  //! The transaction the state machine is working on. It is written to the
+  //! audit log as soon as its outcome is known. Until then the timestamp of
+  //! the record holds the time of the request.
+  struct
+  {
+    bool               active;
+    struct AuditRecord record;
+  } pending_audit;
+
+  //! CLOCK_MONOTONIC in nanoseconds when the controller timer expires, 0 if it's not running.
+  //! All portals share sm_timerfd, which always runs until the earliest deadline.
+  uint64_t timer_deadline;
+
+  //! The same deadline as CLOCK_REALTIME in milliseconds, which survives a restart of the daemon.
+  uint64_t timer_realtime_deadline;
 };
 
-static volatile sig_atomic_t shutdown_requested = 0;
+static struct PortalRouter portal_router;
+static struct Portal       portals[PORTAL_ROUTER_MAX];
+
+static volatile sig_atomic_t shutdown_requested       = 0;
+static volatile sig_atomic_t flight_recorder_requested = 0;
+static volatile sig_atomic_t upgrade_requested         = 0;
+
+//! The new daemon of a hot upgrade is ready to take over, see upgrade.h.
+static bool upgrade_ready = false;
 
 static int ipc_sock   = -1;
 static int sm_timerfd = -1;
 
+//! The ipc socket was passed by socket activation, its file belongs to systemd.
+static bool ipc_sock_activated = false;
+
+//! Longest iteration of the main loop since the last watchdog ping, in nanoseconds.
+static uint64_t longest_loop_nsecs = 0;
+
 static struct MqttClient * mqtt_client = NULL;
 
+//! Metrics served with -M. Events are counted where they happen, values that
+//! are counted elsewhere anyways are copied right before a scrape.
+static struct Metrics metrics;
+static struct
+{
+  struct MetricSeries * loop_duration;
+  struct MetricSeries * mqtt_connects;
+  struct MetricSeries * mqtt_disconnects;
+  struct MetricSeries * mqtt_connected;
+  struct MetricSeries * mqtt_response_time;
+  struct MetricSeries * mqtt_queued_publishes;
+  struct MetricSeries * ipc_clients;
+  struct MetricSeries * ipc_messages_sent;
+  struct MetricSeries * ipc_messages_received;
+  struct MetricSeries * ipc_bytes_sent;
+  struct MetricSeries * ipc_bytes_received;
+  struct MetricSeries * events[PORTAL_ROUTER_MAX][SM_EVENT_COUNT];
+  struct MetricSeries * transitions[PORTAL_ROUTER_MAX][SM_EVENT_COUNT];
+  struct MetricSeries * door_duplicates[PORTAL_ROUTER_MAX][SM_DOOR_COUNT];
+  struct MetricSeries * door_flaps[PORTAL_ROUTER_MAX][SM_DOOR_COUNT];
+  struct MetricSeries * devices_online[PORTAL_ROUTER_MAX][DEVICE_COUNT];
+  int                   transactions;         // family, the series are added per action and outcome
+  int                   transaction_duration; // family, the series are added per action
+} metric;
+
 #define POLLFD_IPC       0  // well defined fd: always the unix socket for IPC
 #define POLLFD_MQTT      1  // well defined fd: either the timerfd for reconnecting MQTT or the socket for MQTT communications
 #define POLLFD_SM_TIMER  2  // well defined fd: timerfd for answering state machine requests
-#define POLLFD_FIRST_IPC 3  // First ipc client socket slot
-#define POLLFD_LIMIT     32 // number of maximum socket connections
+#define POLLFD_UPGRADE        3  // well defined fd: the socket to the new daemon during a hot upgrade, -1 otherwise
+#define POLLFD_METRICS        4  // well defined fd: the listener of the metrics endpoint, -1 if it's disabled
+#define POLLFD_METRICS_SCRAPE 5  // well defined fd: the pending scrape of the metrics endpoint, -1 if there is none
+#define POLLFD_FIRST_IPC      6  // First ipc client socket slot
+#define POLLFD_LIMIT          34 // number of maximum socket connections
+
+_Static_assert(POLLFD_LIMIT - POLLFD_FIRST_IPC <= UPGRADE_MAX_CLIENTS, "a hot upgrade must be able to pass all ipc clients");
 
 //! Stack array of pollfds. Everything below POLLFD_FIRST_IPC is pre-intialized and has a static purpose
 //! while everything at POLLFD_FIRST_IPC till POLLFD_LIMIT is a dynamic stack of pollfds for ipc client connections.
@@ -107,21 +228,28 @@ static void close_mqtt_client(void);
 
 static void sigint_handler(int sig, siginfo_t * info, void * ucontext);
 static void sigterm_handler(int sig, siginfo_t * info, void * ucontext);
+static void sigusr1_handler(int sig, siginfo_t * info, void * ucontext);
+static void sigusr2_handler(int sig, siginfo_t * info, void * ucontext);
+static void crash_handler(int sig, siginfo_t * info, void * ucontext);
 
-static size_t add_ipc_client(int fd);
+static size_t add_ipc_client(int fd, uint32_t client_id);
 static void   remove_ipc_client(size_t index);
-static void   remove_all_ipc_clients(uint32_t disconnect_flags);
+static void   remove_all_ipc_clients(size_t portal, uint32_t disconnect_flags);
 
 static bool try_connect_mqtt(void);
 static bool install_signal_handlers(void);
 static int  create_reconnect_timeout_timer(int secs);
 
-static bool send_ipc_info(int fd, char const * text);
-static bool send_ipc_infof(int fd, char const * fmt, ...) __attribute__((format(printf, 2, 3)));
+static bool send_ipc_buffer(size_t client_index, struct IpcBuffer * buffer);
+static void update_ipc_client_events(size_t client_index);
+static bool send_ipc_message(size_t client_index, struct IpcMessage const * msg);
+static bool send_ipc_info(size_t client_index, char const * text);
+static bool send_ipc_infof(size_t client_index, char const * fmt, ...) __attribute__((format(printf, 2, 3)));
 
 static bool fetch_timer_fd(int fd);
 
 static bool send_mqtt_msg(char const * topic, char const * data);
+static bool publish_portal_msg(size_t portal, char const * topic, char const * data);
 
 static void mqtt_handle_message(void * user_data, char const * topic, char const * data);
 
@@ -138,28 +266,91 @@ static void panic(char const * msg)
   exit(EXIT_FAILURE);
 }
 
-static void state_machine_signal_handler(void * user_data, void * context, enum SM_Signal signal);
-
-static bool push_signal(enum SM_Signal sig, uint32_t client_id);
-static bool pop_signal(enum SM_Signal * sig, uint32_t * client_id);
-
-static struct StateMachine global_state_machine;
+static bool     controller_send_mqtt(void * user_data, char const * topic, char const * data);
+static void     controller_start_timer(void * user_data, uint32_t ms);
+static void     controller_cancel_timer(void * user_data);
+static uint64_t controller_get_time_ms(void * user_data);
+
+static void init_portal(struct Portal * portal);
+static void update_sm_timer(void);
+
+static void     filter_door_status(struct Portal * portal, int door, enum DoorState state);
+static void     apply_door_status(struct Portal * portal, int door, enum DoorState state);
+static void     flush_door_filters(void);
+static int      door_filters_timeout(void);
+static uint32_t count_door_flaps(void);
+
+static void device_seen(struct Portal * portal, enum PortalDevice device);
+static void check_liveness(void);
+static void fail_stale_transaction(struct Portal * portal);
+static int  liveness_timeouts(void);
+
+static void build_snapshot(struct Snapshot * snapshot);
+static void apply_snapshot(struct Snapshot const * snapshot);
+static void restore_snapshot(void);
+static void save_snapshot(void);
+static int  min_timeout(int a, int b);
+
+static void open_status_page(void);
+static void open_trace_and_audit_log(void);
+static bool remove_stale_ipc_socket(void);
+static void ping_watchdog(void);
+static void start_mqtt(void);
+static void hand_over(void);
+static bool take_over(void);
 
 static uint32_t find_ipc_client_by_id(uint32_t client_id);
 
 static uint32_t fetch_next_client_id(void);
 
-static void print_log_to_ipc_clients(void * user_data, enum LogSubSystem subsystem, enum LogLevel level, char const * msg);
+static char const * signal_door(enum SM_Signal signal);
+
+static bool wants_log(struct IpcClientInfo const * client, enum LogSubSystem subsystem, enum LogLevel level);
+static void update_ipc_log_level(void);
+static void print_log_to_ipc_clients(void * user_data, struct LogRecord const * record);
 
 static struct LogConsumer ipc_client_logger = {
     .log       = print_log_to_ipc_clients,
     .user_data = NULL,
+    .max_level = LL_ERROR,
 };
 
 static void close_sm_timerfd(void);
 
+static void set_keyholder(struct Keyholder * keyholder, struct IpcClientInfo const * client);
+
+static void     audit_begin(struct Portal * portal, struct IpcClientInfo const * client, enum AuditAction action);
+static void     audit_finish(struct Portal * portal, enum AuditOutcome outcome);
+static void     audit_record(struct IpcClientInfo const * client, enum AuditAction action, enum AuditOutcome outcome);
+
 static void update_api_status(void);
 
+static void init_metrics(void);
+static void update_metrics(void);
+static void observe_transaction(enum AuditAction action, enum AuditOutcome outcome, uint32_t latency_ms);
+
+static void                        send_status_text(size_t client_index, struct PortalStatus const * status);
+static void                        get_portal_status(struct Portal const * portal, struct PortalStatus * status);
+static struct PortalStatus const * refresh_status_snapshot(void);
+static void                        notify_subscriber(size_t client_index);
+
+//! Subscribers are not interested in other subscribers connecting and disconnecting.
+#define SUBSCRIPTION_FIELDS (STATUS_FIELD_ALL & ~STATUS_FIELD_IPC_CLIENTS)
+
+#define ALL_LOG_SUBSYSTEMS (~0U)
+
+//! Cached status snapshot. The encoded message is only rebuilt when the status
+//! changed since the last query, so answering a query only queues a reference.
+static struct
+{
+  bool                valid;
+  struct PortalStatus status;
+  struct IpcBuffer *  encoded; // V1 status message, NULL if encoding failed
+} status_snapshot = {
+    .valid   = false,
+    .encoded = NULL,
+};
+
 struct CliOptions cli;
 
 int main(int argc, char ** argv)
@@ -170,8 +361,6 @@ int main(int argc, char ** argv)
     return EXIT_FAILURE;
   }
 
-  sm_init(&global_state_machine, state_machine_signal_handler, NULL);
-
   log_set_level(LSS_IPC, LL_WARNING);
 
   sm_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
@@ -185,6 +374,18 @@ int main(int argc, char ** argv)
       .fd     = sm_timerfd,
       .events = POLLIN,
   };
+  pollfds[POLLFD_UPGRADE] = (struct pollfd){
+      .fd     = -1,
+      .events = POLLIN,
+  };
+  pollfds[POLLFD_METRICS] = (struct pollfd){
+      .fd     = -1,
+      .events = POLLIN,
+  };
+  pollfds[POLLFD_METRICS_SCRAPE] = (struct pollfd){
+      .fd     = -1,
+      .events = POLLIN,
+  };
 
   if (!install_signal_handlers()) {
     log_print(LSS_SYSTEM, LL_ERROR, "failed to install signal handlers.");
@@ -205,6 +406,74 @@ int main(int argc, char ** argv)
     return EXIT_SUCCESS;
   }
 
+  portal_router_init(&portal_router);
+  for (size_t i = 0; i < cli.portal_count; i++) {
+    int const index = portal_router_add(&portal_router, cli.portal_prefixes[i]);
+    if (index < 0) {
+      fprintf(stderr, "invalid or duplicate portal prefix: %s\n", cli.portal_prefixes[i]);
+      return EXIT_FAILURE;
+    }
+    init_portal(&portals[index]);
+  }
+  init_metrics();
+
+  enum LogLevel const console_level = cli.verbose ? LL_VERBOSE : LL_MESSAGE;
+  if (cli.verbose) {
+    log_set_level(LSS_IPC, LL_VERBOSE);
+  }
+
+  // When running as a service, stderr ends up in the journal anyways. Talk to
+  // journald directly then, so messages keep their structure.
+  if (log_journal_stderr_is_journal() && log_journal_open("portal-daemon", console_level)) {
+    log_disable_stderr();
+    atexit(log_journal_close);
+  }
+  else {
+    log_set_stderr_level(console_level);
+  }
+
+  // Writing the log from a separate thread keeps a slow journald from stalling
+  // the door handling.
+  if (cli.async_log) {
+    if (log_start_async()) {
+      atexit(log_stop_async);
+    }
+  }
+
+  (void)flight_recorder_set_path(cli.flight_recorder_path);
+
+  (void)upgrade_init(argv);
+  bool const upgrading = upgrade_is_pending();
+
+  // the new daemon of a hot upgrade must not rotate the trace or write the
+  // audit log of the running one before it took over
+  if (!upgrading) {
+    open_trace_and_audit_log();
+  }
+
+  // continue where the previous daemon stopped. fresh MQTT data overrides the
+  // restored door and device states as soon as it arrives. a hot upgrade
+  // receives the current state from the running daemon instead.
+  if (snapshot_set_path(cli.snapshot_path)) {
+    if (!upgrading) {
+      restore_snapshot();
+    }
+    atexit(snapshot_close);
+  }
+
+  // the new daemon of a hot upgrade must not replace the page of the running
+  // one before it took over
+  if (!upgrading) {
+    open_status_page();
+  }
+
+  // There's only a single last will, so it covers the primary portal.
+  char last_will_topic[PORTAL_ROUTER_PREFIX_LEN + 64];
+  if (!portal_router_topic(&portal_router, 0, PORTAL_TOPIC(PORTAL300_TOPIC_STATUS_SSH_INTERFACE), last_will_topic, sizeof last_will_topic)) {
+    log_write(LSS_MQTT, LL_ERROR, "portal prefix is too long.");
+    return EXIT_FAILURE;
+  }
+
   // Create MQTT client from CLI info
   mqtt_client = mqtt_client_create(
       cli.host_name,
@@ -212,7 +481,7 @@ int main(int argc, char ** argv)
       cli.ca_cert_file,
       cli.client_key_file,
       cli.client_crt_file,
-      PORTAL300_TOPIC_STATUS_SSH_INTERFACE,
+      last_will_topic,
       "offline",
       mqtt_handle_message,
       NULL);
@@ -222,35 +491,46 @@ int main(int argc, char ** argv)
   }
   atexit(close_mqtt_client);
 
-  ipc_sock = ipc_create_socket();
-  if (ipc_sock == -1) {
-    return EXIT_FAILURE;
-  }
-
-  if (try_connect_mqtt()) {
-    // we successfully connected to MQTT, set up the poll entry for MQTT action:
-    pollfds[POLLFD_MQTT] = (struct pollfd){
-        .fd      = mqtt_client_get_socket_fd(mqtt_client),
-        .events  = POLLIN,
-        .revents = 0,
-    };
+  if (!upgrading) {
+    // with socket activation, requests queue in the kernel while the daemon restarts
+    ipc_sock           = service_listen_fd();
+    ipc_sock_activated = (ipc_sock != -1);
+    if (!ipc_sock_activated) {
+      ipc_sock = ipc_create_socket();
+      if (ipc_sock == -1) {
+        return EXIT_FAILURE;
+      }
+    }
   }
-  else {
-    log_print(LSS_MQTT, LL_WARNING, "failed to connect to mqtt server, retrying in %d seconds", MQTT_RECONNECT_TIMEOUT);
 
-    // we failed to connect to MQTT, set up a timerfd to retry in some seconds
-    int timer = create_reconnect_timeout_timer(MQTT_RECONNECT_TIMEOUT);
+  // the connection is only established here, MQTT-C sends CONNECT and the
+  // subscription with the first sync in the main loop.
+  start_mqtt();
 
-    pollfds[POLLFD_MQTT] = (struct pollfd){
-        .fd      = timer,
+  if (upgrading) {
+    // the running daemon keeps serving until now
+    if (!take_over()) {
+      return EXIT_FAILURE;
+    }
+    open_trace_and_audit_log();
+    open_status_page();
+  }
+  else if (ipc_sock_activated) {
+    // systemd created the socket file with its permissions already
+    atexit(close_ipc_sock);
+    pollfds[POLLFD_IPC] = (struct pollfd){
+        .fd      = ipc_sock,
         .events  = POLLIN,
         .revents = 0,
     };
   }
-
-  // Bind and setup the ipc socket, so we can receive ipc messages
-  {
-    if (bind(ipc_sock, (struct sockaddr const *)&ipc_socket_address, sizeof ipc_socket_address) == -1) {
+  else {
+    // Bind and setup the ipc socket, so we can receive ipc messages
+    bool bound = (bind(ipc_sock, (struct sockaddr const *)&ipc_socket_address, sizeof ipc_socket_address) == 0);
+    if (!bound && (errno == EADDRINUSE) && remove_stale_ipc_socket()) {
+      bound = (bind(ipc_sock, (struct sockaddr const *)&ipc_socket_address, sizeof ipc_socket_address) == 0);
+    }
+    if (!bound) {
       log_perror(LSS_IPC, LL_ERROR, "failed to bind ipc socket");
       log_print(LSS_IPC, LL_ERROR, "is another instance of this daemon already running?");
       log_print(LSS_IPC, LL_ERROR, "If not, delete %s", ipc_socket_address.sun_path);
@@ -274,83 +554,69 @@ int main(int argc, char ** argv)
     }
   }
 
+  // the old daemon of a hot upgrade leaves the endpoint to us, so it's only
+  // opened after the take over
+  if (cli.metrics_address != NULL) {
+    if (!metrics_http_listen(cli.metrics_address)) {
+      return EXIT_FAILURE;
+    }
+    atexit(metrics_http_close);
+  }
+
   log_register_consumer(&ipc_client_logger);
 
+  service_watchdog_init();
+  (void)service_notify("STATUS=waiting for mqtt");
+  bool ready_notified = false;
+
   while (shutdown_requested == false) {
-    {
+    if (flight_recorder_requested) {
+      flight_recorder_requested = 0;
+      (void)flight_recorder_dump();
+    }
+
+    if (upgrade_requested) {
+      upgrade_requested = 0;
+      (void)upgrade_start();
+    }
+
+    // door status changes that were held until their door settled
+    flush_door_filters();
+
+    // devices that didn't send anything for too long
+    check_liveness();
+
+    for (size_t portal_index = 0; portal_index < portal_router.count; portal_index++) {
+      struct Portal * const portal = &portals[portal_index];
+
       enum SM_Signal signal;
       uint32_t       client_id;
-      while (pop_signal(&signal, &client_id)) {
+      while (controller_pop_signal(&portal->controller, &signal, &client_id)) {
+        trace(SM_SIGNAL, (int)signal, client_id);
+
         uint32_t const               ipc_client_index = find_ipc_client_by_id(client_id);
         uint32_t const               ipc_client_valid = (ipc_client_index != INVALID_IPC_CLIENT);
         struct IpcClientInfo * const ipc_client_data  = ipc_client_valid ? &ipc_client_info_storage[ipc_client_index] : NULL;
 
-        switch (signal) {
-        case SIGNAL_OPEN_DOOR_B:
-          log_print(LSS_SYSTEM, LL_MESSAGE, "Unlocking building front door.");
-
-          // Wenn der shack aktuell sicher "offen" ist, senden wir eine Nachricht an die Fronttüre:
-          if (!send_mqtt_msg(PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_B))) {
-            log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to open B.");
-          }
-
-          break;
-
-        case SIGNAL_OPEN_DOOR_C:
-          log_print(LSS_SYSTEM, LL_MESSAGE, "Unlocking building back door.");
-          if (!send_mqtt_msg(PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_C))) {
-            log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to open C.");
-          }
-          break;
+        log_set_context(&(struct LogContext){
+            .member_id      = ipc_client_valid ? ipc_client_data->member_id : -1,
+            .door           = signal_door(signal),
+            .transaction_id = (client_id != INVALID_IPC_CLIENT) ? client_id : 0,
+        });
 
+        // keyholders, audit log and ipc clients. the door actions are done by the controller afterwards.
+        switch (signal) {
         case SIGNAL_OPEN_DOOR_B2_SAFE:
-          log_print(LSS_SYSTEM, LL_MESSAGE, "Safely opening inner front door.");
-          if (!send_mqtt_msg(PORTAL300_TOPIC_ACTION_OPEN_DOOR_SAFE, DOOR_NAME(DOOR_B2))) {
-            log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to safely open B2");
-          }
-          break;
-
         case SIGNAL_OPEN_DOOR_C2_SAFE:
-          log_print(LSS_SYSTEM, LL_MESSAGE, "Safely opening inner back door.");
-          if (!send_mqtt_msg(PORTAL300_TOPIC_ACTION_OPEN_DOOR_SAFE, DOOR_NAME(DOOR_C2))) {
-            log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to safely open C2");
-          }
-          break;
-
-        case SIGNAL_OPEN_DOOR_B2_UNSAFE:
-          log_print(LSS_SYSTEM, LL_MESSAGE, "Opening inner front door.");
-          if (!send_mqtt_msg(PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_B2))) {
-            log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to open B2");
-          }
-          break;
-
-        case SIGNAL_OPEN_DOOR_C2_UNSAFE:
-          log_print(LSS_SYSTEM, LL_MESSAGE, "Opening inner back door.");
-          if (!send_mqtt_msg(PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_C2))) {
-            log_print(LSS_SYSTEM, LL_ERROR, "Failed to send message to open C2");
+          if (ipc_client_valid) {
+            set_keyholder(&portal->pending_keyholder, ipc_client_data);
           }
+          audit_begin(portal, ipc_client_data, (signal == SIGNAL_OPEN_DOOR_B2_SAFE) ? AUDIT_OPEN_FRONT : AUDIT_OPEN_BACK);
           break;
 
         case SIGNAL_LOCK_ALL:
-        {
-          bool ok;
-          log_print(LSS_SYSTEM, LL_MESSAGE, "Sending request to lock all doors...");
-
-          // Close both doors
-          ok = send_mqtt_msg(PORTAL300_TOPIC_ACTION_LOCK_DOOR, DOOR_NAME(DOOR_C2));
-          if (!ok) {
-            log_print(LSS_SYSTEM, LL_ERROR, "Could not send message to close door C2");
-            break;
-          }
-
-          ok = send_mqtt_msg(PORTAL300_TOPIC_ACTION_LOCK_DOOR, DOOR_NAME(DOOR_B2));
-          if (!ok) {
-            log_print(LSS_SYSTEM, LL_ERROR, "Could not send message to close door B2");
-            break;
-          }
-
+          audit_begin(portal, ipc_client_data, AUDIT_CLOSE);
           break;
-        }
 
         case SIGNAL_UNLOCK_SUCCESSFUL:
         {
@@ -362,14 +628,19 @@ int main(int argc, char ** argv)
         case SIGNAL_LOCK_SUCCESSFUL:
         {
           log_print(LSS_SYSTEM, LL_MESSAGE, "shack was successfully locked");
-          remove_all_ipc_clients(IPC_DISCONNECT_ON_LOCKED);
+          audit_finish(portal, AUDIT_SUCCESS);
+          set_keyholder(&portal->current_keyholder, NULL);
+          remove_all_ipc_clients(portal_index, IPC_DISCONNECT_ON_LOCKED);
           break;
         }
 
         case SIGNAL_OPEN_SUCCESSFUL:
         {
           log_print(LSS_SYSTEM, LL_MESSAGE, "shack was successfully unlocked");
-          remove_all_ipc_clients(IPC_DISCONNECT_ON_OPEN);
+          audit_finish(portal, AUDIT_SUCCESS);
+          portal->current_keyholder = portal->pending_keyholder;
+          set_keyholder(&portal->pending_keyholder, NULL);
+          remove_all_ipc_clients(portal_index, IPC_DISCONNECT_ON_OPEN);
           break;
         }
 
@@ -377,11 +648,13 @@ int main(int argc, char ** argv)
         {
           if (ipc_client_valid) {
             log_print(LSS_SYSTEM, LL_MESSAGE, "Changing active keyholder to %s", ipc_client_data->nick_name);
+            audit_record(ipc_client_data, ipc_client_data->requested_action, AUDIT_SUCCESS);
+            set_keyholder(&portal->current_keyholder, ipc_client_data);
           }
           else {
             log_print(LSS_SYSTEM, LL_MESSAGE, "Could not transfer keyholder status: Could not detect active keyholder.");
           }
-          remove_all_ipc_clients(IPC_DISCONNECT_ON_OPEN);
+          remove_all_ipc_clients(portal_index, IPC_DISCONNECT_ON_OPEN);
           break;
         }
 
@@ -390,51 +663,108 @@ int main(int argc, char ** argv)
           log_print(LSS_SYSTEM, LL_MESSAGE, "Could not handle user request.");
 
           if (ipc_client_valid) {
-            int fd = pollfds[ipc_client_index].fd;
-            send_ipc_info(fd, "Could not handle your request right now. Another process is still in action.");
+            audit_record(ipc_client_data, ipc_client_data->requested_action, AUDIT_REJECTED);
+            send_ipc_info(ipc_client_index, "Could not handle your request right now. Another process is still in action.");
 
             remove_ipc_client(ipc_client_index);
           }
           break;
         }
 
+        case SIGNAL_REQUEST_ATTACHED:
+        {
+          log_print(LSS_SYSTEM, LL_MESSAGE, "User request joins the running transaction.");
+
+          if (ipc_client_valid) {
+            audit_record(ipc_client_data, ipc_client_data->requested_action, AUDIT_ATTACHED);
+            send_ipc_info(ipc_client_index, (ipc_client_data->requested_action == AUDIT_CLOSE) ? "Das Portal wird bereits geschlossen, bitte warten..." : "Das Portal wird bereits geöffnet, bitte warten...");
+          }
+          break;
+        }
+
+        case SIGNAL_REQUEST_QUEUED:
+        {
+          log_print(LSS_SYSTEM, LL_MESSAGE, "Another transaction is running, queueing user request.");
+
+          if (ipc_client_valid) {
+            send_ipc_info(ipc_client_index, "Ein anderer Vorgang läuft noch, deine Anfrage folgt direkt danach...");
+          }
+          break;
+        }
+
         case SIGNAL_UNLOCK_TIMEOUT:
           log_print(LSS_SYSTEM, LL_MESSAGE, "Nobody entered the building, locking doors again...");
+          audit_finish(portal, AUDIT_NOT_ENTERED);
           break;
 
         case SIGNAL_STATE_CHANGE:
-          log_print(LSS_SYSTEM, LL_MESSAGE, "shackspace is now %s", sm_shack_state_name(sm_get_shack_state(&global_state_machine)));
+          log_print(LSS_SYSTEM, LL_MESSAGE, "shackspace is now %s", sm_shack_state_name(sm_get_shack_state(&portal->controller.state_machine)));
           break;
 
         case SIGNAL_NO_STATE_CHANGE:
-          log_print(LSS_SYSTEM, LL_MESSAGE, "shackspace is still %s", sm_shack_state_name(sm_get_shack_state(&global_state_machine)));
-          remove_all_ipc_clients(IPC_DISCONNECT_ON_NO_CHANGE);
+          log_print(LSS_SYSTEM, LL_MESSAGE, "shackspace is still %s", sm_shack_state_name(sm_get_shack_state(&portal->controller.state_machine)));
+          audit_record(ipc_client_data, AUDIT_CLOSE, AUDIT_NO_CHANGE);
+          remove_all_ipc_clients(portal_index, IPC_DISCONNECT_ON_NO_CHANGE);
           break;
 
-        case SIGNAL_START_TIMEOUT:
-          log_print(LSS_SYSTEM, LL_VERBOSE, "handling timeout request. timeout is in %d ms.", STATE_MACHINE_TIMEOUT_MS);
-          arm_timer(sm_timerfd, true, STATE_MACHINE_TIMEOUT_MS);
+        case SIGNAL_USER_REQUESTED_TIMED_OUT:
+          log_print(LSS_SYSTEM, LL_MESSAGE, "Requested operation timed out. Not able to lock/open shackspace!");
+          audit_finish(portal, AUDIT_TIMEOUT);
+          remove_all_ipc_clients(portal_index, IPC_DISCONNECT_ON_ERROR);
           break;
 
-        case SIGNAL_CANCEL_TIMEOUT:
-          log_print(LSS_SYSTEM, LL_VERBOSE, "cancelling timeout request.");
-          disarm_timer(sm_timerfd);
+        default:
           break;
+        }
 
-        case SIGNAL_USER_REQUESTED_TIMED_OUT:
-          log_print(LSS_SYSTEM, LL_MESSAGE, "Requested operation timed out. Not able to lock/open shackspace!");
-          remove_all_ipc_clients(IPC_DISCONNECT_ON_ERROR);
-          break;
+        controller_execute_signal(&portal->controller, signal);
+
+        // a door that can't report won't let the new phase finish
+        if (signal == SIGNAL_START_TIMEOUT) {
+          fail_stale_transaction(portal);
         }
+
+        log_set_context(NULL);
       }
     }
 
     // sync the mqtt client to send some leftovers
     mqtt_client_sync(mqtt_client);
 
+    // units ordered after us may rely on the doors, which needs the broker
+    if (!ready_notified && mqtt_client_is_connected(mqtt_client)) {
+      ready_notified = true;
+      (void)service_notify("READY=1\nSTATUS=connected to mqtt");
+    }
+
     update_api_status();
 
-    int const poll_ret = poll(pollfds, pollfds_size, -1); // wait infinitly for an event
+    // publishes to the status page when something changed
+    (void)refresh_status_snapshot();
+
+    save_snapshot();
+
+    // all signals are handled and sent, so the state is consistent for the new daemon
+    if (upgrade_ready) {
+      upgrade_ready = false;
+      hand_over();
+    }
+
+    // only a loop that gets here keeps the watchdog quiet
+    if (service_watchdog_timeout() == 0) {
+      ping_watchdog();
+    }
+
+    // wait for an event, but wake up for the summaries of rate limited log messages, the snapshot sync,
+    // to give up on a new daemon that doesn't get ready, for the next watchdog ping, for held door status
+    // changes and for the next device deadline
+    int timeout                = min_timeout(min_timeout(log_flush_ratelimited(), snapshot_sync()), min_timeout(upgrade_sync(), service_watchdog_timeout()));
+    timeout                    = min_timeout(timeout, min_timeout(door_filters_timeout(), liveness_timeouts()));
+    pollfds[POLLFD_UPGRADE].fd        = upgrade_get_fd();
+    pollfds[POLLFD_METRICS].fd        = metrics_http_get_listen_fd();
+    pollfds[POLLFD_METRICS_SCRAPE].fd = metrics_http_get_client_fd(&pollfds[POLLFD_METRICS_SCRAPE].events);
+
+    int const poll_ret = poll(pollfds, pollfds_size, timeout);
     if (poll_ret == -1) {
       if (errno != EINTR) {
         log_perror(LSS_SYSTEM, LL_ERROR, "central poll failed");
@@ -456,7 +786,7 @@ int main(int argc, char ** argv)
 
           int client_fd = accept(ipc_sock, NULL, NULL);
           if (client_fd != -1) {
-            size_t const index = add_ipc_client(client_fd);
+            size_t const index = add_ipc_client(client_fd, fetch_next_client_id());
             if (index != INVALID_IPC_CLIENT) {
               log_print(LSS_IPC, LL_MESSAGE, "accepted new IPC client on connection slot %zu", index);
             }
@@ -513,11 +843,42 @@ int main(int argc, char ** argv)
           break;
         }
 
+        case POLLFD_UPGRADE:
+        {
+          // the new daemon is ready or died, both are handled by hand_over()
+          upgrade_ready = true;
+          break;
+        }
+
+        case POLLFD_METRICS:
+        {
+          metrics_http_accept();
+          break;
+        }
+
+        case POLLFD_METRICS_SCRAPE:
+        {
+          // the values are only copied and rendered once per scrape, when its request is complete
+          if (metrics_http_handle()) {
+            update_metrics();
+            metrics_http_respond(&metrics);
+          }
+          break;
+        }
+
         case POLLFD_SM_TIMER:
         {
-          printf("ready?\n");
           if (fetch_timer_fd(pfd.fd)) {
-            sm_apply_event(&global_state_machine, EVENT_TIMEOUT, NULL);
+            uint64_t const now = clock_get_ns(CLOCK_MONOTONIC);
+            for (size_t i = 0; i < portal_router.count; i++) {
+              struct Portal * const portal = &portals[i];
+              if ((portal->timer_deadline != 0) && (portal->timer_deadline <= now)) {
+                portal->timer_deadline          = 0;
+                portal->timer_realtime_deadline = 0;
+                controller_handle_timeout(&portal->controller);
+              }
+            }
+            update_sm_timer();
           }
           else {
             log_perror(LSS_SYSTEM, LL_ERROR, "failed to fetch state machine timerfd");
@@ -537,7 +898,7 @@ int main(int argc, char ** argv)
             struct IpcClientInfo * const ipc_client_data = &ipc_client_info_storage[pfd_index];
 
             struct IpcMessage msg;
-            enum IpcRcvResult msg_ok = ipc_receive_msg(pfd.fd, &msg);
+            enum IpcRcvResult msg_ok = ipc_receive_msg_with_format(pfd.fd, &msg, &ipc_client_data->wire_format);
 
             switch (msg_ok) {
             case IPC_EOF:
@@ -553,18 +914,38 @@ int main(int argc, char ** argv)
             }
             case IPC_SUCCESS:
             {
+              trace(IPC_MESSAGE, ipc_client_data->client_id, (unsigned int)msg.type, (unsigned int)msg.portal);
+
+              if (msg.portal >= portal_router.count) {
+                log_print(LSS_IPC, LL_WARNING, "client %zu requested unknown portal %u", pfd_index, msg.portal);
+                send_ipc_info(pfd_index, "Dieses Portal gibt es nicht!");
+                remove_ipc_client(pfd_index);
+                break;
+              }
+              struct Portal * const portal = &portals[msg.portal];
+              ipc_client_data->portal      = msg.portal;
+
+              // everything logged while handling the request belongs to this client
+              bool const is_open_request = (msg.type == IPC_MSG_OPEN_FRONT) || (msg.type == IPC_MSG_OPEN_BACK);
+              log_set_context(&(struct LogContext){
+                  .member_id      = is_open_request ? msg.data.open.member_id : ipc_client_data->member_id,
+                  .door           = NULL,
+                  .transaction_id = ipc_client_data->client_id,
+              });
+
               switch (msg.type) {
               case IPC_MSG_OPEN_BACK:
               case IPC_MSG_OPEN_FRONT:
               {
                 ipc_client_data->forward_logs = true;
+                update_ipc_log_level();
                 ipc_client_data->disconnect_flags |= (IPC_DISCONNECT_ON_OPEN | IPC_DISCONNECT_ON_NO_CHANGE | IPC_DISCONNECT_ON_ERROR);
 
                 size_t const nick_len = strnlen(msg.data.open.member_nick, IPC_MAX_NICK_LEN);
                 size_t const name_len = strnlen(msg.data.open.member_name, IPC_MAX_NAME_LEN);
 
                 if (nick_len == 0 || name_len == 0 || msg.data.open.member_id <= 0) {
-                  send_ipc_info(pfd.fd, "Es wurden keine gültigen Member-Daten übertragen!");
+                  send_ipc_info(pfd_index, "Es wurden keine gültigen Member-Daten übertragen!");
                   remove_ipc_client(pfd_index);
                   break;
                 }
@@ -579,7 +960,7 @@ int main(int argc, char ** argv)
                   free(ipc_client_data->nick_name);
                   free(ipc_client_data->full_name);
 
-                  send_ipc_info(pfd.fd, "Out of memory!");
+                  send_ipc_info(pfd_index, "Out of memory!");
                   remove_ipc_client(pfd_index);
                   break;
                 }
@@ -587,7 +968,7 @@ int main(int argc, char ** argv)
                   free(ipc_client_data->nick_name);
                   free(ipc_client_data->full_name);
 
-                  send_ipc_info(pfd.fd, "Out of memory!");
+                  send_ipc_info(pfd_index, "Out of memory!");
                   remove_ipc_client(pfd_index);
                   break;
                 }
@@ -597,22 +978,24 @@ int main(int argc, char ** argv)
                 ipc_client_data->nick_name[nick_len] = 0;
                 ipc_client_data->full_name[name_len] = 0;
                 ipc_client_data->member_id           = msg.data.open.member_id;
+                ipc_client_data->requested_action    = (msg.type == IPC_MSG_OPEN_BACK) ? AUDIT_OPEN_BACK : AUDIT_OPEN_FRONT;
+                ipc_client_data->request_time        = clock_get_ms(CLOCK_REALTIME);
 
                 log_print(LSS_IPC, LL_MESSAGE, "client %zu requested portal opening via %s for (%d, '%.*s', '%.*s').", pfd_index, (msg.type == IPC_MSG_OPEN_BACK) ? "back door" : "front door", msg.data.open.member_id, (int)strnlen(msg.data.open.member_nick, sizeof msg.data.open.member_nick), msg.data.open.member_nick, (int)strnlen(msg.data.open.member_name, sizeof msg.data.open.member_name), msg.data.open.member_name);
 
-                send_ipc_infof(pfd.fd, "Portal wird geöffnet, bitte warten...");
+                send_ipc_infof(pfd_index, "Portal wird geöffnet, bitte warten...");
 
-                sm_apply_event(
-                    &global_state_machine,
+                controller_handle_request(
+                    &portal->controller,
                     (msg.type == IPC_MSG_OPEN_BACK) ? EVENT_SSH_OPEN_BACK_REQUEST : EVENT_SSH_OPEN_FRONT_REQUEST,
-                    &ipc_client_data->client_id);
+                    ipc_client_data->client_id);
 
                 // // Open outer door
                 // ok = send_mqtt_msg(
                 //     PORTAL300_TOPIC_ACTION_OPEN_DOOR,
                 //     (msg.type == IPC_MSG_OPEN_BACK) ? DOOR_NAME(DOOR_C) : DOOR_NAME(DOOR_B));
                 // if (!ok) {
-                //   send_ipc_infof(pfd.fd, "Konnte Portal nicht öffnen!");
+                //   send_ipc_infof(pfd_index, "Konnte Portal nicht öffnen!");
                 //   remove_ipc_client(i);
                 //   break;
                 // }
@@ -622,7 +1005,7 @@ int main(int argc, char ** argv)
                 //     PORTAL300_TOPIC_ACTION_OPEN_DOOR,
                 //     (msg.type == IPC_MSG_OPEN_BACK) ? DOOR_NAME(DOOR_C2) : DOOR_NAME(DOOR_B2));
                 // if (!ok) {
-                //   send_ipc_infof(pfd.fd, "Konnte Portal nicht öffnen!");
+                //   send_ipc_infof(pfd_index, "Konnte Portal nicht öffnen!");
                 //   remove_ipc_client(i);
                 //   break;
                 // }
@@ -633,26 +1016,31 @@ int main(int argc, char ** argv)
               case IPC_MSG_CLOSE:
               {
                 ipc_client_data->forward_logs = true;
+                update_ipc_log_level();
                 ipc_client_data->disconnect_flags |= (IPC_DISCONNECT_ON_LOCKED | IPC_DISCONNECT_ON_NO_CHANGE | IPC_DISCONNECT_ON_ERROR);
 
                 log_print(LSS_IPC, LL_MESSAGE, "client %zu requested portal close.", pfd_index);
 
-                send_ipc_infof(pfd.fd, "Portal wird geschlossen, bitte warten...");
+                ipc_client_data->requested_action = AUDIT_CLOSE;
+                ipc_client_data->request_time     = clock_get_ms(CLOCK_REALTIME);
+
+                send_ipc_infof(pfd_index, "Portal wird geschlossen, bitte warten...");
 
-                sm_apply_event(
-                    &global_state_machine,
+                controller_handle_request(
+                    &portal->controller,
                     EVENT_SSH_CLOSE_REQUEST,
-                    &ipc_client_data->client_id);
+                    ipc_client_data->client_id);
 
                 break;
               }
 
               case IPC_MSG_FORCE_OPEN:
               {
-                mqtt_client_publish(mqtt_client, PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_B), 2);
-                mqtt_client_publish(mqtt_client, PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_B2), 2);
-                mqtt_client_publish(mqtt_client, PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_C), 2);
-                mqtt_client_publish(mqtt_client, PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_C2), 2);
+                audit_record(ipc_client_data, AUDIT_FORCE_OPEN, AUDIT_SUCCESS);
+                publish_portal_msg(msg.portal, PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_B));
+                publish_portal_msg(msg.portal, PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_B2));
+                publish_portal_msg(msg.portal, PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_C));
+                publish_portal_msg(msg.portal, PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE, DOOR_NAME(DOOR_C2));
                 remove_ipc_client(pfd_index);
                 break;
               }
@@ -660,17 +1048,20 @@ int main(int argc, char ** argv)
               case IPC_MSG_SYSTEM_RESET:
               {
                 ipc_client_data->forward_logs = true;
+                update_ipc_log_level();
                 log_print(LSS_IPC, LL_MESSAGE, "Starting system reset!");
-                mqtt_client_publish(mqtt_client, PORTAL300_TOPIC_ACTION_RESET, "*", 2);
+                audit_record(ipc_client_data, AUDIT_SYSTEM_RESET, AUDIT_SUCCESS);
+                publish_portal_msg(msg.portal, PORTAL300_TOPIC_ACTION_RESET, "*");
               }
 
               case IPC_MSG_SHUTDOWN:
               {
                 ipc_client_data->forward_logs = true;
+                update_ipc_log_level();
 
                 log_print(LSS_IPC, LL_MESSAGE, "client %zu requested portal shutdown.", pfd_index);
 
-                send_ipc_infof(pfd.fd, "Shutdown wird zur Zeit noch nicht unterstützt...");
+                send_ipc_infof(pfd_index, "Shutdown wird zur Zeit noch nicht unterstützt...");
                 remove_ipc_client(pfd_index);
 
                 break;
@@ -680,19 +1071,34 @@ int main(int argc, char ** argv)
               {
                 log_print(LSS_IPC, LL_MESSAGE, "client %zu requested portal status.", pfd_index);
 
-                (void)send_ipc_infof(pfd.fd, "Portal-Status:");
-                (void)send_ipc_infof(pfd.fd, "  Space Status:    %s", sm_shack_state_name(sm_get_shack_state(&global_state_machine)));
-                (void)send_ipc_infof(pfd.fd, "  Aktivität:       %s", sm_state_name(&global_state_machine));
-                (void)send_ipc_infof(pfd.fd, "  MQTT:            %s", mqtt_client_is_connected(mqtt_client) ? "Verbunden" : "Nicht verbunden");
-                (void)send_ipc_infof(pfd.fd, "  IPC Clients:     %u", (pollfds_size - POLLFD_FIRST_IPC));
-                (void)send_ipc_infof(pfd.fd, "Tür-Status:");
-                (void)send_ipc_infof(pfd.fd, "  B2:              %s", sm_door_state_name(global_state_machine.door_b2)); // geöffnet, geschlossen
-                (void)send_ipc_infof(pfd.fd, "  C2:              %s", sm_door_state_name(global_state_machine.door_c2)); // geöffnet, geschlossen
-                (void)send_ipc_infof(pfd.fd, "Geräte-Status:");
-                (void)send_ipc_infof(pfd.fd, "  ssh_interface:   %s", device_status.ssh_interface ? "online" : "offline");
-                (void)send_ipc_infof(pfd.fd, "  door_control_b2: %s", device_status.door_control_b2 ? "online" : "offline");
-                (void)send_ipc_infof(pfd.fd, "  door_control_c2: %s", device_status.door_control_c2 ? "online" : "offline");
-                (void)send_ipc_infof(pfd.fd, "  busch_interface: %s", device_status.busch_interface ? "online" : "offline");
+                if (msg.portal != 0) {
+                  // only the primary portal has a cached snapshot
+                  struct IpcMessage reply = {.type = IPC_MSG_STATUS};
+                  get_portal_status(portal, &reply.data.status);
+                  if (ipc_client_data->wire_format == IPC_WIRE_V1) {
+                    (void)send_ipc_message(pfd_index, &reply);
+                  }
+                  else {
+                    send_status_text(pfd_index, &reply.data.status);
+                  }
+                  remove_ipc_client(pfd_index);
+                  break;
+                }
+
+                struct PortalStatus const * const status = refresh_status_snapshot();
+                if (ipc_client_data->wire_format == IPC_WIRE_V1) {
+                  // queued behind the log lines the client already gets
+                  if (status_snapshot.encoded != NULL) {
+                    (void)send_ipc_buffer(pfd_index, status_snapshot.encoded);
+                  }
+                  else {
+                    (void)send_ipc_message(pfd_index, &(struct IpcMessage){.type = IPC_MSG_STATUS, .data.status = *status});
+                  }
+                }
+                else {
+                  // clients from before the TLV protocol can't decode IPC_MSG_STATUS
+                  send_status_text(pfd_index, status);
+                }
 
                 // after a status message, we can just drop the client connection
                 remove_ipc_client(pfd_index);
@@ -703,13 +1109,64 @@ int main(int argc, char ** argv)
               {
                 log_print(LSS_IPC, LL_MESSAGE, "client %zu requested simple portal status.", pfd_index);
 
-                (void)send_ipc_infof(pfd.fd, "%s\n", sm_shack_state_name(sm_get_shack_state(&global_state_machine)));
+                (void)send_ipc_infof(pfd_index, "%s\n", sm_shack_state_name(sm_get_shack_state(&portal->controller.state_machine)));
 
                 // after a status message, we can just drop the client connection
                 remove_ipc_client(pfd_index);
                 break;
               }
 
+              case IPC_MSG_DUMP_FLIGHT_RECORDER:
+              {
+                log_print(LSS_IPC, LL_MESSAGE, "client %zu requested a flight recorder dump.", pfd_index);
+
+                if (flight_recorder_dump()) {
+                  (void)send_ipc_infof(pfd_index, "%s", flight_recorder_get_path());
+                }
+                else {
+                  send_ipc_info(pfd_index, "Failed to write the flight recorder.");
+                }
+
+                remove_ipc_client(pfd_index);
+                break;
+              }
+
+              case IPC_MSG_SUBSCRIBE:
+              {
+                if (ipc_client_data->wire_format != IPC_WIRE_V1) {
+                  send_ipc_info(pfd_index, "Status subscriptions require a newer portal-trigger.");
+                  remove_ipc_client(pfd_index);
+                  break;
+                }
+                if (msg.portal != 0) {
+                  // the snapshot and the updates only exist for the primary portal
+                  send_ipc_info(pfd_index, "Status subscriptions are only available for the primary portal.");
+                  remove_ipc_client(pfd_index);
+                  break;
+                }
+
+                log_print(LSS_IPC, LL_MESSAGE, "client %zu subscribed to status updates.", pfd_index);
+
+                // the subscriber starts with a full snapshot, afterwards it only receives changes
+                (void)refresh_status_snapshot();
+                struct IpcMessage const snapshot = {
+                    .type        = IPC_MSG_STATUS,
+                    .data.status = status_snapshot.status,
+                };
+                if (!send_ipc_message(pfd_index, &snapshot)) {
+                  remove_ipc_client(pfd_index);
+                  break;
+                }
+                ipc_client_data->subscribed        = true;
+                ipc_client_data->subscriber_status = status_snapshot.status;
+
+                ipc_client_data->log_subsystems = msg.data.subscribe.log_subsystems;
+                ipc_client_data->log_level      = msg.data.subscribe.log_level;
+                ipc_client_data->forward_logs   = (msg.data.subscribe.log_subsystems != 0);
+                update_ipc_log_level();
+                break;
+              }
+
               default:
               {
                 // Invalid message received. Print error message and kick the client
@@ -718,8 +1175,21 @@ int main(int argc, char ** argv)
                 break;
               }
               }
+
+              log_set_context(NULL);
+              break;
+            }
             }
+          }
+          else if (pfd.revents & POLLOUT) {
+            // a slow client can take messages again
+            struct IpcClientInfo * const ipc_client_data = &ipc_client_info_storage[pfd_index];
+
+            (void)ipc_queue_flush(&ipc_client_data->send_queue, pfd.fd);
+            if (ipc_client_data->subscribed) {
+              notify_subscriber(pfd_index);
             }
+            update_ipc_client_events(pfd_index);
           }
           break;
         }
@@ -739,6 +1209,11 @@ int main(int argc, char ** argv)
       total_nsecs += loop_end.tv_nsec - loop_start.tv_nsec;
     }
 
+    if (total_nsecs > longest_loop_nsecs) {
+      longest_loop_nsecs = total_nsecs;
+    }
+    metrics_observe(metric.loop_duration, total_nsecs / 1000000000.0);
+
     if (total_nsecs > 10000000UL) { // 1ms
       double       time = total_nsecs;
       char const * unit = "ns";
@@ -763,112 +1238,161 @@ int main(int argc, char ** argv)
   return EXIT_SUCCESS;
 }
 
-#define MAX_SIGNAL_RINGBUFFER_ITEMS 64
-static struct
-{
-  uint32_t       read_offset, size;
-  enum SM_Signal signals[MAX_SIGNAL_RINGBUFFER_ITEMS];
-  uint32_t       client_ids[MAX_SIGNAL_RINGBUFFER_ITEMS];
-} signal_ring_buffer = {
-    .read_offset = 0,
-    .size        = 0,
-};
-
-static bool push_signal(enum SM_Signal sig, uint32_t client_id)
+static bool send_ipc_info(size_t client_index, char const * text)
 {
-  if (signal_ring_buffer.size >= MAX_SIGNAL_RINGBUFFER_ITEMS)
-    return false;
+  struct IpcMessage msg = {
+      .type      = IPC_MSG_INFO,
+      .data.info = "",
+  };
 
-  size_t write_index                         = (signal_ring_buffer.read_offset + signal_ring_buffer.size) % MAX_SIGNAL_RINGBUFFER_ITEMS;
-  signal_ring_buffer.signals[write_index]    = sig;
-  signal_ring_buffer.client_ids[write_index] = client_id;
-  signal_ring_buffer.size += 1;
+  strncpy(msg.data.info, text, sizeof msg.data.info);
 
-  return true;
+  return send_ipc_message(client_index, &msg);
 }
 
-static bool pop_signal(enum SM_Signal * sig, uint32_t * client_id)
+static bool send_ipc_infof(size_t client_index, char const * fmt, ...)
 {
-  assert(sig != NULL);
-  assert(client_id != NULL);
-  if (signal_ring_buffer.size == 0)
-    return false;
-
-  *sig       = signal_ring_buffer.signals[signal_ring_buffer.read_offset];
-  *client_id = signal_ring_buffer.client_ids[signal_ring_buffer.read_offset];
+  struct IpcMessage msg = {
+      .type      = IPC_MSG_INFO,
+      .data.info = "",
+  };
 
-  signal_ring_buffer.size -= 1;
-  signal_ring_buffer.read_offset += 1;
-  signal_ring_buffer.read_offset %= MAX_SIGNAL_RINGBUFFER_ITEMS;
+  va_list list;
+  va_start(list, fmt);
+  vsnprintf(msg.data.info, sizeof msg.data.info, fmt, list);
+  va_end(list);
 
-  return true;
+  return send_ipc_message(client_index, &msg);
 }
 
-void state_machine_signal_handler(void * user_data, void * context, enum SM_Signal signal)
+//! Sends a message to a single client. Goes through the send queue of the client,
+//! so it stays ordered with messages that are still pending.
+static bool send_ipc_message(size_t client_index, struct IpcMessage const * msg)
 {
-  (void)user_data; // is always NULL anyways
-
-  uint32_t client_id;
-  if (context != NULL) {
-    client_id = *(uint32_t *)context;
-  }
-  else {
-    client_id = INVALID_IPC_CLIENT;
-  }
-
-  if (!push_signal(signal, client_id)) {
-    log_print(LSS_SYSTEM, LL_ERROR, "Could not handle signal from state machine: ring buffer full!");
+  struct IpcBuffer * const buffer = ipc_buffer_create(ipc_client_info_storage[client_index].wire_format, msg);
+  if (buffer == NULL) {
+    return false;
   }
+  bool const queued = send_ipc_buffer(client_index, buffer);
+  ipc_buffer_unref(buffer);
+  return queued;
 }
 
-static bool send_ipc_info(int fd, char const * text)
+static bool try_connect_mqtt()
 {
-  struct IpcMessage msg = {
-      .type      = IPC_MSG_INFO,
-      .data.info = "",
-  };
+  assert(mqtt_client != NULL);
 
-  strncpy(msg.data.info, text, sizeof msg.data.info);
+  if (!mqtt_client_connect(mqtt_client)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < portal_router.count; i++) {
+    if (!publish_portal_msg(i, PORTAL300_TOPIC_STATUS_SSH_INTERFACE, "online")) {
+      return false;
+    }
+  }
 
-  return ipc_send_msg(fd, msg);
+  if (!mqtt_client_subscribe(mqtt_client, "#")) {
+    log_print(LSS_MQTT, LL_ERROR, "failed to subscribe to topic '#' on mqtt server.");
+    return false;
+  }
+
+  return true;
 }
 
-static bool send_ipc_infof(int fd, char const * fmt, ...)
+//! Connects to MQTT, or sets up a timerfd to retry in some seconds.
+static void start_mqtt(void)
 {
-  struct IpcMessage msg = {
-      .type      = IPC_MSG_INFO,
-      .data.info = "",
-  };
+  if (try_connect_mqtt()) {
+    // we successfully connected to MQTT, set up the poll entry for MQTT action:
+    pollfds[POLLFD_MQTT] = (struct pollfd){
+        .fd      = mqtt_client_get_socket_fd(mqtt_client),
+        .events  = POLLIN,
+        .revents = 0,
+    };
+  }
+  else {
+    log_print(LSS_MQTT, LL_WARNING, "failed to connect to mqtt server, retrying in %d seconds", MQTT_RECONNECT_TIMEOUT);
 
-  va_list list;
-  va_start(list, fmt);
-  vsnprintf(msg.data.info, sizeof msg.data.info, fmt, list);
-  va_end(list);
+    // we failed to connect to MQTT, set up a timerfd to retry in some seconds
+    int timer = create_reconnect_timeout_timer(MQTT_RECONNECT_TIMEOUT);
 
-  return ipc_send_msg(fd, msg);
+    pollfds[POLLFD_MQTT] = (struct pollfd){
+        .fd      = timer,
+        .events  = POLLIN,
+        .revents = 0,
+    };
+  }
 }
 
-static bool try_connect_mqtt()
+//! Removes the ipc socket file of a daemon that didn't exit cleanly. Returns
+//! false if another daemon is still listening on it.
+static bool remove_stale_ipc_socket(void)
 {
-  assert(mqtt_client != NULL);
-
-  if (!mqtt_client_connect(mqtt_client)) {
+  int const probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (probe == -1) {
     return false;
   }
+  bool const stale = (connect(probe, (struct sockaddr const *)&ipc_socket_address, sizeof ipc_socket_address) == -1) && (errno == ECONNREFUSED);
+  close(probe);
 
-  if (!mqtt_client_publish(mqtt_client, PORTAL300_TOPIC_STATUS_SSH_INTERFACE, "online", 2)) {
-    log_print(LSS_MQTT, LL_ERROR, "failed to publish message to mqtt server.");
+  if (!stale) {
+    errno = EADDRINUSE;
     return false;
   }
 
-  if (!mqtt_client_subscribe(mqtt_client, "#")) {
-    log_print(LSS_MQTT, LL_ERROR, "failed to subscribe to topic '#' on mqtt server.");
+  log_print(LSS_IPC, LL_WARNING, "removing stale ipc socket %s", ipc_socket_address.sun_path);
+  if (unlink(ipc_socket_address.sun_path) == -1) {
+    log_perror(LSS_IPC, LL_ERROR, "failed to remove stale ipc socket");
+    errno = EADDRINUSE;
     return false;
   }
-
   return true;
 }
 
+//! Pings the watchdog, the status shows how the main loop is doing.
+static void ping_watchdog(void)
+{
+  char status[128];
+  snprintf(status,
+           sizeof status,
+           "%u ipc clients, mqtt %s, longest loop %.1f ms, %u door flaps",
+           (unsigned int)(pollfds_size - POLLFD_FIRST_IPC),
+           mqtt_client_is_connected(mqtt_client) ? "connected" : "disconnected",
+           (double)longest_loop_nsecs / 1e6,
+           (unsigned int)count_door_flaps());
+  service_watchdog_ping(status);
+  longest_loop_nsecs = 0;
+}
+
+static void open_trace_and_audit_log(void)
+{
+  // the trace is cheap enough to be always on, see trace.h
+  if (trace_open(cli.trace_path)) {
+    atexit(trace_close);
+  }
+  else {
+    log_print(LSS_SYSTEM, LL_WARNING, "trace file %s is not available, running without trace.", cli.trace_path);
+  }
+
+  if (audit_open(cli.audit_path)) {
+    atexit(audit_close);
+  }
+  else {
+    log_print(LSS_SYSTEM, LL_WARNING, "audit log %s is not available, door transactions are not recorded.", cli.audit_path);
+  }
+}
+
+static void open_status_page(void)
+{
+  if (status_page_create(cli.status_page_path)) {
+    atexit(status_page_destroy);
+  }
+  else {
+    log_print(LSS_SYSTEM, LL_WARNING, "status page %s is not available, readers have to query the daemon.", cli.status_page_path);
+  }
+}
+
 /// Sends a mqtt message.
 /// - `topic` is a NUL terminated string.
 /// - `data` is a pointer to the message payload.
@@ -879,6 +1403,7 @@ static bool send_mqtt_msg(char const * topic, char const * data)
   assert(data != NULL);
 
   log_print(LSS_SYSTEM, LL_VERBOSE, "Sending mqtt message '%s': %s", topic, data);
+  trace(MQTT_SEND, topic, data);
 
   if (!mqtt_client_is_connected(mqtt_client)) {
     log_print(LSS_MQTT, LL_ERROR, "failed to publish message to mqtt server: not connected.");
@@ -893,18 +1418,405 @@ static bool send_mqtt_msg(char const * topic, char const * data)
   return true;
 }
 
+//! Publishes `topic` of portal300.h for `portal`, below the prefix of that portal.
+static bool publish_portal_msg(size_t portal, char const * topic, char const * data)
+{
+  char absolute_topic[PORTAL_ROUTER_PREFIX_LEN + 64];
+  if (!portal_router_topic(&portal_router, (int)portal, PORTAL_TOPIC(topic), absolute_topic, sizeof absolute_topic)) {
+    log_print(LSS_MQTT, LL_ERROR, "topic '%s' is too long for portal %zu.", topic, portal);
+    return false;
+  }
+
+  if (!mqtt_client_publish(mqtt_client, absolute_topic, data, 2)) {
+    log_print(LSS_MQTT, LL_ERROR, "failed to publish message to mqtt server.");
+    return false;
+  }
+  return true;
+}
+
+static void init_portal(struct Portal * portal)
+{
+  *portal = (struct Portal){
+      .device_status = {
+          .ssh_interface   = true, // we're always online
+          .door_control_b2 = false,
+          .door_control_c2 = false,
+          .busch_interface = false,
+      },
+      .current_keyholder       = {.member_id = 0},
+      .pending_keyholder       = {.member_id = 0},
+      .pending_audit.active    = false,
+      .timer_deadline          = 0,
+      .timer_realtime_deadline = 0,
+  };
+
+  controller_init(
+      &portal->controller,
+      &(struct ControllerEnvironment){
+          .user_data    = portal,
+          .send_mqtt    = controller_send_mqtt,
+          .start_timer  = controller_start_timer,
+          .cancel_timer = controller_cancel_timer,
+          .get_time_ms  = controller_get_time_ms,
+      });
+
+  for (size_t phase = 0; phase < SM_PHASE_COUNT; phase++) {
+    if (cli.timeouts_ms[phase] != 0) {
+      controller_set_timeout(&portal->controller, (enum SM_Phase)phase, cli.timeouts_ms[phase]);
+    }
+  }
+
+  door_filter_init(&portal->door_filter, cli.door_hold_ms);
+
+  liveness_init(&portal->liveness);
+  for (int device = 0; device < DEVICE_COUNT; device++) {
+    if (cli.deadlines_set & (1U << device)) {
+      liveness_set_deadline(&portal->liveness, (enum PortalDevice)device, cli.deadlines_ms[device]);
+    }
+  }
+}
+
+//! Passes a door status message through the filter of `portal`.
+static void filter_door_status(struct Portal * portal, int door, enum DoorState state)
+{
+  struct DoorFilterDoor const * const filtered = &portal->door_filter.doors[door];
+  uint32_t const                      flaps    = filtered->flaps;
+
+  bool const waited = sm_waits_for_door(&portal->controller.state_machine, door);
+  if (door_filter_input(&portal->door_filter, door, state, waited, clock_get_ns(CLOCK_MONOTONIC) / 1000000u)) {
+    apply_door_status(portal, door, state);
+  }
+  else if (filtered->flaps != flaps) {
+    log_print_ratelimited(LSS_SYSTEM, LL_WARNING, "door %s is flapping, waiting %u ms for it to settle", sm_doors[door].name, (unsigned int)portal->door_filter.hold_ms);
+  }
+}
+
+//! Applies a door status that passed the filter to the state machine.
+static void apply_door_status(struct Portal * portal, int door, enum DoorState state)
+{
+  trace(DOOR_STATUS, (unsigned int)(portal - portals), sm_doors[door].name, (int)state);
+  controller_handle_door_status(&portal->controller, door, state);
+}
+
+//! Applies the held door status changes whose hold time is over.
+static void flush_door_filters(void)
+{
+  uint64_t const now = clock_get_ns(CLOCK_MONOTONIC) / 1000000u;
+  for (size_t i = 0; i < portal_router.count; i++) {
+    int            door;
+    enum DoorState state;
+    while (door_filter_take_due(&portals[i].door_filter, now, &door, &state)) {
+      log_print(LSS_SYSTEM, LL_VERBOSE, "door %s settled as %s", sm_doors[door].name, sm_door_state_name(state));
+      apply_door_status(&portals[i], door, state);
+    }
+  }
+}
+
+//! Returns the time until the next held door status change is due, or -1.
+static int door_filters_timeout(void)
+{
+  uint64_t const now     = clock_get_ns(CLOCK_MONOTONIC) / 1000000u;
+  int            timeout = -1;
+  for (size_t i = 0; i < portal_router.count; i++) {
+    timeout = min_timeout(timeout, door_filter_timeout(&portals[i].door_filter, now));
+  }
+  return timeout;
+}
+
+//! Returns the door status changes of all portals that came within the hold time.
+static uint32_t count_door_flaps(void)
+{
+  uint32_t flaps = 0;
+  for (size_t i = 0; i < portal_router.count; i++) {
+    for (int door = 0; door < SM_DOOR_COUNT; door++) {
+      flaps += portals[i].door_filter.doors[door].flaps;
+    }
+  }
+  return flaps;
+}
+
+static char const * const device_names[DEVICE_COUNT] = {
+    [DEVICE_SSH_INTERFACE]   = "ssh interface",
+    [DEVICE_DOOR_CONTROL_B2] = "door control b2",
+    [DEVICE_DOOR_CONTROL_C2] = "door control c2",
+    [DEVICE_BUSCH_INTERFACE] = "busch interface",
+};
+
+//! Returns the device that controls `door`.
+//! Any message of a device shows that it's alive.
+static void device_seen(struct Portal * portal, enum PortalDevice device)
+{
+  if (liveness_seen(&portal->liveness, device, clock_get_ns(CLOCK_MONOTONIC) / 1000000u)) {
+    trace(DEVICE_STATUS, device_names[device], "alive");
+    log_print(LSS_SYSTEM, LL_MESSAGE, "device '%s' is alive again", device_names[device]);
+  }
+}
+
+//! Marks the devices that missed their deadline as stale.
+static void check_liveness(void)
+{
+  uint64_t const now = clock_get_ns(CLOCK_MONOTONIC) / 1000000u;
+  for (size_t i = 0; i < portal_router.count; i++) {
+    enum PortalDevice device;
+    while (liveness_take_stale(&portals[i].liveness, now, &device)) {
+      trace(DEVICE_STATUS, device_names[device], "stale");
+      log_print(LSS_SYSTEM, LL_WARNING, "device '%s' sent nothing for %u ms, treating it as offline", device_names[device], (unsigned int)portals[i].liveness.devices[device].deadline_ms);
+      fail_stale_transaction(&portals[i]);
+    }
+  }
+}
+
+//! Fails the running transaction right away if it waits for a door whose
+//! control is stale, instead of letting the members wait for the timeout.
+static void fail_stale_transaction(struct Portal * portal)
+{
+  struct StateMachine const * const sm = &portal->controller.state_machine;
+
+  // a lock of an already locked shack completes with the status of any door,
+  // so it only fails when none of them can report
+  bool const any_door = (sm_get_phase(sm) == SM_PHASE_LOCK) && (sm_get_shack_state(sm) == SHACK_LOCKED);
+
+  int  stale_door = -1;
+  bool reachable  = false;
+  for (int door = 0; door < SM_DOOR_COUNT; door++) {
+    if (!sm_waits_for_door(sm, door))
+      continue;
+    if (!liveness_is_stale(&portal->liveness, sm_doors[door].device))
+      reachable = true;
+    else if (stale_door < 0)
+      stale_door = door;
+  }
+
+  if ((stale_door >= 0) && !(any_door && reachable)) {
+    log_print(LSS_SYSTEM, LL_WARNING, "door %s can't report its status, giving up on the running transaction", sm_doors[stale_door].name);
+    (void)controller_expire_timer(&portal->controller);
+  }
+}
+
+//! Returns the time until the next device deadline of all portals is over, or -1.
+static int liveness_timeouts(void)
+{
+  uint64_t const now     = clock_get_ns(CLOCK_MONOTONIC) / 1000000u;
+  int            timeout = -1;
+  for (size_t i = 0; i < portal_router.count; i++) {
+    timeout = min_timeout(timeout, liveness_timeout(&portals[i].liveness, now));
+  }
+  return timeout;
+}
+
+//! The controller works on topics relative to its portal.
+static bool controller_send_mqtt(void * user_data, char const * topic, char const * data)
+{
+  struct Portal const * const portal = user_data;
+
+  char absolute_topic[PORTAL_ROUTER_PREFIX_LEN + 64];
+  if (!portal_router_topic(&portal_router, (int)(portal - portals), topic, absolute_topic, sizeof absolute_topic)) {
+    log_print(LSS_MQTT, LL_ERROR, "topic '%s' is too long for portal %td.", topic, portal - portals);
+    return false;
+  }
+  return send_mqtt_msg(absolute_topic, data);
+}
+
+static void controller_start_timer(void * user_data, uint32_t ms)
+{
+  struct Portal * const portal   = user_data;
+  portal->timer_deadline          = clock_get_ns(CLOCK_MONOTONIC) + 1000000u * (uint64_t)ms;
+  portal->timer_realtime_deadline = clock_get_ms(CLOCK_REALTIME) + ms;
+  update_sm_timer();
+
+  // the timeouts adapt to the whole history of the daemon, the replay takes them from here
+  trace(SM_TIMER, (unsigned int)(portal - portals), ms);
+}
+
+static void controller_cancel_timer(void * user_data)
+{
+  struct Portal * const portal   = user_data;
+  portal->timer_deadline          = 0;
+  portal->timer_realtime_deadline = 0;
+  update_sm_timer();
+}
+
+static uint64_t controller_get_time_ms(void * user_data)
+{
+  (void)user_data;
+  return clock_get_ns(CLOCK_MONOTONIC) / 1000000u;
+}
+
+//! Runs sm_timerfd until the earliest deadline of all portals.
+static void update_sm_timer(void)
+{
+  uint64_t deadline = 0;
+  for (size_t i = 0; i < portal_router.count; i++) {
+    uint64_t const portal_deadline = portals[i].timer_deadline;
+    if ((portal_deadline != 0) && ((deadline == 0) || (portal_deadline < deadline))) {
+      deadline = portal_deadline;
+    }
+  }
+
+  if (deadline == 0) {
+    disarm_timer(sm_timerfd);
+    return;
+  }
+
+  // rounded up, the timer must never expire before the deadline
+  uint64_t const now = clock_get_ns(CLOCK_MONOTONIC);
+  arm_timer(sm_timerfd, true, (deadline > now) ? (uint32_t)((deadline - now + 999999u) / 1000000u) : 1);
+}
+
+static void save_keyholder(struct SnapshotKeyholder * saved, struct Keyholder const * keyholder)
+{
+  saved->member_id = keyholder->member_id;
+  memcpy(saved->nick_name, keyholder->nick_name, sizeof saved->nick_name);
+}
+
+static void restore_keyholder(struct Keyholder * keyholder, struct SnapshotKeyholder const * saved)
+{
+  keyholder->member_id = saved->member_id;
+  memcpy(keyholder->nick_name, saved->nick_name, sizeof keyholder->nick_name);
+}
+
+//! Stores the state of all portals in `snapshot`.
+static void build_snapshot(struct Snapshot * snapshot)
+{
+  memset(snapshot, 0, sizeof *snapshot); // the portals are compared byte by byte
+
+  snapshot->portal_count = portal_router.count;
+  for (size_t i = 0; i < portal_router.count; i++) {
+    struct Portal const * const        portal = &portals[i];
+    struct StateMachine const * const  sm     = &portal->controller.state_machine;
+    struct SnapshotPortal * const      saved  = &snapshot->portals[i];
+
+    struct PortalStatus status;
+    get_portal_status(portal, &status);
+
+    strncpy(saved->prefix, portal_router_prefix(&portal_router, (int)i), sizeof saved->prefix - 1);
+    saved->timer_deadline       = portal->timer_realtime_deadline;
+    saved->state                = (uint8_t)sm->state;
+    saved->doors_observed       = sm->doors_observed;
+    saved->doors_open           = sm->doors_open;
+    saved->doors_locked         = sm->doors_locked;
+    saved->devices_online       = (uint8_t)status.devices_online;
+    saved->pending_audit_active = portal->pending_audit.active;
+    save_keyholder(&saved->current_keyholder, &portal->current_keyholder);
+    save_keyholder(&saved->pending_keyholder, &portal->pending_keyholder);
+    if (portal->pending_audit.active) {
+      saved->pending_audit = portal->pending_audit.record;
+    }
+  }
+}
+
+//! Saves the state of all portals, the file is only written when it changed.
+static void save_snapshot(void)
+{
+  struct Snapshot snapshot;
+  build_snapshot(&snapshot);
+  (void)snapshot_save(&snapshot);
+}
+
+//! Restores the portals of the last snapshot that still exist under the same prefix.
+static void restore_snapshot(void)
+{
+  struct Snapshot snapshot;
+  if (!snapshot_load(&snapshot)) {
+    return;
+  }
+
+  uint64_t const now = clock_get_ms(CLOCK_REALTIME);
+  uint64_t const age = (now > snapshot.saved_at) ? (now - snapshot.saved_at) : 0;
+  if (age > SNAPSHOT_MAX_AGE_MS) {
+    log_print(LSS_SYSTEM, LL_MESSAGE, "snapshot is %llu s old, starting from scratch.", (unsigned long long)(age / 1000));
+    return;
+  }
+
+  apply_snapshot(&snapshot);
+}
+
+//! Continues the portals of `snapshot` that still exist under the same prefix.
+static void apply_snapshot(struct Snapshot const * snapshot)
+{
+  uint64_t const now = clock_get_ms(CLOCK_REALTIME);
+  uint64_t const age = (now > snapshot->saved_at) ? (now - snapshot->saved_at) : 0;
+
+  for (size_t i = 0; i < snapshot->portal_count; i++) {
+    struct SnapshotPortal const * const saved = &snapshot->portals[i];
+
+    char prefix[PORTAL_ROUTER_PREFIX_LEN];
+    memcpy(prefix, saved->prefix, sizeof prefix);
+    prefix[sizeof prefix - 1] = 0;
+
+    char const * suffix = NULL;
+    int const    index  = portal_router_find(&portal_router, prefix, &suffix);
+    if ((index < 0) || (*suffix != 0)) {
+      log_print(LSS_SYSTEM, LL_MESSAGE, "portal %s of the snapshot is not configured anymore, skipping it.", prefix);
+      continue;
+    }
+
+    struct Portal * const       portal = &portals[index];
+    struct StateMachine * const sm     = &portal->controller.state_machine;
+    if (!sm_restore(sm, saved->state, saved->doors_observed, saved->doors_open, saved->doors_locked)) {
+      log_print(LSS_SYSTEM, LL_WARNING, "portal %s has an inconsistent state in the snapshot, skipping it.", prefix);
+      continue;
+    }
+
+    portal->device_status = (struct DeviceStatus){
+        .ssh_interface   = true, // we're always online
+        .door_control_b2 = (saved->devices_online & (1U << DEVICE_DOOR_CONTROL_B2)) != 0,
+        .door_control_c2 = (saved->devices_online & (1U << DEVICE_DOOR_CONTROL_C2)) != 0,
+        .busch_interface = (saved->devices_online & (1U << DEVICE_BUSCH_INTERFACE)) != 0,
+    };
+    restore_keyholder(&portal->current_keyholder, &saved->current_keyholder);
+    restore_keyholder(&portal->pending_keyholder, &saved->pending_keyholder);
+    portal->pending_audit.active = (saved->pending_audit_active != 0);
+    portal->pending_audit.record = saved->pending_audit;
+
+    // a request in progress gets the rest of its time, a timeout that
+    // expired while no daemon was running fires right away.
+    uint32_t timer_ms = 0;
+    if (saved->timer_deadline != 0) {
+      uint64_t const left = (saved->timer_deadline > now) ? (saved->timer_deadline - now) : 1;
+      uint32_t const limit = controller_get_timeout(&portal->controller, (sm_get_phase(sm) != SM_NO_PHASE) ? sm_get_phase(sm) : SM_PHASE_ENTRY);
+      timer_ms             = (left < limit) ? (uint32_t)left : limit;
+      controller_start_timer(portal, timer_ms);
+    }
+
+    trace(SM_RESTORE, (char const *)prefix, sm->state, (int)sm->doors_observed, (int)sm->doors_open, (int)sm->doors_locked, timer_ms);
+    log_print(LSS_SYSTEM, LL_MESSAGE, "restored portal %s from a snapshot of %.1f s ago: shackspace is %s, state machine is in '%s'", prefix, (double)age / 1000.0, sm_shack_state_name(sm_get_shack_state(sm)), sm_state_name(sm));
+  }
+}
+
+//! Combines two poll() timeouts, -1 means none.
+static int min_timeout(int a, int b)
+{
+  if (a < 0)
+    return b;
+  if (b < 0)
+    return a;
+  return (a < b) ? a : b;
+}
+
 static bool streq(char const * a, char const * b)
 {
   return (strcmp(a, b) == 0);
 }
 
+//! Applies the online status a device (or the broker with its last will) sent.
+static void update_liveness(struct Portal * portal, enum PortalDevice device, bool online)
+{
+  if (online) {
+    device_seen(portal, device);
+  }
+  else {
+    liveness_offline(&portal->liveness, device);
+  }
+}
+
 static bool parse_system_status(char const * status)
 {
   if (streq(status, PORTAL300_STATUS_SYSTEM_ONLINE))
     return true;
   if (streq(status, PORTAL300_STATUS_SYSTEM_OFFLINE))
     return false;
-  log_print(LSS_SYSTEM, LL_WARNING, "Received invalid system status: '%s'", status);
+  log_print_ratelimited(LSS_SYSTEM, LL_WARNING, "Received invalid system status: '%s'", status);
   return false;
 }
 
@@ -914,70 +1826,70 @@ static void mqtt_handle_message(void * user_data, char const * topic, char const
   (void)user_data;
 
   log_print(LSS_SYSTEM, LL_VERBOSE, "Received mqtt message '%s': %s", topic, data);
+  trace(MQTT_RECEIVE, topic, data);
 
-  if (streq(topic, PORTAL300_TOPIC_EVENT_DOORBELL)) {
-    sm_apply_event(&global_state_machine, EVENT_DOORBELL_FRONT, NULL);
-  }
-  else if (streq(topic, PORTAL300_TOPIC_STATUS_DOOR_B2)) {
-    if (streq(data, PORTAL300_STATUS_DOOR_LOCKED))
-      sm_apply_event(&global_state_machine, EVENT_DOOR_B2_LOCKED, NULL);
-    else if (streq(data, PORTAL300_STATUS_DOOR_CLOSED))
-      sm_apply_event(&global_state_machine, EVENT_DOOR_B2_CLOSED, NULL);
-    else if (streq(data, PORTAL300_STATUS_DOOR_OPENED))
-      sm_apply_event(&global_state_machine, EVENT_DOOR_B2_OPENED, NULL);
-    else
-      log_print(LSS_SYSTEM, LL_WARNING, "door B2 status update sent invalid status: %s", data);
-  }
-  else if (streq(topic, PORTAL300_TOPIC_STATUS_DOOR_C2)) {
-    if (streq(data, PORTAL300_STATUS_DOOR_LOCKED))
-      sm_apply_event(&global_state_machine, EVENT_DOOR_C2_LOCKED, NULL);
-    else if (streq(data, PORTAL300_STATUS_DOOR_CLOSED))
-      sm_apply_event(&global_state_machine, EVENT_DOOR_C2_CLOSED, NULL);
-    else if (streq(data, PORTAL300_STATUS_DOOR_OPENED))
-      sm_apply_event(&global_state_machine, EVENT_DOOR_C2_OPENED, NULL);
-    else
-      log_print(LSS_SYSTEM, LL_WARNING, "door C2 status update sent invalid status: %s", data);
-  }
-  else if (streq(topic, PORTAL300_TOPIC_STATUS_SSH_INTERFACE)) {
-    device_status.ssh_interface = parse_system_status(data);
-    log_print(LSS_SYSTEM, LL_MESSAGE, "device 'ssh interface' is now %s", device_status.ssh_interface ? "online" : "offline");
-  }
-  else if (streq(topic, PORTAL300_TOPIC_STATUS_DOOR_CONTROL_B2)) {
-    device_status.door_control_b2 = parse_system_status(data);
-    log_print(LSS_SYSTEM, LL_MESSAGE, "device 'door control b2' is now %s", device_status.door_control_b2 ? "online" : "offline");
-  }
-  else if (streq(topic, PORTAL300_TOPIC_STATUS_DOOR_CONTROL_C2)) {
-    device_status.door_control_c2 = parse_system_status(data);
-    log_print(LSS_SYSTEM, LL_MESSAGE, "device 'door control c2' is now %s", device_status.door_control_c2 ? "online" : "offline");
-  }
-  else if (streq(topic, PORTAL300_TOPIC_STATUS_BUSCH_INTERFACE)) {
-    device_status.busch_interface = parse_system_status(data);
-    log_print(LSS_SYSTEM, LL_MESSAGE, "device 'busch interface' is now %s", device_status.busch_interface ? "online" : "offline");
-  }
-  else if (streq(topic, PORTAL300_TOPIC_EVENT_BUTTON)) {
-    if (streq(data, DOOR_NAME(DOOR_B2)))
-      sm_apply_event(&global_state_machine, EVENT_BUTTON_B2, NULL);
-    else if (streq(data, DOOR_NAME(DOOR_C2)))
-      sm_apply_event(&global_state_machine, EVENT_BUTTON_C2, NULL);
-    else
-      log_print(LSS_SYSTEM, LL_WARNING, "Received button event for unhandled door %s", data);
-  }
-  else if (streq(topic, PORTAL300_TOPIC_ACTION_OPEN_DOOR_SAFE)) {
-    // Silently ignore message
+  // we only need to manage topics of our portals
+  char const * suffix = NULL;
+  int const    index  = portal_router_find(&portal_router, topic, &suffix);
+  if (index < 0) {
+    return;
+  }
+  struct Portal * const       portal        = &portals[index];
+  struct DeviceStatus * const device_status = &portal->device_status;
+
+  int            door;
+  enum DoorState door_state;
+  if (controller_parse_door_status(suffix, data, &door, &door_state)) {
+    device_seen(portal, sm_doors[door].device);
+
+    // the door controllers repeat their status and bouncing sensors flap, the state machine only sees changes
+    if (door_state != DOOR_UNOBSERVED) {
+      filter_door_status(portal, door, door_state);
+    }
+  }
+  else if (controller_handle_mqtt(&portal->controller, suffix, data)) {
+    // buttons and the door bell go to the state machine
+    if (streq(suffix, PORTAL_TOPIC(PORTAL300_TOPIC_EVENT_DOORBELL))) {
+      device_seen(portal, DEVICE_BUSCH_INTERFACE);
+    }
+    else if (streq(suffix, PORTAL_TOPIC(PORTAL300_TOPIC_EVENT_BUTTON)) && (sm_find_door_id(data) >= 0)) {
+      device_seen(portal, sm_doors[sm_find_door_id(data)].device);
+    }
   }
-  else if (streq(topic, PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE)) {
+  else if (streq(suffix, PORTAL_TOPIC(PORTAL300_TOPIC_STATUS_SSH_INTERFACE))) {
+    device_status->ssh_interface = parse_system_status(data);
+    trace(DEVICE_STATUS, "ssh interface", data);
+    log_print(LSS_SYSTEM, LL_MESSAGE, "device 'ssh interface' is now %s", device_status->ssh_interface ? "online" : "offline");
+  }
+  else if (streq(suffix, PORTAL_TOPIC(PORTAL300_TOPIC_STATUS_DOOR_CONTROL_B2))) {
+    device_status->door_control_b2 = parse_system_status(data);
+    trace(DEVICE_STATUS, "door control b2", data);
+    update_liveness(portal, DEVICE_DOOR_CONTROL_B2, device_status->door_control_b2);
+    log_print(LSS_SYSTEM, LL_MESSAGE, "device 'door control b2' is now %s", device_status->door_control_b2 ? "online" : "offline");
+  }
+  else if (streq(suffix, PORTAL_TOPIC(PORTAL300_TOPIC_STATUS_DOOR_CONTROL_C2))) {
+    device_status->door_control_c2 = parse_system_status(data);
+    trace(DEVICE_STATUS, "door control c2", data);
+    update_liveness(portal, DEVICE_DOOR_CONTROL_C2, device_status->door_control_c2);
+    log_print(LSS_SYSTEM, LL_MESSAGE, "device 'door control c2' is now %s", device_status->door_control_c2 ? "online" : "offline");
+  }
+  else if (streq(suffix, PORTAL_TOPIC(PORTAL300_TOPIC_STATUS_BUSCH_INTERFACE))) {
+    device_status->busch_interface = parse_system_status(data);
+    trace(DEVICE_STATUS, "busch interface", data);
+    update_liveness(portal, DEVICE_BUSCH_INTERFACE, device_status->busch_interface);
+    log_print(LSS_SYSTEM, LL_MESSAGE, "device 'busch interface' is now %s", device_status->busch_interface ? "online" : "offline");
+  }
+  else if (streq(suffix, PORTAL_TOPIC(PORTAL300_TOPIC_ACTION_OPEN_DOOR_SAFE))) {
     // Silently ignore message
   }
-  else if (streq(topic, PORTAL300_TOPIC_ACTION_LOCK_DOOR)) {
+  else if (streq(suffix, PORTAL_TOPIC(PORTAL300_TOPIC_ACTION_OPEN_DOOR_UNSAFE))) {
     // Silently ignore message
   }
-  else if (strstr(topic, PORTAL300_TOPIC_PREFIX) == topic) {
-    // we only need to manage topics for portal300
-    log_print(LSS_SYSTEM, LL_WARNING, "Received data for unhandled topic '%s': %s", topic, data);
+  else if (streq(suffix, PORTAL_TOPIC(PORTAL300_TOPIC_ACTION_LOCK_DOOR))) {
+    // Silently ignore message
   }
-  else if (strstr(topic, PORTAL300_TOPIC_ACTION_RESET) == topic) {
-    log_print(LSS_SYSTEM, LL_WARNING, "Received global system reset. Shutting down!");
-    exit(1);
+  else {
+    log_print_ratelimited(LSS_SYSTEM, LL_WARNING, "Received data for unhandled topic '%s': %s", topic, data);
   }
 }
 
@@ -1001,6 +1913,38 @@ static bool install_signal_handlers()
     return false;
   }
 
+  static struct sigaction const sigusr1_action = {
+      .sa_sigaction = sigusr1_handler,
+      .sa_flags     = SA_SIGINFO | SA_RESTART,
+  };
+  if (sigaction(SIGUSR1, &sigusr1_action, NULL) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to set SIGUSR1 handler");
+    return false;
+  }
+
+  static struct sigaction const sigusr2_action = {
+      .sa_sigaction = sigusr2_handler,
+      .sa_flags     = SA_SIGINFO | SA_RESTART,
+  };
+  if (sigaction(SIGUSR2, &sigusr2_action, NULL) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to set SIGUSR2 handler");
+    return false;
+  }
+
+  // the handler restores the default action and raises the signal again,
+  // so we still get a core dump.
+  static struct sigaction const crash_action = {
+      .sa_sigaction = crash_handler,
+      .sa_flags     = SA_SIGINFO | SA_RESETHAND,
+  };
+  static int const crash_signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+  for (size_t i = 0; i < sizeof crash_signals / sizeof crash_signals[0]; i++) {
+    if (sigaction(crash_signals[i], &crash_action, NULL) == -1) {
+      log_perror(LSS_SYSTEM, LL_ERROR, "failed to set crash handler");
+      return false;
+    }
+  }
+
   return true;
 }
 
@@ -1081,7 +2025,7 @@ static bool arm_timer(int timer, bool oneshot, uint32_t ms)
   return configure_timerfd(timer, oneshot, ms);
 }
 
-static size_t add_ipc_client(int fd)
+static size_t add_ipc_client(int fd, uint32_t client_id)
 {
   if (pollfds_size >= POLLFD_LIMIT) {
     log_print(LSS_IPC, LL_WARNING, "cannot accept ipc client: too many ipc connections!");
@@ -1098,23 +2042,37 @@ static size_t add_ipc_client(int fd)
   };
 
   ipc_client_info_storage[index] = (struct IpcClientInfo){
-      .client_id        = fetch_next_client_id(),
+      .client_id        = client_id,
       .disconnect_flags = 0,
       .forward_logs     = false,
+      .log_subsystems   = ALL_LOG_SUBSYSTEMS,
+      .log_level        = LL_MESSAGE,
+      .wire_format      = IPC_WIRE_V1,
+      .subscribed       = false,
 
       .nick_name = NULL,
       .full_name = NULL,
       .member_id = -1,
+
+      .requested_action = 0,
+      .request_time     = 0,
+      .portal           = 0,
   };
+  ipc_queue_init(&ipc_client_info_storage[index].send_queue);
+
+  trace(IPC_CONNECT, ipc_client_info_storage[index].client_id, index);
 
   return index;
 }
 
-static void remove_all_ipc_clients(uint32_t disconnect_flags)
+//! Removes the clients of `portal` that wait for one of `disconnect_flags`.
+//! Clients with a queued request wait for their own transaction instead.
+static void remove_all_ipc_clients(size_t portal, uint32_t disconnect_flags)
 {
   size_t i = POLLFD_FIRST_IPC;
   while (i < pollfds_size) {
-    if (ipc_client_info_storage[i].disconnect_flags & disconnect_flags) {
+    struct IpcClientInfo const * const client = &ipc_client_info_storage[i];
+    if ((client->portal == portal) && (client->disconnect_flags & disconnect_flags) && !controller_has_request(&portals[portal].controller, client->client_id)) {
       remove_ipc_client(i);
     }
     else {
@@ -1128,6 +2086,15 @@ static void remove_ipc_client(size_t index)
   assert(index >= POLLFD_FIRST_IPC);
   assert(index < pollfds_size);
 
+  trace(IPC_DISCONNECT, ipc_client_info_storage[index].client_id, index);
+
+  // a queued request must not run for somebody who gave up on it
+  controller_cancel_requests(&portals[ipc_client_info_storage[index].portal].controller, ipc_client_info_storage[index].client_id);
+
+  // give the client a last chance to receive its pending messages
+  (void)ipc_queue_flush(&ipc_client_info_storage[index].send_queue, pollfds[index].fd);
+  ipc_queue_clear(&ipc_client_info_storage[index].send_queue);
+
   // close the socket when we remove a client connection
   if (close(pollfds[index].fd) == -1) {
     log_perror(LSS_IPC, LL_ERROR, "failed to close ipc client");
@@ -1144,6 +2111,8 @@ static void remove_ipc_client(size_t index)
   pollfds_size -= 1;
   memset(&pollfds[pollfds_size], 0xAA, sizeof(struct pollfd));
   memset(&ipc_client_info_storage[pollfds_size], 0xAA, sizeof(struct IpcClientInfo));
+
+  update_ipc_log_level();
 }
 
 static void close_ipc_sock()
@@ -1153,6 +2122,10 @@ static void close_ipc_sock()
   }
   ipc_sock = -1;
 
+  if (ipc_sock_activated) {
+    return;
+  }
+
   if (unlink(ipc_socket_address.sun_path) == -1) {
     log_perror(LSS_IPC, LL_ERROR, "failed to delete socket handle");
   }
@@ -1180,6 +2153,30 @@ static void sigterm_handler(int sig, siginfo_t * info, void * ucontext)
   shutdown_requested = 1;
 }
 
+static void sigusr1_handler(int sig, siginfo_t * info, void * ucontext)
+{
+  (void)sig;
+  (void)info;
+  (void)ucontext;
+  flight_recorder_requested = 1;
+}
+
+static void sigusr2_handler(int sig, siginfo_t * info, void * ucontext)
+{
+  (void)sig;
+  (void)info;
+  (void)ucontext;
+  upgrade_requested = 1;
+}
+
+static void crash_handler(int sig, siginfo_t * info, void * ucontext)
+{
+  (void)info;
+  (void)ucontext;
+  flight_recorder_dump_crash();
+  raise(sig);
+}
+
 static bool fetch_timer_fd(int fd)
 {
   uint64_t counter;
@@ -1194,18 +2191,32 @@ static bool fetch_timer_fd(int fd)
 static bool parse_cli(int argc, char ** argv, struct CliOptions * args)
 {
   *args = (struct CliOptions){
-      .help               = false,
-      .host_name          = "mqtt.portal.shackspace.de",
-      .port               = 8883,
-      .ca_cert_file       = NULL,
-      .client_key_file    = NULL,
-      .client_crt_file    = NULL,
-      .serial_device_name = "/dev/portal-status",
+      .help                 = false,
+      .host_name            = "mqtt.portal.shackspace.de",
+      .port                 = 8883,
+      .ca_cert_file         = NULL,
+      .client_key_file      = NULL,
+      .client_crt_file      = NULL,
+      .serial_device_name   = "/dev/portal-status",
+      .status_page_path     = STATUS_PAGE_DEFAULT_PATH,
+      .trace_path           = TRACE_DEFAULT_PATH,
+      .audit_path           = AUDIT_DEFAULT_PATH,
+      .flight_recorder_path = FLIGHT_RECORDER_DEFAULT_PATH,
+      .snapshot_path        = SNAPSHOT_DEFAULT_PATH,
+      .async_log            = false,
+      .verbose              = false,
+      .portal_prefixes      = {NULL},
+      .portal_count         = 0,
+      .timeouts_ms          = {0},
+      .door_hold_ms         = DOOR_FILTER_DEFAULT_HOLD_MS,
+      .deadlines_ms         = {0},
+      .deadlines_set        = 0,
+      .metrics_address      = NULL,
   };
 
   {
     int opt;
-    while ((opt = getopt(argc, argv, "hH:p:k:c:C:vP:")) != -1) {
+    while ((opt = getopt(argc, argv, "hH:p:k:c:C:vaP:S:T:A:R:D:x:t:d:l:M:")) != -1) {
       switch (opt) {
 
       case 'h':
@@ -1274,9 +2285,133 @@ static bool parse_cli(int argc, char ** argv, struct CliOptions * args)
         break;
       }
 
+      case 'S':
+      { // status page
+        args->status_page_path = strdup(optarg);
+        if (args->status_page_path == NULL) {
+          panic("out of memory");
+        }
+        break;
+      }
+
+      case 'R':
+      { // flight recorder dump file
+        args->flight_recorder_path = strdup(optarg);
+        if (args->flight_recorder_path == NULL) {
+          panic("out of memory");
+        }
+        break;
+      }
+
+      case 'D':
+      { // snapshot file
+        args->snapshot_path = strdup(optarg);
+        if (args->snapshot_path == NULL) {
+          panic("out of memory");
+        }
+        break;
+      }
+
+      case 'A':
+      { // audit log directory
+        args->audit_path = strdup(optarg);
+        if (args->audit_path == NULL) {
+          panic("out of memory");
+        }
+        break;
+      }
+
+      case 'T':
+      { // trace file
+        args->trace_path = strdup(optarg);
+        if (args->trace_path == NULL) {
+          panic("out of memory");
+        }
+        break;
+      }
+
+      case 'x':
+      { // portal topic prefix
+        if (args->portal_count >= PORTAL_ROUTER_MAX) {
+          fprintf(stderr, "too many portals, at most %d are supported\n", PORTAL_ROUTER_MAX);
+          return false;
+        }
+        args->portal_prefixes[args->portal_count] = optarg;
+        args->portal_count += 1;
+        break;
+      }
+
+      case 't':
+      { // phase timeout, <phase>=<ms>
+        char const * const separator = strchr(optarg, '=');
+        size_t const       name_len  = (separator != NULL) ? (size_t)(separator - optarg) : 0;
+
+        int phase = 0;
+        while ((phase < SM_PHASE_COUNT) && ((strlen(sm_phase_name(phase)) != name_len) || (strncmp(optarg, sm_phase_name(phase), name_len) != 0))) {
+          phase += 1;
+        }
+
+        errno                = 0;
+        char *        end_ptr = NULL;
+        unsigned long ms      = (separator != NULL) ? strtoul(separator + 1, &end_ptr, 10) : 0;
+        if ((phase == SM_PHASE_COUNT) || (errno != 0) || (end_ptr == separator + 1) || (*end_ptr != 0) || (ms < 1000) || (ms > 3600000)) {
+          fprintf(stderr, "invalid phase timeout: %s\n", optarg);
+          return false;
+        }
+        args->timeouts_ms[phase] = (uint32_t)ms;
+        break;
+      }
+
+      case 'd':
+      { // door status hold time
+        errno                 = 0;
+        char *        end_ptr = optarg;
+        unsigned long ms      = strtoul(optarg, &end_ptr, 10);
+        if ((errno != 0) || (end_ptr == optarg) || (*end_ptr != 0) || (ms > 60000)) {
+          fprintf(stderr, "invalid door hold time: %s\n", optarg);
+          return false;
+        }
+        args->door_hold_ms = (uint32_t)ms;
+        break;
+      }
+
+      case 'l':
+      { // device deadline, <device>=<ms>
+        char const * const separator = strchr(optarg, '=');
+        size_t const       name_len  = (separator != NULL) ? (size_t)(separator - optarg) : 0;
+
+        int device = 0;
+        while ((device < DEVICE_COUNT) && ((strlen(status_device_name(device)) != name_len) || (strncmp(optarg, status_device_name(device), name_len) != 0))) {
+          device += 1;
+        }
+
+        errno                 = 0;
+        char *        end_ptr = NULL;
+        unsigned long ms      = (separator != NULL) ? strtoul(separator + 1, &end_ptr, 10) : 0;
+        if ((device == DEVICE_COUNT) || (errno != 0) || (end_ptr == separator + 1) || (*end_ptr != 0) || ((ms != 0) && (ms < 1000)) || (ms > 3600000)) {
+          fprintf(stderr, "invalid device deadline: %s\n", optarg);
+          return false;
+        }
+        args->deadlines_ms[device] = (uint32_t)ms;
+        args->deadlines_set |= (1U << device);
+        break;
+      }
+
+      case 'M':
+      { // metrics endpoint
+        args->metrics_address = optarg;
+        break;
+      }
+
       case 'v':
       { // verbose
-        log_set_level(LSS_IPC, LL_VERBOSE);
+        args->verbose = true;
+        break;
+      }
+
+      case 'a':
+      { // async logging
+        args->async_log = true;
         break;
       }
 
@@ -1294,6 +2429,11 @@ static bool parse_cli(int argc, char ** argv, struct CliOptions * args)
     return false;
   }
 
+  if (args->portal_count == 0) {
+    args->portal_prefixes[0] = PORTAL300_TOPIC_PREFIX;
+    args->portal_count       = 1;
+  }
+
   bool params_ok = true;
 
   if (args->ca_cert_file == NULL) {
@@ -1323,7 +2463,20 @@ static bool parse_cli(int argc, char ** argv, struct CliOptions * args)
 static void print_usage(FILE * stream)
 {
   static const char usage_msg[] =
-      "portal-daemon [-h] -H <host> -C <ca certificate> -c <client certificate> -k <client key>\n"
+      "portal-daemon [-h] [-v] [-a] [-T <trace file>] [-A <audit dir>] [-R <flight recorder file>] [-D <snapshot file>] [-x <topic prefix>]... [-t <phase>=<ms>]... [-d <ms>] [-l <device>=<ms>]... [-M <address>] -H <host> -C <ca certificate> -c <client certificate> -k <client key>\n"
+      "  -x <topic prefix>  Adds a portal below <topic prefix>, which ends with '/'. The first one is the primary portal.\n"
+      "                     Default is " PORTAL300_TOPIC_PREFIX ".\n"
+      "  -t <phase>=<ms>    Sets the worst case timeout of the unlock, entry or lock phase of a transaction. The unlock and\n"
+      "                     lock timeouts adapt below it to how long the doors take. Defaults are unlock=40000,\n"
+      "                     entry=120000 and lock=60000.\n"
+      "  -d <ms>            Holds a door status change that follows the last one within <ms> until the door settled,\n"
+      "                     so flapping doors don't reach the state machine. Default is 500, 0 only drops repeated\n"
+      "                     status messages.\n"
+      "  -l <device>=<ms>   Treats <device> as offline when it sent nothing for <ms>, 0 disables the deadline. Devices are\n"
+      "                     door_control_b2 and door_control_c2 (default 30000), busch_interface and ssh_interface (no\n"
+      "                     deadline by default).\n"
+      "  -M <address>       Serves metrics for Prometheus at http://<address>/metrics. <address> is [<host>:]<port>, the\n"
+      "                     host defaults to 127.0.0.1, or the path of a Unix socket. Disabled by default.\n"
       "TODO!\n";
 
   fprintf(stream, usage_msg);
@@ -1340,9 +2493,10 @@ static uint32_t find_ipc_client_by_id(uint32_t client_id)
 }
 
 //! Stores the next valid ipc client id. All values are valid except for
-//! `INVALID_IPC_CLIENT`. Assumption made: Not more than `intMax(uint32_t)-1`
-//! clients are connected at the same time which should be possible.
-static uint32_t next_ipc_client_id = 0;
+//! `INVALID_IPC_CLIENT` and 0, which is the "no transaction" id in log contexts.
+//! Assumption made: Not more than `intMax(uint32_t)-2` clients are connected
+//! at the same time which should be possible.
+static uint32_t next_ipc_client_id = 1;
 
 static uint32_t fetch_next_client_id(void)
 {
@@ -1351,7 +2505,7 @@ static uint32_t fetch_next_client_id(void)
 _increment_id:
   next_ipc_client_id += 1;
   if (next_ipc_client_id == INVALID_IPC_CLIENT) {
-    next_ipc_client_id += 1;
+    next_ipc_client_id += 2;
   }
 
   // search through the array of all active clients.
@@ -1366,25 +2520,292 @@ _increment_id:
   return next;
 }
 
-void print_log_to_ipc_clients(void * user_data, enum LogSubSystem subsystem, enum LogLevel level, char const * msg)
+//! Passes the ipc socket, the ipc clients and the state of all portals to the
+//! new daemon of a hot upgrade and exits. Keeps running if the upgrade fails.
+static void hand_over(void)
 {
-  (void)user_data; // we don't need that
+  // a new binary that crashed or doesn't fit must not cost us the broker connection
+  if (!upgrade_accept()) {
+    return;
+  }
+
+  static struct UpgradeState state; // too large for the stack
+  memset(&state, 0, sizeof state);
+
+  state.magic            = UPGRADE_MAGIC;
+  state.version          = UPGRADE_VERSION;
+  state.size             = sizeof state;
+  state.next_client_id   = next_ipc_client_id;
+  state.listen_activated = ipc_sock_activated;
+
+  build_snapshot(&state.snapshot);
+  state.snapshot.saved_at = clock_get_ms(CLOCK_REALTIME);
+
+  for (size_t i = 0; i < portal_router.count; i++) {
+    struct Controller const * const  controller = &portals[i].controller;
+    struct UpgradeController * const saved      = &state.controllers[i];
+
+    saved->request_count = controller->request_count;
+    memcpy(saved->requests, controller->requests, controller->request_count * sizeof controller->requests[0]);
+    memcpy(saved->timeouts, controller->timeouts, sizeof saved->timeouts);
+    saved->timer_phase   = controller->timer_phase;
+    saved->timer_started = controller->timer_started;
+    saved->timer_ms      = controller->timer_ms;
+    memcpy(saved->doors, portals[i].door_filter.doors, sizeof saved->doors);
+    memcpy(saved->devices, portals[i].liveness.devices, sizeof saved->devices);
+  }
 
+  int client_fds[UPGRADE_MAX_CLIENTS];
   for (size_t i = POLLFD_FIRST_IPC; i < pollfds_size; i++) {
-    if (ipc_client_info_storage[i].forward_logs) {
-      if (subsystem == LSS_SYSTEM && level == LL_MESSAGE) {
-        send_ipc_info(pollfds[i].fd, msg);
+    struct IpcClientInfo * const client = &ipc_client_info_storage[i];
+    struct UpgradeClient * const saved  = &state.clients[state.client_count];
+
+    // the send queue stays here, give the client a last chance to receive it
+    (void)ipc_queue_flush(&client->send_queue, pollfds[i].fd);
+
+    saved->client_id         = client->client_id;
+    saved->disconnect_flags  = client->disconnect_flags;
+    saved->forward_logs      = client->forward_logs;
+    saved->log_subsystems    = client->log_subsystems;
+    saved->log_level         = client->log_level;
+    saved->wire_format       = client->wire_format;
+    saved->subscribed        = client->subscribed;
+    saved->subscriber_status = client->subscriber_status;
+    saved->member_id         = client->member_id;
+    saved->requested_action  = client->requested_action;
+    saved->request_time      = client->request_time;
+    saved->portal            = client->portal;
+    if ((client->nick_name != NULL) && (client->full_name != NULL)) {
+      saved->has_names = true;
+      strncpy(saved->nick_name, client->nick_name, sizeof saved->nick_name - 1);
+      strncpy(saved->full_name, client->full_name, sizeof saved->full_name - 1);
+    }
+
+    client_fds[state.client_count] = pollfds[i].fd;
+    state.client_count += 1;
+  }
+
+  // otherwise the broker publishes our last will after the new daemon connected
+  bool const mqtt_connected = mqtt_client_is_connected(mqtt_client);
+  if (mqtt_connected) {
+    mqtt_client_close(mqtt_client);
+  }
+
+  if (!upgrade_handover(&state, ipc_sock, client_fds)) {
+    if (mqtt_connected) {
+      start_mqtt();
+    }
+    return;
+  }
+
+  // the atexit handlers would unlink the ipc socket and the status page the
+  // new daemon uses now, so only flush what is ours.
+  snapshot_close();
+  audit_close();
+  trace_close();
+  log_stop_async();
+  log_journal_close();
+  _exit(EXIT_SUCCESS);
+}
+
+//! Takes the ipc socket, the ipc clients and the state of all portals over
+//! from the running daemon.
+static bool take_over(void)
+{
+  static struct UpgradeState state; // too large for the stack
+
+  int client_fds[UPGRADE_MAX_CLIENTS];
+  if (!upgrade_receive(&state, &ipc_sock, client_fds)) {
+    return false;
+  }
+  ipc_sock_activated = state.listen_activated;
+  pollfds[POLLFD_IPC] = (struct pollfd){
+      .fd      = ipc_sock,
+      .events  = POLLIN,
+      .revents = 0,
+  };
+
+  apply_snapshot(&state.snapshot);
+
+  for (size_t i = 0; i < state.client_count; i++) {
+    struct UpgradeClient const * const saved = &state.clients[i];
+
+    size_t const index = add_ipc_client(client_fds[i], saved->client_id);
+    if (index == INVALID_IPC_CLIENT) {
+      close(client_fds[i]);
+      continue;
+    }
+
+    struct IpcClientInfo * const client = &ipc_client_info_storage[index];
+    client->disconnect_flags            = saved->disconnect_flags;
+    client->forward_logs                = saved->forward_logs;
+    client->log_subsystems              = saved->log_subsystems;
+    client->log_level                   = (enum LogLevel)saved->log_level;
+    client->wire_format                 = (enum IpcWireFormat)saved->wire_format;
+    client->subscribed                  = saved->subscribed;
+    client->subscriber_status           = saved->subscriber_status;
+    client->member_id                   = saved->member_id;
+    client->requested_action            = (enum AuditAction)saved->requested_action;
+    client->request_time                = saved->request_time;
+    client->portal                      = (saved->portal < portal_router.count) ? saved->portal : 0;
+    if (saved->has_names) {
+      client->nick_name = strndup(saved->nick_name, IPC_MAX_NICK_LEN);
+      client->full_name = strndup(saved->full_name, IPC_MAX_NAME_LEN);
+      if ((client->nick_name == NULL) || (client->full_name == NULL)) {
+        panic("out of memory");
+      }
+    }
+  }
+  next_ipc_client_id = state.next_client_id;
+  update_ipc_log_level();
+
+  // the clients are back, so their requests can wait for the restored
+  // transactions again. the timeouts keep what they learned, but use the
+  // limits of this binary. the monotonic clock is the same for both processes.
+  for (size_t i = 0; (i < state.snapshot.portal_count) && (i < portal_router.count); i++) {
+    struct UpgradeController const * const saved      = &state.controllers[i];
+    struct Controller * const              controller = &portals[i].controller;
+
+    for (uint32_t j = 0; (j < saved->request_count) && (j < CONTROLLER_REQUEST_QUEUE_LEN); j++) {
+      if (find_ipc_client_by_id(saved->requests[j].client_id) != INVALID_IPC_CLIENT) {
+        controller->requests[controller->request_count++] = saved->requests[j];
       }
-      else {
-        send_ipc_infof(
-            pollfds[i].fd,
-            "[%s] [%s] %s",
-            log_get_level_name(level),
-            log_get_subsystem_name(subsystem),
-            msg);
+    }
+    for (size_t phase = 0; phase < SM_PHASE_COUNT; phase++) {
+      controller->timeouts[phase].samples      = saved->timeouts[phase].samples;
+      controller->timeouts[phase].mean_ms      = saved->timeouts[phase].mean_ms;
+      controller->timeouts[phase].deviation_ms = saved->timeouts[phase].deviation_ms;
+    }
+    controller->timer_phase   = (saved->timer_phase <= SM_NO_PHASE) ? (enum SM_Phase)saved->timer_phase : SM_NO_PHASE;
+    controller->timer_started = saved->timer_started;
+    controller->timer_ms      = saved->timer_ms;
+
+    // the hold time is the one of this binary
+    memcpy(portals[i].door_filter.doors, saved->doors, sizeof saved->doors);
+
+    // a device that hung right before the upgrade still misses its deadline,
+    // which is the one of this binary
+    for (int device = 0; device < DEVICE_COUNT; device++) {
+      struct LivenessDevice * const watched = &portals[i].liveness.devices[device];
+      watched->alive                        = saved->devices[device].alive;
+      watched->stale                        = saved->devices[device].stale && (watched->deadline_ms != 0);
+      watched->last_seen                    = saved->devices[device].last_seen;
+    }
+  }
+
+  // systemd has to follow us before the old daemon exits, or it stops the service
+  (void)service_notify("MAINPID=%d", (int)getpid());
+
+  if (!upgrade_confirm()) {
+    return false;
+  }
+
+  // the socket is ours now, so we remove it on exit
+  atexit(close_ipc_sock);
+
+  log_print(LSS_SYSTEM, LL_MESSAGE, "took over %u ipc clients from the previous daemon.", state.client_count);
+  return true;
+}
+
+//! Returns the door a state machine signal acts on, for log contexts.
+static char const * signal_door(enum SM_Signal signal)
+{
+  switch (signal) {
+  case SIGNAL_OPEN_DOOR_B: return DOOR_B;
+  case SIGNAL_OPEN_DOOR_C: return DOOR_C;
+  case SIGNAL_OPEN_DOOR_B2_SAFE: return DOOR_B2;
+  case SIGNAL_OPEN_DOOR_C2_SAFE: return DOOR_C2;
+  case SIGNAL_OPEN_DOOR_B2_UNSAFE: return DOOR_B2;
+  case SIGNAL_OPEN_DOOR_C2_UNSAFE: return DOOR_C2;
+  default: return NULL;
+  }
+}
+
+static bool wants_log(struct IpcClientInfo const * client, enum LogSubSystem subsystem, enum LogLevel level)
+{
+  if (!client->forward_logs)
+    return false;
+  if (level > client->log_level)
+    return false;
+  return (client->log_subsystems & (1U << subsystem)) != 0;
+}
+
+//! Lets the log backend only format messages that at least one client will receive.
+static void update_ipc_log_level(void)
+{
+  enum LogLevel level = LL_ERROR;
+  for (size_t i = POLLFD_FIRST_IPC; i < pollfds_size; i++) {
+    struct IpcClientInfo const * const client = &ipc_client_info_storage[i];
+    if (client->forward_logs && (client->log_level > level)) {
+      level = client->log_level;
+    }
+  }
+  log_set_consumer_level(&ipc_client_logger, level);
+}
+
+void print_log_to_ipc_clients(void * user_data, struct LogRecord const * record)
+{
+  (void)user_data; // we don't need that
+
+  // sending to a client might log an error, which would end up here again
+  static bool forwarding = false;
+  if (forwarding) {
+    return;
+  }
+
+  // don't format anything when nobody is interested
+  bool interested = false;
+  for (size_t i = POLLFD_FIRST_IPC; i < pollfds_size; i++) {
+    if (wants_log(&ipc_client_info_storage[i], record->subsystem, record->level)) {
+      interested = true;
+      break;
+    }
+  }
+  if (!interested) {
+    return;
+  }
+
+  forwarding = true;
+
+  // format the message once for all clients
+  struct IpcMessage log_msg = {
+      .type      = IPC_MSG_INFO,
+      .data.info = "",
+  };
+  if (record->subsystem == LSS_SYSTEM && record->level == LL_MESSAGE) {
+    strncpy(log_msg.data.info, record->msg, sizeof log_msg.data.info);
+  }
+  else {
+    snprintf(
+        log_msg.data.info,
+        sizeof log_msg.data.info,
+        "[%s] [%s] %s",
+        log_get_level_name(record->level),
+        log_get_subsystem_name(record->subsystem),
+        record->msg);
+  }
+
+  // encode it at most once per wire format and share the buffer between all clients
+  struct IpcBuffer * encoded[IPC_WIRE_V1 + 1] = {NULL};
+  for (size_t i = POLLFD_FIRST_IPC; i < pollfds_size; i++) {
+    struct IpcClientInfo const * const client = &ipc_client_info_storage[i];
+    if (!wants_log(client, record->subsystem, record->level)) {
+      continue;
+    }
+    if (encoded[client->wire_format] == NULL) {
+      encoded[client->wire_format] = ipc_buffer_create(client->wire_format, &log_msg);
+      if (encoded[client->wire_format] == NULL) {
+        continue;
       }
     }
+    send_ipc_buffer(i, encoded[client->wire_format]);
+  }
+
+  for (size_t i = 0; i < sizeof encoded / sizeof encoded[0]; i++) {
+    ipc_buffer_unref(encoded[i]);
   }
+
+  forwarding = false;
 }
 
 static void close_sm_timerfd(void)
@@ -1453,7 +2874,8 @@ static void update_api_status(void)
     return;
   }
 
-  bool const is_open = (sm_get_shack_state(&global_state_machine) == SHACK_OPEN);
+  // the status line only knows a single shack
+  bool const is_open = (sm_get_shack_state(&portals[0].controller.state_machine) == SHACK_OPEN);
 
   uint8_t const msg = is_open ? PORTAL_SIGNAL_OPEN : PORTAL_SIGNAL_CLOSED;
 
@@ -1465,3 +2887,323 @@ static void update_api_status(void)
     log_perror(LSS_API, LL_ERROR, "failed to close serial status device");
   }
 }
+
+static void get_portal_status(struct Portal const * portal, struct PortalStatus * status)
+{
+  *status = (struct PortalStatus){
+      .shack_state    = sm_get_shack_state(&portal->controller.state_machine),
+      .activity       = portal->controller.state_machine.state,
+      .door_b2        = sm_get_door_state(&portal->controller.state_machine, SM_DOOR_B2),
+      .door_c2        = sm_get_door_state(&portal->controller.state_machine, SM_DOOR_C2),
+      .mqtt_connected = mqtt_client_is_connected(mqtt_client),
+      .devices_online = 0,
+      .ipc_clients    = pollfds_size - POLLFD_FIRST_IPC,
+      .keyholder_id   = portal->current_keyholder.member_id,
+  };
+  memcpy(status->keyholder_nick, portal->current_keyholder.nick_name, sizeof status->keyholder_nick);
+  if (portal->device_status.ssh_interface)
+    status->devices_online |= (1U << DEVICE_SSH_INTERFACE);
+  if (portal->device_status.door_control_b2)
+    status->devices_online |= (1U << DEVICE_DOOR_CONTROL_B2);
+  if (portal->device_status.door_control_c2)
+    status->devices_online |= (1U << DEVICE_DOOR_CONTROL_C2);
+  if (portal->device_status.busch_interface)
+    status->devices_online |= (1U << DEVICE_BUSCH_INTERFACE);
+
+  // a device that hangs is as good as offline
+  for (int device = 0; device < DEVICE_COUNT; device++) {
+    if (liveness_is_stale(&portal->liveness, (enum PortalDevice)device))
+      status->devices_online &= ~(1U << device);
+  }
+}
+
+//! The snapshot, the status page and the subscribers show the primary portal.
+static struct PortalStatus const * refresh_status_snapshot(void)
+{
+  struct PortalStatus status;
+  get_portal_status(&portals[0], &status);
+
+  if (status_snapshot.valid && memcmp(&status, &status_snapshot.status, sizeof status) == 0) {
+    return &status_snapshot.status;
+  }
+
+  struct IpcMessage const msg = {
+      .type        = IPC_MSG_STATUS,
+      .data.status = status,
+  };
+
+  // clients that were sent the previous snapshot keep their own reference
+  ipc_buffer_unref(status_snapshot.encoded);
+
+  status_snapshot.status  = status;
+  status_snapshot.encoded = ipc_buffer_create(IPC_WIRE_V1, &msg);
+  status_snapshot.valid   = true;
+
+  status_page_publish(&status_snapshot.status);
+
+  for (size_t i = POLLFD_FIRST_IPC; i < pollfds_size; i++) {
+    if (ipc_client_info_storage[i].subscribed) {
+      notify_subscriber(i);
+    }
+  }
+
+  return &status_snapshot.status;
+}
+
+//! Sends all changes the subscriber hasn't seen yet.
+//! A slow subscriber never holds more than its send queue: When the queue is full, we
+//! wait until it drained and then send a single update containing all changes in between.
+static void notify_subscriber(size_t client_index)
+{
+  struct IpcClientInfo * const client = &ipc_client_info_storage[client_index];
+  assert(client->subscribed);
+
+  uint32_t const fields = status_diff(&client->subscriber_status, &status_snapshot.status) & SUBSCRIPTION_FIELDS;
+  if (fields == 0) {
+    update_ipc_client_events(client_index);
+    return;
+  }
+
+  struct IpcMessage const msg = {
+      .type        = IPC_MSG_STATUS_UPDATE,
+      .data.update = {
+          .fields = fields,
+          .status = status_snapshot.status,
+      },
+  };
+
+  // queued like every other message, so it can't overtake the log lines sent
+  // before it and is flushed when the client is removed. when the queue is
+  // full, we retry on POLLOUT. other errors will show up as POLLERR or EOF in
+  // the main loop and drop the client there.
+  if (send_ipc_message(client_index, &msg)) {
+    status_apply(&client->subscriber_status, &status_snapshot.status, fields);
+  }
+  update_ipc_client_events(client_index);
+}
+
+//! Only wait for POLLOUT while we actually have something to write, otherwise
+//! poll would return immediately all the time.
+static void update_ipc_client_events(size_t client_index)
+{
+  struct IpcClientInfo const * const client = &ipc_client_info_storage[client_index];
+
+  bool pending = (client->send_queue.size > 0);
+  if (client->subscribed && (status_diff(&client->subscriber_status, &status_snapshot.status) & SUBSCRIPTION_FIELDS) != 0) {
+    pending = true;
+  }
+
+  pollfds[client_index].events = POLLIN | (pending ? POLLOUT : 0);
+}
+
+//! Queues `buffer` for the client and writes as much as possible right away.
+//! Returns false if the queue is full and the message was dropped.
+static bool send_ipc_buffer(size_t client_index, struct IpcBuffer * buffer)
+{
+  struct IpcClientInfo * const client = &ipc_client_info_storage[client_index];
+
+  if (!ipc_queue_push(&client->send_queue, buffer)) {
+    // we can't log here, as this might be called from the log consumer
+    return false;
+  }
+  (void)ipc_queue_flush(&client->send_queue, pollfds[client_index].fd);
+  update_ipc_client_events(client_index);
+  return true;
+}
+
+static void send_status_text(size_t client_index, struct PortalStatus const * status)
+{
+  char text[IPC_MAX_INFOSTR_LEN];
+  status_format_text(status, text, sizeof text);
+
+  char * line = text;
+  while (*line != 0) {
+    char * const end = strchr(line, '\n');
+    if (end != NULL) {
+      *end = 0;
+    }
+    (void)send_ipc_info(client_index, line);
+    if (end == NULL) {
+      break;
+    }
+    line = end + 1;
+  }
+}
+
+//! Remembers the transaction the state machine just started for `client`.
+//! `client` is NULL when the transaction was not requested via IPC, like
+//! locking with a door button.
+static void audit_begin(struct Portal * portal, struct IpcClientInfo const * client, enum AuditAction action)
+{
+  uint64_t const now     = clock_get_ms(CLOCK_REALTIME);
+  bool const     request = (client != NULL) && (client->requested_action != 0);
+
+  portal->pending_audit.active = true;
+  portal->pending_audit.record = (struct AuditRecord){
+      .timestamp      = request ? client->request_time : now,
+      .member_id      = (client != NULL) ? client->member_id : -1,
+      .latency_ms     = 0,
+      .transaction_id = (client != NULL) ? client->client_id : 0,
+      .action         = action,
+      .outcome        = 0,
+  };
+}
+
+//! Writes the pending transaction with `outcome` to the audit log.
+static void audit_finish(struct Portal * portal, enum AuditOutcome outcome)
+{
+  if (!portal->pending_audit.active)
+    return;
+  portal->pending_audit.active = false;
+
+  uint64_t const now       = clock_get_ms(CLOCK_REALTIME);
+  uint64_t const requested = portal->pending_audit.record.timestamp;
+
+  portal->pending_audit.record.timestamp  = now;
+  portal->pending_audit.record.outcome    = outcome;
+  portal->pending_audit.record.latency_ms = (now > requested) ? (uint32_t)(now - requested) : 0;
+  (void)audit_append(&portal->pending_audit.record);
+  observe_transaction(portal->pending_audit.record.action, outcome, portal->pending_audit.record.latency_ms);
+}
+
+//! Writes a transaction that ends right away, without touching the pending one.
+static void audit_record(struct IpcClientInfo const * client, enum AuditAction action, enum AuditOutcome outcome)
+{
+  if (action == 0)
+    return;
+
+  uint64_t const now     = clock_get_ms(CLOCK_REALTIME);
+  bool const     request = (client != NULL) && (client->requested_action != 0);
+
+  struct AuditRecord const record = {
+      .timestamp      = now,
+      .member_id      = (client != NULL) ? client->member_id : -1,
+      .latency_ms     = (request && (now > client->request_time)) ? (uint32_t)(now - client->request_time) : 0,
+      .transaction_id = (client != NULL) ? client->client_id : 0,
+      .action         = action,
+      .outcome        = outcome,
+  };
+  (void)audit_append(&record);
+  observe_transaction(action, outcome, record.latency_ms);
+}
+
+//! Creates the metric families and the series of all portals.
+static void init_metrics(void)
+{
+  static double const loop_bounds[]        = {0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0};
+  static double const transaction_bounds[] = {1, 2, 5, 10, 20, 30, 60, 120, 300};
+
+  metrics_init(&metrics);
+
+  int const loop_duration  = metrics_add_family(&metrics, "portal300_loop_duration_seconds", "Time the main loop spent on the events of one poll().", METRIC_HISTOGRAM, loop_bounds, sizeof loop_bounds / sizeof loop_bounds[0]);
+  int const mqtt_connects  = metrics_add_family(&metrics, "portal300_mqtt_connects_total", "Successful connections to the MQTT broker.", METRIC_COUNTER, NULL, 0);
+  int const mqtt_drops     = metrics_add_family(&metrics, "portal300_mqtt_disconnects_total", "Connections to the MQTT broker that were closed or lost.", METRIC_COUNTER, NULL, 0);
+  int const mqtt_connected = metrics_add_family(&metrics, "portal300_mqtt_connected", "Whether the daemon is connected to the MQTT broker.", METRIC_GAUGE, NULL, 0);
+  int const mqtt_response  = metrics_add_family(&metrics, "portal300_mqtt_response_time_seconds", "Smoothed time the MQTT broker takes to acknowledge a message, sampled in whole seconds, -1 before the first.", METRIC_GAUGE, NULL, 0);
+  int const mqtt_queued    = metrics_add_family(&metrics, "portal300_mqtt_queued_publishes", "Published messages the MQTT broker didn't acknowledge yet.", METRIC_GAUGE, NULL, 0);
+  int const ipc_clients    = metrics_add_family(&metrics, "portal300_ipc_clients", "Connected IPC clients.", METRIC_GAUGE, NULL, 0);
+  int const ipc_messages   = metrics_add_family(&metrics, "portal300_ipc_messages_total", "IPC messages sent and received.", METRIC_COUNTER, NULL, 0);
+  int const ipc_bytes      = metrics_add_family(&metrics, "portal300_ipc_bytes_total", "Bytes of the IPC messages sent and received.", METRIC_COUNTER, NULL, 0);
+  int const events         = metrics_add_family(&metrics, "portal300_state_machine_events_total", "Events applied to the state machine.", METRIC_COUNTER, NULL, 0);
+  int const transitions    = metrics_add_family(&metrics, "portal300_state_machine_transitions_total", "Events that changed the state or the doors of the state machine.", METRIC_COUNTER, NULL, 0);
+  int const duplicates     = metrics_add_family(&metrics, "portal300_door_status_duplicates_total", "Repeated door status messages that were dropped.", METRIC_COUNTER, NULL, 0);
+  int const flaps          = metrics_add_family(&metrics, "portal300_door_status_flaps_total", "Door status changes that came within the hold time.", METRIC_COUNTER, NULL, 0);
+  int const devices_online = metrics_add_family(&metrics, "portal300_device_online", "Whether a device is online and not stale.", METRIC_GAUGE, NULL, 0);
+
+  metric.transactions         = metrics_add_family(&metrics, "portal300_transactions_total", "Finished door transactions.", METRIC_COUNTER, NULL, 0);
+  metric.transaction_duration = metrics_add_family(&metrics, "portal300_transaction_duration_seconds", "Time from the request to the outcome of a door transaction.", METRIC_HISTOGRAM, transaction_bounds, sizeof transaction_bounds / sizeof transaction_bounds[0]);
+
+  metric.loop_duration         = metrics_series(&metrics, loop_duration, "");
+  metric.mqtt_connects         = metrics_series(&metrics, mqtt_connects, "");
+  metric.mqtt_disconnects      = metrics_series(&metrics, mqtt_drops, "");
+  metric.mqtt_connected        = metrics_series(&metrics, mqtt_connected, "");
+  metric.mqtt_response_time    = metrics_series(&metrics, mqtt_response, "");
+  metric.mqtt_queued_publishes = metrics_series(&metrics, mqtt_queued, "");
+  metric.ipc_clients           = metrics_series(&metrics, ipc_clients, "");
+  metric.ipc_messages_sent     = metrics_series(&metrics, ipc_messages, "direction=\"sent\"");
+  metric.ipc_messages_received = metrics_series(&metrics, ipc_messages, "direction=\"received\"");
+  metric.ipc_bytes_sent        = metrics_series(&metrics, ipc_bytes, "direction=\"sent\"");
+  metric.ipc_bytes_received    = metrics_series(&metrics, ipc_bytes, "direction=\"received\"");
+
+  for (size_t i = 0; i < portal_router.count; i++) {
+    // the prefix comes from the command line and may contain anything. labels
+    // that don't fit are rejected by metrics_series() instead of truncated
+    char prefix[2 * PORTAL_ROUTER_PREFIX_LEN];
+    char labels[2 * METRICS_MAX_LABELS_LEN];
+    (void)metrics_escape_label_value(prefix, sizeof prefix, portal_router_prefix(&portal_router, (int)i));
+
+    for (int event = 0; event < SM_EVENT_COUNT; event++) {
+      snprintf(labels, sizeof labels, "portal=\"%s\",event=\"%s\"", prefix, sm_event_name(event));
+      metric.events[i][event]      = metrics_series(&metrics, events, labels);
+      metric.transitions[i][event] = metrics_series(&metrics, transitions, labels);
+    }
+    for (int door = 0; door < SM_DOOR_COUNT; door++) {
+      snprintf(labels, sizeof labels, "portal=\"%s\",door=\"%s\"", prefix, sm_doors[door].name);
+      metric.door_duplicates[i][door] = metrics_series(&metrics, duplicates, labels);
+      metric.door_flaps[i][door]      = metrics_series(&metrics, flaps, labels);
+    }
+    for (int device = 0; device < DEVICE_COUNT; device++) {
+      snprintf(labels, sizeof labels, "portal=\"%s\",device=\"%s\"", prefix, status_device_name(device));
+      metric.devices_online[i][device] = metrics_series(&metrics, devices_online, labels);
+    }
+  }
+}
+
+//! Copies the values that are counted elsewhere into the metrics.
+static void update_metrics(void)
+{
+  metrics_set(metric.mqtt_connects, mqtt_client->connects);
+  metrics_set(metric.mqtt_disconnects, mqtt_client->disconnects);
+  metrics_set(metric.mqtt_connected, mqtt_client_is_connected(mqtt_client) ? 1 : 0);
+  metrics_set(metric.mqtt_response_time, mqtt_client_get_response_time(mqtt_client));
+  metrics_set(metric.mqtt_queued_publishes, (double)mqtt_client_get_queued_publishes(mqtt_client));
+  metrics_set(metric.ipc_clients, pollfds_size - POLLFD_FIRST_IPC);
+
+  struct IpcTraffic traffic;
+  ipc_get_traffic(&traffic);
+  metrics_set(metric.ipc_messages_sent, (double)traffic.messages_sent);
+  metrics_set(metric.ipc_messages_received, (double)traffic.messages_received);
+  metrics_set(metric.ipc_bytes_sent, (double)traffic.bytes_sent);
+  metrics_set(metric.ipc_bytes_received, (double)traffic.bytes_received);
+
+  for (size_t i = 0; i < portal_router.count; i++) {
+    struct Portal const * const portal = &portals[i];
+
+    for (int event = 0; event < SM_EVENT_COUNT; event++) {
+      metrics_set(metric.events[i][event], (double)portal->controller.events[event]);
+      metrics_set(metric.transitions[i][event], (double)portal->controller.transitions[event]);
+    }
+    for (int door = 0; door < SM_DOOR_COUNT; door++) {
+      metrics_set(metric.door_duplicates[i][door], portal->door_filter.doors[door].duplicates);
+      metrics_set(metric.door_flaps[i][door], portal->door_filter.doors[door].flaps);
+    }
+
+    struct PortalStatus status;
+    get_portal_status(portal, &status);
+    for (int device = 0; device < DEVICE_COUNT; device++) {
+      metrics_set(metric.devices_online[i][device], status_device_online(&status, device) ? 1 : 0);
+    }
+  }
+}
+
+//! Counts a finished transaction as it goes to the audit log.
+static void observe_transaction(enum AuditAction action, enum AuditOutcome outcome, uint32_t latency_ms)
+{
+  char labels[METRICS_MAX_LABELS_LEN];
+
+  snprintf(labels, sizeof labels, "action=\"%s\",outcome=\"%s\"", audit_action_name(action), audit_outcome_name(outcome));
+  metrics_add(metrics_series(&metrics, metric.transactions, labels), 1);
+
+  snprintf(labels, sizeof labels, "action=\"%s\"", audit_action_name(action));
+  metrics_observe(metrics_series(&metrics, metric.transaction_duration, labels), latency_ms / 1000.0);
+}
+
+static void set_keyholder(struct Keyholder * keyholder, struct IpcClientInfo const * client)
+{
+  memset(keyholder, 0, sizeof *keyholder);
+  if (client == NULL || client->nick_name == NULL) {
+    return;
+  }
+  keyholder->member_id = client->member_id;
+  strncpy(keyholder->nick_name, client->nick_name, sizeof keyholder->nick_name);
+}
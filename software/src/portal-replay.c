@@ -0,0 +1,631 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "controller.h"
+#include "ipc.h"
+#include "log.h"
+#include "portal-router.h"
+#include "trace.h"
+
+// Replays the inputs recorded in a trace file (MQTT messages, ipc requests)
+// through the door logic of the daemon and compares the signals and MQTT
+// messages it produces with the ones recorded by the daemon. Timers run on a
+// virtual clock that follows the timestamps of the trace, so a day of traffic
+// replays in milliseconds and every run is exactly the same.
+//
+// Like the daemon, the replay runs a door logic for each portal prefix given
+// with -x, so the traces of a daemon with several portals replay as well.
+//
+// The daemon filters the door status messages against its own clock before
+// they reach the door logic, so the replay applies the door status changes the
+// daemon passed on (TRACE_DOOR_STATUS) instead of the raw messages. Traces of
+// daemons without the filter have no such records and replay the messages.
+
+#define REPLAY_QUEUE_LEN 256
+
+struct ReplayArgsCli
+{
+  bool          help;
+  bool          verbose;
+  long          repeat;         // replay all traces this many times, for benchmarking
+  long          max_mismatches; // stop printing mismatches after this many
+  char const ** paths;
+  size_t        path_count;
+  char const *  portal_prefixes[PORTAL_ROUTER_MAX];
+  size_t        portal_count;
+};
+
+struct ReplayPortal
+{
+  struct Controller controller;
+  bool              timer_armed;
+  uint64_t          timer_expires; // virtual time of the next EVENT_TIMEOUT
+};
+
+//! State of the replay of a single trace file.
+static struct
+{
+  uint64_t now;           // virtual CLOCK_REALTIME in nanoseconds
+  bool     door_filtered; // the trace has door status records
+
+  struct PortalRouter router;
+  struct ReplayPortal portals[PORTAL_ROUTER_MAX];
+
+  // outputs of the replay that were not compared to the recording yet
+  size_t           read_offset, size;
+  struct TraceArgs outputs[REPLAY_QUEUE_LEN];
+} replay;
+
+static struct
+{
+  uint64_t records;
+  uint64_t inputs;
+  uint64_t outputs;
+  uint64_t timeouts;
+  uint64_t mismatches;
+  uint64_t duration; // recorded time in nanoseconds
+} stats;
+
+static struct ReplayArgsCli cli;
+
+static void print_usage(FILE * stream);
+static bool parse_cli(int argc, char ** argv, struct ReplayArgsCli * args);
+static bool replay_file(char const * path);
+static void replay_record(struct TraceRecord const * record);
+static void advance_clock(uint64_t timestamp);
+static void run_signals(struct ReplayPortal * portal);
+static void push_output(struct TraceArgs const * output);
+static void compare_output(struct TraceRecord const * recorded);
+static void report_mismatch(uint64_t timestamp, struct TraceArgs const * replayed, struct TraceArgs const * recorded);
+static void format_args(struct TraceArgs const * args, char * buffer, size_t buffer_size);
+static void format_wall_time(uint64_t nanoseconds, char * buffer, size_t buffer_size);
+
+static bool     replay_send_mqtt(void * user_data, char const * topic, char const * data);
+static void     replay_start_timer(void * user_data, uint32_t ms);
+static void     replay_cancel_timer(void * user_data);
+static uint64_t replay_get_time_ms(void * user_data);
+
+int main(int argc, char ** argv)
+{
+  if (!log_init()) {
+    fprintf(stderr, "failed to initialize logging.\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!parse_cli(argc, argv, &cli)) {
+    return EXIT_FAILURE;
+  }
+
+  if (cli.help) {
+    print_usage(stdout);
+    return EXIT_SUCCESS;
+  }
+
+  // the door logic logs everything it does, which we only want to see when asked for
+  log_set_stderr_level(cli.verbose ? LL_VERBOSE : LL_ERROR);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (long i = 0; i < cli.repeat; i++) {
+    for (size_t j = 0; j < cli.path_count; j++) {
+      if (!replay_file(cli.paths[j])) {
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double const elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+  fprintf(stderr,
+          "replayed %llu records (%llu inputs, %llu timeouts, %llu outputs) covering %.1f hours in %.3f s, %.0f records/s\n",
+          (unsigned long long)stats.records,
+          (unsigned long long)stats.inputs,
+          (unsigned long long)stats.timeouts,
+          (unsigned long long)stats.outputs,
+          (double)stats.duration / 3.6e12,
+          elapsed,
+          (elapsed > 0) ? (double)stats.records / elapsed : 0.0);
+
+  if (stats.mismatches > 0) {
+    fprintf(stderr, "%llu outputs differ from the recording\n", (unsigned long long)stats.mismatches);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+//! Replays a single trace file. Each file holds a single run of the daemon,
+//! so every file starts with a fresh state machine.
+static bool replay_file(char const * path)
+{
+  struct TraceReader reader;
+  if (!trace_reader_open(&reader, path)) {
+    return false;
+  }
+
+  uint64_t first, end;
+  trace_reader_range(&reader, &first, &end);
+  // sequences start at 0, so `first` is the number of overwritten records
+  if (first > 0) {
+    fprintf(stderr, "%s: the trace lost %llu records since the daemon started, the replay starts in an unknown state\n", path, (unsigned long long)first);
+  }
+
+  replay.now         = 0;
+  replay.read_offset = 0;
+  replay.size        = 0;
+
+  portal_router_init(&replay.router);
+  for (size_t i = 0; i < cli.portal_count; i++) {
+    int const index = portal_router_add(&replay.router, cli.portal_prefixes[i]);
+    if (index < 0) {
+      fprintf(stderr, "invalid or duplicate portal prefix: %s\n", cli.portal_prefixes[i]);
+      trace_reader_close(&reader);
+      return false;
+    }
+
+    struct ReplayPortal * const portal = &replay.portals[index];
+    portal->timer_armed                = false;
+    controller_init(
+        &portal->controller,
+        &(struct ControllerEnvironment){
+            .user_data    = portal,
+            .send_mqtt    = replay_send_mqtt,
+            .start_timer  = replay_start_timer,
+            .cancel_timer = replay_cancel_timer,
+            .get_time_ms  = replay_get_time_ms,
+        });
+  }
+
+  replay.door_filtered = false;
+  for (uint64_t sequence = first; (sequence < end) && !replay.door_filtered; sequence++) {
+    struct TraceRecord record;
+    replay.door_filtered = trace_reader_get(&reader, sequence, &record) && (record.point == TRACE_DOOR_STATUS);
+  }
+
+  uint64_t first_timestamp = 0;
+  for (uint64_t sequence = first; sequence < end; sequence++) {
+    struct TraceRecord record;
+    if (!trace_reader_get(&reader, sequence, &record)) {
+      fprintf(stderr, "%s: record %llu is incomplete, skipping it\n", path, (unsigned long long)sequence);
+      continue;
+    }
+    if (first_timestamp == 0) {
+      first_timestamp = record.timestamp;
+    }
+    replay_record(&record);
+    stats.records += 1;
+  }
+  stats.duration += (replay.now > first_timestamp) ? (replay.now - first_timestamp) : 0;
+
+  // everything the replay did after the last recorded output
+  while (replay.size > 0) {
+    report_mismatch(replay.now, &replay.outputs[replay.read_offset], NULL);
+    replay.read_offset = (replay.read_offset + 1) % REPLAY_QUEUE_LEN;
+    replay.size -= 1;
+  }
+
+  trace_reader_close(&reader);
+  return true;
+}
+
+static void replay_record(struct TraceRecord const * record)
+{
+  advance_clock(record->timestamp);
+
+  char   args[6][TRACE_RECORD_DATA + 1];
+  size_t const arg_count = trace_record_args(record, args, 6);
+
+  switch (record->point) {
+  case TRACE_MQTT_RECEIVE:
+  {
+    char const * suffix = NULL;
+    int const    portal = (arg_count == 2) ? portal_router_find(&replay.router, args[0], &suffix) : -1;
+    int            door;
+    enum DoorState state;
+    if ((portal >= 0) && !(replay.door_filtered && controller_parse_door_status(suffix, args[1], &door, &state))) {
+      stats.inputs += 1;
+      (void)controller_handle_mqtt(&replay.portals[portal].controller, suffix, args[1]);
+      run_signals(&replay.portals[portal]);
+    }
+    break;
+  }
+
+  case TRACE_DOOR_STATUS:
+  {
+    unsigned long const portal = (arg_count == 3) ? strtoul(args[0], NULL, 10) : PORTAL_ROUTER_MAX;
+    int const           door   = (arg_count == 3) ? sm_find_door(args[1]) : -1;
+    long const          state  = (arg_count == 3) ? strtol(args[2], NULL, 10) : DOOR_UNOBSERVED;
+    if ((portal < replay.router.count) && (door >= 0) && (state > DOOR_UNOBSERVED) && (state <= DOOR_LOCKED)) {
+      stats.inputs += 1;
+      controller_handle_door_status(&replay.portals[portal].controller, door, (enum DoorState)state);
+      run_signals(&replay.portals[portal]);
+    }
+    break;
+  }
+
+  case TRACE_IPC_MESSAGE:
+  {
+    if (arg_count < 2)
+      break;
+
+    uint32_t const client_id = strtoul(args[0], NULL, 10);
+    unsigned long  type      = strtoul(args[1], NULL, 10);
+    unsigned long  portal    = (arg_count > 2) ? strtoul(args[2], NULL, 10) : 0; // traces from before multi-portal support
+    if (portal >= replay.router.count)
+      break;
+
+    // only these requests reach the state machine
+    enum SM_Event event;
+    if (type == IPC_MSG_OPEN_FRONT)
+      event = EVENT_SSH_OPEN_FRONT_REQUEST;
+    else if (type == IPC_MSG_OPEN_BACK)
+      event = EVENT_SSH_OPEN_BACK_REQUEST;
+    else if (type == IPC_MSG_CLOSE)
+      event = EVENT_SSH_CLOSE_REQUEST;
+    else
+      break;
+
+    stats.inputs += 1;
+    controller_handle_request(&replay.portals[portal].controller, event, client_id);
+    run_signals(&replay.portals[portal]);
+    break;
+  }
+
+  case TRACE_IPC_DISCONNECT:
+  {
+    if (arg_count < 1)
+      break;
+
+    // the daemon drops the queued requests of the client, of whatever portal
+    uint32_t const client_id = strtoul(args[0], NULL, 10);
+    for (size_t i = 0; i < replay.router.count; i++) {
+      controller_cancel_requests(&replay.portals[i].controller, client_id);
+    }
+    break;
+  }
+
+  case TRACE_SM_RESTORE:
+  {
+    // the daemon continued from a snapshot, so does the replay
+    char const * suffix = NULL;
+    int const    portal = (arg_count == 6) ? portal_router_find(&replay.router, args[0], &suffix) : -1;
+    if ((portal < 0) || (*suffix != 0))
+      break;
+
+    int const      state    = (int)strtol(args[1], NULL, 10);
+    uint8_t const  observed = (uint8_t)strtoul(args[2], NULL, 10);
+    uint8_t const  open     = (uint8_t)strtoul(args[3], NULL, 10);
+    uint8_t const  locked   = (uint8_t)strtoul(args[4], NULL, 10);
+    uint32_t const timer_ms = strtoul(args[5], NULL, 10);
+
+    if (sm_restore(&replay.portals[portal].controller.state_machine, state, observed, open, locked) && (timer_ms > 0)) {
+      replay_start_timer(&replay.portals[portal], timer_ms);
+    }
+    break;
+  }
+
+  case TRACE_SM_TIMER:
+  {
+    // the daemon's timeouts adapted to everything it saw, maybe long before
+    // the trace starts, so its timer wins over the one the replay started.
+    unsigned long const portal = (arg_count == 2) ? strtoul(args[0], NULL, 10) : PORTAL_ROUTER_MAX;
+    if (portal < replay.router.count) {
+      replay_start_timer(&replay.portals[portal], strtoul(args[1], NULL, 10));
+    }
+    break;
+  }
+
+  case TRACE_SM_SIGNAL:
+  case TRACE_MQTT_SEND:
+    compare_output(record);
+    break;
+
+  default:
+    break;
+  }
+}
+
+//! Moves the virtual clock to `timestamp`, expiring the timers on the way in order.
+static void advance_clock(uint64_t timestamp)
+{
+  while (true) {
+    struct ReplayPortal * next = NULL;
+    for (size_t i = 0; i < replay.router.count; i++) {
+      struct ReplayPortal * const portal = &replay.portals[i];
+      if (portal->timer_armed && (portal->timer_expires <= timestamp) && ((next == NULL) || (portal->timer_expires < next->timer_expires))) {
+        next = portal;
+      }
+    }
+    if (next == NULL)
+      break;
+
+    replay.now        = next->timer_expires;
+    next->timer_armed = false;
+    stats.timeouts += 1;
+    if (cli.verbose) {
+      fprintf(stderr, "replay: timeout of portal %s\n", portal_router_prefix(&replay.router, (int)(next - replay.portals)));
+    }
+    controller_handle_timeout(&next->controller);
+    run_signals(next);
+  }
+  if (timestamp > replay.now) {
+    replay.now = timestamp;
+  }
+}
+
+//! Does what the main loop of the daemon does with the signals of the state machine.
+static void run_signals(struct ReplayPortal * portal)
+{
+  enum SM_Signal signal;
+  uint32_t       client_id;
+  while (controller_pop_signal(&portal->controller, &signal, &client_id)) {
+    struct TraceArgs output;
+    trace_begin(&output, TRACE_SM_SIGNAL);
+    TRACE_ARGS(&output, (int)signal, client_id);
+    push_output(&output);
+
+    controller_execute_signal(&portal->controller, signal);
+  }
+}
+
+static bool replay_send_mqtt(void * user_data, char const * topic, char const * data)
+{
+  struct ReplayPortal const * const portal = user_data;
+
+  // the daemon records the topic below the prefix of the portal
+  char absolute_topic[PORTAL_ROUTER_PREFIX_LEN + 64];
+  if (!portal_router_topic(&replay.router, (int)(portal - replay.portals), topic, absolute_topic, sizeof absolute_topic)) {
+    return false;
+  }
+
+  struct TraceArgs output;
+  trace_begin(&output, TRACE_MQTT_SEND);
+  TRACE_ARGS(&output, (char const *)absolute_topic, data);
+  push_output(&output);
+  return true;
+}
+
+static void replay_start_timer(void * user_data, uint32_t ms)
+{
+  struct ReplayPortal * const portal = user_data;
+  portal->timer_armed                = true;
+  portal->timer_expires              = replay.now + 1000000u * (uint64_t)ms;
+}
+
+static void replay_cancel_timer(void * user_data)
+{
+  struct ReplayPortal * const portal = user_data;
+  portal->timer_armed                = false;
+}
+
+static uint64_t replay_get_time_ms(void * user_data)
+{
+  (void)user_data;
+  return replay.now / 1000000u;
+}
+
+//! Queues an output of the replay until the daemon's recorded output shows up.
+//! Outputs are encoded like the trace() calls of the daemon, so they compare byte by byte.
+static void push_output(struct TraceArgs const * output)
+{
+  stats.outputs += 1;
+
+  if (cli.verbose) {
+    char text[512];
+    format_args(output, text, sizeof text);
+    fprintf(stderr, "replay: %s\n", text);
+  }
+
+  if (replay.size >= REPLAY_QUEUE_LEN) {
+    // the recording is far behind, this can't match anymore
+    report_mismatch(replay.now, output, NULL);
+    return;
+  }
+  replay.outputs[(replay.read_offset + replay.size) % REPLAY_QUEUE_LEN] = *output;
+  replay.size += 1;
+}
+
+static void compare_output(struct TraceRecord const * recorded)
+{
+  struct TraceArgs expected = {
+      .point     = recorded->point,
+      .arg_count = recorded->arg_count,
+      .length    = recorded->length,
+  };
+  memcpy(expected.data, recorded->data, recorded->length);
+
+  if (replay.size == 0) {
+    report_mismatch(recorded->timestamp, NULL, &expected);
+    return;
+  }
+
+  struct TraceArgs const * const replayed = &replay.outputs[replay.read_offset];
+  replay.read_offset                      = (replay.read_offset + 1) % REPLAY_QUEUE_LEN;
+  replay.size -= 1;
+
+  bool const equal = (replayed->point == expected.point) && (replayed->length == expected.length) && (memcmp(replayed->data, expected.data, expected.length) == 0);
+  if (!equal) {
+    report_mismatch(recorded->timestamp, replayed, &expected);
+  }
+}
+
+static void report_mismatch(uint64_t timestamp, struct TraceArgs const * replayed, struct TraceArgs const * recorded)
+{
+  stats.mismatches += 1;
+  if (stats.mismatches > (uint64_t)cli.max_mismatches) {
+    return;
+  }
+
+  char time[48];
+  format_wall_time(timestamp, time, sizeof time);
+
+  char replayed_text[512] = "nothing";
+  char recorded_text[512] = "nothing";
+  if (replayed != NULL) {
+    format_args(replayed, replayed_text, sizeof replayed_text);
+  }
+  if (recorded != NULL) {
+    format_args(recorded, recorded_text, sizeof recorded_text);
+  }
+
+  fprintf(stdout, "%s mismatch: recorded %s, replayed %s\n", time, recorded_text, replayed_text);
+  if (stats.mismatches == (uint64_t)cli.max_mismatches) {
+    fprintf(stdout, "not printing more mismatches\n");
+  }
+}
+
+static void format_args(struct TraceArgs const * args, char * buffer, size_t buffer_size)
+{
+  struct TraceRecord record = {
+      .timestamp = 0,
+      .point     = args->point,
+      .arg_count = args->arg_count,
+      .length    = args->length,
+  };
+  memcpy(record.data, args->data, args->length);
+
+  char message[384];
+  trace_format_record(&record, message, sizeof message);
+  snprintf(buffer, buffer_size, "'%s'", message);
+}
+
+static void format_wall_time(uint64_t nanoseconds, char * buffer, size_t buffer_size)
+{
+  time_t const  seconds = (time_t)(nanoseconds / 1000000000u);
+  unsigned long micros  = (unsigned long)((nanoseconds % 1000000000u) / 1000u);
+
+  struct tm local;
+  char      timestamp[32];
+  strftime(timestamp, sizeof timestamp, "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &local));
+  snprintf(buffer, buffer_size, "%s.%06lu", timestamp, micros);
+}
+
+static bool parse_cli(int argc, char ** argv, struct ReplayArgsCli * args)
+{
+  *args = (struct ReplayArgsCli){
+      .help            = false,
+      .verbose         = false,
+      .repeat          = 1,
+      .max_mismatches  = 20,
+      .paths           = NULL,
+      .path_count      = 0,
+      .portal_prefixes = {NULL},
+      .portal_count    = 0,
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "hvn:m:x:")) != -1) {
+    switch (opt) {
+    case 'h':
+    {
+      args->help = true;
+      return true;
+    }
+
+    case 'v':
+    {
+      args->verbose = true;
+      break;
+    }
+
+    case 'n':
+    {
+      errno          = 0;
+      char * end_ptr = optarg;
+      args->repeat   = strtol(optarg, &end_ptr, 10);
+      if ((errno != 0) || (end_ptr != (optarg + strlen(optarg))) || (args->repeat <= 0)) {
+        fprintf(stderr, "invalid repeat count: %s\n", optarg);
+        return false;
+      }
+      break;
+    }
+
+    case 'm':
+    {
+      errno                = 0;
+      char * end_ptr       = optarg;
+      args->max_mismatches = strtol(optarg, &end_ptr, 10);
+      if ((errno != 0) || (end_ptr != (optarg + strlen(optarg))) || (args->max_mismatches < 0)) {
+        fprintf(stderr, "invalid mismatch count: %s\n", optarg);
+        return false;
+      }
+      break;
+    }
+
+    case 'x':
+    {
+      if (args->portal_count >= PORTAL_ROUTER_MAX) {
+        fprintf(stderr, "too many portals, at most %d are supported\n", PORTAL_ROUTER_MAX);
+        return false;
+      }
+      args->portal_prefixes[args->portal_count] = optarg;
+      args->portal_count += 1;
+      break;
+    }
+
+    default:
+    {
+      // unknown argument, error message is already printed by getopt
+      return false;
+    }
+    }
+  }
+
+  if (optind == argc) {
+    print_usage(stderr);
+    return false;
+  }
+
+  if (args->portal_count == 0) {
+    args->portal_prefixes[0] = PORTAL300_TOPIC_PREFIX;
+    args->portal_count       = 1;
+  }
+
+  args->paths      = (char const **)&argv[optind];
+  args->path_count = (size_t)(argc - optind);
+
+  return true;
+}
+
+static void print_usage(FILE * stream)
+{
+  static const char usage_msg[] =
+      "portal-replay [-h] [-v] [-n <count>] [-m <count>] [-x <topic prefix>]... <trace file>..."
+      "\n"
+      "Replays the MQTT messages and requests of portal-daemon traces through the door logic"
+      "\n"
+      "and compares the resulting signals and MQTT messages with the recorded ones."
+      "\n"
+      "Pass the traces oldest first, like " TRACE_DEFAULT_PATH ".1 " TRACE_DEFAULT_PATH "."
+      "\n"
+      ""
+      "\n"
+      "Options:"
+      "\n"
+      "  -h         Print this help text."
+      "\n"
+      "  -v         Print the log of the door logic and every replayed output."
+      "\n"
+      "  -n <count> Replay the traces <count> times, for benchmarking."
+      "\n"
+      "  -m <count> Print at most <count> mismatches. Default is 20."
+      "\n"
+      "  -x <topic prefix>"
+      "\n"
+      "             Replays a portal below <topic prefix>, like the daemon. Pass the same ones in the"
+      "\n"
+      "             same order as the daemon. Default is " PORTAL300_TOPIC_PREFIX "."
+      "\n"
+      "\n"
+      "Exits with 1 if the replay differs from the recording."
+      "\n";
+
+  fprintf(stream, usage_msg);
+}
@@ -0,0 +1,114 @@
+#include "portal-router.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+_Static_assert((PORTAL_ROUTER_SLOTS & (PORTAL_ROUTER_SLOTS - 1)) == 0, "PORTAL_ROUTER_SLOTS must be a power of two");
+_Static_assert(PORTAL_ROUTER_SLOTS >= 2 * PORTAL_ROUTER_MAX, "the router table needs free slots");
+
+#define FNV_OFFSET 2166136261U
+#define FNV_PRIME  16777619U
+
+static uint32_t hash_step(uint32_t hash, char c)
+{
+  return (hash ^ (uint8_t)c) * FNV_PRIME;
+}
+
+static uint32_t hash_string(char const * str, size_t length)
+{
+  uint32_t hash = FNV_OFFSET;
+  for (size_t i = 0; i < length; i++) {
+    hash = hash_step(hash, str[i]);
+  }
+  return hash;
+}
+
+//! Returns the portal with `prefix`, or -1.
+static int lookup(struct PortalRouter const * router, char const * prefix, size_t length, uint32_t hash)
+{
+  for (size_t probe = 0; probe < PORTAL_ROUTER_SLOTS; probe++) {
+    uint8_t const slot = router->slots[(hash + probe) & (PORTAL_ROUTER_SLOTS - 1)];
+    if (slot == 0)
+      return -1;
+
+    int const portal = slot - 1;
+    if ((router->prefix_hashes[portal] == hash) && (router->prefix_lengths[portal] == length) && (memcmp(router->prefixes[portal], prefix, length) == 0))
+      return portal;
+  }
+  return -1;
+}
+
+void portal_router_init(struct PortalRouter * router)
+{
+  assert(router != NULL);
+  memset(router, 0, sizeof *router);
+}
+
+int portal_router_add(struct PortalRouter * router, char const * prefix)
+{
+  assert(router != NULL);
+  assert(prefix != NULL);
+
+  size_t const length = strlen(prefix);
+  if ((length == 0) || (length >= PORTAL_ROUTER_PREFIX_LEN) || (prefix[length - 1] != '/'))
+    return -1;
+  if (router->count >= PORTAL_ROUTER_MAX)
+    return -1;
+
+  uint32_t const hash = hash_string(prefix, length);
+  if (lookup(router, prefix, length, hash) >= 0)
+    return -1;
+
+  int const portal = (int)router->count;
+  memcpy(router->prefixes[portal], prefix, length + 1);
+  router->prefix_lengths[portal] = length;
+  router->prefix_hashes[portal]  = hash;
+  router->count += 1;
+
+  size_t slot = hash & (PORTAL_ROUTER_SLOTS - 1);
+  while (router->slots[slot] != 0) {
+    slot = (slot + 1) & (PORTAL_ROUTER_SLOTS - 1);
+  }
+  router->slots[slot] = (uint8_t)(portal + 1);
+
+  return portal;
+}
+
+int portal_router_find(struct PortalRouter const * router, char const * topic, char const ** suffix)
+{
+  assert(router != NULL);
+  assert(topic != NULL);
+
+  // every prefix ends with '/', so only the positions after a '/' can end one.
+  // the hash of the topic start is extended char by char on the way.
+  int      found = -1;
+  uint32_t hash  = FNV_OFFSET;
+  for (size_t i = 0; topic[i] != 0; i++) {
+    hash = hash_step(hash, topic[i]);
+    if (topic[i] != '/')
+      continue;
+
+    int const portal = lookup(router, topic, i + 1, hash);
+    if (portal >= 0) {
+      found = portal;
+      if (suffix != NULL) {
+        *suffix = topic + i + 1;
+      }
+    }
+  }
+  return found;
+}
+
+char const * portal_router_prefix(struct PortalRouter const * router, int portal)
+{
+  assert(router != NULL);
+  assert((portal >= 0) && ((size_t)portal < router->count));
+  return router->prefixes[portal];
+}
+
+bool portal_router_topic(struct PortalRouter const * router, int portal, char const * suffix, char * buffer, size_t buffer_size)
+{
+  int const length = snprintf(buffer, buffer_size, "%s%s", portal_router_prefix(router, portal), suffix);
+  return (length >= 0) && ((size_t)length < buffer_size);
+}
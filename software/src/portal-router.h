@@ -0,0 +1,53 @@
+#ifndef PORTAL300_PORTAL_ROUTER_H
+#define PORTAL300_PORTAL_ROUTER_H
+
+#include <portal300.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maps MQTT topics to the portal they belong to. Every portal is a set of
+// doors and devices below its own topic prefix, like "shackspace/portal/".
+// Controllers work on topics relative to their prefix, PORTAL_TOPIC() turns
+// the topics of portal300.h into those.
+//
+// A lookup hashes the topic once and probes a small table at each '/', so it
+// doesn't depend on the number of portals.
+
+#define PORTAL_ROUTER_MAX        16
+#define PORTAL_ROUTER_SLOTS      64 // power of two, at least twice PORTAL_ROUTER_MAX
+#define PORTAL_ROUTER_PREFIX_LEN 128
+
+//! `_Topic` of portal300.h relative to PORTAL300_TOPIC_PREFIX.
+#define PORTAL_TOPIC(_Topic) ((char const *)(_Topic) + sizeof(PORTAL300_TOPIC_PREFIX) - 1)
+
+struct PortalRouter
+{
+  size_t   count;
+  char     prefixes[PORTAL_ROUTER_MAX][PORTAL_ROUTER_PREFIX_LEN];
+  size_t   prefix_lengths[PORTAL_ROUTER_MAX];
+  uint32_t prefix_hashes[PORTAL_ROUTER_MAX];
+
+  //! Index of a portal plus one, 0 for an empty slot. Open addressing with linear probing.
+  uint8_t slots[PORTAL_ROUTER_SLOTS];
+};
+
+void portal_router_init(struct PortalRouter * router);
+
+//! Adds a portal for `prefix`, which must end with '/'. Returns the index of
+//! the new portal or -1 if the prefix is invalid, already known or the router
+//! is full.
+int portal_router_add(struct PortalRouter * router, char const * prefix);
+
+//! Returns the portal `topic` belongs to and stores the rest of the topic
+//! in `suffix`, or returns -1. The longest matching prefix wins.
+int portal_router_find(struct PortalRouter const * router, char const * topic, char const ** suffix);
+
+char const * portal_router_prefix(struct PortalRouter const * router, int portal);
+
+//! Writes the absolute topic for `suffix` of `portal` into `buffer`.
+//! Returns false if the buffer is too small.
+bool portal_router_topic(struct PortalRouter const * router, int portal, char const * suffix, char * buffer, size_t buffer_size);
+
+#endif // PORTAL300_PORTAL_ROUTER_H
@@ -0,0 +1,294 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flight-recorder.h"
+#include "log.h"
+#include "state-machine.h"
+#include "trace.h"
+
+struct TraceArgsCli
+{
+  bool         help;
+  bool         follow;
+  char const * path;
+  char const * flight_recorder_path; // print this flight recorder dump instead of the trace
+  long         count;                // only print the last `count` records, 0 for all
+};
+
+static void print_usage(FILE * stream);
+static bool parse_cli(int argc, char ** argv, struct TraceArgsCli * args);
+static void print_record(struct TraceRecord const * record);
+static void format_wall_time(uint64_t nanoseconds, char * buffer, size_t buffer_size);
+static int  print_flight_recorder(char const * path, long count);
+
+int main(int argc, char ** argv)
+{
+  if (!log_init()) {
+    fprintf(stderr, "failed to initialize logging.\n");
+    return EXIT_FAILURE;
+  }
+
+  struct TraceArgsCli cli;
+  if (!parse_cli(argc, argv, &cli)) {
+    return EXIT_FAILURE;
+  }
+
+  if (cli.help) {
+    print_usage(stdout);
+    return EXIT_SUCCESS;
+  }
+
+  if (cli.flight_recorder_path != NULL) {
+    return print_flight_recorder(cli.flight_recorder_path, cli.count);
+  }
+
+  struct TraceReader reader;
+  if (!trace_reader_open(&reader, cli.path)) {
+    return EXIT_FAILURE;
+  }
+
+  uint64_t first, end;
+  trace_reader_range(&reader, &first, &end);
+  if ((cli.count > 0) && (end - first > (uint64_t)cli.count)) {
+    first = end - (uint64_t)cli.count;
+  }
+
+  uint64_t skipped = 0;
+  while (true) {
+    for (uint64_t sequence = first; sequence < end; sequence++) {
+      struct TraceRecord record;
+      if (trace_reader_get(&reader, sequence, &record)) {
+        print_record(&record);
+      }
+      else {
+        skipped += 1;
+      }
+    }
+    fflush(stdout);
+
+    if (!cli.follow)
+      break;
+
+    usleep(100 * 1000);
+
+    uint64_t oldest;
+    first = end;
+    trace_reader_range(&reader, &oldest, &end);
+    if (oldest > first) {
+      // the writer lapped us
+      skipped += oldest - first;
+      first = oldest;
+    }
+  }
+
+  trace_reader_close(&reader);
+
+  if (skipped > 0) {
+    fprintf(stderr, "%llu records were overwritten while reading.\n", (unsigned long long)skipped);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static void print_record(struct TraceRecord const * record)
+{
+  char timestamp[48];
+  format_wall_time(record->timestamp, timestamp, sizeof timestamp);
+
+  char message[512];
+  trace_format_record(record, message, sizeof message);
+
+  fprintf(stdout, "%s %-14s %s\n", timestamp, trace_point_name(record->point), message);
+}
+
+static void format_wall_time(uint64_t nanoseconds, char * buffer, size_t buffer_size)
+{
+  time_t const  seconds = (time_t)(nanoseconds / 1000000000u);
+  unsigned long micros  = (unsigned long)((nanoseconds % 1000000000u) / 1000u);
+
+  struct tm local;
+  char      timestamp[32];
+  strftime(timestamp, sizeof timestamp, "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &local));
+  snprintf(buffer, buffer_size, "%s.%06lu", timestamp, micros);
+}
+
+static int print_flight_recorder(char const * path, long count)
+{
+  FILE * const file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  struct FlightRecorderDump header;
+  if (fread(&header, sizeof header, 1, file) != 1) {
+    fprintf(stderr, "%s is too short for a flight recorder dump\n", path);
+    fclose(file);
+    return EXIT_FAILURE;
+  }
+  if ((header.magic != FLIGHT_RECORDER_MAGIC) || (header.version != FLIGHT_RECORDER_VERSION) || (header.record_size != sizeof(struct FlightRecord))) {
+    fprintf(stderr, "%s is not a flight recorder dump of this version\n", path);
+    fclose(file);
+    return EXIT_FAILURE;
+  }
+
+  if (header.total > header.count) {
+    fprintf(stdout, "%llu older records were overwritten\n", (unsigned long long)(header.total - header.count));
+  }
+
+  uint32_t skip = 0;
+  if ((count > 0) && (header.count > (uint64_t)count)) {
+    skip = header.count - (uint32_t)count;
+  }
+
+  for (uint32_t i = 0; i < header.count; i++) {
+    struct FlightRecord record;
+    if (fread(&record, sizeof record, 1, file) != 1) {
+      fprintf(stderr, "%s is truncated after %u records\n", path, i);
+      break;
+    }
+    if (i < skip)
+      continue;
+
+    // records carry monotonic time, the dump tells us where that was on the wall clock
+    char timestamp[48];
+    format_wall_time(header.real_time - (header.monotonic_time - record.timestamp), timestamp, sizeof timestamp);
+
+    switch (record.kind) {
+    case FLIGHT_EVENT:
+    {
+      char label[64];
+      fprintf(stdout, "%s EVENT      %s in state '%s'\n", timestamp, sm_event_label(label, sizeof label, record.code, record.door), sm_state_name_by_id(record.state_before));
+      break;
+    }
+
+    case FLIGHT_SIGNAL:
+      fprintf(stdout, "%s SIGNAL     %s\n", timestamp, sm_signal_name(record.code));
+      break;
+
+    case FLIGHT_TRANSITION:
+      fprintf(stdout,
+              "%s TRANSITION state '%s' -> '%s'",
+              timestamp,
+              sm_state_name_by_id(record.state_before),
+              sm_state_name_by_id(record.state_after));
+      for (int door = 0; door < SM_DOOR_COUNT; door++) {
+        fprintf(stdout,
+                ", %s %s -> %s",
+                sm_doors[door].name,
+                sm_door_state_name((record.doors_before >> (2 * door)) & 0x03),
+                sm_door_state_name((record.doors_after >> (2 * door)) & 0x03));
+      }
+      fprintf(stdout, "\n");
+      break;
+
+    default:
+      fprintf(stdout, "%s <<INVALID RECORD KIND %u>>\n", timestamp, record.kind);
+      break;
+    }
+  }
+
+  fclose(file);
+  return EXIT_SUCCESS;
+}
+
+static bool parse_cli(int argc, char ** argv, struct TraceArgsCli * args)
+{
+  *args = (struct TraceArgsCli){
+      .help                 = false,
+      .follow               = false,
+      .path                 = TRACE_DEFAULT_PATH,
+      .flight_recorder_path = NULL,
+      .count                = 0,
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "hFf:r:n:")) != -1) {
+    switch (opt) {
+    case 'h':
+    {
+      args->help = true;
+      return true;
+    }
+
+    case 'F':
+    {
+      args->follow = true;
+      break;
+    }
+
+    case 'f':
+    {
+      args->path = optarg;
+      break;
+    }
+
+    case 'r':
+    {
+      args->flight_recorder_path = optarg;
+      break;
+    }
+
+    case 'n':
+    {
+      errno          = 0;
+      char * end_ptr = optarg;
+      args->count    = strtol(optarg, &end_ptr, 10);
+      if ((errno != 0) || (end_ptr != (optarg + strlen(optarg))) || (args->count <= 0)) {
+        fprintf(stderr, "invalid record count: %s\n", optarg);
+        return false;
+      }
+      break;
+    }
+
+    default:
+    {
+      // unknown argument, error message is already printed by getopt
+      return false;
+    }
+    }
+  }
+
+  if (optind != argc) {
+    print_usage(stderr);
+    return false;
+  }
+
+  if (args->follow && (args->flight_recorder_path != NULL)) {
+    fprintf(stderr, "-F can't be used with -r\n");
+    return false;
+  }
+
+  return true;
+}
+
+static void print_usage(FILE * stream)
+{
+  static const char usage_msg[] =
+      "portal-trace [-h] [-F] [-f <file>] [-r <file>] [-n <count>]"
+      "\n"
+      "Prints the binary trace or a flight recorder dump of the portal-daemon as text."
+      "\n"
+      ""
+      "\n"
+      "Options:"
+      "\n"
+      "  -h         Print this help text."
+      "\n"
+      "  -F         Keep printing new records until interrupted."
+      "\n"
+      "  -f <file>  The trace file to read. Default is " TRACE_DEFAULT_PATH "."
+      "\n"
+      "  -r <file>  Print the flight recorder dump <file> instead of the trace."
+      "\n"
+      "  -n <count> Only print the last <count> records."
+      "\n";
+
+  fprintf(stream, usage_msg);
+}
@@ -8,37 +8,63 @@
 #include <sys/un.h>
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
 
+#include "audit.h"
 #include "ipc.h"
 #include "log.h"
+#include "state-machine.h"
+#include "status.h"
+#include "status-page.h"
+
+#define HISTORY_DEFAULT_COUNT 20
 
 static void print_usage(FILE * stream);
 static void panic(char const * msg);
+static void print_status(struct PortalStatus const * status, bool json);
+static void print_status_update(struct PortalStatus const * status, uint32_t fields, bool json);
 
 enum PortalAction
 {
-  PA_OPEN_FRONT    = 1,
-  PA_OPEN_BACK     = 2,
-  PA_CLOSE         = 3,
-  PA_SHUTDOWN      = 4,
-  PA_STATUS        = 5,
-  PA_SIMPLE_STATUS = 6,
-  PA_SYSTEM_RESET  = 7,
-  PA_FORCE_OPEN    = 8,
+  PA_OPEN_FRONT      = 1,
+  PA_OPEN_BACK       = 2,
+  PA_CLOSE           = 3,
+  PA_SHUTDOWN        = 4,
+  PA_STATUS          = 5,
+  PA_SIMPLE_STATUS   = 6,
+  PA_SYSTEM_RESET    = 7,
+  PA_FORCE_OPEN      = 8,
+  PA_WATCH           = 9,
+  PA_HISTORY         = 10,
+  PA_FLIGHT_RECORDER = 11,
 };
 
 struct PortalArgs
 {
   bool              help;
+  bool              json;
+  bool              shm;
+  uint32_t          log_subsystems; // bit mask of (1 << enum LogSubSystem), 0 if no logs are requested
+  enum LogLevel     log_level;
+  uint32_t          history_actions; // bit mask of (1 << enum AuditAction), 0 for all
+  size_t            history_count;
+  bool              own_history; // history is limited to `member_id`
+  char const *      audit_path;       // NULL for AUDIT_DEFAULT_PATH
+  char const *      status_page_path; // NULL for STATUS_PAGE_DEFAULT_PATH
   int               member_id;
   char const *      member_nick;
   char const *      member_name;
+  uint8_t           portal; // index of the portal in the daemon, 0 is the primary one
   enum PortalAction action;
 };
 
 static bool parse_cli(int argc, char ** argv, struct PortalArgs * args);
+static bool parse_subsystem_list(char const * list, uint32_t * subsystems);
+static bool parse_action_list(char const * list, uint32_t * actions);
 
 static int connecToDaemon(void);
+static int read_status_page(char const * path, enum PortalAction action, bool json);
+static int print_history(struct PortalArgs const * args);
 
 static int  ipc_socket = -1;
 static void close_ipc_socket(void);
@@ -59,6 +85,14 @@ int main(int argc, char ** argv)
     return EXIT_SUCCESS;
   }
 
+  if (cli.shm) {
+    return read_status_page((cli.status_page_path != NULL) ? cli.status_page_path : STATUS_PAGE_DEFAULT_PATH, cli.action, cli.json);
+  }
+
+  if (cli.action == PA_HISTORY) {
+    return print_history(&cli);
+  }
+
   ipc_socket = connecToDaemon();
   if (ipc_socket == -1) {
     return EXIT_FAILURE;
@@ -77,6 +111,7 @@ int main(int argc, char ** argv)
   {
     struct IpcMessage msg = {
         .type                = (cli.action == PA_OPEN_FRONT) ? IPC_MSG_OPEN_FRONT : IPC_MSG_OPEN_BACK,
+        .portal              = cli.portal,
         .data.open.member_id = cli.member_id,
     };
     strncpy(msg.data.open.member_name, cli.member_name, IPC_MAX_NAME_LEN);
@@ -90,7 +125,8 @@ int main(int argc, char ** argv)
   case PA_CLOSE:
   {
     bool const ok = ipc_send_msg(ipc_socket, (struct IpcMessage){
-                                                 .type = IPC_MSG_CLOSE,
+                                                 .type   = IPC_MSG_CLOSE,
+                                                 .portal = cli.portal,
                                              });
     if (!ok) {
       return EXIT_FAILURE;
@@ -110,7 +146,8 @@ int main(int argc, char ** argv)
   case PA_STATUS:
   {
     bool const ok = ipc_send_msg(ipc_socket, (struct IpcMessage){
-                                                 .type = IPC_MSG_QUERY_STATUS,
+                                                 .type   = IPC_MSG_QUERY_STATUS,
+                                                 .portal = cli.portal,
                                              });
     if (!ok) {
       return EXIT_FAILURE;
@@ -120,7 +157,8 @@ int main(int argc, char ** argv)
   case PA_SIMPLE_STATUS:
   {
     bool const ok = ipc_send_msg(ipc_socket, (struct IpcMessage){
-                                                 .type = IPC_MSG_SIMPLE_STATUS,
+                                                 .type   = IPC_MSG_SIMPLE_STATUS,
+                                                 .portal = cli.portal,
                                              });
     if (!ok) {
       return EXIT_FAILURE;
@@ -130,7 +168,20 @@ int main(int argc, char ** argv)
   case PA_FORCE_OPEN:
   {
     bool const ok = ipc_send_msg(ipc_socket, (struct IpcMessage){
-                                                 .type = IPC_MSG_FORCE_OPEN,
+                                                 .type   = IPC_MSG_FORCE_OPEN,
+                                                 .portal = cli.portal,
+                                             });
+    if (!ok) {
+      return EXIT_FAILURE;
+    }
+    break;
+  }
+  case PA_WATCH:
+  {
+    bool const ok = ipc_send_msg(ipc_socket, (struct IpcMessage){
+                                                 .type                          = IPC_MSG_SUBSCRIBE,
+                                                 .data.subscribe.log_subsystems = cli.log_subsystems,
+                                                 .data.subscribe.log_level      = cli.log_level,
                                              });
     if (!ok) {
       return EXIT_FAILURE;
@@ -140,14 +191,34 @@ int main(int argc, char ** argv)
   case PA_SYSTEM_RESET:
   {
     bool const ok = ipc_send_msg(ipc_socket, (struct IpcMessage){
-                                                 .type = IPC_MSG_SYSTEM_RESET,
+                                                 .type   = IPC_MSG_SYSTEM_RESET,
+                                                 .portal = cli.portal,
                                              });
     if (!ok) {
       return EXIT_FAILURE;
     }
     break;
   }
+  case PA_FLIGHT_RECORDER:
+  {
+    bool const ok = ipc_send_msg(ipc_socket, (struct IpcMessage){
+                                                 .type = IPC_MSG_DUMP_FLIGHT_RECORDER,
+                                             });
+    if (!ok) {
+      return EXIT_FAILURE;
+    }
+    break;
   }
+  case PA_HISTORY:
+  {
+    // handled without the daemon
+    return EXIT_FAILURE;
+  }
+  }
+
+  // the status as seen by `watch`, updated incrementally
+  struct PortalStatus watched_status;
+  memset(&watched_status, 0, sizeof watched_status);
 
   while (true) {
     struct IpcMessage msg;
@@ -168,13 +239,33 @@ int main(int argc, char ** argv)
         break;
       }
 
+      case IPC_MSG_STATUS:
+      {
+        if (cli.action == PA_WATCH) {
+          watched_status = msg.data.status;
+          print_status_update(&watched_status, STATUS_FIELD_ALL & ~STATUS_FIELD_IPC_CLIENTS, cli.json);
+        }
+        else {
+          print_status(&msg.data.status, cli.json);
+        }
+        break;
+      }
+
+      case IPC_MSG_STATUS_UPDATE:
+      {
+        status_apply(&watched_status, &msg.data.update.status, msg.data.update.fields);
+        print_status_update(&watched_status, msg.data.update.fields, cli.json);
+        break;
+      }
+
       default:
         log_print(LSS_SYSTEM, LL_WARNING, "received invalid ipc message of type %u\n", msg.type);
         break;
       }
     }
     else {
-      __builtin_unreachable();
+      log_print(LSS_SYSTEM, LL_ERROR, "failed to receive ipc message\n");
+      return EXIT_FAILURE;
     }
   }
 
@@ -184,7 +275,7 @@ int main(int argc, char ** argv)
 static void print_usage(FILE * stream)
 {
   static const char usage_msg[] =
-      "portal-trigger [-h] -i <id> -f <name> -n <nick> <action>"
+      "portal-trigger [-h] [-j] [-s] [-S <file>] [-l <level>] [-L <list>] [-c <count>] [-a <list>] [-A <dir>] [-x <portal>] -i <id> -f <name> -n <nick> <action>"
       "\n"
       ""
       "\n"
@@ -202,13 +293,57 @@ static void print_usage(FILE * stream)
       "\n"
       "  status     the current status of this portal will be printed."
       "\n"
+      "  watch      prints the status of this portal on every change until interrupted."
+      "\n"
+      "  history    prints the last door transactions, newest first. Only the own ones via ssh."
+      "\n"
+      "  flight-recorder"
+      "\n"
+      "             writes the state machine flight recorder to disk and prints the file name."
+      "\n"
       ""
       "\n"
       "Options:"
       "\n"
       "  -h         Print this help text."
       "\n"
-      "  -i <id>    The member id of the keyholder."
+      "  -j, --json Print the status as JSON."
+      "\n"
+      "  -s, --shm  Read status and simple-status from the status page instead of asking the daemon."
+      "\n"
+      "  -S, --status-page <file>"
+      "\n"
+      "             -s reads the status page of a daemon started with -S <file>. Default is " STATUS_PAGE_DEFAULT_PATH "."
+      "\n"
+      "  -l, --log-level <level>"
+      "\n"
+      "             watch also prints daemon logs up to <level> (error, warning, message, verbose)."
+      "\n"
+      "  -L, --log-subsystems <list>"
+      "\n"
+      "             watch only prints daemon logs of the comma separated subsystems in <list>."
+      "\n"
+      "  -c, --count <count>"
+      "\n"
+      "             history prints at most <count> transactions. Default is 20."
+      "\n"
+      "  -a, --audit-actions <list>"
+      "\n"
+      "             history only prints the comma separated actions in <list>"
+      "\n"
+      "             (open-front, open-back, close, force-open, system-reset)."
+      "\n"
+      "  -A, --audit-log <dir>"
+      "\n"
+      "             history reads the audit log of a daemon started with -A <dir>. Default is " AUDIT_DEFAULT_PATH "."
+      "\n"
+      "  -x, --portal <portal>"
+      "\n"
+      "             The portal of a daemon with several ones, counted in the order of its -x options."
+      "\n"
+      "             Default is 0, the primary portal. -s and watch are only available for that one."
+      "\n"
+      "  -i <id>    The member id of the keyholder. history only prints transactions of this member."
       "\n"
       "  -f <name>  The full name of the keyholder."
       "\n"
@@ -225,6 +360,36 @@ static void close_ipc_socket()
   }
 }
 
+static void print_status(struct PortalStatus const * status, bool json)
+{
+  if (json) {
+    status_print_json(status, stdout);
+  }
+  else {
+    char text[IPC_MAX_INFOSTR_LEN];
+    status_format_text(status, text, sizeof text);
+    fputs(text, stdout);
+  }
+  fflush(stdout);
+}
+
+static void print_status_update(struct PortalStatus const * status, uint32_t fields, bool json)
+{
+  if (json) {
+    status_print_json(status, stdout);
+  }
+  else {
+    char      timestamp[32];
+    time_t    now = time(NULL);
+    struct tm local;
+    strftime(timestamp, sizeof timestamp, "%Y-%m-%d %H:%M:%S", localtime_r(&now, &local));
+
+    fprintf(stdout, "[%s] ", timestamp);
+    status_print_fields(status, fields, stdout);
+  }
+  fflush(stdout);
+}
+
 static void panic(char const * msg)
 {
   log_print(LSS_SYSTEM, LL_ERROR, "\n\nPANIC: %s\n\n\n", msg);
@@ -260,6 +425,15 @@ static bool parse_action(char const * action_str, enum PortalAction * action)
   else if (strcmp(action_str, "force-open") == 0) {
     *action = PA_FORCE_OPEN;
   }
+  else if (strcmp(action_str, "watch") == 0) {
+    *action = PA_WATCH;
+  }
+  else if (strcmp(action_str, "history") == 0) {
+    *action = PA_HISTORY;
+  }
+  else if (strcmp(action_str, "flight-recorder") == 0) {
+    *action = PA_FLIGHT_RECORDER;
+  }
   else {
     return false;
   }
@@ -269,16 +443,43 @@ static bool parse_action(char const * action_str, enum PortalAction * action)
 static bool parse_cli(int argc, char ** argv, struct PortalArgs * args)
 {
   *args = (struct PortalArgs){
-      .help        = false,
-      .member_id   = 0,
-      .member_nick = NULL,
-      .member_name = NULL,
-      .action      = 0,
+      .help           = false,
+      .json           = false,
+      .shm            = false,
+      .log_subsystems = 0,
+      .log_level        = LL_MESSAGE,
+      .history_actions  = 0,
+      .history_count    = HISTORY_DEFAULT_COUNT,
+      .own_history      = false,
+      .audit_path       = NULL,
+      .status_page_path = NULL,
+      .member_id        = 0,
+      .member_nick      = NULL,
+      .member_name      = NULL,
+      .portal           = 0,
+      .action           = 0,
   };
 
   {
+    static struct option const long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"json", no_argument, NULL, 'j'},
+        {"shm", no_argument, NULL, 's'},
+        {"status-page", required_argument, NULL, 'S'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"log-subsystems", required_argument, NULL, 'L'},
+        {"count", required_argument, NULL, 'c'},
+        {"audit-actions", required_argument, NULL, 'a'},
+        {"audit-log", required_argument, NULL, 'A'},
+        {"portal", required_argument, NULL, 'x'},
+        {NULL, 0, NULL, 0},
+    };
+
+    bool log_level_set      = false;
+    bool log_subsystems_set = false;
+
     int opt;
-    while ((opt = getopt(argc, argv, "hn:f:i:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "hjsS:l:L:c:a:A:n:f:i:x:", long_options, NULL)) != -1) {
       switch (opt) {
       case 'n':
       { // nick name
@@ -314,6 +515,83 @@ static bool parse_cli(int argc, char ** argv, struct PortalArgs * args)
         return true;
       }
 
+      case 'j':
+      {
+        args->json = true;
+        break;
+      }
+
+      case 's':
+      {
+        args->shm = true;
+        break;
+      }
+
+      case 'l':
+      {
+        if (!log_parse_level(optarg, &args->log_level)) {
+          fprintf(stderr, "invalid log level: %s\n", optarg);
+          return false;
+        }
+        log_level_set = true;
+        break;
+      }
+
+      case 'L':
+      {
+        if (!parse_subsystem_list(optarg, &args->log_subsystems)) {
+          return false;
+        }
+        log_subsystems_set = true;
+        break;
+      }
+
+      case 'c':
+      {
+        errno            = 0;
+        char * end_ptr   = optarg;
+        long const count = strtol(optarg, &end_ptr, 10);
+        if ((errno != 0) || (end_ptr != (optarg + strlen(optarg))) || (count <= 0)) {
+          fprintf(stderr, "invalid count: %s\n", optarg);
+          return false;
+        }
+        args->history_count = (size_t)count;
+        break;
+      }
+
+      case 'a':
+      {
+        if (!parse_action_list(optarg, &args->history_actions)) {
+          return false;
+        }
+        break;
+      }
+
+      case 'A':
+      {
+        args->audit_path = optarg;
+        break;
+      }
+
+      case 'S':
+      {
+        args->status_page_path = optarg;
+        break;
+      }
+
+      case 'x':
+      {
+        errno             = 0;
+        char * end_ptr    = optarg;
+        long const portal = strtol(optarg, &end_ptr, 10);
+        if ((errno != 0) || (end_ptr != (optarg + strlen(optarg))) || (portal < 0) || (portal > UINT8_MAX)) {
+          fprintf(stderr, "invalid portal: %s\n", optarg);
+          return false;
+        }
+        args->portal = (uint8_t)portal;
+        break;
+      }
+
       default:
       {
         // unknown argument, error message is already printed by getopt
@@ -321,6 +599,14 @@ static bool parse_cli(int argc, char ** argv, struct PortalArgs * args)
       }
       }
     }
+
+    // only one of the log options means the other one takes a sensible default
+    if (log_level_set && !log_subsystems_set) {
+      args->log_subsystems = ~0U;
+    }
+    if (log_subsystems_set && !log_level_set) {
+      args->log_level = LL_MESSAGE;
+    }
   }
 
   // Allow SSH_ORIGINAL_COMMAND to be used to open the portal as well.
@@ -336,6 +622,9 @@ static bool parse_cli(int argc, char ** argv, struct PortalArgs * args)
     return false;
   }
 
+  // members logged in via ssh may only see what they did themselves
+  args->own_history = ssh_action_ok;
+
   if (!ssh_action_ok && optind >= argc) {
     // If we don't have a ssh action, we require a action passed
     // on the command line.
@@ -356,6 +645,36 @@ static bool parse_cli(int argc, char ** argv, struct PortalArgs * args)
 
   bool params_ok = true;
 
+  if (args->shm && (args->action != PA_STATUS) && (args->action != PA_SIMPLE_STATUS)) {
+    fprintf(stderr, "Option -s is only available for status and simple-status!\n");
+    params_ok = false;
+  }
+
+  if ((args->status_page_path != NULL) && !args->shm) {
+    fprintf(stderr, "Option -S is only available with -s!\n");
+    params_ok = false;
+  }
+
+  if ((args->portal != 0) && (args->shm || (args->action == PA_WATCH))) {
+    fprintf(stderr, "Option -s and watch are only available for the primary portal!\n");
+    params_ok = false;
+  }
+
+  if ((args->log_subsystems != 0) && (args->action != PA_WATCH)) {
+    fprintf(stderr, "Options -l and -L are only available for watch!\n");
+    params_ok = false;
+  }
+
+  if (((args->history_actions != 0) || (args->history_count != HISTORY_DEFAULT_COUNT) || (args->audit_path != NULL)) && (args->action != PA_HISTORY)) {
+    fprintf(stderr, "Options -c, -a and -A are only available for history!\n");
+    params_ok = false;
+  }
+
+  if (args->own_history && (args->action == PA_HISTORY) && (args->member_id <= 0)) {
+    fprintf(stderr, "Option -i is missing!\n");
+    params_ok = false;
+  }
+
   bool requires_user_info = (args->action == PA_OPEN_FRONT) || (args->action == PA_OPEN_BACK);
 
   if (requires_user_info) {
@@ -408,3 +727,169 @@ static int connecToDaemon()
 
   return sock;
 }
+
+static int read_status_page(char const * path, enum PortalAction action, bool json)
+{
+  struct StatusPageReader reader;
+  if (!status_page_open(&reader, path)) {
+    return EXIT_FAILURE;
+  }
+
+  struct PortalStatus         status;
+  enum StatusPageResult const result = status_page_read(&reader, &status);
+  status_page_close(&reader);
+
+  if (result == STATUS_PAGE_STALE) {
+    log_print(LSS_SYSTEM, LL_ERROR, "status page is stale, portal-daemon is not running.");
+    return EXIT_FAILURE;
+  }
+  if (result != STATUS_PAGE_OK) {
+    return EXIT_FAILURE;
+  }
+
+  if (action == PA_SIMPLE_STATUS && !json) {
+    fprintf(stdout, "%s\n", sm_shack_state_name(status.shack_state));
+  }
+  else {
+    print_status(&status, json);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static bool parse_subsystem_list(char const * list, uint32_t * subsystems)
+{
+  assert(list != NULL);
+  assert(subsystems != NULL);
+
+  char * const copy = strdup(list);
+  if (copy == NULL) {
+    panic("out of memory");
+  }
+
+  *subsystems = 0;
+
+  bool   ok = true;
+  char * save_ptr;
+  for (char * name = strtok_r(copy, ",", &save_ptr); name != NULL; name = strtok_r(NULL, ",", &save_ptr)) {
+    enum LogSubSystem subsystem;
+    if (!log_parse_subsystem(name, &subsystem)) {
+      fprintf(stderr, "invalid log subsystem: %s\n", name);
+      ok = false;
+      break;
+    }
+    *subsystems |= (1U << subsystem);
+  }
+
+  free(copy);
+
+  if (ok && (*subsystems == 0)) {
+    fprintf(stderr, "empty log subsystem list\n");
+    ok = false;
+  }
+  return ok;
+}
+
+static bool parse_action_list(char const * list, uint32_t * actions)
+{
+  assert(list != NULL);
+  assert(actions != NULL);
+
+  char * const copy = strdup(list);
+  if (copy == NULL) {
+    panic("out of memory");
+  }
+
+  *actions = 0;
+
+  bool   ok = true;
+  char * save_ptr;
+  for (char * name = strtok_r(copy, ",", &save_ptr); name != NULL; name = strtok_r(NULL, ",", &save_ptr)) {
+    enum AuditAction action;
+    if (!audit_parse_action(name, &action)) {
+      fprintf(stderr, "invalid audit action: %s\n", name);
+      ok = false;
+      break;
+    }
+    *actions |= (1U << action);
+  }
+
+  free(copy);
+
+  if (ok && (*actions == 0)) {
+    fprintf(stderr, "empty audit action list\n");
+    ok = false;
+  }
+  return ok;
+}
+
+struct HistoryPrinter
+{
+  bool json;
+  bool first;
+};
+
+static bool print_history_record(void * user_data, struct AuditRecord const * record)
+{
+  struct HistoryPrinter * const printer = user_data;
+
+  // the record is stamped with the outcome, members know the time they asked
+  time_t const seconds = (time_t)(audit_request_time(record) / 1000u);
+  struct tm    local;
+  char         timestamp[32];
+  strftime(timestamp, sizeof timestamp, "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &local));
+
+  if (printer->json) {
+    fprintf(stdout,
+            "%s\n  {\"time\": \"%s\", \"timestamp_ms\": %llu, \"member_id\": %d, \"action\": \"%s\", \"outcome\": \"%s\", \"latency_ms\": %u, \"transaction_id\": %u}",
+            printer->first ? "" : ",",
+            timestamp,
+            (unsigned long long)record->timestamp,
+            record->member_id,
+            audit_action_name(record->action),
+            audit_outcome_name(record->outcome),
+            record->latency_ms,
+            record->transaction_id);
+  }
+  else {
+    char member[16];
+    if (record->member_id >= 0) {
+      snprintf(member, sizeof member, "%d", record->member_id);
+    }
+    else {
+      strcpy(member, "-");
+    }
+    fprintf(stdout, "%s  %-12s  member %-6s  %-11s  %6u ms\n", timestamp, audit_action_name(record->action), member, audit_outcome_name(record->outcome), record->latency_ms);
+  }
+  printer->first = false;
+
+  return true;
+}
+
+static int print_history(struct PortalArgs const * args)
+{
+  struct AuditQuery const query = {
+      .member_id = (args->member_id > 0) ? args->member_id : -1,
+      .actions   = args->history_actions,
+      .before    = 0,
+      .limit     = args->history_count,
+  };
+
+  struct HistoryPrinter printer = {
+      .json  = args->json,
+      .first = true,
+  };
+
+  if (printer.json) {
+    fputs("[", stdout);
+  }
+
+  bool const ok = audit_query((args->audit_path != NULL) ? args->audit_path : AUDIT_DEFAULT_PATH, &query, print_history_record, &printer);
+
+  if (printer.json) {
+    fputs(printer.first ? "]\n" : "\n]\n", stdout);
+  }
+  fflush(stdout);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,159 @@
+#include "service-notify.h"
+
+#include "clock.h"
+#include "log.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct
+{
+  uint64_t interval;  // time between two pings in milliseconds, 0 without watchdog
+  uint64_t next_ping; // CLOCK_MONOTONIC in milliseconds
+} watchdog = {
+    .interval  = 0,
+    .next_ping = 0,
+};
+
+//! Parses an unsigned number from the environment, returns false if `name` is not set or invalid.
+static bool get_env_number(char const * name, unsigned long long * value)
+{
+  char const * const text = getenv(name);
+  if ((text == NULL) || (text[0] == 0)) {
+    return false;
+  }
+
+  errno      = 0;
+  char * end = NULL;
+  *value     = strtoull(text, &end, 10);
+  return (errno == 0) && (*end == 0);
+}
+
+bool service_notify(char const * fmt, ...)
+{
+  char const * const path = getenv("NOTIFY_SOCKET");
+  if ((path == NULL) || (path[0] == 0)) {
+    return false;
+  }
+
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  size_t const       length  = strlen(path);
+  if (length >= sizeof address.sun_path) {
+    log_print(LSS_SYSTEM, LL_WARNING, "NOTIFY_SOCKET is too long: %s", path);
+    return false;
+  }
+  memcpy(address.sun_path, path, length);
+  if (address.sun_path[0] == '@') {
+    address.sun_path[0] = 0; // abstract namespace
+  }
+
+  char    message[256];
+  va_list args;
+  va_start(args, fmt);
+  int const message_length = vsnprintf(message, sizeof message, fmt, args);
+  va_end(args);
+  if ((message_length < 0) || ((size_t)message_length >= sizeof message)) {
+    return false;
+  }
+
+  int const fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to create notify socket");
+    return false;
+  }
+
+  socklen_t const address_length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length);
+  bool const      ok             = (sendto(fd, message, (size_t)message_length, MSG_NOSIGNAL, (struct sockaddr const *)&address, address_length) == message_length);
+  if (!ok) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to notify the service manager");
+  }
+  close(fd);
+  return ok;
+}
+
+int service_listen_fd(void)
+{
+  unsigned long long pid, count;
+  bool const         passed = get_env_number("LISTEN_PID", &pid) && get_env_number("LISTEN_FDS", &count);
+
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+
+  if (!passed || (pid != (unsigned long long)getpid()) || (count == 0)) {
+    return -1;
+  }
+  if (count > 1) {
+    log_print(LSS_SYSTEM, LL_WARNING, "got %llu sockets from the service manager, only using the first one.", count);
+  }
+
+  int const fd = SERVICE_LISTEN_FDS_START;
+
+  int       type;
+  int       listening;
+  socklen_t type_size      = sizeof type;
+  socklen_t listening_size = sizeof listening;
+  if ((getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_size) == -1) || (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &listening_size) == -1)) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "the socket passed by the service manager is unusable");
+    return -1;
+  }
+  if ((type != SOCK_SEQPACKET) || !listening) {
+    log_print(LSS_SYSTEM, LL_ERROR, "the socket passed by the service manager is not a listening SOCK_SEQPACKET socket.");
+    return -1;
+  }
+
+  (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
+
+void service_watchdog_init(void)
+{
+  unsigned long long usec, pid;
+  if (!get_env_number("WATCHDOG_USEC", &usec) || (usec == 0)) {
+    return;
+  }
+
+  // the watchdog is meant for the main process. a new daemon of a hot
+  // upgrade inherits the environment of its parent and takes over from it.
+  if (get_env_number("WATCHDOG_PID", &pid) && (pid != (unsigned long long)getpid()) && (pid != (unsigned long long)getppid())) {
+    return;
+  }
+
+  // ping twice per interval, so a late loop iteration doesn't kill us right away
+  watchdog.interval  = (usec / 1000u) / 2u;
+  watchdog.next_ping = clock_get_ms(CLOCK_MONOTONIC);
+  if (watchdog.interval == 0) {
+    watchdog.interval = 1;
+  }
+}
+
+int service_watchdog_timeout(void)
+{
+  if (watchdog.interval == 0) {
+    return -1;
+  }
+
+  uint64_t const now = clock_get_ms(CLOCK_MONOTONIC);
+  return (now < watchdog.next_ping) ? (int)(watchdog.next_ping - now) : 0;
+}
+
+void service_watchdog_ping(char const * status)
+{
+  if (watchdog.interval == 0) {
+    return;
+  }
+
+  watchdog.next_ping = clock_get_ms(CLOCK_MONOTONIC) + watchdog.interval;
+  (void)service_notify("WATCHDOG=1\nSTATUS=%s", status);
+}
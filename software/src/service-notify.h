@@ -0,0 +1,34 @@
+#ifndef PORTAL300_SERVICE_NOTIFY_H
+#define PORTAL300_SERVICE_NOTIFY_H
+
+#include <stdbool.h>
+
+// Integration with the service manager, see sd_notify(3) and
+// sd_listen_fds(3). Only the plain protocols are implemented, so the daemon
+// doesn't need libsystemd. Everything does nothing when the daemon isn't
+// started by systemd.
+
+//! The first file descriptor passed by socket activation.
+#define SERVICE_LISTEN_FDS_START 3
+
+//! Sends a notification like "READY=1" to $NOTIFY_SOCKET. Returns false
+//! if there is no service manager or it could not be reached.
+bool service_notify(char const * fmt, ...) __attribute__((format(printf, 1, 2)));
+
+//! Returns the listening socket passed by socket activation, or -1 if the
+//! daemon has to create its own. Removes the variables from the environment,
+//! so processes started by the daemon don't take it as theirs.
+int service_listen_fd(void);
+
+//! Reads the watchdog interval set by WatchdogSec=.
+void service_watchdog_init(void);
+
+//! Returns the time in ms until the next watchdog ping is due, 0 if it is
+//! due now or -1 if there is no watchdog. Suitable as poll() timeout.
+int service_watchdog_timeout(void);
+
+//! Tells the service manager that the main loop is alive, with a `status`
+//! line for `systemctl status`.
+void service_watchdog_ping(char const * status);
+
+#endif // PORTAL300_SERVICE_NOTIFY_H
@@ -0,0 +1,214 @@
+#include "sm-check.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+static void record_signal(void * user_data, void * context, enum SM_Signal signal)
+{
+  (void)context;
+  struct SmModel * const model = user_data;
+  if (model->signal_count < SM_CHECK_MAX_SIGNALS) {
+    model->signals[model->signal_count] = signal;
+  }
+  // count the overflow too, so the check can report it
+  model->signal_count += 1;
+}
+
+void sm_model_init(struct SmModel * model)
+{
+  assert(model != NULL);
+  *model = (struct SmModel){
+      .timer_armed  = false,
+      .opening      = false,
+      .locking      = false,
+      .signal_count = 0,
+  };
+  sm_init(&model->sm, record_signal, model);
+}
+
+bool sm_model_can_apply(struct SmModel const * model, enum SM_Event event, int door)
+{
+  switch (event) {
+  case EVENT_DOOR_OPENED:
+  case EVENT_DOOR_CLOSED:
+  case EVENT_DOOR_LOCKED:
+  case EVENT_BUTTON:
+    return (door >= 0) && (door < SM_DOOR_COUNT);
+
+  case EVENT_TIMEOUT:
+    return (door == SM_NO_DOOR) && model->timer_armed;
+
+  default:
+    return (door == SM_NO_DOOR);
+  }
+}
+
+static bool is_inner_door_open(enum SM_Signal signal)
+{
+  switch (signal) {
+  case SIGNAL_OPEN_DOOR_B2_SAFE: return true;
+  case SIGNAL_OPEN_DOOR_C2_SAFE: return true;
+  case SIGNAL_OPEN_DOOR_B2_UNSAFE: return true;
+  case SIGNAL_OPEN_DOOR_C2_UNSAFE: return true;
+  default: return false;
+  }
+}
+
+//! Returns true if the periodic status of any door that the state machine
+//! doesn't wait for would take a transition, which the door filter drops.
+static bool needs_dropped_repeat(struct SmModel const * model)
+{
+  static enum SM_Event const events[] = {
+      [DOOR_OPEN]   = EVENT_DOOR_OPENED,
+      [DOOR_CLOSED] = EVENT_DOOR_CLOSED,
+      [DOOR_LOCKED] = EVENT_DOOR_LOCKED,
+  };
+
+  for (int door = 0; door < SM_DOOR_COUNT; door++) {
+    enum DoorState const state = sm_get_door_state(&model->sm, door);
+    if ((state == DOOR_UNOBSERVED) || sm_waits_for_door(&model->sm, door))
+      continue;
+
+    struct SmModel probe = *model;
+    probe.sm.user_data   = &probe;
+    sm_apply_event(&probe.sm, events[state], door, NULL);
+    if (probe.sm.last_transition >= 0)
+      return true;
+  }
+  return false;
+}
+
+static bool is_ssh_request(enum SM_Event event)
+{
+  switch (event) {
+  case EVENT_SSH_OPEN_FRONT_REQUEST: return true;
+  case EVENT_SSH_OPEN_BACK_REQUEST: return true;
+  case EVENT_SSH_CLOSE_REQUEST: return true;
+  default: return false;
+  }
+}
+
+char const * sm_model_apply(struct SmModel * model, enum SM_Event event, int door)
+{
+  assert(model != NULL);
+
+  // models are copied around by the explorer
+  model->sm.user_data = model;
+  model->signal_count = 0;
+
+  if (event == EVENT_TIMEOUT) {
+    model->timer_armed = false;
+  }
+
+  enum ShackState const previous_shack_state = model->sm.last_shack_state;
+
+  sm_apply_event(&model->sm, event, door, NULL);
+
+  if (model->signal_count > SM_CHECK_MAX_SIGNALS)
+    return "an event sent more signals than the daemon can queue for a single event";
+
+  if ((model->sm.state < 0) || (model->sm.state >= SM_STATE_COUNT))
+    return "the internal state is out of range";
+
+  enum ShackState const shack_state = sm_get_shack_state(&model->sm);
+  bool const            changed     = (shack_state != previous_shack_state);
+  bool const            announced   = (model->signal_count > 0) && (model->signals[0] == SIGNAL_STATE_CHANGE);
+  if (changed != announced)
+    return "SIGNAL_STATE_CHANGE must be the first signal exactly when the shack state changed";
+
+  for (size_t i = 0; i < model->signal_count; i++) {
+    enum SM_Signal const signal = model->signals[i];
+
+    if (model->locking && is_inner_door_open(signal))
+      return "an inner door was opened while locking";
+
+    switch (signal) {
+    case SIGNAL_OPEN_DOOR_B2_SAFE:
+    case SIGNAL_OPEN_DOOR_C2_SAFE:
+      if (model->opening || model->locking)
+        return "an opening started while another request was in progress";
+      model->opening = true;
+      break;
+
+    case SIGNAL_LOCK_ALL:
+      if (model->opening || model->locking)
+        return "a locking started while another request was in progress";
+      model->locking = true;
+      break;
+
+    case SIGNAL_UNLOCK_SUCCESSFUL:
+      if (!model->opening)
+        return "SIGNAL_UNLOCK_SUCCESSFUL without an opening in progress";
+      break;
+
+    case SIGNAL_UNLOCK_TIMEOUT:
+      if (!model->opening)
+        return "SIGNAL_UNLOCK_TIMEOUT without an opening in progress";
+      model->opening = false;
+      model->locking = true;
+      break;
+
+    case SIGNAL_OPEN_SUCCESSFUL:
+      if (!model->opening)
+        return "SIGNAL_OPEN_SUCCESSFUL without an opening in progress";
+      if (shack_state != SHACK_OPEN)
+        return "SIGNAL_OPEN_SUCCESSFUL while the shack is not open";
+      model->opening = false;
+      break;
+
+    case SIGNAL_LOCK_SUCCESSFUL:
+      if (!model->locking)
+        return "SIGNAL_LOCK_SUCCESSFUL without a locking in progress";
+      if (shack_state != SHACK_LOCKED)
+        return "SIGNAL_LOCK_SUCCESSFUL while the shack is not locked";
+      model->locking = false;
+      break;
+
+    case SIGNAL_USER_REQUESTED_TIMED_OUT:
+      if (event != EVENT_TIMEOUT)
+        return "SIGNAL_USER_REQUESTED_TIMED_OUT without a timeout";
+      model->opening = false;
+      model->locking = false;
+      break;
+
+    case SIGNAL_CANNOT_HANDLE_REQUEST:
+    case SIGNAL_CHANGE_KEYHOLDER:
+    case SIGNAL_NO_STATE_CHANGE:
+      if (!is_ssh_request(event))
+        return "a request was answered without a request";
+      break;
+
+    case SIGNAL_START_TIMEOUT:
+      model->timer_armed = true;
+      break;
+
+    case SIGNAL_CANCEL_TIMEOUT:
+      model->timer_armed = false;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  // a request without timer could hang forever, a timer without request
+  // would time out something else
+  bool const in_progress = model->opening || model->locking;
+  if (in_progress != model->timer_armed)
+    return "the timer must run exactly while a request is in progress";
+
+  // the timer is started with the timeout of the phase
+  if (in_progress == (sm_get_phase(&model->sm) == SM_NO_PHASE))
+    return "a request in progress must be in a phase";
+
+  // the state machine starts idle
+  struct StateMachine idle;
+  sm_init(&idle, record_signal, model);
+  if ((model->sm.state == idle.state) == in_progress)
+    return "the state machine must be idle exactly when no request is in progress";
+
+  if (needs_dropped_repeat(model))
+    return "a repeated door status takes a transition, but the machine doesn't wait for the door";
+
+  return NULL;
+}
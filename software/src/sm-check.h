@@ -0,0 +1,43 @@
+#ifndef PORTAL300_SM_CHECK_H
+#define PORTAL300_SM_CHECK_H
+
+#include "state-machine.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Invariants of the state machine, shared by sm-explore and sm-fuzz. The
+// model adds what the daemon sees from the outside: whether the timer
+// requested with SIGNAL_START_TIMEOUT runs, and whether an opening or locking
+// was started and didn't report its outcome yet.
+//
+// The daemon drops repeated door status messages unless the state machine
+// waits for the door (door-filter.h), so a repeat of any other door must not
+// make a difference.
+
+#define SM_CHECK_MAX_SIGNALS 8
+
+struct SmModel
+{
+  struct StateMachine sm;
+  bool                timer_armed;
+  bool                opening; // SIGNAL_OPEN_DOOR_*_SAFE was sent, the outcome is pending
+  bool                locking; // SIGNAL_LOCK_ALL or SIGNAL_UNLOCK_TIMEOUT was sent, the outcome is pending
+
+  // signals of the last event
+  size_t         signal_count;
+  enum SM_Signal signals[SM_CHECK_MAX_SIGNALS];
+};
+
+void sm_model_init(struct SmModel * model);
+
+//! Returns true if the daemon can deliver `event` for `door` right now. Door
+//! and button events need a door, the others SM_NO_DOOR. EVENT_TIMEOUT only
+//! happens while the timer runs.
+bool sm_model_can_apply(struct SmModel const * model, enum SM_Event event, int door);
+
+//! Applies `event` to `model` and checks all invariants. Returns NULL if they
+//! hold, otherwise a description of the violated one.
+char const * sm_model_apply(struct SmModel * model, enum SM_Event event, int door);
+
+#endif // PORTAL300_SM_CHECK_H
@@ -0,0 +1,274 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sm-check.h"
+#include "state-machine.h"
+
+// Explores every configuration of the state machine that is reachable from
+// sm_init() by a breadth first search over all events, and checks the
+// invariants of sm-check.c on every transition. A violation is reported with
+// the shortest event sequence that leads to it.
+
+// internal state, the state of every door, last shack state, timer, opening, locking
+#define EXPLORE_KEY_COUNT (SM_STATE_COUNT * (1 << (2 * SM_DOOR_COUNT)) * SM_SHACK_STATE_COUNT * 2 * 2 * 2)
+
+struct ExploreArgsCli
+{
+  bool help;
+  bool verbose;
+  long max_depth; // 0 for no limit
+};
+
+struct Node
+{
+  struct SmModel model;
+  int32_t        parent; // index into `nodes`, -1 for the initial configuration
+  uint8_t        event;  // event that led here from `parent`
+  uint8_t        door;   // door of `event`
+  uint32_t       depth;
+};
+
+static struct Node nodes[EXPLORE_KEY_COUNT];
+static size_t      node_count = 0;
+
+//! Index into `nodes` plus one for every configuration, 0 if not seen yet.
+static uint32_t seen[EXPLORE_KEY_COUNT];
+
+static void print_usage(FILE * stream);
+static bool parse_cli(int argc, char ** argv, struct ExploreArgsCli * args);
+static size_t config_key(struct SmModel const * model);
+static void   print_config(FILE * stream, struct SmModel const * model);
+static void   print_path(FILE * stream, size_t index);
+
+int main(int argc, char ** argv)
+{
+  struct ExploreArgsCli cli;
+  if (!parse_cli(argc, argv, &cli)) {
+    return EXIT_FAILURE;
+  }
+
+  if (cli.help) {
+    print_usage(stdout);
+    return EXIT_SUCCESS;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  nodes[0] = (struct Node){
+      .parent = -1,
+      .event  = 0,
+      .depth  = 0,
+  };
+  sm_model_init(&nodes[0].model);
+  node_count                         = 1;
+  seen[config_key(&nodes[0].model)] = 1;
+
+  uint64_t transitions  = 0;
+  uint64_t ignored      = 0;
+  uint32_t max_depth    = 0;
+  uint8_t  taken[64]    = {0};
+  size_t   taken_count  = 0;
+
+  // `nodes` is the queue of the search at the same time
+  for (size_t current = 0; current < node_count; current++) {
+    if ((cli.max_depth > 0) && (nodes[current].depth >= (uint32_t)cli.max_depth))
+      continue;
+
+    for (int input = 0; input < SM_EVENT_COUNT * (SM_NO_DOOR + 1); input++) {
+      int const event = input / (SM_NO_DOOR + 1);
+      int const door  = input % (SM_NO_DOOR + 1);
+      if (!sm_model_can_apply(&nodes[current].model, event, door))
+        continue;
+
+      struct SmModel     next      = nodes[current].model;
+      char const * const violation = sm_model_apply(&next, event, door);
+      transitions += 1;
+
+      char label[64];
+      if (cli.verbose) {
+        print_config(stdout, &nodes[current].model);
+        fprintf(stdout, " --%s--> ", sm_event_label(label, sizeof label, event, door));
+        print_config(stdout, &next);
+        fprintf(stdout, "\n");
+      }
+
+      if (violation != NULL) {
+        fprintf(stderr, "invariant violated: %s\n", violation);
+        fprintf(stderr, "events from sm_init():\n");
+        print_path(stderr, current);
+        fprintf(stderr, "  %s\n", sm_event_label(label, sizeof label, event, door));
+        fprintf(stderr, "before: ");
+        print_config(stderr, &nodes[current].model);
+        fprintf(stderr, "\nafter:  ");
+        print_config(stderr, &next);
+        fprintf(stderr, "\nsignals:");
+        for (size_t i = 0; (i < next.signal_count) && (i < SM_CHECK_MAX_SIGNALS); i++) {
+          fprintf(stderr, " %s%s", sm_signal_name(next.signals[i]), (i + 1 < next.signal_count) ? "," : "");
+        }
+        fprintf(stderr, "\n");
+        return EXIT_FAILURE;
+      }
+
+      if (next.sm.last_transition < 0) {
+        ignored += 1;
+      }
+      else if ((size_t)next.sm.last_transition < sizeof taken && !taken[next.sm.last_transition]) {
+        taken[next.sm.last_transition] = 1;
+        taken_count += 1;
+      }
+
+      size_t const key = config_key(&next);
+      if (seen[key] == 0) {
+        nodes[node_count] = (struct Node){
+            .model  = next,
+            .parent = (int32_t)current,
+            .event  = (uint8_t)event,
+            .door   = (uint8_t)door,
+            .depth  = nodes[current].depth + 1,
+        };
+        node_count += 1;
+        seen[key] = node_count;
+        if (nodes[current].depth + 1 > max_depth) {
+          max_depth = nodes[current].depth + 1;
+        }
+      }
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double const elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+  fprintf(stdout,
+          "explored %zu reachable configurations up to depth %u with %llu transitions (%llu ignored events) in %.3f ms, %.0f transitions/s\n",
+          node_count,
+          max_depth,
+          (unsigned long long)transitions,
+          (unsigned long long)ignored,
+          1000.0 * elapsed,
+          (elapsed > 0) ? (double)transitions / elapsed : 0.0);
+  fprintf(stdout, "%zu of %zu transitions of the table were taken\n", taken_count, sm_transition_count);
+  for (size_t i = 0; i < sm_transition_count; i++) {
+    if ((i >= sizeof taken) || !taken[i]) {
+      fprintf(stdout, "  never taken: %zu. %s\n", i + 1, sm_transitions[i].description);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static size_t config_key(struct SmModel const * model)
+{
+  size_t key = (size_t)model->sm.state;
+  for (int door = 0; door < SM_DOOR_COUNT; door++) {
+    key = 4 * key + sm_get_door_state(&model->sm, door);
+  }
+  key = SM_SHACK_STATE_COUNT * key + model->sm.last_shack_state;
+  key = 2 * key + model->timer_armed;
+  key = 2 * key + model->opening;
+  key = 2 * key + model->locking;
+  return key;
+}
+
+static void print_config(FILE * stream, struct SmModel const * model)
+{
+  fprintf(stream, "[%s", sm_state_name(&model->sm));
+  for (int door = 0; door < SM_DOOR_COUNT; door++) {
+    fprintf(stream, ", %s %s", sm_doors[door].name, sm_door_state_name(sm_get_door_state(&model->sm, door)));
+  }
+  fprintf(stream,
+          ", shack %s%s%s%s]",
+          sm_shack_state_name(sm_get_shack_state(&model->sm)),
+          model->timer_armed ? ", timer" : "",
+          model->opening ? ", opening" : "",
+          model->locking ? ", locking" : "");
+}
+
+//! Prints the events that lead from the initial configuration to `nodes[index]`.
+static void print_path(FILE * stream, size_t index)
+{
+  if (nodes[index].parent < 0)
+    return;
+  print_path(stream, (size_t)nodes[index].parent);
+
+  char label[64];
+  fprintf(stream, "  %s\n", sm_event_label(label, sizeof label, nodes[index].event, nodes[index].door));
+}
+
+static bool parse_cli(int argc, char ** argv, struct ExploreArgsCli * args)
+{
+  *args = (struct ExploreArgsCli){
+      .help      = false,
+      .verbose   = false,
+      .max_depth = 0,
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "hvd:")) != -1) {
+    switch (opt) {
+    case 'h':
+    {
+      args->help = true;
+      return true;
+    }
+
+    case 'v':
+    {
+      args->verbose = true;
+      break;
+    }
+
+    case 'd':
+    {
+      errno           = 0;
+      char * end_ptr  = optarg;
+      args->max_depth = strtol(optarg, &end_ptr, 10);
+      if ((errno != 0) || (end_ptr != (optarg + strlen(optarg))) || (args->max_depth <= 0)) {
+        fprintf(stderr, "invalid depth: %s\n", optarg);
+        return false;
+      }
+      break;
+    }
+
+    default:
+    {
+      // unknown argument, error message is already printed by getopt
+      return false;
+    }
+    }
+  }
+
+  if (optind != argc) {
+    print_usage(stderr);
+    return false;
+  }
+
+  return true;
+}
+
+static void print_usage(FILE * stream)
+{
+  static const char usage_msg[] =
+      "sm-explore [-h] [-v] [-d <depth>]"
+      "\n"
+      "Explores all reachable configurations of the state machine and checks its invariants."
+      "\n"
+      ""
+      "\n"
+      "Options:"
+      "\n"
+      "  -h         Print this help text."
+      "\n"
+      "  -v         Print every transition."
+      "\n"
+      "  -d <depth> Only follow event sequences up to <depth> events. Default is no limit."
+      "\n";
+
+  fprintf(stream, usage_msg);
+}
@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sm-check.h"
+#include "state-machine.h"
+
+// Fuzz target for the state machine: every input byte is an event and a door,
+// and the invariants of sm-check.c are checked after each of them.
+//
+// With libFuzzer (needs clang):
+//   make fuzz
+// Without, SM_FUZZ_STANDALONE adds a main() that runs random inputs or replays
+// the files given on the command line:
+//   bin/sm-fuzz [-n <runs>] [-l <length>] [-s <seed>] [file...]
+
+int LLVMFuzzerTestOneInput(uint8_t const * data, size_t size);
+
+int LLVMFuzzerTestOneInput(uint8_t const * data, size_t size)
+{
+  struct SmModel model;
+  sm_model_init(&model);
+
+  for (size_t i = 0; i < size; i++) {
+    enum SM_Event const event = (enum SM_Event)(data[i] % SM_EVENT_COUNT);
+    int                 door  = (data[i] / SM_EVENT_COUNT) % SM_DOOR_COUNT;
+    if (!sm_model_can_apply(&model, event, door))
+      door = SM_NO_DOOR;
+    if (!sm_model_can_apply(&model, event, door))
+      continue;
+
+    char const * const violation = sm_model_apply(&model, event, door);
+    if (violation != NULL) {
+      char label[64];
+      fprintf(stderr, "invariant violated by event %zu (%s): %s\n", i, sm_event_label(label, sizeof label, event, door), violation);
+      abort();
+    }
+  }
+
+  return 0;
+}
+
+#ifdef SM_FUZZ_STANDALONE
+
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#define SM_FUZZ_MAX_INPUT 4096
+
+static bool parse_count(char const * text, unsigned long * value)
+{
+  errno      = 0;
+  char * end = NULL;
+  *value     = strtoul(text, &end, 10);
+  return (errno == 0) && (end != text) && (*end == 0);
+}
+
+//! xorshift64, runs are reproducible with the same seed
+static uint64_t next_random(uint64_t * state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+static bool run_file(char const * path)
+{
+  static uint8_t data[SM_FUZZ_MAX_INPUT];
+
+  FILE * const file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  size_t const size = fread(data, 1, sizeof data, file);
+  fclose(file);
+
+  LLVMFuzzerTestOneInput(data, size);
+  return true;
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned long runs   = 10000;
+  unsigned long length = 256;
+  unsigned long seed   = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "hn:l:s:")) != -1) {
+    switch (opt) {
+    case 'n':
+      if (!parse_count(optarg, &runs)) {
+        fprintf(stderr, "invalid run count: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'l':
+      if (!parse_count(optarg, &length) || (length > SM_FUZZ_MAX_INPUT)) {
+        fprintf(stderr, "invalid length: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 's':
+      if (!parse_count(optarg, &seed) || (seed == 0)) {
+        fprintf(stderr, "invalid seed: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'h':
+      fprintf(stdout, "sm-fuzz [-n <runs>] [-l <length>] [-s <seed>] [file...]\n");
+      return EXIT_SUCCESS;
+
+    default:
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind < argc) {
+    for (int i = optind; i < argc; i++) {
+      if (!run_file(argv[i]))
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  static uint8_t data[SM_FUZZ_MAX_INPUT];
+  uint64_t       state = seed;
+  for (unsigned long run = 0; run < runs; run++) {
+    for (size_t i = 0; i < length; i++) {
+      data[i] = (uint8_t)next_random(&state);
+    }
+    LLVMFuzzerTestOneInput(data, length);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double const elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  double const events  = (double)runs * (double)length;
+
+  fprintf(stdout,
+          "ran %lu inputs of %lu events in %.3f s, %.0f events/s\n",
+          runs,
+          length,
+          elapsed,
+          (elapsed > 0) ? events / elapsed : 0.0);
+
+  return EXIT_SUCCESS;
+}
+
+#endif // SM_FUZZ_STANDALONE
@@ -0,0 +1,115 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "state-machine.h"
+
+// Prints the transition table of the state machine as a Graphviz graph:
+//   bin/sm-graph | dot -Tsvg > state-machine.svg
+
+static void print_mask(char const * (*name)(int id), unsigned int mask, unsigned int all, int count);
+static void print_transition(struct SM_Transition const * transition);
+
+static char const * event_name(int id)
+{
+  return sm_event_name((enum SM_Event)id);
+}
+
+static char const * door_name(int id)
+{
+  return sm_doors[id].name;
+}
+
+static char const * shack_state_name(int id)
+{
+  return sm_shack_state_name((enum ShackState)id);
+}
+
+int main(int argc, char ** argv)
+{
+  (void)argv;
+  if (argc != 1) {
+    fprintf(stderr, "usage: sm-graph > state-machine.dot\n");
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stdout, "// generated by software/bin/sm-graph from sm_transitions, don't edit\n");
+  fprintf(stdout, "digraph state_machine {\n");
+  fprintf(stdout, "  node [shape=box, style=rounded];\n");
+  fprintf(stdout, "  edge [fontsize=10];\n");
+
+  for (int state = 0; state < SM_STATE_COUNT; state++) {
+    fprintf(stdout, "  s%d [label=\"%s\"];\n", state, sm_state_name_by_id(state));
+  }
+
+  for (size_t i = 0; i < sm_transition_count; i++) {
+    print_transition(&sm_transitions[i]);
+  }
+
+  fprintf(stdout, "}\n");
+  return EXIT_SUCCESS;
+}
+
+//! Prints one edge per source state. The label has the priority of the
+//! transition, its events and conditions and the signals it sends.
+static void print_transition(struct SM_Transition const * transition)
+{
+  size_t const priority = (size_t)(transition - sm_transitions) + 1;
+
+  for (int state = 0; state < SM_STATE_COUNT; state++) {
+    if ((transition->states & (1U << state)) == 0)
+      continue;
+
+    int const next = (transition->next_state == SM_SAME_STATE) ? state : transition->next_state;
+
+    fprintf(stdout, "  s%d -> s%d [label=\"%zu. %s\\n", state, next, priority, transition->description);
+    print_mask(event_name, transition->events, (1U << SM_EVENT_COUNT) - 1, SM_EVENT_COUNT);
+    if (transition->doors != (1U << (SM_NO_DOOR + 1)) - 1) {
+      fprintf(stdout, " at ");
+      print_mask(door_name, transition->doors, (1U << SM_DOOR_COUNT) - 1, SM_DOOR_COUNT);
+    }
+    if (transition->shack_states != (1U << SM_SHACK_STATE_COUNT) - 1) {
+      fprintf(stdout, "\\nshack ");
+      print_mask(shack_state_name, transition->shack_states, (1U << SM_SHACK_STATE_COUNT) - 1, SM_SHACK_STATE_COUNT);
+    }
+    if (transition->guard == SM_GUARD_DOOR_CHANGED) {
+      fprintf(stdout, "\\nif the door changed");
+    }
+    if (transition->guard == SM_GUARD_DOOR_UNLOCKED) {
+      fprintf(stdout, "\\nif the door unlocked");
+    }
+    for (size_t i = 0; i < transition->signal_count; i++) {
+      fprintf(stdout, "%s%s", (i == 0) ? "\\n/ " : ", ", sm_signal_name(transition->signals[i]));
+    }
+    fprintf(stdout, "\"];\n");
+  }
+}
+
+//! Prints the names in `mask`, or "not ..." when that is shorter.
+static void print_mask(char const * (*name)(int id), unsigned int mask, unsigned int all, int count)
+{
+  if (mask == all) {
+    fprintf(stdout, "any");
+    return;
+  }
+
+  int set = 0;
+  for (int id = 0; id < count; id++) {
+    if (mask & (1U << id))
+      set += 1;
+  }
+
+  bool const negate = set > count / 2;
+  if (negate) {
+    fprintf(stdout, "not ");
+    mask = all & ~mask;
+  }
+
+  bool first = true;
+  for (int id = 0; id < count; id++) {
+    if ((mask & (1U << id)) == 0)
+      continue;
+    fprintf(stdout, "%s%s", first ? "" : negate ? " or " : ", ", name(id));
+    first = false;
+  }
+}
@@ -0,0 +1,198 @@
+#include "snapshot.h"
+
+#include "clock.h"
+#include "log.h"
+#include "state-machine.h"
+
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FNV_OFFSET 2166136261U
+#define FNV_PRIME  16777619U
+
+static struct
+{
+  char path[PATH_MAX];
+  char temp_path[PATH_MAX];
+  char directory[PATH_MAX];
+
+  bool            saved; // `last` holds the last saved snapshot
+  struct Snapshot last;
+
+  bool     sync_pending; // the file was replaced since the last sync
+  uint64_t last_sync;    // CLOCK_MONOTONIC of the last sync in milliseconds
+} snapshot_writer = {
+    .path         = SNAPSHOT_DEFAULT_PATH,
+    .temp_path    = SNAPSHOT_DEFAULT_PATH ".tmp",
+    .directory    = "/var/lib/portal300",
+    .saved        = false,
+    .sync_pending = false,
+    .last_sync    = 0,
+};
+
+static uint32_t checksum(void const * data, size_t length)
+{
+  uint8_t const * const bytes = data;
+
+  uint32_t hash = FNV_OFFSET;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+bool snapshot_set_path(char const * path)
+{
+  assert(path != NULL);
+
+  if (strlen(path) + sizeof ".tmp" > sizeof snapshot_writer.path) {
+    log_print(LSS_SYSTEM, LL_ERROR, "snapshot path is too long: %s", path);
+    return false;
+  }
+
+  strcpy(snapshot_writer.path, path);
+  snprintf(snapshot_writer.temp_path, sizeof snapshot_writer.temp_path, "%s.tmp", path);
+
+  // dirname() may modify its argument
+  char copy[PATH_MAX];
+  strcpy(copy, path);
+  snprintf(snapshot_writer.directory, sizeof snapshot_writer.directory, "%s", dirname(copy));
+  return true;
+}
+
+bool snapshot_load(struct Snapshot * snapshot)
+{
+  assert(snapshot != NULL);
+
+  int const fd = open(snapshot_writer.path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      log_perror(LSS_SYSTEM, LL_WARNING, "failed to open snapshot");
+    }
+    return false;
+  }
+
+  struct SnapshotHeader header;
+  bool                  ok = (read(fd, &header, sizeof header) == (ssize_t)sizeof header);
+  if (ok) {
+    ok = (header.magic == SNAPSHOT_MAGIC) && (header.version == SNAPSHOT_VERSION) && (header.portal_size == sizeof(struct SnapshotPortal)) && (header.door_count == SM_DOOR_COUNT) && (header.portal_count <= PORTAL_ROUTER_MAX);
+  }
+
+  size_t const portals_size = ok ? header.portal_count * sizeof(struct SnapshotPortal) : 0;
+  if (ok) {
+    ok = (read(fd, snapshot->portals, portals_size) == (ssize_t)portals_size) && (checksum(snapshot->portals, portals_size) == header.checksum);
+  }
+  close(fd);
+
+  if (!ok) {
+    log_print(LSS_SYSTEM, LL_WARNING, "snapshot %s is damaged or from another version, ignoring it.", snapshot_writer.path);
+    return false;
+  }
+
+  snapshot->saved_at     = header.saved_at;
+  snapshot->portal_count = header.portal_count;
+  return true;
+}
+
+bool snapshot_save(struct Snapshot const * snapshot)
+{
+  assert(snapshot != NULL);
+  assert(snapshot->portal_count <= PORTAL_ROUTER_MAX);
+
+  size_t const portals_size = snapshot->portal_count * sizeof(struct SnapshotPortal);
+
+  if (snapshot_writer.saved && (snapshot_writer.last.portal_count == snapshot->portal_count) && (memcmp(snapshot_writer.last.portals, snapshot->portals, portals_size) == 0)) {
+    return true;
+  }
+
+  struct SnapshotHeader const header = {
+      .magic        = SNAPSHOT_MAGIC,
+      .version      = SNAPSHOT_VERSION,
+      .portal_size  = sizeof(struct SnapshotPortal),
+      .portal_count = (uint32_t)snapshot->portal_count,
+      .door_count   = SM_DOOR_COUNT,
+      .checksum     = checksum(snapshot->portals, portals_size),
+      .saved_at     = clock_get_ms(CLOCK_REALTIME),
+  };
+
+  struct iovec const parts[] = {
+      {.iov_base = (void *)&header, .iov_len = sizeof header},
+      {.iov_base = (void *)snapshot->portals, .iov_len = portals_size},
+  };
+  size_t const size = parts[0].iov_len + parts[1].iov_len;
+
+  // the data has to be on disk before the rename, or a power loss can leave
+  // an empty or torn file behind the new name. Saves only happen on changes,
+  // so this is cheap; only the directory sync is batched.
+  int const fd = open(snapshot_writer.temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    log_print_ratelimited(LSS_SYSTEM, LL_WARNING, "failed to create snapshot %s: %s", snapshot_writer.temp_path, strerror(errno));
+    return false;
+  }
+  bool const written = (writev(fd, parts, sizeof parts / sizeof parts[0]) == (ssize_t)size) && (fsync(fd) == 0);
+  close(fd);
+
+  if (!written || (rename(snapshot_writer.temp_path, snapshot_writer.path) == -1)) {
+    log_print_ratelimited(LSS_SYSTEM, LL_WARNING, "failed to write snapshot %s: %s", snapshot_writer.path, strerror(errno));
+    unlink(snapshot_writer.temp_path);
+    return false;
+  }
+
+  snapshot_writer.last.portal_count = snapshot->portal_count;
+  memcpy(snapshot_writer.last.portals, snapshot->portals, portals_size);
+  snapshot_writer.saved        = true;
+  snapshot_writer.sync_pending = true;
+
+  (void)snapshot_sync();
+  return true;
+}
+
+static void sync_now(void)
+{
+  snapshot_writer.sync_pending = false;
+  snapshot_writer.last_sync    = clock_get_ms(CLOCK_MONOTONIC);
+
+  // the file was synced before the rename, which is only durable with its
+  // directory
+  int const dir_fd = open(snapshot_writer.directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1) {
+    log_print_ratelimited(LSS_SYSTEM, LL_WARNING, "failed to open %s for syncing the snapshot: %s", snapshot_writer.directory, strerror(errno));
+    return;
+  }
+  if (fsync(dir_fd) == -1) {
+    log_print_ratelimited(LSS_SYSTEM, LL_WARNING, "failed to sync snapshot %s: %s", snapshot_writer.path, strerror(errno));
+  }
+  close(dir_fd);
+}
+
+int snapshot_sync(void)
+{
+  if (!snapshot_writer.sync_pending) {
+    return -1;
+  }
+
+  uint64_t const now = clock_get_ms(CLOCK_MONOTONIC);
+  uint64_t const due = snapshot_writer.last_sync + SNAPSHOT_SYNC_INTERVAL_MS;
+  if (now < due) {
+    return (int)(due - now);
+  }
+
+  sync_now();
+  return -1;
+}
+
+void snapshot_close(void)
+{
+  if (snapshot_writer.sync_pending) {
+    sync_now();
+  }
+}
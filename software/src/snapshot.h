@@ -0,0 +1,91 @@
+#ifndef PORTAL300_SNAPSHOT_H
+#define PORTAL300_SNAPSHOT_H
+
+#include "audit.h"
+#include "portal-router.h"
+#include "status.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Durable snapshot of the portals, so a restarted daemon continues where the
+// previous one stopped instead of starting unobserved. The daemon saves the
+// snapshot whenever it changed. Each save is written to a temporary file,
+// synced and renamed over the previous one, so a reader always gets a complete
+// snapshot, even after a power loss. Only the sync of the directory, which
+// makes the rename durable, is batched to at most every
+// SNAPSHOT_SYNC_INTERVAL_MS. A crash of the daemon loses nothing, a power loss
+// falls back to a complete snapshot of at most the last interval before.
+
+#define SNAPSHOT_DEFAULT_PATH     "/var/lib/portal300/snapshot"
+#define SNAPSHOT_SYNC_INTERVAL_MS 1000
+
+//! Snapshots older than this are not restored, the doors will have changed since.
+#define SNAPSHOT_MAX_AGE_MS (10u * 60u * 1000u)
+
+#define SNAPSHOT_MAGIC   0x53503350 // "P3PS"
+#define SNAPSHOT_VERSION 1
+
+struct SnapshotKeyholder
+{
+  int32_t member_id; // 0 if nobody holds the key
+  char    nick_name[STATUS_MAX_KEYHOLDER_NICK_LEN];
+};
+
+struct SnapshotPortal
+{
+  char     prefix[PORTAL_ROUTER_PREFIX_LEN]; // the portal is only restored under the same prefix
+  uint64_t timer_deadline;                   // CLOCK_REALTIME in milliseconds when the state machine timer expires, 0 if it isn't running
+  uint8_t  state;                            // internal state of the state machine
+  uint8_t  doors_observed;                   // door bit sets of the state machine
+  uint8_t  doors_open;
+  uint8_t  doors_locked;
+  uint8_t  devices_online; // bit mask of (1 << enum PortalDevice)
+  uint8_t  pending_audit_active;
+  uint8_t  reserved[2];
+
+  struct SnapshotKeyholder current_keyholder;
+  struct SnapshotKeyholder pending_keyholder;
+  struct AuditRecord       pending_audit;
+};
+
+//! Layout of the snapshot file: the header followed by `portal_count` portals.
+struct SnapshotHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t portal_size; // sizeof(struct SnapshotPortal)
+  uint32_t portal_count;
+  uint32_t door_count; // SM_DOOR_COUNT, the door bit sets depend on it
+  uint32_t checksum;   // FNV-1a of the portals
+  uint64_t saved_at;   // CLOCK_REALTIME in milliseconds
+};
+
+struct Snapshot
+{
+  uint64_t              saved_at; // CLOCK_REALTIME in milliseconds, set by snapshot_load()
+  size_t                portal_count;
+  struct SnapshotPortal portals[PORTAL_ROUTER_MAX];
+};
+
+//! Sets the snapshot file.
+bool snapshot_set_path(char const * path);
+
+//! Loads the last saved snapshot. Returns false if there is none or it is
+//! damaged, then the daemon starts from scratch.
+bool snapshot_load(struct Snapshot * snapshot);
+
+//! Saves `snapshot` if it differs from the last saved one. The file is
+//! synced and replaced right away, the directory is synced with
+//! snapshot_sync().
+bool snapshot_save(struct Snapshot const * snapshot);
+
+//! Makes a saved snapshot durable once SNAPSHOT_SYNC_INTERVAL_MS passed since
+//! the last sync. Returns the time in ms until the next sync is due, or -1 if
+//! nothing is pending. Suitable as poll() timeout.
+int snapshot_sync(void);
+
+//! Syncs a pending snapshot right away, for a clean shutdown.
+void snapshot_close(void);
+
+#endif // PORTAL300_SNAPSHOT_H
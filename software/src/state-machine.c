@@ -1,7 +1,14 @@
 #include "state-machine.h"
+#include "flight-recorder.h"
+#include "trace.h"
+
+#include <portal300.h>
 
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 enum State
 {
@@ -11,6 +18,279 @@ enum State
   STATE_WAIT_FOR_OPEN_VIA_C,
 };
 
+_Static_assert(STATE_WAIT_FOR_OPEN_VIA_C + 1 == SM_STATE_COUNT, "SM_STATE_COUNT must match enum State");
+_Static_assert(SM_EVENT_COUNT <= 16, "sm_transitions can only hold 16 events");
+_Static_assert(SM_DOOR_COUNT <= 8, "door states are stored in 8 bit sets");
+
+#define BIT(_Id)   (1U << (_Id))
+#define ANY_STATE  (BIT(SM_STATE_COUNT) - 1)
+#define ANY_SHACK  (BIT(SM_SHACK_STATE_COUNT) - 1)
+#define ANY_DOOR   (BIT(SM_NO_DOOR + 1) - 1)
+#define ALL_DOORS  ((uint8_t)(BIT(SM_DOOR_COUNT) - 1))
+
+//! The doors of the shack. A door added here is observed via its status topic,
+//! locked by SIGNAL_LOCK_ALL and its button locks the shack. The shack is only
+//! locked when all doors are locked and only open when none is.
+struct SM_Door const sm_doors[SM_DOOR_COUNT] = {
+    [SM_DOOR_C2] = {
+        .name           = DOOR_C2,
+        .id             = DOOR_NAME(DOOR_C2),
+        .unlocked_state = SHACK_UNLOCKED_VIA_C2,
+        .device         = DEVICE_DOOR_CONTROL_C2,
+    },
+    [SM_DOOR_B2] = {
+        .name           = DOOR_B2,
+        .id             = DOOR_NAME(DOOR_B2),
+        .unlocked_state = SHACK_UNLOCKED_VIA_B2,
+        .device         = DEVICE_DOOR_CONTROL_B2,
+    },
+};
+
+//! How an event changed the state of its door, the guards depend on it.
+enum DoorChange
+{
+  DOOR_UNCHANGED,
+  DOOR_CHANGED,
+  DOOR_UNLOCKED, // changed from locked to closed or open
+};
+
+#define DOOR_CHANGE_COUNT (DOOR_UNLOCKED + 1)
+
+#define SSH_REQUESTS (BIT(EVENT_SSH_OPEN_FRONT_REQUEST) | BIT(EVENT_SSH_OPEN_BACK_REQUEST) | BIT(EVENT_SSH_CLOSE_REQUEST))
+
+#define SIGNALS(...)                 \
+  .signals      = {__VA_ARGS__},     \
+  .signal_count = sizeof((enum SM_Signal[]){__VA_ARGS__}) / sizeof(enum SM_Signal)
+
+//! All transitions of the state machine. An event is handled by the first
+//! transition that matches the event, the internal state, the shack state
+//! after the event and the guard. Before that, every event updates the door
+//! states and sends SIGNAL_STATE_CHANGE if the shack state changed.
+struct SM_Transition const sm_transitions[] = {
+    {
+        .description  = "the requested action timed out",
+        .events       = BIT(EVENT_TIMEOUT),
+        .doors        = ANY_DOOR,
+        .states       = ANY_STATE & ~BIT(STATE_IDLE),
+        .shack_states = ANY_SHACK,
+        .guard        = SM_GUARD_NONE,
+        .next_state   = STATE_IDLE,
+        SIGNALS(SIGNAL_USER_REQUESTED_TIMED_OUT),
+    },
+    {
+        // after a request to unlock via B2, door B2 was successfully unlocked, but never opened and
+        // has auto-closed itself again. start a timeout for the locking and tell the user that
+        // nobody entered the shack.
+        .description  = "nobody entered via B2",
+        .events       = BIT(EVENT_DOOR_LOCKED),
+        .doors        = BIT(SM_DOOR_B2),
+        .states       = BIT(STATE_WAIT_FOR_OPEN_VIA_B),
+        .shack_states = ANY_SHACK,
+        .guard        = SM_GUARD_DOOR_CHANGED,
+        .next_state   = STATE_WAIT_FOR_LOCKED,
+        SIGNALS(SIGNAL_START_TIMEOUT, SIGNAL_UNLOCK_TIMEOUT),
+    },
+    {
+        .description  = "nobody entered via C2",
+        .events       = BIT(EVENT_DOOR_LOCKED),
+        .doors        = BIT(SM_DOOR_C2),
+        .states       = BIT(STATE_WAIT_FOR_OPEN_VIA_C),
+        .shack_states = ANY_SHACK,
+        .guard        = SM_GUARD_DOOR_CHANGED,
+        .next_state   = STATE_WAIT_FOR_LOCKED,
+        SIGNALS(SIGNAL_START_TIMEOUT, SIGNAL_UNLOCK_TIMEOUT),
+    },
+    {
+        // after a request to unlock via B2, door B2 was successfully opened by a user, now unlock the other door
+        .description  = "entered via B2",
+        .events       = BIT(EVENT_DOOR_OPENED),
+        .doors        = BIT(SM_DOOR_B2),
+        .states       = BIT(STATE_WAIT_FOR_OPEN_VIA_B),
+        .shack_states = ANY_SHACK & ~BIT(SHACK_OPEN),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_OPEN_DOOR_C2_UNSAFE),
+    },
+    {
+        .description  = "entered via C2",
+        .events       = BIT(EVENT_DOOR_OPENED),
+        .doors        = BIT(SM_DOOR_C2),
+        .states       = BIT(STATE_WAIT_FOR_OPEN_VIA_C),
+        .shack_states = ANY_SHACK & ~BIT(SHACK_OPEN),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_OPEN_DOOR_B2_UNSAFE),
+    },
+    {
+        // door B2 reports that it is unlocked, so the entry starts with a fresh timeout
+        .description  = "unlocked via B2",
+        .events       = BIT(EVENT_DOOR_CLOSED),
+        .doors        = BIT(SM_DOOR_B2),
+        .states       = BIT(STATE_WAIT_FOR_OPEN_VIA_B),
+        .shack_states = ANY_SHACK & ~BIT(SHACK_OPEN),
+        .guard        = SM_GUARD_DOOR_UNLOCKED,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_UNLOCK_SUCCESSFUL, SIGNAL_START_TIMEOUT),
+    },
+    {
+        .description  = "unlocked via C2",
+        .events       = BIT(EVENT_DOOR_CLOSED),
+        .doors        = BIT(SM_DOOR_C2),
+        .states       = BIT(STATE_WAIT_FOR_OPEN_VIA_C),
+        .shack_states = ANY_SHACK & ~BIT(SHACK_OPEN),
+        .guard        = SM_GUARD_DOOR_UNLOCKED,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_UNLOCK_SUCCESSFUL, SIGNAL_START_TIMEOUT),
+    },
+    {
+        .description  = "unlocking completed, all doors open",
+        .events       = BIT(EVENT_DOOR_OPENED) | BIT(EVENT_DOOR_CLOSED),
+        .doors        = ANY_DOOR,
+        .states       = BIT(STATE_WAIT_FOR_OPEN_VIA_B) | BIT(STATE_WAIT_FOR_OPEN_VIA_C),
+        .shack_states = BIT(SHACK_OPEN),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = STATE_IDLE,
+        SIGNALS(SIGNAL_CANCEL_TIMEOUT, SIGNAL_OPEN_SUCCESSFUL),
+    },
+    {
+        // open the front door afterwards, so users can leave the shack conveniently
+        .description  = "locking completed",
+        .events       = BIT(EVENT_DOOR_LOCKED),
+        .doors        = ANY_DOOR,
+        .states       = BIT(STATE_WAIT_FOR_LOCKED),
+        .shack_states = BIT(SHACK_LOCKED),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = STATE_IDLE,
+        SIGNALS(SIGNAL_CANCEL_TIMEOUT, SIGNAL_LOCK_SUCCESSFUL, SIGNAL_OPEN_DOOR_B),
+    },
+    {
+        .description  = "door bell opens the front door of an open shack",
+        .events       = BIT(EVENT_DOORBELL_FRONT),
+        .doors        = ANY_DOOR,
+        .states       = ANY_STATE,
+        .shack_states = BIT(SHACK_OPEN),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_OPEN_DOOR_B),
+    },
+    {
+        // When shack is fully locked, you can leave the building through the back
+        // by clicking the close button on C2 again.
+        .description  = "leave a locked shack via C",
+        .events       = BIT(EVENT_BUTTON),
+        .doors        = BIT(SM_DOOR_C2),
+        .states       = ANY_STATE,
+        .shack_states = BIT(SHACK_LOCKED),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_OPEN_DOOR_C),
+    },
+    {
+        .description  = "leave a locked shack via B",
+        .events       = BIT(EVENT_BUTTON),
+        .doors        = BIT(SM_DOOR_B2),
+        .states       = ANY_STATE,
+        .shack_states = BIT(SHACK_LOCKED),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_OPEN_DOOR_B),
+    },
+    {
+        // When shack is closed and open is requested, let the user in and begin unlocking the door.
+        .description  = "open via B",
+        .events       = BIT(EVENT_SSH_OPEN_FRONT_REQUEST),
+        .doors        = ANY_DOOR,
+        .states       = BIT(STATE_IDLE),
+        .shack_states = ANY_SHACK & ~BIT(SHACK_OPEN),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = STATE_WAIT_FOR_OPEN_VIA_B,
+        SIGNALS(SIGNAL_START_TIMEOUT, SIGNAL_OPEN_DOOR_B2_SAFE, SIGNAL_OPEN_DOOR_B),
+    },
+    {
+        .description  = "open via C",
+        .events       = BIT(EVENT_SSH_OPEN_BACK_REQUEST),
+        .doors        = ANY_DOOR,
+        .states       = BIT(STATE_IDLE),
+        .shack_states = ANY_SHACK & ~BIT(SHACK_OPEN),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = STATE_WAIT_FOR_OPEN_VIA_C,
+        SIGNALS(SIGNAL_START_TIMEOUT, SIGNAL_OPEN_DOOR_C2_SAFE, SIGNAL_OPEN_DOOR_C),
+    },
+    {
+        // Transfer key ownership when the shack is already open and no process is in action.
+        .description  = "change keyholder via B",
+        .events       = BIT(EVENT_SSH_OPEN_FRONT_REQUEST),
+        .doors        = ANY_DOOR,
+        .states       = BIT(STATE_IDLE),
+        .shack_states = BIT(SHACK_OPEN),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_OPEN_DOOR_B, SIGNAL_CHANGE_KEYHOLDER),
+    },
+    {
+        .description  = "change keyholder via C",
+        .events       = BIT(EVENT_SSH_OPEN_BACK_REQUEST),
+        .doors        = ANY_DOOR,
+        .states       = BIT(STATE_IDLE),
+        .shack_states = BIT(SHACK_OPEN),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_OPEN_DOOR_C, SIGNAL_CHANGE_KEYHOLDER),
+    },
+    {
+        // Any close request immediatly triggers a closing process when nothing else is happening right now
+        .description  = "lock",
+        .events       = BIT(EVENT_SSH_CLOSE_REQUEST) | BIT(EVENT_BUTTON),
+        .doors        = ANY_DOOR,
+        .states       = BIT(STATE_IDLE),
+        .shack_states = ANY_SHACK & ~BIT(SHACK_LOCKED),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = STATE_WAIT_FOR_LOCKED,
+        SIGNALS(SIGNAL_START_TIMEOUT, SIGNAL_LOCK_ALL),
+    },
+    {
+        // we currently cannot take requests, as we're still performing a process
+        .description  = "busy",
+        .events       = SSH_REQUESTS,
+        .doors        = ANY_DOOR,
+        .states       = ANY_STATE & ~BIT(STATE_IDLE),
+        .shack_states = ANY_SHACK,
+        .guard        = SM_GUARD_NONE,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_CANNOT_HANDLE_REQUEST),
+    },
+    {
+        // opening the front door for people who are late
+        .description  = "already locked",
+        .events       = BIT(EVENT_SSH_CLOSE_REQUEST),
+        .doors        = ANY_DOOR,
+        .states       = ANY_STATE,
+        .shack_states = BIT(SHACK_LOCKED),
+        .guard        = SM_GUARD_NONE,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_NO_STATE_CHANGE, SIGNAL_OPEN_DOOR_B),
+    },
+    {
+        .description  = "request not possible",
+        .events       = SSH_REQUESTS,
+        .doors        = ANY_DOOR,
+        .states       = ANY_STATE,
+        .shack_states = ANY_SHACK,
+        .guard        = SM_GUARD_NONE,
+        .next_state   = SM_SAME_STATE,
+        SIGNALS(SIGNAL_CANNOT_HANDLE_REQUEST),
+    },
+};
+
+size_t const sm_transition_count = sizeof sm_transitions / sizeof sm_transitions[0];
+
+//! Index into `sm_transitions` plus one for every event, door, internal
+//! state, shack state and guard, 0 if the event is ignored. Built from
+//! `sm_transitions` by sm_init().
+static uint8_t dispatch_table[SM_EVENT_COUNT][SM_NO_DOOR + 1][SM_STATE_COUNT][SM_SHACK_STATE_COUNT][DOOR_CHANGE_COUNT];
+
+static void build_dispatch_table(void);
+
 void sm_init(struct StateMachine * sm, StateMachineSignal signal_handler, void * user_data)
 {
   assert(sm != NULL);
@@ -18,290 +298,307 @@ void sm_init(struct StateMachine * sm, StateMachineSignal signal_handler, void *
   *sm = (struct StateMachine){
       .state = STATE_IDLE,
 
-      .door_c2          = DOOR_UNOBSERVED,
-      .door_b2          = DOOR_UNOBSERVED,
+      .doors_observed   = 0,
+      .doors_open       = 0,
+      .doors_locked     = 0,
       .last_shack_state = SHACK_UNOBSERVED,
+      .last_transition  = -1,
 
       .on_signal = signal_handler,
       .user_data = user_data,
   };
+
+  build_dispatch_table();
 }
 
-static bool is_open_request(enum SM_Event event)
+// Applies changes to the door states based on a event.
+static void sm_change_door_state(struct StateMachine * sm, enum SM_Event event, int door)
 {
-  if (event == EVENT_SSH_OPEN_FRONT_REQUEST)
-    return true;
-  if (event == EVENT_SSH_OPEN_BACK_REQUEST)
-    return true;
-  return false;
+  if ((event != EVENT_DOOR_OPENED) && (event != EVENT_DOOR_CLOSED) && (event != EVENT_DOOR_LOCKED))
+    return;
+
+  uint8_t const mask = (uint8_t)BIT(door);
+  sm->doors_observed |= mask;
+  sm->doors_open   = (uint8_t)((sm->doors_open & ~mask) | ((event == EVENT_DOOR_OPENED) ? mask : 0));
+  sm->doors_locked = (uint8_t)((sm->doors_locked & ~mask) | ((event == EVENT_DOOR_LOCKED) ? mask : 0));
 }
 
-static bool is_close_request(enum SM_Event event, enum ShackState shack_state)
+//! Packs the door states as two bits per door, for the flight recorder.
+static uint16_t pack_doors(struct StateMachine const * sm)
 {
-  if (event == EVENT_SSH_CLOSE_REQUEST)
-    return true;
-  if (event == EVENT_BUTTON_C2 && shack_state != SHACK_LOCKED)
-    return true;
-  if (event == EVENT_BUTTON_B2 && shack_state != SHACK_LOCKED)
-    return true;
-  return false;
+  uint16_t doors = 0;
+  for (int door = 0; door < SM_DOOR_COUNT; door++) {
+    doors |= (uint16_t)(sm_get_door_state(sm, door) << (2 * door));
+  }
+  return doors;
 }
 
-enum DoorFilter
+static void send_signal(struct StateMachine * sm, void * context, enum SM_Signal signal)
 {
-  DOOR_B2  = 1,
-  DOOR_C2  = 2,
-  DOOR_ANY = DOOR_B2 | DOOR_C2,
-};
+  flight_recorder_add((struct FlightRecord){
+      .kind         = FLIGHT_SIGNAL,
+      .code         = signal,
+      .state_before = sm->state,
+      .state_after  = sm->state,
+      .doors_before = pack_doors(sm),
+      .doors_after  = pack_doors(sm),
+  });
 
-static bool is_door_unlock_event(enum SM_Event event, enum DoorFilter filter)
-{
-  if (event == EVENT_DOOR_B2_OPENED && (filter & DOOR_B2))
-    return true;
-  if (event == EVENT_DOOR_B2_CLOSED && (filter & DOOR_B2))
-    return true;
-  if (event == EVENT_DOOR_C2_OPENED && (filter & DOOR_C2))
-    return true;
-  if (event == EVENT_DOOR_C2_CLOSED && (filter & DOOR_C2))
-    return true;
-  return false;
+  sm->on_signal(sm->user_data, context, signal);
 }
 
-static bool is_door_lock_event(enum SM_Event event, enum DoorFilter filter)
+bool sm_restore(struct StateMachine * sm, int state, uint8_t doors_observed, uint8_t doors_open, uint8_t doors_locked)
 {
-  if (event == EVENT_DOOR_B2_LOCKED && (filter & DOOR_B2))
-    return true;
-  if (event == EVENT_DOOR_C2_LOCKED && (filter & DOOR_C2))
-    return true;
-  return false;
-}
+  assert(sm != NULL);
 
-static bool is_state_wait_for_open(enum State state)
-{
-  if (state == STATE_WAIT_FOR_OPEN_VIA_B)
-    return true;
-  if (state == STATE_WAIT_FOR_OPEN_VIA_C)
-    return true;
-  return false;
+  if ((state < 0) || (state >= SM_STATE_COUNT))
+    return false;
+  if ((doors_observed & ~ALL_DOORS) != 0)
+    return false;
+  if (((doors_open | doors_locked) & ~doors_observed) != 0)
+    return false;
+  if ((doors_open & doors_locked) != 0)
+    return false;
+
+  int const      previous_state = sm->state;
+  uint16_t const previous_doors = pack_doors(sm);
+
+  sm->state            = state;
+  sm->doors_observed   = doors_observed;
+  sm->doors_open       = doors_open;
+  sm->doors_locked     = doors_locked;
+  sm->last_shack_state = sm_get_shack_state(sm);
+  sm->last_transition  = -1;
+
+  flight_recorder_add((struct FlightRecord){
+      .kind         = FLIGHT_TRANSITION,
+      .code         = 0,
+      .state_before = previous_state,
+      .state_after  = sm->state,
+      .doors_before = previous_doors,
+      .doors_after  = pack_doors(sm),
+  });
+  return true;
 }
 
-static bool is_ssh_request(enum SM_Event event)
-{
-  if (event == EVENT_SSH_OPEN_BACK_REQUEST)
-    return true;
-  if (event == EVENT_SSH_OPEN_FRONT_REQUEST)
-    return true;
-  if (event == EVENT_SSH_CLOSE_REQUEST)
-    return true;
-  return false;
-}
+static void apply_event(struct StateMachine * sm, enum SM_Event event, int door, void * user_context);
 
-// Applies changes to the door states based on a event.
-static void sm_change_door_state(struct StateMachine * sm, enum SM_Event event)
+void sm_apply_event(struct StateMachine * sm, enum SM_Event event, int door, void * user_context)
 {
-  if (event == EVENT_DOOR_B2_OPENED) {
-    sm->door_b2 = DOOR_OPEN;
-  }
-  if (event == EVENT_DOOR_B2_CLOSED) {
-    sm->door_b2 = DOOR_CLOSED;
-  }
-  if (event == EVENT_DOOR_B2_LOCKED) {
-    sm->door_b2 = DOOR_LOCKED;
-  }
-
-  if (event == EVENT_DOOR_C2_OPENED) {
-    sm->door_c2 = DOOR_OPEN;
-  }
-  if (event == EVENT_DOOR_C2_CLOSED) {
-    sm->door_c2 = DOOR_CLOSED;
+  assert((event == EVENT_DOOR_OPENED) || (event == EVENT_DOOR_CLOSED) || (event == EVENT_DOOR_LOCKED) || (event == EVENT_BUTTON)
+             ? (door >= 0) && (door < SM_DOOR_COUNT)
+             : (door == SM_NO_DOOR));
+
+  int const      previous_state = sm->state;
+  uint16_t const previous_doors = pack_doors(sm);
+
+  flight_recorder_add((struct FlightRecord){
+      .kind         = FLIGHT_EVENT,
+      .code         = event,
+      .door         = (uint8_t)door,
+      .state_before = previous_state,
+      .state_after  = previous_state,
+      .doors_before = previous_doors,
+      .doors_after  = previous_doors,
+  });
+
+  apply_event(sm, event, door, user_context);
+
+  if ((sm->state != previous_state) || (pack_doors(sm) != previous_doors)) {
+    flight_recorder_add((struct FlightRecord){
+        .kind         = FLIGHT_TRANSITION,
+        .code         = 0,
+        .state_before = previous_state,
+        .state_after  = sm->state,
+        .doors_before = previous_doors,
+        .doors_after  = pack_doors(sm),
+    });
   }
-  if (event == EVENT_DOOR_C2_LOCKED) {
-    sm->door_c2 = DOOR_LOCKED;
-  }
-}
 
-static void send_signal(struct StateMachine * sm, void * context, enum SM_Signal signal)
-{
-  sm->on_signal(sm->user_data, context, signal);
+  char label[64];
+  trace(SM_EVENT, sm_event_label(label, sizeof label, event, door), sm_state_name_by_id(previous_state), sm_state_name_by_id(sm->state));
 }
 
-void sm_apply_event(struct StateMachine * sm, enum SM_Event event, void * user_context)
+static void apply_event(struct StateMachine * sm, enum SM_Event event, int door, void * user_context)
 {
-  enum DoorState const previous_b2_state = sm->door_b2;
-  enum DoorState const previous_c2_state = sm->door_c2;
+  uint8_t const previous_observed = sm->doors_observed;
+  uint8_t const previous_open     = sm->doors_open;
+  uint8_t const previous_locked   = sm->doors_locked;
 
   // incorporate all door change events *BEFORE* computing the current state
   // of shackspace!
-  sm_change_door_state(sm, event);
-
-  enum ShackState shack_state = sm_get_shack_state(sm);
-  enum State      sm_state    = sm->state;
+  sm_change_door_state(sm, event, door);
 
-#define SIGNAL(_Signal) send_signal(sm, user_context, _Signal)
+  enum ShackState const shack_state  = sm_get_shack_state(sm);
+  bool const            door_changed = (sm->doors_observed != previous_observed) || (sm->doors_open != previous_open) || (sm->doors_locked != previous_locked);
+  bool const            unlocked     = (door < SM_DOOR_COUNT) && (previous_locked & BIT(door)) && !(sm->doors_locked & BIT(door));
 
   // Check if the shack space changed its state
   if (shack_state != sm->last_shack_state) {
     sm->last_shack_state = shack_state;
-    SIGNAL(SIGNAL_STATE_CHANGE);
-    // don't return here, this is just a notification!
+    send_signal(sm, user_context, SIGNAL_STATE_CHANGE);
+    // don't continue here, this is just a notification!
   }
 
-  if (event == EVENT_TIMEOUT && sm_state != STATE_IDLE) {
-    // the requested action timed out
-    sm->state = STATE_IDLE;
-    SIGNAL(SIGNAL_USER_REQUESTED_TIMED_OUT);
-    return;
-  }
+  enum DoorChange const change = unlocked ? DOOR_UNLOCKED : (door_changed ? DOOR_CHANGED : DOOR_UNCHANGED);
 
-  if (previous_b2_state != DOOR_LOCKED && event == EVENT_DOOR_B2_LOCKED && sm_state == STATE_WAIT_FOR_OPEN_VIA_B) {
-    // after a request to unlock via B2, door B2 was successfully unlocked, but never opened and
-    // has auto-closed itself again.
-    sm->state = STATE_WAIT_FOR_LOCKED;
-    SIGNAL(SIGNAL_START_TIMEOUT);  // trigger potential timeout for the locking operation
-    SIGNAL(SIGNAL_UNLOCK_TIMEOUT); // signal via ssh that nobody entered the shack and we're locking again.
+  uint8_t const index = dispatch_table[event][door][sm->state][shack_state][change];
+  sm->last_transition = (int)index - 1;
+  if (index == 0) {
+    // nothing to do for this event right now
     return;
   }
 
-  if (previous_c2_state != DOOR_LOCKED && event == EVENT_DOOR_C2_LOCKED && sm_state == STATE_WAIT_FOR_OPEN_VIA_C) {
-    // after a request to unlock via C2, door C2 was successfully unlocked, but never opened and
-    // has auto-closed itself again.
-    sm->state = STATE_WAIT_FOR_LOCKED;
-    SIGNAL(SIGNAL_START_TIMEOUT);  // trigger potential timeout for the locking operation
-    SIGNAL(SIGNAL_UNLOCK_TIMEOUT); // signal via ssh that nobody entered the shack and we're locking again.
-    return;
+  struct SM_Transition const * const transition = &sm_transitions[index - 1];
+  if (transition->next_state != SM_SAME_STATE) {
+    sm->state = transition->next_state;
   }
-
-  if (event == EVENT_DOOR_B2_OPENED && shack_state != SHACK_OPEN && sm_state == STATE_WAIT_FOR_OPEN_VIA_B) {
-    // after a request to unlock via B2, door B2 was successfully opened by a user, now unlock the other door:
-    SIGNAL(SIGNAL_OPEN_DOOR_C2_UNSAFE);
-    return;
+  for (size_t i = 0; i < transition->signal_count; i++) {
+    send_signal(sm, user_context, transition->signals[i]);
   }
+}
 
-  if (event == EVENT_DOOR_C2_OPENED && shack_state != SHACK_OPEN && sm_state == STATE_WAIT_FOR_OPEN_VIA_C) {
-    // after a request to unlock via C2, door C2 was successfully opened by a user, now unlock the other door:
-    SIGNAL(SIGNAL_OPEN_DOOR_B2_UNSAFE);
+//! Compiles `sm_transitions` into `dispatch_table`: For every combination of
+//! the inputs, the first matching transition wins.
+static void build_dispatch_table(void)
+{
+  static bool built = false;
+  if (built)
     return;
-  }
 
-  if (is_door_unlock_event(event, DOOR_ANY) && shack_state == SHACK_OPEN && is_state_wait_for_open(sm_state)) {
-    // unlock process completed, both doors open
-    sm->state = STATE_IDLE;
-    SIGNAL(SIGNAL_CANCEL_TIMEOUT);
-    SIGNAL(SIGNAL_OPEN_SUCCESSFUL);
-    return;
+  for (size_t event = 0; event < SM_EVENT_COUNT; event++) {
+    for (size_t door = 0; door <= SM_NO_DOOR; door++) {
+      for (size_t state = 0; state < SM_STATE_COUNT; state++) {
+        for (size_t shack_state = 0; shack_state < SM_SHACK_STATE_COUNT; shack_state++) {
+          for (size_t change = 0; change < DOOR_CHANGE_COUNT; change++) {
+            uint8_t index = 0;
+            for (size_t i = 0; i < sm_transition_count; i++) {
+              struct SM_Transition const * const transition = &sm_transitions[i];
+              if ((transition->events & (1U << event)) == 0)
+                continue;
+              if ((transition->doors & (1U << door)) == 0)
+                continue;
+              if ((transition->states & (1U << state)) == 0)
+                continue;
+              if ((transition->shack_states & (1U << shack_state)) == 0)
+                continue;
+              if ((transition->guard == SM_GUARD_DOOR_CHANGED) && (change == DOOR_UNCHANGED))
+                continue;
+              if ((transition->guard == SM_GUARD_DOOR_UNLOCKED) && (change != DOOR_UNLOCKED))
+                continue;
+              index = (uint8_t)(i + 1);
+              break;
+            }
+            dispatch_table[event][door][state][shack_state][change] = index;
+          }
+        }
+      }
+    }
   }
 
-  if (is_door_lock_event(event, DOOR_ANY) && shack_state == SHACK_LOCKED && sm_state == STATE_WAIT_FOR_LOCKED) {
-    // lock successful
-    sm->state = STATE_IDLE;
-    SIGNAL(SIGNAL_CANCEL_TIMEOUT);
-    SIGNAL(SIGNAL_LOCK_SUCCESSFUL);
+  built = true;
+}
 
-    SIGNAL(SIGNAL_OPEN_DOOR_B); // open front door so users can leave the shack conveniently
-    return;
-  }
+bool sm_is_busy(struct StateMachine const * sm)
+{
+  assert(sm != NULL);
+  return (sm->state != STATE_IDLE);
+}
 
-  if (event == EVENT_DOORBELL_FRONT && shack_state == SHACK_OPEN) {
-    // When the shack is open, ringing the door bell will unlock the front door.
-    SIGNAL(SIGNAL_OPEN_DOOR_B);
-    return;
-  }
+//! An opening waits for `door` to unlock first, then for somebody to enter through it.
+static enum SM_Phase opening_phase(struct StateMachine const * sm, int door)
+{
+  enum DoorState const state = sm_get_door_state(sm, door);
+  return ((state == DOOR_CLOSED) || (state == DOOR_OPEN)) ? SM_PHASE_ENTRY : SM_PHASE_UNLOCK;
+}
 
-  if (event == EVENT_BUTTON_C2 && shack_state == SHACK_LOCKED) {
-    // When shack is fully locked, you can leave the building through the back
-    // by clicking the close button on C2 again (unlocks door C).
-    SIGNAL(SIGNAL_OPEN_DOOR_C);
-    return;
-  }
+enum SM_Phase sm_get_phase(struct StateMachine const * sm)
+{
+  assert(sm != NULL);
 
-  if (event == EVENT_BUTTON_B2 && shack_state == SHACK_LOCKED) {
-    // When shack is fully locked, you can leave the building through the front
-    // by clicking the close button on B2 again (unlocks door B).
-    SIGNAL(SIGNAL_OPEN_DOOR_B);
-    return;
+  switch (sm->state) {
+  case STATE_WAIT_FOR_LOCKED: return SM_PHASE_LOCK;
+  case STATE_WAIT_FOR_OPEN_VIA_B: return opening_phase(sm, SM_DOOR_B2);
+  case STATE_WAIT_FOR_OPEN_VIA_C: return opening_phase(sm, SM_DOOR_C2);
+  default: return SM_NO_PHASE;
   }
+}
 
-  if (event == EVENT_SSH_OPEN_FRONT_REQUEST && shack_state != SHACK_OPEN && sm_state == STATE_IDLE) {
-    // When shack is closed and open is requested, let the user in and begin unlocking the door.
-    sm->state = STATE_WAIT_FOR_OPEN_VIA_B;
-    SIGNAL(SIGNAL_START_TIMEOUT);
-    SIGNAL(SIGNAL_OPEN_DOOR_B2_SAFE);
-    SIGNAL(SIGNAL_OPEN_DOOR_B);
-    return;
-  }
+bool sm_serves_request(struct StateMachine const * sm, enum SM_Event request)
+{
+  assert(sm != NULL);
 
-  if (event == EVENT_SSH_OPEN_BACK_REQUEST && shack_state != SHACK_OPEN && sm_state == STATE_IDLE) {
-    // When shack is closed and open is requested, let the user in and begin unlocking the door.
-    sm->state = STATE_WAIT_FOR_OPEN_VIA_C;
-    SIGNAL(SIGNAL_START_TIMEOUT);
-    SIGNAL(SIGNAL_OPEN_DOOR_C2_SAFE);
-    SIGNAL(SIGNAL_OPEN_DOOR_C);
-    return;
+  switch (request) {
+  case EVENT_SSH_OPEN_FRONT_REQUEST: return (sm->state == STATE_WAIT_FOR_OPEN_VIA_B);
+  case EVENT_SSH_OPEN_BACK_REQUEST: return (sm->state == STATE_WAIT_FOR_OPEN_VIA_C);
+  case EVENT_SSH_CLOSE_REQUEST: return (sm->state == STATE_WAIT_FOR_LOCKED);
+  default: return false;
   }
+}
 
-  if (is_open_request(event) && shack_state == SHACK_OPEN && sm_state == STATE_IDLE) {
+bool sm_waits_for_door(struct StateMachine const * sm, int door)
+{
+  assert(sm != NULL);
+  assert((door >= 0) && (door < SM_DOOR_COUNT));
 
-    if (event == EVENT_SSH_OPEN_FRONT_REQUEST) {
-      // if opening of front door is requested
-      SIGNAL(SIGNAL_OPEN_DOOR_B);
-    }
+  uint8_t const mask = (uint8_t)BIT(door);
+  switch (sm->state) {
+  // a lock that started with the last door already locked, like after nobody
+  // entered, only completes with the next status of any door
+  case STATE_WAIT_FOR_LOCKED: return ((sm->doors_locked & mask) == 0) || (sm->doors_locked == ALL_DOORS);
 
-    if (event == EVENT_SSH_OPEN_BACK_REQUEST) {
-      // if opening of front door is requested
-      SIGNAL(SIGNAL_OPEN_DOOR_C);
-    }
+  // every status of the entry door that shows somebody in it unlocks the
+  // other door, which completes the opening once it is open
+  case STATE_WAIT_FOR_OPEN_VIA_B: return (door == SM_DOOR_B2) || ((sm->doors_open & mask) == 0);
+  case STATE_WAIT_FOR_OPEN_VIA_C: return (door == SM_DOOR_C2) || ((sm->doors_open & mask) == 0);
 
-    // Transfer key ownership when the shack was successfully unlocked when no process is in action.
-    SIGNAL(SIGNAL_CHANGE_KEYHOLDER);
-    return;
+  default: return false;
   }
+}
 
-  if (is_close_request(event, shack_state) && shack_state != SHACK_LOCKED && sm_state == STATE_IDLE) {
-    // Any close request immediatly triggers a closing process when nothing else is happening right now
-    sm->state = STATE_WAIT_FOR_LOCKED;
-    SIGNAL(SIGNAL_START_TIMEOUT);
-    SIGNAL(SIGNAL_LOCK_ALL);
-    return;
-  }
+enum ShackState sm_get_shack_state(struct StateMachine const * sm)
+{
+  if (sm->doors_observed != ALL_DOORS)
+    return SHACK_UNOBSERVED;
+  if (sm->doors_locked == ALL_DOORS)
+    return SHACK_LOCKED;
+  if (sm->doors_locked == 0)
+    return SHACK_OPEN;
 
-  if (is_ssh_request(event) && sm_state != STATE_IDLE) {
-    // we currently cannot take requests, as we're still performing a process
-    SIGNAL(SIGNAL_CANNOT_HANDLE_REQUEST);
-    return;
-  }
+  // partially locked, named after the first unlocked door
+  unsigned int const unlocked = ALL_DOORS & ~sm->doors_locked;
+  return sm_doors[__builtin_ctz(unlocked)].unlocked_state;
+}
 
-  if (event == EVENT_SSH_CLOSE_REQUEST && shack_state == SHACK_LOCKED) {
-    SIGNAL(SIGNAL_NO_STATE_CHANGE);
-    SIGNAL(SIGNAL_OPEN_DOOR_B); // Opening door for people who are late
-    return;
-  }
+enum DoorState sm_get_door_state(struct StateMachine const * sm, int door)
+{
+  assert((door >= 0) && (door < SM_DOOR_COUNT));
+  uint8_t const mask = (uint8_t)BIT(door);
+  if ((sm->doors_observed & mask) == 0)
+    return DOOR_UNOBSERVED;
+  if (sm->doors_locked & mask)
+    return DOOR_LOCKED;
+  if (sm->doors_open & mask)
+    return DOOR_OPEN;
+  return DOOR_CLOSED;
+}
 
-  if (is_ssh_request(event)) {
-    // we currently cannot take requests, as we're still performing a process
-    SIGNAL(SIGNAL_CANNOT_HANDLE_REQUEST);
-    return;
+int sm_find_door(char const * name)
+{
+  for (int door = 0; door < SM_DOOR_COUNT; door++) {
+    if (strcmp(sm_doors[door].name, name) == 0)
+      return door;
   }
-
-#undef SIGNAL
+  return -1;
 }
 
-enum ShackState sm_get_shack_state(struct StateMachine const * sm)
+int sm_find_door_id(char const * id)
 {
-  if (sm->door_c2 == DOOR_UNOBSERVED || sm->door_b2 == DOOR_UNOBSERVED) {
-    return SHACK_UNOBSERVED;
+  for (int door = 0; door < SM_DOOR_COUNT; door++) {
+    if (strcmp(sm_doors[door].id, id) == 0)
+      return door;
   }
-
-  bool locked_b2 = (sm->door_b2 == DOOR_LOCKED);
-  bool locked_c2 = (sm->door_c2 == DOOR_LOCKED);
-
-  if (locked_b2 && locked_c2)
-    return SHACK_LOCKED;
-  else if (!locked_b2 && !locked_c2)
-    return SHACK_OPEN;
-  else if (!locked_c2)
-    return SHACK_UNLOCKED_VIA_C2;
-  else
-    return SHACK_UNLOCKED_VIA_B2;
+  return -1;
 }
 
 char const * sm_shack_state_name(enum ShackState state)
@@ -332,15 +629,88 @@ char const * sm_door_state_name(enum DoorState state)
   return "<<INVALID>>";
 }
 
+char const * sm_event_name(enum SM_Event event)
+{
+  switch (event) {
+  case EVENT_DOOR_OPENED: return "door opened";
+  case EVENT_DOOR_CLOSED: return "door closed";
+  case EVENT_DOOR_LOCKED: return "door locked";
+  case EVENT_SSH_OPEN_FRONT_REQUEST: return "ssh open front request";
+  case EVENT_SSH_OPEN_BACK_REQUEST: return "ssh open back request";
+  case EVENT_SSH_CLOSE_REQUEST: return "ssh close request";
+  case EVENT_BUTTON: return "button";
+  case EVENT_DOORBELL_FRONT: return "doorbell front";
+  case EVENT_TIMEOUT: return "timeout";
+  }
+  return "<<INVALID>>";
+}
+
+char const * sm_event_label(char * buffer, size_t size, enum SM_Event event, int door)
+{
+  if ((door < 0) || (door >= SM_DOOR_COUNT))
+    return sm_event_name(event);
+
+  switch (event) {
+  case EVENT_DOOR_OPENED: snprintf(buffer, size, "door %s opened", sm_doors[door].name); break;
+  case EVENT_DOOR_CLOSED: snprintf(buffer, size, "door %s closed", sm_doors[door].name); break;
+  case EVENT_DOOR_LOCKED: snprintf(buffer, size, "door %s locked", sm_doors[door].name); break;
+  case EVENT_BUTTON: snprintf(buffer, size, "button %s", sm_doors[door].name); break;
+  default: return sm_event_name(event);
+  }
+  return buffer;
+}
+
+char const * sm_signal_name(enum SM_Signal signal)
+{
+  switch (signal) {
+  case SIGNAL_OPEN_DOOR_B: return "open door b";
+  case SIGNAL_OPEN_DOOR_C: return "open door c";
+  case SIGNAL_OPEN_DOOR_B2_SAFE: return "open door b2 safe";
+  case SIGNAL_OPEN_DOOR_C2_SAFE: return "open door c2 safe";
+  case SIGNAL_OPEN_DOOR_B2_UNSAFE: return "open door b2 unsafe";
+  case SIGNAL_OPEN_DOOR_C2_UNSAFE: return "open door c2 unsafe";
+  case SIGNAL_LOCK_ALL: return "lock all";
+  case SIGNAL_CHANGE_KEYHOLDER: return "change keyholder";
+  case SIGNAL_STATE_CHANGE: return "state change";
+  case SIGNAL_NO_STATE_CHANGE: return "no state change";
+  case SIGNAL_UNLOCK_SUCCESSFUL: return "unlock successful";
+  case SIGNAL_LOCK_SUCCESSFUL: return "lock successful";
+  case SIGNAL_OPEN_SUCCESSFUL: return "open successful";
+  case SIGNAL_CANNOT_HANDLE_REQUEST: return "cannot handle request";
+  case SIGNAL_USER_REQUESTED_TIMED_OUT: return "user requested timed out";
+  case SIGNAL_UNLOCK_TIMEOUT: return "unlock timeout";
+  case SIGNAL_START_TIMEOUT: return "start timeout";
+  case SIGNAL_CANCEL_TIMEOUT: return "cancel timeout";
+  case SIGNAL_REQUEST_ATTACHED: return "request attached";
+  case SIGNAL_REQUEST_QUEUED: return "request queued";
+  }
+  return "<<INVALID>>";
+}
+
+char const * sm_phase_name(enum SM_Phase phase)
+{
+  switch (phase) {
+  case SM_PHASE_UNLOCK: return "unlock";
+  case SM_PHASE_ENTRY: return "entry";
+  case SM_PHASE_LOCK: return "lock";
+  }
+  return "<<INVALID>>";
+}
+
 char const * sm_state_name(struct StateMachine const * sm)
 {
-  if (sm->state == STATE_IDLE)
+  return sm_state_name_by_id(sm->state);
+}
+
+char const * sm_state_name_by_id(int state)
+{
+  if (state == STATE_IDLE)
     return "idle";
-  if (sm->state == STATE_WAIT_FOR_OPEN_VIA_B)
+  if (state == STATE_WAIT_FOR_OPEN_VIA_B)
     return "wait for shack entry via B";
-  if (sm->state == STATE_WAIT_FOR_OPEN_VIA_C)
+  if (state == STATE_WAIT_FOR_OPEN_VIA_C)
     return "wait for shack entry via C";
-  if (sm->state == STATE_WAIT_FOR_LOCKED)
+  if (state == STATE_WAIT_FOR_LOCKED)
     return "wait for shack locked";
 
   return "<<INVALID>>";
@@ -1,34 +1,48 @@
 #ifndef PORTAL300_DAEMON_STATE_MACHINE_H
 #define PORTAL300_DAEMON_STATE_MACHINE_H
 
+#include "status.h"
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! Index into `sm_doors`. Door states, the shack state, locking and buttons
+//! work on these indices, but a door is more than a registry entry: it also
+//! needs its own SHACK_UNLOCKED_VIA_* state, door control device and status
+//! fields, and signals and transitions to be used as an entry.
+enum SM_DoorId
+{
+  SM_DOOR_C2 = 0,
+  SM_DOOR_B2 = 1,
+};
 
-#define STATE_MACHINE_TIMEOUT_MS 120000 // ms
+#define SM_DOOR_COUNT 2
+
+//! `door` of events that don't belong to a door.
+#define SM_NO_DOOR SM_DOOR_COUNT
 
 enum SM_Event
 {
-  // door status changes:
-  EVENT_DOOR_B2_OPENED, // door B2 changed its state to open
-  EVENT_DOOR_B2_CLOSED, // door B2 changed its state to closed
-  EVENT_DOOR_B2_LOCKED, // door B2 changed its state to locked
-
-  EVENT_DOOR_C2_OPENED, // door C2 changed its state to open
-  EVENT_DOOR_C2_CLOSED, // door C2 changed its state to closed
-  EVENT_DOOR_C2_LOCKED, // door C2 changed its state to locked
+  // door status changes, of the door passed to `sm_apply_event`:
+  EVENT_DOOR_OPENED, // the door changed its state to open
+  EVENT_DOOR_CLOSED, // the door changed its state to closed
+  EVENT_DOOR_LOCKED, // the door changed its state to locked
 
   // user interactions:
   EVENT_SSH_OPEN_FRONT_REQUEST, // user requested front door entry via SSH interface
   EVENT_SSH_OPEN_BACK_REQUEST,  // user requested back door entry via SSH interface
   EVENT_SSH_CLOSE_REQUEST,      // user requested lock down via SSH interface
 
-  EVENT_BUTTON_C2, // User pressed the button on door C2
-  EVENT_BUTTON_B2, // User pressed the button on door B2
+  EVENT_BUTTON, // User pressed the button on the door passed to `sm_apply_event`
 
   // other events
   EVENT_DOORBELL_FRONT, // Someone rang the door bell.
   EVENT_TIMEOUT,        // The requested timeout happened
 };
 
+#define SM_EVENT_COUNT (EVENT_TIMEOUT + 1)
+
 enum SM_Signal
 {
   SIGNAL_OPEN_DOOR_B,         // opens door B (temporary, unlocks itself after short time)
@@ -51,8 +65,12 @@ enum SM_Signal
   SIGNAL_USER_REQUESTED_TIMED_OUT, // the request that is currently processed has timed out
   SIGNAL_UNLOCK_TIMEOUT,           // nobody entered the space, and a door decided to auto-close the space again.
 
-  SIGNAL_START_TIMEOUT,  // a timeout is requested by the state machine. apply `EVENT_TIMEOUT` after `STATE_MACHINE_TIMEOUT_MS` milliseconds
+  SIGNAL_START_TIMEOUT,  // a timeout is requested by the state machine. apply `EVENT_TIMEOUT` after the timeout of the current phase, see sm_get_phase()
   SIGNAL_CANCEL_TIMEOUT, // a previously started timeout should be cancelled
+
+  // sent by the controller for requests that arrive while the state machine is busy:
+  SIGNAL_REQUEST_ATTACHED, // the request waits for the result of the running transaction, which does what it asks for
+  SIGNAL_REQUEST_QUEUED,   // the request is applied as soon as the running transaction is finished
 };
 
 enum DoorState
@@ -72,6 +90,66 @@ enum ShackState
   SHACK_LOCKED          = 4,
 };
 
+#define SM_SHACK_STATE_COUNT (SHACK_LOCKED + 1)
+
+//! Phases of a running transaction, each has its own timeout.
+enum SM_Phase
+{
+  SM_PHASE_UNLOCK = 0, // the door to enter through is unlocking
+  SM_PHASE_ENTRY  = 1, // the door is unlocked, waiting for somebody to enter
+  SM_PHASE_LOCK   = 2, // the doors are locking
+};
+
+#define SM_PHASE_COUNT (SM_PHASE_LOCK + 1)
+
+//! Phase of the idle state machine.
+#define SM_NO_PHASE SM_PHASE_COUNT
+
+//! Number of internal states, see `sm_state_name_by_id`.
+#define SM_STATE_COUNT 4
+
+//! `next_state` of a transition that keeps the internal state.
+#define SM_SAME_STATE (-1)
+
+#define SM_MAX_TRANSITION_SIGNALS 3
+
+//! Entry of the door registry.
+struct SM_Door
+{
+  char const *    name;           // "b2", also used in the status topic of the door
+  char const *    id;             // "door.b2", payload of button events and door actions
+  enum ShackState   unlocked_state; // shack state when this is the first unlocked door of a partially locked shack
+  enum PortalDevice device;         // door control that reports the status of this door
+};
+
+//! The doors observed by the state machine, indexed by `enum SM_DoorId`.
+extern struct SM_Door const sm_doors[SM_DOOR_COUNT];
+
+enum SM_Guard
+{
+  SM_GUARD_NONE          = 0,
+  SM_GUARD_DOOR_CHANGED  = 1, // the event changed the state of its door
+  SM_GUARD_DOOR_UNLOCKED = 2, // the door of the event was locked before and isn't anymore
+};
+
+//! A row of the transition table, see `sm_transitions`.
+struct SM_Transition
+{
+  char const *   description;
+  uint16_t       events;       // bit mask of (1 << enum SM_Event)
+  uint16_t       doors;        // bit mask of (1 << door of the event), including SM_NO_DOOR
+  uint8_t        states;       // bit mask of (1 << internal state)
+  uint8_t        shack_states; // bit mask of (1 << enum ShackState), after the door states were updated
+  uint8_t        guard;        // enum SM_Guard
+  int8_t         next_state;   // internal state afterwards, SM_SAME_STATE to keep it
+  uint8_t        signal_count;
+  enum SM_Signal signals[SM_MAX_TRANSITION_SIGNALS]; // sent in this order
+};
+
+//! The transitions of the state machine, first match wins.
+extern struct SM_Transition const sm_transitions[];
+extern size_t const               sm_transition_count;
+
 struct StateMachine;
 
 //! Signal handler callback
@@ -82,10 +160,15 @@ typedef void (*StateMachineSignal)(void * user_data, void * context, enum SM_Sig
 
 struct StateMachine
 {
-  int             state;
-  enum DoorState  door_c2;
-  enum DoorState  door_b2;
+  int state;
+
+  // door states as bit sets over `sm_doors`, see sm_get_door_state()
+  uint8_t doors_observed;
+  uint8_t doors_open;
+  uint8_t doors_locked;
+
   enum ShackState last_shack_state;
+  int             last_transition; // index into `sm_transitions` of the last event, -1 if it was ignored
 
   StateMachineSignal on_signal;
   void *             user_data;
@@ -93,12 +176,52 @@ struct StateMachine
 
 void sm_init(struct StateMachine * sm, StateMachineSignal signal_handler, void * user_data);
 
-void sm_apply_event(struct StateMachine * sm, enum SM_Event event, void * context);
+//! Applies `event`. `door` is the index into `sm_doors` for door status
+//! changes and buttons, SM_NO_DOOR otherwise.
+void sm_apply_event(struct StateMachine * sm, enum SM_Event event, int door, void * context);
+
+//! Restores the internal state and the door states of a state machine of a
+//! previous run, without sending signals. Returns false and leaves `sm` alone
+//! if they are not consistent.
+bool sm_restore(struct StateMachine * sm, int state, uint8_t doors_observed, uint8_t doors_open, uint8_t doors_locked);
+
+//! Returns true while a transaction is running. The state machine rejects
+//! requests with SIGNAL_CANNOT_HANDLE_REQUEST then.
+bool sm_is_busy(struct StateMachine const * sm);
+
+//! Returns the phase of the running transaction, or SM_NO_PHASE.
+enum SM_Phase sm_get_phase(struct StateMachine const * sm);
+
+//! Returns true if the running transaction leads to the result the ssh
+//! request `request` asks for, so the request can wait for it.
+bool sm_serves_request(struct StateMachine const * sm, enum SM_Event request);
+
+//! Returns true if a status update of `door` can advance the running
+//! transaction, even if it repeats the last one: a lock waits for the doors
+//! that aren't locked yet, an opening for its entry door and the doors that
+//! aren't open yet. A lock of an already locked shack waits for any door.
+bool sm_waits_for_door(struct StateMachine const * sm, int door);
 
 enum ShackState sm_get_shack_state(struct StateMachine const * sm);
+enum DoorState  sm_get_door_state(struct StateMachine const * sm, int door);
+
+//! Returns the index of the door called `name` in `sm_doors`, or -1.
+int sm_find_door(char const * name);
+
+//! Returns the index of the door with the id `id` in `sm_doors`, or -1.
+int sm_find_door_id(char const * id);
 
 char const * sm_shack_state_name(enum ShackState state);
 char const * sm_door_state_name(enum DoorState state);
+char const * sm_event_name(enum SM_Event event);
+
+//! Writes the name of `event` for `door` into `buffer`, like "door b2 opened".
+char const * sm_event_label(char * buffer, size_t size, enum SM_Event event, int door);
+char const * sm_signal_name(enum SM_Signal signal);
+char const * sm_phase_name(enum SM_Phase phase);
 char const * sm_state_name(struct StateMachine const * sm);
 
+//! Returns the name of an internal state as stored in `struct StateMachine.state`.
+char const * sm_state_name_by_id(int state);
+
 #endif
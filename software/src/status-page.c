@@ -0,0 +1,249 @@
+#include "status-page.h"
+
+#include "log.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATUS_PAGE_MAGIC   0x50335350 // "PS3P"
+#define STATUS_PAGE_VERSION 1
+
+//! Layout of the file. Only fields may be appended, readers check `size`
+//! to see how much of `status` the writer knows about.
+struct StatusPage
+{
+  uint32_t         magic;
+  uint32_t         version;
+  uint32_t         size;     // sizeof(struct PortalStatus) of the writer
+  uint32_t         pid;      // process id of the writer, used to detect stale pages
+  _Atomic uint32_t sequence; // odd while an update is in progress
+  uint32_t         reserved;
+  uint64_t         update_time; // CLOCK_REALTIME of the last update in nanoseconds
+
+  struct PortalStatus status;
+};
+
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "status page requires lock-free atomics to be shared between processes");
+
+static struct StatusPage * writer_page = NULL;
+static char                writer_path[PATH_MAX];
+
+bool status_page_create(char const * path)
+{
+  assert(path != NULL);
+  assert(writer_page == NULL);
+
+  char temp_path[PATH_MAX];
+  if (snprintf(temp_path, sizeof temp_path, "%s.tmp", path) >= (int)sizeof temp_path) {
+    log_print(LSS_SYSTEM, LL_ERROR, "status page path is too long: %s", path);
+    return false;
+  }
+
+  int const fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to create status page");
+    return false;
+  }
+
+  if (ftruncate(fd, sizeof(struct StatusPage)) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to resize status page");
+    close(fd);
+    unlink(temp_path);
+    return false;
+  }
+
+  void * const mapping = mmap(NULL, sizeof(struct StatusPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps the file alive
+  if (mapping == MAP_FAILED) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to map status page");
+    unlink(temp_path);
+    return false;
+  }
+
+  struct StatusPage * const page = mapping;
+  page->magic                    = STATUS_PAGE_MAGIC;
+  page->version                  = STATUS_PAGE_VERSION;
+  page->size                     = sizeof(struct PortalStatus);
+  page->pid                      = getpid();
+  atomic_init(&page->sequence, 0);
+
+  // readers must never see a half-initialized page, so only make it visible now
+  if (rename(temp_path, path) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to move status page into place");
+    munmap(mapping, sizeof(struct StatusPage));
+    unlink(temp_path);
+    return false;
+  }
+
+  strncpy(writer_path, path, sizeof writer_path - 1);
+  writer_page = page;
+  return true;
+}
+
+void status_page_destroy(void)
+{
+  if (writer_page == NULL)
+    return;
+
+  if (munmap(writer_page, sizeof(struct StatusPage)) == -1) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to unmap status page");
+  }
+  writer_page = NULL;
+
+  if (unlink(writer_path) == -1) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to delete status page");
+  }
+}
+
+void status_page_publish(struct PortalStatus const * status)
+{
+  assert(status != NULL);
+  if (writer_page == NULL)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  uint32_t const sequence = atomic_load_explicit(&writer_page->sequence, memory_order_relaxed);
+
+  atomic_store_explicit(&writer_page->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  writer_page->status      = *status;
+  writer_page->update_time = 1000000000ULL * now.tv_sec + now.tv_nsec;
+
+  atomic_store_explicit(&writer_page->sequence, sequence + 2, memory_order_release);
+}
+
+bool status_page_open(struct StatusPageReader * reader, char const * path)
+{
+  assert(reader != NULL);
+  assert(path != NULL);
+
+  *reader = (struct StatusPageReader){
+      .fd   = -1,
+      .page = NULL,
+  };
+
+  int const fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to open status page");
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to query status page");
+    close(fd);
+    return false;
+  }
+  if ((size_t)info.st_size < sizeof(struct StatusPage)) {
+    log_print(LSS_SYSTEM, LL_ERROR, "status page is too small: %zu bytes", (size_t)info.st_size);
+    close(fd);
+    return false;
+  }
+
+  void const * const mapping = mmap(NULL, sizeof(struct StatusPage), PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to map status page");
+    close(fd);
+    return false;
+  }
+
+  struct StatusPage const * const page = mapping;
+  if (page->magic != STATUS_PAGE_MAGIC || page->version != STATUS_PAGE_VERSION) {
+    log_print(LSS_SYSTEM, LL_ERROR, "status page has an unsupported format");
+    munmap((void *)mapping, sizeof(struct StatusPage));
+    close(fd);
+    return false;
+  }
+
+  reader->fd   = fd;
+  reader->page = mapping;
+  return true;
+}
+
+void status_page_close(struct StatusPageReader * reader)
+{
+  assert(reader != NULL);
+  if (reader->page != NULL) {
+    munmap((void *)reader->page, sizeof(struct StatusPage));
+  }
+  if (reader->fd != -1) {
+    close(reader->fd);
+  }
+  reader->page = NULL;
+  reader->fd   = -1;
+}
+
+enum StatusPageResult status_page_read(struct StatusPageReader const * reader, struct PortalStatus * status)
+{
+  assert(reader != NULL);
+  assert(reader->page != NULL);
+  assert(status != NULL);
+
+  // the page is shared with the writer, so the sequence is modified concurrently
+  struct StatusPage * const page = (struct StatusPage *)reader->page;
+
+  size_t const copy_len = (page->size < sizeof *status) ? page->size : sizeof *status;
+  memset(status, 0, sizeof *status);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += STATUS_PAGE_READ_TIMEOUT_MS / 1000;
+  deadline.tv_nsec += (STATUS_PAGE_READ_TIMEOUT_MS % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  bool consistent = false;
+  for (bool first = true; !consistent; first = false) {
+    if (!first) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if ((now.tv_sec > deadline.tv_sec) || ((now.tv_sec == deadline.tv_sec) && (now.tv_nsec >= deadline.tv_nsec))) {
+        break;
+      }
+      // let the writer finish its update
+      sched_yield();
+    }
+
+    uint32_t const start = atomic_load_explicit(&page->sequence, memory_order_acquire);
+    if (start & 1) {
+      // writer is in the middle of an update
+      continue;
+    }
+
+    memcpy(status, (void const *)&page->status, copy_len);
+
+    atomic_thread_fence(memory_order_acquire);
+    uint32_t const end = atomic_load_explicit(&page->sequence, memory_order_relaxed);
+    consistent         = (start == end);
+  }
+
+  if (!consistent) {
+    memset(status, 0, sizeof *status);
+    log_print(LSS_SYSTEM, LL_ERROR, "status page is inconsistent, its writer might have died during an update.");
+    return STATUS_PAGE_ERROR;
+  }
+
+  if (kill(page->pid, 0) == -1 && errno == ESRCH) {
+    return STATUS_PAGE_STALE;
+  }
+  return STATUS_PAGE_OK;
+}
@@ -0,0 +1,55 @@
+#ifndef PORTAL300_STATUS_PAGE_H
+#define PORTAL300_STATUS_PAGE_H
+
+#include "status.h"
+
+#include <stdbool.h>
+
+// The status page is a small file that the daemon keeps mapped into memory
+// and updates on every status change. Readers map it read-only and can poll
+// it at any rate without ever talking to the daemon.
+// Consistency is guaranteed with a sequence lock: the daemon increments the
+// sequence before and after every update, so readers retry when they see an
+// odd sequence or the sequence changed while they were copying. A writer that
+// died in the middle of an update leaves the sequence odd, so readers give up
+// after STATUS_PAGE_READ_TIMEOUT_MS.
+
+#define STATUS_PAGE_DEFAULT_PATH "/run/portal300/status"
+
+//! An update takes microseconds, this also covers a writer that was preempted.
+#define STATUS_PAGE_READ_TIMEOUT_MS 100
+
+enum StatusPageResult
+{
+  STATUS_PAGE_OK    = 0,
+  STATUS_PAGE_STALE = 1, // the page is readable, but the daemon that wrote it is gone.
+  STATUS_PAGE_ERROR = 2,
+};
+
+struct StatusPageReader
+{
+  int          fd;
+  void const * page;
+};
+
+//! Creates the status page at `path` and maps it for writing.
+//! An existing page is atomically replaced.
+bool status_page_create(char const * path);
+
+//! Unmaps the status page and deletes the file.
+void status_page_destroy(void);
+
+//! Publishes a new status to all readers.
+void status_page_publish(struct PortalStatus const * status);
+
+//! Opens and maps the status page at `path` read-only.
+bool status_page_open(struct StatusPageReader * reader, char const * path);
+
+void status_page_close(struct StatusPageReader * reader);
+
+//! Reads a consistent copy of the status from the page. Returns
+//! STATUS_PAGE_ERROR if no consistent copy was seen within
+//! STATUS_PAGE_READ_TIMEOUT_MS.
+enum StatusPageResult status_page_read(struct StatusPageReader const * reader, struct PortalStatus * status);
+
+#endif // PORTAL300_STATUS_PAGE_H
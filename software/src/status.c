@@ -0,0 +1,225 @@
+#include "status.h"
+
+#include "state-machine.h"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <string.h>
+
+uint32_t status_diff(struct PortalStatus const * a, struct PortalStatus const * b)
+{
+  assert(a != NULL);
+  assert(b != NULL);
+
+  uint32_t fields = 0;
+  if (a->shack_state != b->shack_state)
+    fields |= STATUS_FIELD_SHACK_STATE;
+  if (a->activity != b->activity)
+    fields |= STATUS_FIELD_ACTIVITY;
+  if (a->door_b2 != b->door_b2)
+    fields |= STATUS_FIELD_DOOR_B2;
+  if (a->door_c2 != b->door_c2)
+    fields |= STATUS_FIELD_DOOR_C2;
+  if (a->mqtt_connected != b->mqtt_connected)
+    fields |= STATUS_FIELD_MQTT_CONNECTED;
+  if (a->devices_online != b->devices_online)
+    fields |= STATUS_FIELD_DEVICES_ONLINE;
+  if (a->ipc_clients != b->ipc_clients)
+    fields |= STATUS_FIELD_IPC_CLIENTS;
+  if (a->keyholder_id != b->keyholder_id || memcmp(a->keyholder_nick, b->keyholder_nick, sizeof a->keyholder_nick) != 0)
+    fields |= STATUS_FIELD_KEYHOLDER;
+  return fields;
+}
+
+void status_apply(struct PortalStatus * dst, struct PortalStatus const * src, uint32_t fields)
+{
+  assert(dst != NULL);
+  assert(src != NULL);
+
+  if (fields & STATUS_FIELD_SHACK_STATE)
+    dst->shack_state = src->shack_state;
+  if (fields & STATUS_FIELD_ACTIVITY)
+    dst->activity = src->activity;
+  if (fields & STATUS_FIELD_DOOR_B2)
+    dst->door_b2 = src->door_b2;
+  if (fields & STATUS_FIELD_DOOR_C2)
+    dst->door_c2 = src->door_c2;
+  if (fields & STATUS_FIELD_MQTT_CONNECTED)
+    dst->mqtt_connected = src->mqtt_connected;
+  if (fields & STATUS_FIELD_DEVICES_ONLINE)
+    dst->devices_online = src->devices_online;
+  if (fields & STATUS_FIELD_IPC_CLIENTS)
+    dst->ipc_clients = src->ipc_clients;
+  if (fields & STATUS_FIELD_KEYHOLDER) {
+    dst->keyholder_id = src->keyholder_id;
+    memcpy(dst->keyholder_nick, src->keyholder_nick, sizeof dst->keyholder_nick);
+  }
+}
+
+bool status_device_online(struct PortalStatus const * status, enum PortalDevice device)
+{
+  return (status->devices_online & (1U << device)) != 0;
+}
+
+char const * status_device_name(enum PortalDevice device)
+{
+  if (device == DEVICE_SSH_INTERFACE)
+    return "ssh_interface";
+  if (device == DEVICE_DOOR_CONTROL_B2)
+    return "door_control_b2";
+  if (device == DEVICE_DOOR_CONTROL_C2)
+    return "door_control_c2";
+  if (device == DEVICE_BUSCH_INTERFACE)
+    return "busch_interface";
+  return "<<INVALID>>";
+}
+
+struct TextWriter
+{
+  char * buffer;
+  size_t size;
+  size_t offset;
+};
+
+static void text_printf(struct TextWriter * writer, char const * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void text_printf(struct TextWriter * writer, char const * fmt, ...)
+{
+  if (writer->offset >= writer->size)
+    return;
+
+  va_list list;
+  va_start(list, fmt);
+  int const len = vsnprintf(writer->buffer + writer->offset, writer->size - writer->offset, fmt, list);
+  va_end(list);
+
+  if (len > 0) {
+    writer->offset += len;
+  }
+  if (writer->offset >= writer->size) {
+    writer->offset = writer->size - 1;
+  }
+}
+
+size_t status_format_text(struct PortalStatus const * status, char * buffer, size_t buffer_size)
+{
+  assert(status != NULL);
+  assert(buffer != NULL);
+  assert(buffer_size > 0);
+
+  struct TextWriter writer = {
+      .buffer = buffer,
+      .size   = buffer_size,
+      .offset = 0,
+  };
+  buffer[0] = 0;
+
+  text_printf(&writer, "Portal-Status:\n");
+  text_printf(&writer, "  Space Status:    %s\n", sm_shack_state_name(status->shack_state));
+  text_printf(&writer, "  Aktivität:       %s\n", sm_state_name_by_id(status->activity));
+  text_printf(&writer, "  MQTT:            %s\n", status->mqtt_connected ? "Verbunden" : "Nicht verbunden");
+  text_printf(&writer, "  IPC Clients:     %u\n", status->ipc_clients);
+  if (status->keyholder_id > 0) {
+    text_printf(&writer, "  Keyholder:       %.*s (%d)\n", (int)strnlen(status->keyholder_nick, sizeof status->keyholder_nick), status->keyholder_nick, status->keyholder_id);
+  }
+  else {
+    text_printf(&writer, "  Keyholder:       -\n");
+  }
+  text_printf(&writer, "Tür-Status:\n");
+  text_printf(&writer, "  B2:              %s\n", sm_door_state_name(status->door_b2)); // geöffnet, geschlossen
+  text_printf(&writer, "  C2:              %s\n", sm_door_state_name(status->door_c2)); // geöffnet, geschlossen
+  text_printf(&writer, "Geräte-Status:\n");
+  for (enum PortalDevice device = 0; device < DEVICE_COUNT; device++) {
+    char label[32];
+    snprintf(label, sizeof label, "%s:", status_device_name(device));
+    text_printf(&writer, "  %-17s%s\n", label, status_device_online(status, device) ? "online" : "offline");
+  }
+
+  return writer.offset;
+}
+
+void status_print_fields(struct PortalStatus const * status, uint32_t fields, FILE * stream)
+{
+  assert(status != NULL);
+  assert(stream != NULL);
+
+  char const * sep = "";
+  if (fields & STATUS_FIELD_SHACK_STATE) {
+    fprintf(stream, "%sshack_state=%s", sep, sm_shack_state_name(status->shack_state));
+    sep = " ";
+  }
+  if (fields & STATUS_FIELD_ACTIVITY) {
+    fprintf(stream, "%sactivity=\"%s\"", sep, sm_state_name_by_id(status->activity));
+    sep = " ";
+  }
+  if (fields & STATUS_FIELD_DOOR_B2) {
+    fprintf(stream, "%sdoor_b2=%s", sep, sm_door_state_name(status->door_b2));
+    sep = " ";
+  }
+  if (fields & STATUS_FIELD_DOOR_C2) {
+    fprintf(stream, "%sdoor_c2=%s", sep, sm_door_state_name(status->door_c2));
+    sep = " ";
+  }
+  if (fields & STATUS_FIELD_MQTT_CONNECTED) {
+    fprintf(stream, "%smqtt=%s", sep, status->mqtt_connected ? "connected" : "disconnected");
+    sep = " ";
+  }
+  if (fields & STATUS_FIELD_DEVICES_ONLINE) {
+    for (enum PortalDevice device = 0; device < DEVICE_COUNT; device++) {
+      fprintf(stream, "%s%s=%s", sep, status_device_name(device), status_device_online(status, device) ? "online" : "offline");
+      sep = " ";
+    }
+  }
+  if (fields & STATUS_FIELD_IPC_CLIENTS) {
+    fprintf(stream, "%sipc_clients=%u", sep, status->ipc_clients);
+    sep = " ";
+  }
+  if (fields & STATUS_FIELD_KEYHOLDER) {
+    fprintf(stream, "%skeyholder=%d", sep, status->keyholder_id);
+    sep = " ";
+  }
+  fprintf(stream, "\n");
+}
+
+static void print_json_string(FILE * stream, char const * str, size_t length)
+{
+  fputc('"', stream);
+  for (size_t i = 0; i < length; i++) {
+    unsigned char const c = str[i];
+    if (c == '"' || c == '\\') {
+      fprintf(stream, "\\%c", c);
+    }
+    else if (c < 0x20) {
+      fprintf(stream, "\\u%04x", c);
+    }
+    else {
+      fputc(c, stream);
+    }
+  }
+  fputc('"', stream);
+}
+
+void status_print_json(struct PortalStatus const * status, FILE * stream)
+{
+  assert(status != NULL);
+  assert(stream != NULL);
+
+  fprintf(stream, "{\"shack_state\":\"%s\"", sm_shack_state_name(status->shack_state));
+  fprintf(stream, ",\"activity\":\"%s\"", sm_state_name_by_id(status->activity));
+  fprintf(stream, ",\"mqtt_connected\":%s", status->mqtt_connected ? "true" : "false");
+  fprintf(stream, ",\"ipc_clients\":%u", status->ipc_clients);
+  if (status->keyholder_id > 0) {
+    fprintf(stream, ",\"keyholder\":{\"id\":%d,\"nick\":", status->keyholder_id);
+    print_json_string(stream, status->keyholder_nick, strnlen(status->keyholder_nick, sizeof status->keyholder_nick));
+    fprintf(stream, "}");
+  }
+  else {
+    fprintf(stream, ",\"keyholder\":null");
+  }
+  fprintf(stream, ",\"doors\":{\"b2\":\"%s\",\"c2\":\"%s\"}", sm_door_state_name(status->door_b2), sm_door_state_name(status->door_c2));
+  fprintf(stream, ",\"devices\":{");
+  for (enum PortalDevice device = 0; device < DEVICE_COUNT; device++) {
+    fprintf(stream, "%s\"%s\":%s", (device > 0) ? "," : "", status_device_name(device), status_device_online(status, device) ? "true" : "false");
+  }
+  fprintf(stream, "}}\n");
+}
@@ -0,0 +1,71 @@
+#ifndef PORTAL300_STATUS_H
+#define PORTAL300_STATUS_H
+
+#define STATUS_MAX_KEYHOLDER_NICK_LEN 64
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum PortalDevice
+{
+  DEVICE_SSH_INTERFACE   = 0,
+  DEVICE_DOOR_CONTROL_B2 = 1,
+  DEVICE_DOOR_CONTROL_C2 = 2,
+  DEVICE_BUSCH_INTERFACE = 3,
+
+  DEVICE_COUNT,
+};
+
+//! A snapshot of everything the daemon knows about the portal.
+//! THIS STRUCT MUST NOT CONTAIN ANY POINTERS, as it's shared with other processes.
+struct PortalStatus
+{
+  uint8_t  shack_state;    // enum ShackState
+  uint8_t  activity;       // internal state machine state, see sm_state_name_by_id()
+  uint8_t  door_b2;        // enum DoorState
+  uint8_t  door_c2;        // enum DoorState
+  uint8_t  mqtt_connected; // bool
+  uint8_t  devices_online; // bit mask of (1 << enum PortalDevice)
+  uint16_t ipc_clients;
+  int32_t  keyholder_id;       // member id of the current keyholder or 0 if nobody holds the key
+  char     keyholder_nick[STATUS_MAX_KEYHOLDER_NICK_LEN]; // nick name of the current keyholder, not necessarily 0 terminated!
+};
+
+//! Bit mask to select individual fields of `struct PortalStatus`
+enum PortalStatusField
+{
+  STATUS_FIELD_SHACK_STATE    = (1 << 0),
+  STATUS_FIELD_ACTIVITY       = (1 << 1),
+  STATUS_FIELD_DOOR_B2        = (1 << 2),
+  STATUS_FIELD_DOOR_C2        = (1 << 3),
+  STATUS_FIELD_MQTT_CONNECTED = (1 << 4),
+  STATUS_FIELD_DEVICES_ONLINE = (1 << 5),
+  STATUS_FIELD_IPC_CLIENTS    = (1 << 6),
+  STATUS_FIELD_KEYHOLDER      = (1 << 7),
+
+  STATUS_FIELD_ALL = 0xFF,
+};
+
+//! Returns the set of fields that differ between `a` and `b`.
+uint32_t status_diff(struct PortalStatus const * a, struct PortalStatus const * b);
+
+//! Copies the selected `fields` from `src` into `dst`.
+void status_apply(struct PortalStatus * dst, struct PortalStatus const * src, uint32_t fields);
+
+bool status_device_online(struct PortalStatus const * status, enum PortalDevice device);
+
+char const * status_device_name(enum PortalDevice device);
+
+//! Renders the human readable status report, one line per entry, into `buffer`.
+//! Returns the number of bytes written, excluding the terminating NUL.
+size_t status_format_text(struct PortalStatus const * status, char * buffer, size_t buffer_size);
+
+//! Prints the selected `fields` as a single line of `name=value` pairs to `stream`.
+void status_print_fields(struct PortalStatus const * status, uint32_t fields, FILE * stream);
+
+//! Prints the status as a single-line JSON object to `stream`.
+void status_print_json(struct PortalStatus const * status, FILE * stream);
+
+#endif // PORTAL300_STATUS_H
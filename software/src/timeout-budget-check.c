@@ -0,0 +1,128 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timeout-budget.h"
+
+// Checks the bounds of the adaptive phase timeouts: a phase never fails
+// earlier than TIMEOUT_BUDGET_MIN_MS or later than its limit, the timeout
+// follows the observed durations and widens again after a phase ran into it.
+
+#define LIMIT_MS 60000
+
+struct Check
+{
+  char const * name;
+  bool (*run)(void);
+};
+
+static void sample_many(struct TimeoutBudget * budget, uint32_t duration_ms, int count)
+{
+  for (int i = 0; i < count; i++) {
+    timeout_budget_sample(budget, duration_ms);
+  }
+}
+
+static bool check_fixed(void)
+{
+  struct TimeoutBudget budget;
+  timeout_budget_init(&budget, LIMIT_MS, false);
+  sample_many(&budget, 1000, 20);
+  timeout_budget_expired(&budget);
+  return timeout_budget_get(&budget) == LIMIT_MS;
+}
+
+static bool check_warmup(void)
+{
+  struct TimeoutBudget budget;
+  timeout_budget_init(&budget, LIMIT_MS, true);
+  sample_many(&budget, 10000, TIMEOUT_BUDGET_MIN_SAMPLES - 1);
+  if (timeout_budget_get(&budget) != LIMIT_MS)
+    return false;
+  timeout_budget_sample(&budget, 10000);
+  return timeout_budget_get(&budget) < LIMIT_MS;
+}
+
+static bool check_follows_durations(void)
+{
+  struct TimeoutBudget budget;
+  timeout_budget_init(&budget, LIMIT_MS, true);
+  sample_many(&budget, 10000, 50);
+  uint32_t const timeout = timeout_budget_get(&budget);
+  return (timeout >= 10000) && (timeout < 11000);
+}
+
+static bool check_lower_bound(void)
+{
+  struct TimeoutBudget budget;
+  timeout_budget_init(&budget, LIMIT_MS, true);
+  sample_many(&budget, 100, 50);
+  if (timeout_budget_get(&budget) != TIMEOUT_BUDGET_MIN_MS)
+    return false;
+
+  // a limit below the minimum still wins
+  timeout_budget_init(&budget, 3000, true);
+  sample_many(&budget, 100, 50);
+  return timeout_budget_get(&budget) == 3000;
+}
+
+static bool check_upper_bound(void)
+{
+  struct TimeoutBudget budget;
+  timeout_budget_init(&budget, LIMIT_MS, true);
+  sample_many(&budget, 30000, 4);
+  sample_many(&budget, 90000, 4);
+  return timeout_budget_get(&budget) == LIMIT_MS;
+}
+
+static bool check_expired_widens(void)
+{
+  struct TimeoutBudget budget;
+  timeout_budget_init(&budget, LIMIT_MS, true);
+  sample_many(&budget, 10000, 50);
+
+  uint32_t previous = timeout_budget_get(&budget);
+  for (int i = 0; i < 20; i++) {
+    timeout_budget_expired(&budget);
+    uint32_t const timeout = timeout_budget_get(&budget);
+    if (timeout < previous)
+      return false;
+    previous = timeout;
+  }
+  return previous == LIMIT_MS;
+}
+
+static bool check_no_overflow(void)
+{
+  struct TimeoutBudget budget;
+  timeout_budget_init(&budget, UINT32_MAX, true);
+  sample_many(&budget, UINT32_MAX, 10);
+  timeout_budget_expired(&budget);
+  return timeout_budget_get(&budget) == UINT32_MAX;
+}
+
+static struct Check const checks[] = {
+    {"a fixed timeout is always the limit", check_fixed},
+    {"the limit applies until enough phases were observed", check_warmup},
+    {"the timeout follows steady durations", check_follows_durations},
+    {"the timeout is never below the minimum", check_lower_bound},
+    {"the timeout is never above the limit", check_upper_bound},
+    {"an expired phase widens the timeout up to the limit", check_expired_widens},
+    {"huge durations don't overflow", check_no_overflow},
+};
+
+int main(void)
+{
+  size_t const count  = sizeof checks / sizeof checks[0];
+  size_t       failed = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!checks[i].run()) {
+      fprintf(stderr, "failed: %s\n", checks[i].name);
+      failed += 1;
+    }
+  }
+
+  fprintf(stdout, "ran %zu timeout budget checks, %zu failed\n", count, failed);
+  return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
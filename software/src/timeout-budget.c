@@ -0,0 +1,65 @@
+#include "timeout-budget.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+void timeout_budget_init(struct TimeoutBudget * budget, uint32_t limit_ms, bool adaptive)
+{
+  assert(budget != NULL);
+
+  *budget = (struct TimeoutBudget){
+      .limit_ms     = limit_ms,
+      .adaptive     = adaptive,
+      .samples      = 0,
+      .mean_ms      = 0,
+      .deviation_ms = 0,
+  };
+}
+
+void timeout_budget_sample(struct TimeoutBudget * budget, uint32_t duration_ms)
+{
+  assert(budget != NULL);
+
+  if (budget->samples == 0) {
+    budget->mean_ms      = duration_ms;
+    budget->deviation_ms = duration_ms / 2;
+  }
+  else {
+    // gains of 1/4 and 1/8 as in RFC 6298, the deviation uses the old mean
+    uint32_t const error = (duration_ms > budget->mean_ms) ? (duration_ms - budget->mean_ms) : (budget->mean_ms - duration_ms);
+    budget->deviation_ms = (uint32_t)((3 * (uint64_t)budget->deviation_ms + error) / 4);
+    budget->mean_ms      = (uint32_t)((7 * (uint64_t)budget->mean_ms + duration_ms) / 8);
+  }
+
+  if (budget->samples < UINT32_MAX) {
+    budget->samples += 1;
+  }
+}
+
+void timeout_budget_expired(struct TimeoutBudget * budget)
+{
+  assert(budget != NULL);
+  if (!budget->adaptive)
+    return;
+
+  // nothing was learned about the real duration, except that it is longer
+  uint64_t const widened = 2 * (uint64_t)budget->deviation_ms;
+  uint64_t const minimum = budget->mean_ms / 4;
+  uint64_t const next    = (widened > minimum) ? widened : minimum;
+  budget->deviation_ms   = (next < budget->limit_ms) ? (uint32_t)next : budget->limit_ms;
+}
+
+uint32_t timeout_budget_get(struct TimeoutBudget const * budget)
+{
+  assert(budget != NULL);
+
+  if (!budget->adaptive || (budget->samples < TIMEOUT_BUDGET_MIN_SAMPLES))
+    return budget->limit_ms;
+
+  uint64_t const timeout = (uint64_t)budget->mean_ms + 4 * (uint64_t)budget->deviation_ms;
+  if (timeout < TIMEOUT_BUDGET_MIN_MS)
+    return (TIMEOUT_BUDGET_MIN_MS < budget->limit_ms) ? TIMEOUT_BUDGET_MIN_MS : budget->limit_ms;
+  if (timeout > budget->limit_ms)
+    return budget->limit_ms;
+  return (uint32_t)timeout;
+}
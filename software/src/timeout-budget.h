@@ -0,0 +1,42 @@
+#ifndef PORTAL300_TIMEOUT_BUDGET_H
+#define PORTAL300_TIMEOUT_BUDGET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timeout of a transaction phase that adapts to how long the phase actually
+// takes. A phase that runs into its timeout is reported as failed, so the
+// timeout should be as short as possible without failing phases that are
+// just slow today. Like the retransmission timeout of TCP (RFC 6298), it is
+// the smoothed duration plus four times its smoothed deviation, bounded by
+// the configured limit. Until enough durations were observed, and for phases
+// that don't adapt, the limit itself is the timeout.
+
+//! Observed durations before the timeout adapts.
+#define TIMEOUT_BUDGET_MIN_SAMPLES 5
+
+//! An adapted timeout is never shorter, so a single fast door can't make the next one fail.
+#define TIMEOUT_BUDGET_MIN_MS 5000
+
+struct TimeoutBudget
+{
+  uint32_t limit_ms; // the configured worst case
+  bool     adaptive;
+  uint32_t samples;
+  uint32_t mean_ms;      // smoothed duration
+  uint32_t deviation_ms; // smoothed mean deviation of the duration
+};
+
+void timeout_budget_init(struct TimeoutBudget * budget, uint32_t limit_ms, bool adaptive);
+
+//! Adds the duration of a phase that finished in time.
+void timeout_budget_sample(struct TimeoutBudget * budget, uint32_t duration_ms);
+
+//! Widens an adapted timeout after the phase ran into it, so doors that
+//! became slower don't fail forever.
+void timeout_budget_expired(struct TimeoutBudget * budget);
+
+//! Returns the timeout for the next run of the phase.
+uint32_t timeout_budget_get(struct TimeoutBudget const * budget);
+
+#endif // PORTAL300_TIMEOUT_BUDGET_H
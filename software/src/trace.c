@@ -0,0 +1,484 @@
+#include "trace.h"
+
+#include "log.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC        0x52543350 // "P3TR"
+#define TRACE_VERSION      1
+#define TRACE_RECORD_COUNT 8192 // 1 MiB of records
+
+#define TRACE_MAX_STRING_LEN 64
+
+//! Layout of the trace file. `points_hash` identifies the TRACE_POINTS table
+//! the writer was built with, so the decoder can detect a mismatch.
+struct TraceFile
+{
+  uint32_t         magic;
+  uint32_t         version;
+  uint32_t         record_size;
+  uint32_t         record_count;
+  uint32_t         points_hash;
+  uint32_t         pid;
+  _Atomic uint64_t next_sequence;
+  uint64_t         reserved[4];
+
+  struct TraceRecord records[];
+};
+
+static char const * const point_names[TRACE_POINT_COUNT] = {
+#define TRACE_POINT_NAME(_Name, _Format) [TRACE_##_Name] = #_Name,
+    TRACE_POINTS(TRACE_POINT_NAME)
+#undef TRACE_POINT_NAME
+};
+
+static char const * const point_formats[TRACE_POINT_COUNT] = {
+#define TRACE_POINT_FORMAT(_Name, _Format) [TRACE_##_Name] = _Format,
+    TRACE_POINTS(TRACE_POINT_FORMAT)
+#undef TRACE_POINT_FORMAT
+};
+
+static struct TraceFile * trace_file      = NULL;
+static size_t             trace_file_size = 0;
+
+static size_t trace_file_size_for(uint32_t record_count)
+{
+  return sizeof(struct TraceFile) + (size_t)record_count * sizeof(struct TraceRecord);
+}
+
+//! FNV-1a over all names and formats of TRACE_POINTS.
+static uint32_t compute_points_hash(void)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < TRACE_POINT_COUNT; i++) {
+    for (char const * it = point_names[i]; *it; it++) {
+      hash = (hash ^ (uint8_t)*it) * 16777619u;
+    }
+    for (char const * it = point_formats[i]; *it; it++) {
+      hash = (hash ^ (uint8_t)*it) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+bool trace_open(char const * path)
+{
+  assert(path != NULL);
+  assert(trace_file == NULL);
+
+  char temp_path[PATH_MAX];
+  char old_path[PATH_MAX];
+  if ((snprintf(temp_path, sizeof temp_path, "%s.tmp", path) >= (int)sizeof temp_path) || (snprintf(old_path, sizeof old_path, "%s.1", path) >= (int)sizeof old_path)) {
+    log_print(LSS_SYSTEM, LL_ERROR, "trace path is too long: %s", path);
+    return false;
+  }
+
+  size_t const size = trace_file_size_for(TRACE_RECORD_COUNT);
+
+  int const fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to create trace file");
+    return false;
+  }
+
+  if (ftruncate(fd, size) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to resize trace file");
+    close(fd);
+    unlink(temp_path);
+    return false;
+  }
+
+  void * const mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps the file alive
+  if (mapping == MAP_FAILED) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to map trace file");
+    unlink(temp_path);
+    return false;
+  }
+
+  // the file is sparse and zero filled, so all records are already marked as empty
+  struct TraceFile * const file = mapping;
+  file->magic                   = TRACE_MAGIC;
+  file->version                 = TRACE_VERSION;
+  file->record_size             = sizeof(struct TraceRecord);
+  file->record_count            = TRACE_RECORD_COUNT;
+  file->points_hash             = compute_points_hash();
+  file->pid                     = getpid();
+  atomic_init(&file->next_sequence, 0);
+
+  // keep the trace of the previous run, it might contain the reason for the restart
+  if ((rename(path, old_path) == -1) && (errno != ENOENT)) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to keep previous trace file");
+  }
+
+  if (rename(temp_path, path) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to publish trace file");
+    munmap(mapping, size);
+    unlink(temp_path);
+    return false;
+  }
+
+  trace_file      = file;
+  trace_file_size = size;
+  return true;
+}
+
+void trace_close(void)
+{
+  if (trace_file == NULL)
+    return;
+
+  // the file itself stays for post mortem analysis
+  if (munmap(trace_file, trace_file_size) == -1) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to unmap trace file");
+  }
+  trace_file      = NULL;
+  trace_file_size = 0;
+}
+
+bool trace_is_enabled(void)
+{
+  return (trace_file != NULL);
+}
+
+void trace_begin(struct TraceArgs * args, enum TracePoint point)
+{
+  assert(args != NULL);
+  args->point     = point;
+  args->arg_count = 0;
+  args->length    = 0;
+}
+
+void trace_commit(struct TraceArgs const * args)
+{
+  assert(args != NULL);
+  if (trace_file == NULL)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  uint64_t const             sequence = atomic_fetch_add_explicit(&trace_file->next_sequence, 1, memory_order_relaxed);
+  struct TraceRecord * const record   = &trace_file->records[sequence % trace_file->record_count];
+
+  // invalidate first, so readers don't mix old and new data
+  atomic_store_explicit(&record->sequence, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  record->timestamp = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+  record->point     = args->point;
+  record->arg_count = args->arg_count;
+  record->length    = args->length;
+  memcpy(record->data, args->data, args->length);
+
+  atomic_store_explicit(&record->sequence, sequence + 1, memory_order_release);
+}
+
+//! Reserves `size` bytes for the next argument, NULL if the record is full.
+static uint8_t * reserve_arg(struct TraceArgs * args, enum TraceArgType type, size_t size)
+{
+  if ((size_t)args->length + 1 + size > sizeof args->data)
+    return NULL;
+  args->data[args->length] = type;
+  uint8_t * const result   = &args->data[args->length + 1];
+  args->length += 1 + size;
+  args->arg_count += 1;
+  return result;
+}
+
+void trace_arg_int(struct TraceArgs * args, long long value)
+{
+  int64_t const   raw  = value;
+  uint8_t * const dest = reserve_arg(args, TRACE_ARG_INT, sizeof raw);
+  if (dest != NULL) {
+    memcpy(dest, &raw, sizeof raw);
+  }
+}
+
+void trace_arg_uint(struct TraceArgs * args, unsigned long long value)
+{
+  uint64_t const  raw  = value;
+  uint8_t * const dest = reserve_arg(args, TRACE_ARG_UINT, sizeof raw);
+  if (dest != NULL) {
+    memcpy(dest, &raw, sizeof raw);
+  }
+}
+
+void trace_arg_double(struct TraceArgs * args, double value)
+{
+  uint8_t * const dest = reserve_arg(args, TRACE_ARG_DOUBLE, sizeof value);
+  if (dest != NULL) {
+    memcpy(dest, &value, sizeof value);
+  }
+}
+
+void trace_arg_string(struct TraceArgs * args, char const * value)
+{
+  if (value == NULL) {
+    value = "(null)";
+  }
+
+  // strings are truncated to TRACE_MAX_STRING_LEN, so a long string doesn't
+  // push the arguments after it out of the record
+  size_t const available = sizeof args->data - args->length;
+  if (available < 2)
+    return;
+  size_t limit = available - 2;
+  if (limit > TRACE_MAX_STRING_LEN) {
+    limit = TRACE_MAX_STRING_LEN;
+  }
+
+  size_t const    length = strnlen(value, limit);
+  uint8_t * const dest   = reserve_arg(args, TRACE_ARG_STRING, 1 + length);
+  if (dest != NULL) {
+    dest[0] = (uint8_t)length;
+    memcpy(dest + 1, value, length);
+  }
+}
+
+bool trace_reader_open(struct TraceReader * reader, char const * path)
+{
+  assert(reader != NULL);
+  assert(path != NULL);
+
+  *reader = (struct TraceReader){
+      .file      = NULL,
+      .file_size = 0,
+  };
+
+  int const fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to open trace file");
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to query trace file");
+    close(fd);
+    return false;
+  }
+  if ((size_t)info.st_size < sizeof(struct TraceFile)) {
+    log_print(LSS_SYSTEM, LL_ERROR, "%s is not a trace file.", path);
+    close(fd);
+    return false;
+  }
+
+  void * const mapping = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to map trace file");
+    return false;
+  }
+
+  struct TraceFile const * const file = mapping;
+  bool                           ok   = true;
+  if ((file->magic != TRACE_MAGIC) || (file->version != TRACE_VERSION) || (file->record_size != sizeof(struct TraceRecord))) {
+    log_print(LSS_SYSTEM, LL_ERROR, "%s is not a compatible trace file.", path);
+    ok = false;
+  }
+  else if ((file->record_count == 0) || (trace_file_size_for(file->record_count) > (size_t)info.st_size)) {
+    log_print(LSS_SYSTEM, LL_ERROR, "%s is truncated.", path);
+    ok = false;
+  }
+  if (!ok) {
+    munmap(mapping, info.st_size);
+    return false;
+  }
+
+  if (file->points_hash != compute_points_hash()) {
+    log_print(LSS_SYSTEM, LL_WARNING, "%s was written by a different version, trace points might be decoded wrong.", path);
+  }
+
+  reader->file      = mapping;
+  reader->file_size = info.st_size;
+  return true;
+}
+
+void trace_reader_close(struct TraceReader * reader)
+{
+  assert(reader != NULL);
+  if (reader->file != NULL) {
+    munmap((void *)reader->file, reader->file_size);
+  }
+  reader->file      = NULL;
+  reader->file_size = 0;
+}
+
+void trace_reader_range(struct TraceReader const * reader, uint64_t * first, uint64_t * end)
+{
+  assert(reader != NULL && reader->file != NULL);
+  struct TraceFile const * const file = reader->file;
+
+  uint64_t const next = atomic_load_explicit((_Atomic uint64_t *)&file->next_sequence, memory_order_acquire);
+
+  *end   = next;
+  *first = (next > file->record_count) ? (next - file->record_count) : 0;
+}
+
+bool trace_reader_get(struct TraceReader const * reader, uint64_t sequence, struct TraceRecord * record)
+{
+  assert(reader != NULL && reader->file != NULL);
+  assert(record != NULL);
+  struct TraceFile const * const   file   = reader->file;
+  struct TraceRecord const * const source = &file->records[sequence % file->record_count];
+
+  uint64_t const before = atomic_load_explicit((_Atomic uint64_t *)&source->sequence, memory_order_acquire);
+  if (before != sequence + 1)
+    return false;
+
+  record->timestamp = source->timestamp;
+  record->point     = source->point;
+  record->arg_count = source->arg_count;
+  record->length    = source->length;
+  memcpy(record->data, source->data, sizeof record->data);
+
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t const after = atomic_load_explicit((_Atomic uint64_t *)&source->sequence, memory_order_relaxed);
+  if (after != before)
+    return false;
+
+  atomic_init(&record->sequence, before);
+  return (record->point < TRACE_POINT_COUNT) && (record->length <= sizeof record->data);
+}
+
+char const * trace_point_name(enum TracePoint point)
+{
+  if (point < TRACE_POINT_COUNT)
+    return point_names[point];
+  return "<<INVALID>>";
+}
+
+//! Renders the next argument at `*offset` into `buffer`. Returns false if there is none.
+static bool format_arg(struct TraceRecord const * record, size_t * offset, char * buffer, size_t buffer_size)
+{
+  if (*offset >= record->length)
+    return false;
+
+  uint8_t const         type  = record->data[*offset];
+  uint8_t const * const value = &record->data[*offset + 1];
+  size_t const          left  = record->length - *offset - 1;
+
+  switch (type) {
+  case TRACE_ARG_INT:
+  {
+    int64_t raw;
+    if (left < sizeof raw)
+      return false;
+    memcpy(&raw, value, sizeof raw);
+    snprintf(buffer, buffer_size, "%lld", (long long)raw);
+    *offset += 1 + sizeof raw;
+    return true;
+  }
+  case TRACE_ARG_UINT:
+  {
+    uint64_t raw;
+    if (left < sizeof raw)
+      return false;
+    memcpy(&raw, value, sizeof raw);
+    snprintf(buffer, buffer_size, "%llu", (unsigned long long)raw);
+    *offset += 1 + sizeof raw;
+    return true;
+  }
+  case TRACE_ARG_DOUBLE:
+  {
+    double raw;
+    if (left < sizeof raw)
+      return false;
+    memcpy(&raw, value, sizeof raw);
+    snprintf(buffer, buffer_size, "%g", raw);
+    *offset += 1 + sizeof raw;
+    return true;
+  }
+  case TRACE_ARG_STRING:
+  {
+    if (left < 1 || left < 1u + value[0])
+      return false;
+    snprintf(buffer, buffer_size, "%.*s", (int)value[0], (char const *)value + 1);
+    *offset += 2 + value[0];
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+void trace_format_record(struct TraceRecord const * record, char * buffer, size_t buffer_size)
+{
+  assert(record != NULL);
+  assert(buffer != NULL && buffer_size > 0);
+
+  if (record->point >= TRACE_POINT_COUNT) {
+    snprintf(buffer, buffer_size, "<<invalid trace point %u>>", record->point);
+    return;
+  }
+
+  size_t out        = 0;
+  size_t arg_offset = 0;
+
+#define APPEND(_Text, _Length)                        \
+  do {                                                \
+    size_t len_ = (_Length);                          \
+    if (len_ > buffer_size - 1 - out)                 \
+      len_ = buffer_size - 1 - out;                   \
+    memcpy(buffer + out, (_Text), len_);              \
+    out += len_;                                      \
+  } while (0)
+
+  char const * it = point_formats[record->point];
+  while (*it != 0) {
+    if (it[0] == '%' && it[1] == '%') {
+      APPEND("%", 1);
+      it += 2;
+    }
+    else if (it[0] == '%') {
+      // skip the conversion specification, the argument knows its type
+      it += 1;
+      while (*it != 0 && strchr("diouxXeEfFgGaAcspn", *it) == NULL) {
+        it += 1;
+      }
+      if (*it != 0) {
+        it += 1;
+      }
+
+      char value[TRACE_RECORD_DATA + 1];
+      if (!format_arg(record, &arg_offset, value, sizeof value)) {
+        snprintf(value, sizeof value, "?");
+      }
+      APPEND(value, strlen(value));
+    }
+    else {
+      size_t const len = strcspn(it, "%");
+      APPEND(it, len);
+      it += len;
+    }
+  }
+  buffer[out] = 0;
+
+#undef APPEND
+}
+
+size_t trace_record_args(struct TraceRecord const * record, char (*values)[TRACE_RECORD_DATA + 1], size_t max_count)
+{
+  assert(record != NULL);
+  assert(values != NULL);
+
+  size_t count  = 0;
+  size_t offset = 0;
+  while (count < max_count && format_arg(record, &offset, values[count], sizeof values[count])) {
+    count += 1;
+  }
+  return count;
+}
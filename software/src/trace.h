@@ -0,0 +1,151 @@
+#ifndef PORTAL300_TRACE_H
+#define PORTAL300_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary trace log. A trace point stores its id and the raw arguments into a
+// fixed size record of a ring that lives in a memory mapped file, nothing is
+// formatted on the hot path. `portal-trace` renders the records later with the
+// formats from TRACE_POINTS. As the file is only a shared memory mapping, the
+// trace survives a crash of the daemon.
+//
+// Usage: trace(MQTT_RECEIVE, topic, data);
+// Arguments can be integers, doubles or strings, at least one is required.
+
+#define TRACE_DEFAULT_PATH "/run/portal300/trace"
+
+//! All trace points: X(name, format). The format uses printf conversions,
+//! but each conversion only marks where the next argument is rendered.
+#define TRACE_POINTS(X)                                                    \
+  X(MQTT_RECEIVE, "mqtt receive '%s': %s")                                 \
+  X(MQTT_SEND, "mqtt send '%s': %s")                                       \
+  X(SM_EVENT, "state machine event %s: %s -> %s")                          \
+  X(SM_SIGNAL, "state machine signal %d for client %u")                    \
+  X(IPC_CONNECT, "ipc client %u connected on slot %zu")                    \
+  X(IPC_DISCONNECT, "ipc client %u disconnected from slot %zu")            \
+  X(IPC_MESSAGE, "ipc client %u sent message type %u for portal %u")       \
+  X(DEVICE_STATUS, "device %s is %s")                                      \
+  X(SM_RESTORE, "restored %s: state %d, doors %d/%d/%d, timer %u ms")      \
+  X(SM_TIMER, "portal %u started its timer for %u ms")                     \
+  X(DOOR_STATUS, "portal %u door %s is now %d")
+
+enum TracePoint
+{
+#define TRACE_POINT_ENUM(_Name, _Format) TRACE_##_Name,
+  TRACE_POINTS(TRACE_POINT_ENUM)
+#undef TRACE_POINT_ENUM
+
+  TRACE_POINT_COUNT,
+};
+
+enum TraceArgType
+{
+  TRACE_ARG_INT    = 1, // int64_t
+  TRACE_ARG_UINT   = 2, // uint64_t
+  TRACE_ARG_DOUBLE = 3, // double
+  TRACE_ARG_STRING = 4, // uint8_t length, then the characters without terminator
+};
+
+#define TRACE_RECORD_SIZE 128
+#define TRACE_RECORD_DATA (TRACE_RECORD_SIZE - 20)
+
+//! A single record. `sequence` is the position of the record plus one, it is
+//! zero while the record is being written.
+struct TraceRecord
+{
+  _Atomic uint64_t sequence;
+  uint64_t         timestamp; // CLOCK_REALTIME in nanoseconds
+  uint16_t         point;     // enum TracePoint
+  uint8_t          arg_count;
+  uint8_t          length; // used bytes of `data`
+  uint8_t          data[TRACE_RECORD_DATA];
+};
+
+//! Record under construction, filled by the trace() macro.
+struct TraceArgs
+{
+  uint16_t point;
+  uint8_t  arg_count;
+  uint8_t  length;
+  uint8_t  data[TRACE_RECORD_DATA];
+};
+
+struct TraceReader
+{
+  void const * file;
+  size_t       file_size;
+};
+
+//! Creates the trace file at `path` and starts tracing. An existing file is
+//! kept as `<path>.1`, so the trace of a crashed daemon survives a restart.
+bool trace_open(char const * path);
+void trace_close(void);
+
+//! Returns true if trace points are recorded.
+bool trace_is_enabled(void);
+
+void trace_begin(struct TraceArgs * args, enum TracePoint point);
+void trace_commit(struct TraceArgs const * args);
+
+void trace_arg_int(struct TraceArgs * args, long long value);
+void trace_arg_uint(struct TraceArgs * args, unsigned long long value);
+void trace_arg_double(struct TraceArgs * args, double value);
+void trace_arg_string(struct TraceArgs * args, char const * value);
+
+#define TRACE_ENCODE_ARG(_Args, _Value) \
+  _Generic((_Value) + 0,                \
+      int: trace_arg_int,               \
+      long: trace_arg_int,              \
+      long long: trace_arg_int,         \
+      unsigned int: trace_arg_uint,     \
+      unsigned long: trace_arg_uint,    \
+      unsigned long long: trace_arg_uint, \
+      float: trace_arg_double,          \
+      double: trace_arg_double,         \
+      char *: trace_arg_string,         \
+      char const *: trace_arg_string)(_Args, _Value)
+
+#define TRACE_ARGS_1(_A, _1)                     TRACE_ENCODE_ARG(_A, _1);
+#define TRACE_ARGS_2(_A, _1, _2)                 TRACE_ARGS_1(_A, _1) TRACE_ENCODE_ARG(_A, _2);
+#define TRACE_ARGS_3(_A, _1, _2, _3)             TRACE_ARGS_2(_A, _1, _2) TRACE_ENCODE_ARG(_A, _3);
+#define TRACE_ARGS_4(_A, _1, _2, _3, _4)         TRACE_ARGS_3(_A, _1, _2, _3) TRACE_ENCODE_ARG(_A, _4);
+#define TRACE_ARGS_5(_A, _1, _2, _3, _4, _5)     TRACE_ARGS_4(_A, _1, _2, _3, _4) TRACE_ENCODE_ARG(_A, _5);
+#define TRACE_ARGS_6(_A, _1, _2, _3, _4, _5, _6) TRACE_ARGS_5(_A, _1, _2, _3, _4, _5) TRACE_ENCODE_ARG(_A, _6);
+
+#define TRACE_ARGS_SELECT(_1, _2, _3, _4, _5, _6, _Name, ...) _Name
+#define TRACE_ARGS(_A, ...) \
+  TRACE_ARGS_SELECT(__VA_ARGS__, TRACE_ARGS_6, TRACE_ARGS_5, TRACE_ARGS_4, TRACE_ARGS_3, TRACE_ARGS_2, TRACE_ARGS_1, _Unused)(_A, __VA_ARGS__)
+
+//! Records the trace point TRACE_<_Point> with up to six arguments.
+#define trace(_Point, ...)                        \
+  do {                                            \
+    if (trace_is_enabled()) {                     \
+      struct TraceArgs trace_args;                \
+      trace_begin(&trace_args, TRACE_##_Point);   \
+      TRACE_ARGS(&trace_args, __VA_ARGS__)        \
+      trace_commit(&trace_args);                  \
+    }                                             \
+  } while (0)
+
+//! Maps the trace file at `path` read-only. Works while the daemon is writing it.
+bool trace_reader_open(struct TraceReader * reader, char const * path);
+void trace_reader_close(struct TraceReader * reader);
+
+//! Returns the sequence numbers of the oldest and one past the newest record still in the file.
+void trace_reader_range(struct TraceReader const * reader, uint64_t * first, uint64_t * end);
+
+//! Copies the record with `sequence`. Returns false if it was overwritten or is incomplete.
+bool trace_reader_get(struct TraceReader const * reader, uint64_t sequence, struct TraceRecord * record);
+
+//! Renders the message of `record` as text, without timestamp.
+void trace_format_record(struct TraceRecord const * record, char * buffer, size_t buffer_size);
+
+//! Renders each argument of `record` as text into `values`. Returns the number of arguments.
+size_t trace_record_args(struct TraceRecord const * record, char (*values)[TRACE_RECORD_DATA + 1], size_t max_count);
+
+//! Returns the name of a trace point, like "MQTT_RECEIVE".
+char const * trace_point_name(enum TracePoint point);
+
+#endif // PORTAL300_TRACE_H
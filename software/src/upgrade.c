@@ -0,0 +1,367 @@
+#include "upgrade.h"
+
+#include "clock.h"
+#include "log.h"
+
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//! The new process finds the handover socket here.
+#define UPGRADE_CHILD_FD 3
+
+//! Sent by the new process when it is ready to take over.
+struct UpgradeHello
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size; // sizeof(struct UpgradeState) of the new binary
+};
+
+extern char ** environ;
+
+static struct
+{
+  char          executable[PATH_MAX];
+  char * const * argv;
+
+  pid_t    child;    // the new process, -1 if no upgrade is running
+  int      sock;     // our end of the handover socket
+  uint64_t deadline; // CLOCK_MONOTONIC in milliseconds when we give up on the new process
+} upgrade = {
+    .executable = "",
+    .argv       = NULL,
+    .child      = -1,
+    .sock       = -1,
+    .deadline   = 0,
+};
+
+bool upgrade_init(char * const argv[])
+{
+  assert(argv != NULL);
+
+  ssize_t const length = readlink("/proc/self/exe", upgrade.executable, sizeof upgrade.executable - 1);
+  if (length == -1) {
+    log_perror(LSS_SYSTEM, LL_WARNING, "failed to find the daemon binary, hot upgrades are not available");
+    upgrade.executable[0] = 0;
+    return false;
+  }
+  upgrade.executable[length] = 0;
+  upgrade.argv               = argv;
+  return true;
+}
+
+//! Kills the new process if it is still running and forgets about it.
+static void stop_child(void)
+{
+  if (upgrade.child != -1) {
+    (void)kill(upgrade.child, SIGKILL);
+    while ((waitpid(upgrade.child, NULL, 0) == -1) && (errno == EINTR)) {
+    }
+  }
+  if (upgrade.sock != -1) {
+    close(upgrade.sock);
+  }
+  upgrade.child = -1;
+  upgrade.sock  = -1;
+}
+
+bool upgrade_start(void)
+{
+  if (upgrade.child != -1) {
+    log_print(LSS_SYSTEM, LL_WARNING, "an upgrade is already running.");
+    return false;
+  }
+  if (upgrade.executable[0] == 0) {
+    log_print(LSS_SYSTEM, LL_WARNING, "the daemon binary is unknown, cannot upgrade.");
+    return false;
+  }
+
+  int socks[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to create upgrade socket");
+    return false;
+  }
+
+  // the environment of the new process, prepared here because the child
+  // must not allocate between fork() and exec()
+  size_t env_count = 0;
+  while (environ[env_count] != NULL) {
+    env_count += 1;
+  }
+  char ** const env = calloc(env_count + 2, sizeof(char *));
+  if (env == NULL) {
+    log_print(LSS_SYSTEM, LL_ERROR, "out of memory");
+    close(socks[0]);
+    close(socks[1]);
+    return false;
+  }
+  size_t env_size = 0;
+  for (size_t i = 0; i < env_count; i++) {
+    if (strncmp(environ[i], UPGRADE_FD_ENV "=", sizeof UPGRADE_FD_ENV) != 0) {
+      env[env_size++] = environ[i];
+    }
+  }
+  static char fd_variable[] = UPGRADE_FD_ENV "=3";
+  _Static_assert(UPGRADE_CHILD_FD == 3, "fd_variable must match UPGRADE_CHILD_FD");
+  env[env_size++] = fd_variable;
+  env[env_size]   = NULL;
+
+  long const max_fd = sysconf(_SC_OPEN_MAX);
+
+  pid_t const child = fork();
+  if (child == -1) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to start the new daemon");
+    free(env);
+    close(socks[0]);
+    close(socks[1]);
+    return false;
+  }
+
+  if (child == 0) {
+    // only our end of the socket survives, neither the ipc clients nor the
+    // MQTT connection may stay open in the new process before the handover.
+    if (dup2(socks[1], UPGRADE_CHILD_FD) == -1) {
+      _exit(EXIT_FAILURE);
+    }
+    if (syscall(SYS_close_range, UPGRADE_CHILD_FD + 1, ~0U, 0) == -1) {
+      for (long fd = UPGRADE_CHILD_FD + 1; fd < max_fd; fd++) {
+        close((int)fd);
+      }
+    }
+    execve(upgrade.executable, upgrade.argv, env);
+    _exit(EXIT_FAILURE);
+  }
+
+  free(env);
+  close(socks[1]);
+
+  upgrade.child    = child;
+  upgrade.sock     = socks[0];
+  upgrade.deadline = clock_get_ms(CLOCK_MONOTONIC) + UPGRADE_TIMEOUT_MS;
+
+  log_print(LSS_SYSTEM, LL_MESSAGE, "started %s as process %d, handing over when it is ready.", upgrade.executable, (int)child);
+  return true;
+}
+
+int upgrade_get_fd(void)
+{
+  return upgrade.sock;
+}
+
+int upgrade_sync(void)
+{
+  if (upgrade.child == -1) {
+    return -1;
+  }
+
+  uint64_t const now = clock_get_ms(CLOCK_MONOTONIC);
+  if (now < upgrade.deadline) {
+    return (int)(upgrade.deadline - now);
+  }
+
+  log_print(LSS_SYSTEM, LL_WARNING, "new daemon %d didn't get ready in time, cancelling the upgrade.", (int)upgrade.child);
+  stop_child();
+  return -1;
+}
+
+//! Waits for the next message on the handover socket. Returns its size, 0 if
+//! the peer is gone and -1 on errors or when `timeout_ms` passed.
+static ssize_t receive_message(int sock, struct msghdr * message, int timeout_ms)
+{
+  struct pollfd pfd = {
+      .fd     = sock,
+      .events = POLLIN,
+  };
+
+  int ret;
+  while (((ret = poll(&pfd, 1, timeout_ms)) == -1) && (errno == EINTR)) {
+  }
+  if (ret <= 0) {
+    if (ret == 0) {
+      errno = ETIMEDOUT;
+    }
+    return -1;
+  }
+
+  ssize_t size;
+  while (((size = recvmsg(sock, message, MSG_CMSG_CLOEXEC)) == -1) && (errno == EINTR)) {
+  }
+  return size;
+}
+
+bool upgrade_accept(void)
+{
+  assert(upgrade.child != -1);
+
+  struct UpgradeHello hello;
+  struct iovec        hello_part = {.iov_base = &hello, .iov_len = sizeof hello};
+  ssize_t const       hello_size = receive_message(upgrade.sock, &(struct msghdr){.msg_iov = &hello_part, .msg_iovlen = 1}, 0);
+  if (hello_size <= 0) {
+    log_print(LSS_SYSTEM, LL_WARNING, "new daemon %d failed to start, cancelling the upgrade.", (int)upgrade.child);
+    stop_child();
+    return false;
+  }
+  if ((hello_size != (ssize_t)sizeof hello) || (hello.magic != UPGRADE_MAGIC) || (hello.version != UPGRADE_VERSION) || (hello.size != sizeof(struct UpgradeState))) {
+    log_print(LSS_SYSTEM, LL_WARNING, "new daemon %d can't take over the state of this one, restart the daemon instead.", (int)upgrade.child);
+    stop_child();
+    return false;
+  }
+  return true;
+}
+
+bool upgrade_handover(struct UpgradeState const * state, int listen_fd, int const client_fds[])
+{
+  assert(state != NULL);
+  assert(state->client_count <= UPGRADE_MAX_CLIENTS);
+  assert(upgrade.child != -1);
+
+  // the listening socket first, then one socket per client
+  size_t const fd_count = 1 + state->client_count;
+  union
+  {
+    char           buffer[CMSG_SPACE((1 + UPGRADE_MAX_CLIENTS) * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof control);
+
+  struct iovec  state_part = {.iov_base = (void *)state, .iov_len = sizeof *state};
+  struct msghdr message    = {
+         .msg_iov        = &state_part,
+         .msg_iovlen     = 1,
+         .msg_control    = control.buffer,
+         .msg_controllen = CMSG_SPACE(fd_count * sizeof(int)),
+  };
+
+  struct cmsghdr * const header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level            = SOL_SOCKET;
+  header->cmsg_type             = SCM_RIGHTS;
+  header->cmsg_len              = CMSG_LEN(fd_count * sizeof(int));
+
+  int * const fds = (int *)CMSG_DATA(header);
+  fds[0]          = listen_fd;
+  memcpy(fds + 1, client_fds, state->client_count * sizeof(int));
+
+  if (sendmsg(upgrade.sock, &message, MSG_NOSIGNAL) != (ssize_t)sizeof *state) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to hand over to the new daemon");
+    stop_child();
+    return false;
+  }
+
+  uint8_t       ack;
+  struct iovec  ack_part = {.iov_base = &ack, .iov_len = sizeof ack};
+  ssize_t const ack_size = receive_message(upgrade.sock, &(struct msghdr){.msg_iov = &ack_part, .msg_iovlen = 1}, UPGRADE_TIMEOUT_MS);
+  if (ack_size != (ssize_t)sizeof ack) {
+    log_print(LSS_SYSTEM, LL_WARNING, "new daemon %d didn't take over, cancelling the upgrade.", (int)upgrade.child);
+    stop_child();
+    return false;
+  }
+
+  log_print(LSS_SYSTEM, LL_MESSAGE, "new daemon %d took over with %u ipc clients.", (int)upgrade.child, state->client_count);
+  close(upgrade.sock);
+  upgrade.sock  = -1;
+  upgrade.child = -1;
+  return true;
+}
+
+bool upgrade_is_pending(void)
+{
+  return (getenv(UPGRADE_FD_ENV) != NULL);
+}
+
+bool upgrade_receive(struct UpgradeState * state, int * listen_fd, int client_fds[])
+{
+  assert(state != NULL);
+  assert(listen_fd != NULL);
+  assert(client_fds != NULL);
+
+  char const * const value = getenv(UPGRADE_FD_ENV);
+  if (value == NULL) {
+    return false;
+  }
+
+  char *     end  = NULL;
+  long const sock = strtol(value, &end, 10);
+  unsetenv(UPGRADE_FD_ENV);
+  if ((end == value) || (*end != 0) || (sock < 0) || (sock > INT_MAX)) {
+    log_print(LSS_SYSTEM, LL_ERROR, "invalid %s: %s", UPGRADE_FD_ENV, value);
+    return false;
+  }
+  upgrade.sock = (int)sock;
+
+  struct UpgradeHello const hello = {
+      .magic   = UPGRADE_MAGIC,
+      .version = UPGRADE_VERSION,
+      .size    = sizeof(struct UpgradeState),
+  };
+  if (send(upgrade.sock, &hello, sizeof hello, MSG_NOSIGNAL) != (ssize_t)sizeof hello) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to reach the running daemon");
+    return false;
+  }
+
+  union
+  {
+    char           buffer[CMSG_SPACE((1 + UPGRADE_MAX_CLIENTS) * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  struct iovec  state_part = {.iov_base = state, .iov_len = sizeof *state};
+  struct msghdr message    = {
+         .msg_iov        = &state_part,
+         .msg_iovlen     = 1,
+         .msg_control    = control.buffer,
+         .msg_controllen = sizeof control.buffer,
+  };
+  ssize_t const size = receive_message(upgrade.sock, &message, UPGRADE_TIMEOUT_MS);
+  if (size <= 0) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "the running daemon didn't hand over");
+    return false;
+  }
+
+  // take the sockets first, so they are closed again whatever is wrong
+  struct cmsghdr const * const header   = CMSG_FIRSTHDR(&message);
+  size_t                       fd_count = 0;
+  int                          fds[1 + UPGRADE_MAX_CLIENTS];
+  if ((header != NULL) && (header->cmsg_level == SOL_SOCKET) && (header->cmsg_type == SCM_RIGHTS)) {
+    fd_count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(header), fd_count * sizeof(int));
+  }
+
+  bool const ok = (size == (ssize_t)sizeof *state) && ((message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) == 0) && (state->magic == UPGRADE_MAGIC) && (state->version == UPGRADE_VERSION) && (state->size == sizeof *state) && (state->client_count <= UPGRADE_MAX_CLIENTS) && (state->snapshot.portal_count <= PORTAL_ROUTER_MAX) && (fd_count == 1 + state->client_count);
+  if (!ok) {
+    log_print(LSS_SYSTEM, LL_ERROR, "received a damaged state from the running daemon.");
+    for (size_t i = 0; i < fd_count; i++) {
+      close(fds[i]);
+    }
+    return false;
+  }
+
+  *listen_fd = fds[0];
+  memcpy(client_fds, fds + 1, state->client_count * sizeof(int));
+  return true;
+}
+
+bool upgrade_confirm(void)
+{
+  assert(upgrade.sock != -1);
+
+  uint8_t const ack = 1;
+  bool const    ok  = (send(upgrade.sock, &ack, sizeof ack, MSG_NOSIGNAL) == (ssize_t)sizeof ack);
+  if (!ok) {
+    log_perror(LSS_SYSTEM, LL_ERROR, "failed to confirm the takeover");
+  }
+  close(upgrade.sock);
+  upgrade.sock = -1;
+  return ok;
+}
@@ -0,0 +1,131 @@
+#ifndef PORTAL300_UPGRADE_H
+#define PORTAL300_UPGRADE_H
+
+#include "controller.h"
+#include "door-filter.h"
+#include "ipc.h"
+#include "liveness.h"
+#include "snapshot.h"
+#include "status.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hot upgrade of the daemon without dropping the ipc socket or its clients.
+//
+// SIGUSR2 makes the running daemon start the installed binary with the same
+// arguments. The new process initializes itself, connects to MQTT and then
+// tells the old one that it is ready. Only then the old process stops,
+// serializes its state and passes it together with the listening ipc socket
+// and all client connections over SCM_RIGHTS. As soon as the new process
+// confirms, the old one exits without unlinking anything. The doors are only
+// unattended for the handover itself, not for the startup of the new binary.
+//
+// If the new process fails, times out or has an incompatible state layout,
+// the old process kills it and keeps running as if nothing happened.
+
+//! Environment variable that passes the handover socket to the new process.
+#define UPGRADE_FD_ENV "PORTAL300_UPGRADE_FD"
+
+//! Time the new process gets to become ready, and the old one to send its state.
+#define UPGRADE_TIMEOUT_MS 10000
+
+#define UPGRADE_MAX_CLIENTS 32
+
+#define UPGRADE_MAGIC   0x55503350 // "P3PU"
+#define UPGRADE_VERSION 6
+
+//! An ipc client connection, its socket is passed alongside.
+struct UpgradeClient
+{
+  uint32_t client_id;
+  uint32_t disconnect_flags;
+  bool     forward_logs;
+  uint32_t log_subsystems;
+  uint32_t log_level;   // enum LogLevel
+  uint32_t wire_format; // enum IpcWireFormat
+
+  bool                subscribed;
+  struct PortalStatus subscriber_status;
+
+  bool    has_names; // the client sent an open request with member data
+  char    nick_name[IPC_MAX_NICK_LEN + 1];
+  char    full_name[IPC_MAX_NAME_LEN + 1];
+  int32_t member_id;
+
+  uint32_t requested_action; // enum AuditAction
+  uint64_t request_time;
+  uint8_t  portal;
+};
+
+//! What the controller of a portal learned beyond the snapshot, see `struct Controller`.
+struct UpgradeController
+{
+  uint32_t                 request_count;
+  struct ControllerRequest requests[CONTROLLER_REQUEST_QUEUE_LEN];
+  struct TimeoutBudget     timeouts[SM_PHASE_COUNT];
+  uint32_t                 timer_phase; // enum SM_Phase
+  uint64_t                 timer_started;
+  uint32_t                 timer_ms;
+  struct DoorFilterDoor    doors[SM_DOOR_COUNT];  // door filter of the portal, see `struct DoorFilter`
+  struct LivenessDevice    devices[DEVICE_COUNT]; // heartbeats of the devices of the portal, see `struct Liveness`
+};
+
+struct UpgradeState
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size; // sizeof(struct UpgradeState), the layout differs between versions otherwise
+
+  uint32_t                 next_client_id;
+  bool                     listen_activated;               // the listening socket came from socket activation
+  struct Snapshot          snapshot;                       // the portals, `saved_at` is the time of the handover
+  struct UpgradeController controllers[PORTAL_ROUTER_MAX]; // indexed like the portals of `snapshot`
+  uint32_t                 client_count;
+  struct UpgradeClient     clients[UPGRADE_MAX_CLIENTS];
+};
+
+// Old process:
+
+//! Saves the path of the running binary, so an upgrade starts the file that
+//! is installed there now and not the one this process was started from.
+bool upgrade_init(char * const argv[]);
+
+//! Starts the installed binary as new process. Returns false if it could not
+//! be started or an upgrade is already running.
+bool upgrade_start(void);
+
+//! Returns the socket to the new process, which becomes readable when it is
+//! ready or died, or -1 if no upgrade is running.
+int upgrade_get_fd(void);
+
+//! Gives up on a new process that isn't ready after UPGRADE_TIMEOUT_MS.
+//! Returns the time in ms until then, or -1 if no upgrade is running.
+//! Suitable as poll() timeout.
+int upgrade_sync(void);
+
+//! Reads the hello of the new process once upgrade_get_fd() became readable.
+//! Returns true if the new process is ready to take over the state of this
+//! one. Otherwise it died or is incompatible and was stopped.
+bool upgrade_accept(void);
+
+//! Passes `state`, `listen_fd` and the `client_fds` of the state's clients to
+//! the new process after upgrade_accept(). Returns true if the new process
+//! took over, then the caller must exit right away. Otherwise the new process
+//! is gone and the caller keeps running.
+bool upgrade_handover(struct UpgradeState const * state, int listen_fd, int const client_fds[]);
+
+// New process:
+
+//! Returns true if this process was started by upgrade_start().
+bool upgrade_is_pending(void);
+
+//! Tells the old process that this one is ready and receives its state.
+//! Returns false if the old process didn't hand over, then this process
+//! has to exit.
+bool upgrade_receive(struct UpgradeState * state, int * listen_fd, int client_fds[]);
+
+//! Confirms the takeover, the old process exits afterwards.
+bool upgrade_confirm(void);
+
+#endif // PORTAL300_UPGRADE_H